@@ -0,0 +1,272 @@
+/**
+ * @file bench.c
+ * @brief In-process microbenchmarks for the storage layer
+ *
+ * Calls the storage, directory, bitmap and allocator functions directly,
+ * with no FUSE in the way, and prints how long each takes as JSON. Run by
+ * "make bench" together with the workloads in bench.pl.
+ */
+
+ #define _GNU_SOURCE
+ #include <stdio.h>
+ #include <stdlib.h>
+ #include <string.h>
+ #include <time.h>
+ #include <unistd.h>
+ #include <sys/stat.h>
+ 
+ #include "storage.h"
+ #include "directory.h"
+ #include "inode.h"
+ #include "helpers/bitmap.h"
+ #include "helpers/blocks.h"
+ 
+ /** Entries in the directory used by the lookup and listing benchmarks */
+ #define BENCH_DIR_ENTRIES 10000
+ 
+ /** Depth of the path resolved by the deep lookup benchmark */
+ #define BENCH_DEPTH 32
+ 
+ /** Size of the file used by the read and write benchmarks */
+ #define BENCH_FILE_SIZE (64 << 20)
+ 
+ /** Where the results go; stdout proper, since the storage layer chats on it */
+ static FILE *out;
+ 
+ /** Nonzero once the first result has been printed */
+ static int printed = 0;
+ 
+ /**
+  * Returns a monotonic timestamp in nanoseconds.
+  */
+ static double now_ns() {
+     struct timespec ts;
+     clock_gettime(CLOCK_MONOTONIC, &ts);
+     return ts.tv_sec * 1e9 + ts.tv_nsec;
+ }
+ 
+ /**
+  * Prints one result as an element of the "results" array.
+  *
+  * @param name Name of the benchmark
+  * @param iters Number of operations timed
+  * @param elapsed Nanoseconds they took in all
+  * @param bytes Bytes moved by each operation, or 0 if it moves no data
+  */
+ static void report(const char *name, long iters, double elapsed, size_t bytes) {
+     fprintf(out, "%s\n    {\"name\": \"%s\", \"iterations\": %ld, \"ns_per_op\": %.1f",
+            printed++ ? "," : "", name, iters, elapsed / iters);
+     if (bytes > 0) {
+         fprintf(out, ", \"mb_per_s\": %.1f", (double)bytes * iters / elapsed * 1e3);
+     }
+     fprintf(out, "}");
+ }
+ 
+ /**
+  * Times scans of a large bitmap whose only free bits are near the end.
+  */
+ static void bench_bitmap() {
+     int bits = 1 << 20;
+     unsigned char *bm = malloc(bits / 8);
+     memset(bm, 0xff, bits / 8);
+     for (int i = bits - 64; i < bits; ++i) {
+         bitmap_put(bm, i, 0);
+     }
+ 
+     long iters = 2000;
+     double start = now_ns();
+     for (long i = 0; i < iters; ++i) {
+         if (bitmap_find_zero(bm, 0, bits) < 0) abort();
+     }
+     report("bitmap_find_zero", iters, now_ns() - start, 0);
+ 
+     start = now_ns();
+     for (long i = 0; i < iters; ++i) {
+         if (bitmap_find_zero_run(bm, 0, bits, 32) < 0) abort();
+     }
+     report("bitmap_find_zero_run", iters, now_ns() - start, 0);
+ 
+     start = now_ns();
+     for (long i = 0; i < iters; ++i) {
+         bitmap_popcount(bm, 0, bits);
+     }
+     report("bitmap_popcount", iters, now_ns() - start, 0);
+     free(bm);
+ }
+ 
+ /**
+  * Times the block allocator, one block and short runs at a time.
+  */
+ static void bench_alloc() {
+     long iters = 100000;
+     double start = now_ns();
+     for (long i = 0; i < iters; ++i) {
+         int bnum = alloc_block();
+         if (bnum < 0) abort();
+         free_block(bnum);
+     }
+     report("alloc_free_block", iters, now_ns() - start, 0);
+ 
+     start = now_ns();
+     for (long i = 0; i < iters; ++i) {
+         int got;
+         int bnum = alloc_block_run(0, 16, &got);
+         if (bnum < 0) abort();
+         for (int j = 0; j < got; ++j) {
+             free_block(bnum + j);
+         }
+     }
+     report("alloc_free_run16", iters, now_ns() - start, 0);
+ }
+ 
+ /**
+  * Times creating, looking up, listing and removing files in a directory.
+  */
+ static void bench_directory() {
+     char name[32];
+     int dir = storage_mkdir_at(0, "bench_dir", 0755);
+     if (dir < 0) abort();
+ 
+     long iters = BENCH_DIR_ENTRIES;
+     double start = now_ns();
+     for (long i = 0; i < iters; ++i) {
+         snprintf(name, sizeof(name), "file%ld", i);
+         if (storage_mknod_at(dir, name, S_IFREG | 0644) < 0) abort();
+     }
+     report("mknod_at", iters, now_ns() - start, 0);
+ 
+     start = now_ns();
+     for (long i = 0; i < iters; ++i) {
+         snprintf(name, sizeof(name), "file%ld", (i * 7919) % BENCH_DIR_ENTRIES);
+         if (storage_lookup_at(dir, name) < 0) abort();
+     }
+     report("lookup_at", iters, now_ns() - start, 0);
+ 
+     inode_t *node = get_inode(dir);
+     start = now_ns();
+     for (long i = 0; i < iters; ++i) {
+         snprintf(name, sizeof(name), "file%ld", (i * 7919) % BENCH_DIR_ENTRIES);
+         if (directory_lookup(node, name) < 0) abort();
+     }
+     report("directory_lookup", iters, now_ns() - start, 0);
+ 
+     struct stat st;
+     int inum = storage_lookup_at(dir, "file0");
+     start = now_ns();
+     for (long i = 0; i < iters; ++i) {
+         storage_stat_inum(inum, &st);
+     }
+     report("stat_inum", iters, now_ns() - start, 0);
+ 
+     long lists = 20;
+     start = now_ns();
+     for (long i = 0; i < lists; ++i) {
+         snames_t names;
+         sn_init(&names);
+         if (directory_list(node, &names) < 0) abort();
+         sn_free(&names);
+     }
+     report("directory_list_10000", lists, now_ns() - start, 0);
+ 
+     start = now_ns();
+     for (long i = 0; i < iters; ++i) {
+         snprintf(name, sizeof(name), "file%ld", i);
+         if (storage_unlink_at(dir, name) < 0) abort();
+     }
+     report("unlink_at", iters, now_ns() - start, 0);
+ }
+ 
+ /**
+  * Times resolving a path BENCH_DEPTH directories deep.
+  */
+ static void bench_deep_path() {
+     char path[BENCH_DEPTH * 4 + 8] = "";
+     int dir = 0;
+     for (int i = 0; i < BENCH_DEPTH; ++i) {
+         dir = storage_mkdir_at(dir, "d", 0755);
+         if (dir < 0) abort();
+         strcat(path, "/d");
+     }
+ 
+     long iters = 20000;
+     double start = now_ns();
+     for (long i = 0; i < iters; ++i) {
+         if (storage_lookup_path(path) != dir) abort();
+     }
+     report("lookup_path_depth32", iters, now_ns() - start, 0);
+ }
+ 
+ /**
+  * Times sequential and random reads and writes of one file.
+  *
+  * @param inum The file
+  * @param size Bytes per operation
+  * @param scatter Whether to pick block-aligned offsets at random
+  * @param write Whether to write rather than read
+  */
+ static void bench_io(int inum, size_t size, int scatter, int write) {
+     char name[64];
+     char *buf = malloc(size);
+     memset(buf, 'x', size);
+ 
+     long iters = (long)BENCH_FILE_SIZE / size;
+     if (iters > 20000) iters = 20000;
+     long chunks = BENCH_FILE_SIZE / size;
+     srandom(42);
+ 
+     double start = now_ns();
+     for (long i = 0; i < iters; ++i) {
+         off_t offset = (off_t)(scatter ? random() % chunks : i % chunks) * size;
+         int rv = write ? storage_write_inum(inum, buf, size, offset)
+                        : storage_read_inum(inum, buf, size, offset);
+         if (rv != (int)size) abort();
+     }
+     snprintf(name, sizeof(name), "%s_%s_%zuk", write ? "write" : "read",
+              scatter ? "rand" : "seq", size / 1024);
+     report(name, iters, now_ns() - start, size);
+     free(buf);
+ }
+ 
+ /**
+  * Runs every benchmark and prints the results as one JSON document.
+  *
+  * Usage: nufs-bench [image], where the image (bench.nufs by default) is
+  * formatted afresh and removed afterwards.
+  */
+ int main(int argc, char *argv[]) {
+     const char *image = argc > 1 ? argv[1] : "bench.nufs";
+     unlink(image);
+ 
+     out = fdopen(dup(STDOUT_FILENO), "w");
+     dup2(STDERR_FILENO, STDOUT_FILENO);
+ 
+     blocks_geometry_t geo;
+     storage_default_geometry(&geo);
+     geo.size = 256 << 20;
+     geo.max_size = (int64_t)4 << 30;
+     geo.inode_count = 65536;
+     storage_init(image, &geo);
+ 
+     fprintf(out, "{\n  \"suite\": \"micro\",\n  \"block_size\": %d,\n  \"results\": [",
+            BLOCK_SIZE);
+ 
+     bench_bitmap();
+     bench_alloc();
+     bench_directory();
+     bench_deep_path();
+ 
+     int inum = storage_mknod_at(0, "bench_file", S_IFREG | 0644);
+     if (inum < 0) abort();
+     static const size_t sizes[] = {4096, 65536, 1 << 20};
+     for (int i = 0; i < 3; ++i) {
+         bench_io(inum, sizes[i], 0, 1);
+         bench_io(inum, sizes[i], 0, 0);
+         bench_io(inum, sizes[i], 1, 1);
+         bench_io(inum, sizes[i], 1, 0);
+     }
+ 
+     fprintf(out, "\n  ]\n}\n");
+     fclose(out);
+     unlink(image);
+     return 0;
+ }
@@ -0,0 +1,111 @@
+#!/usr/bin/perl
+use 5.16.0;
+use warnings FATAL => 'all';
+
+# Workloads run against a mounted nufs; results are printed as JSON.
+# Usage: perl bench.pl > bench-macro.json (run by "make bench").
+
+use Fcntl qw(O_RDWR O_CREAT SEEK_SET);
+use Time::HiRes qw(time sleep);
+
+my $image = "bench.nufs";
+my $file_size = 64 * 1024 * 1024;
+my @results;
+
+sub mount {
+    system("rm -f $image; mkdir -p mnt");
+    system("(./nufs -f -o size=64M,max_size=4G,inodes=65536 mnt $image 2>&1) >> bench.log &");
+    sleep 1;
+}
+
+sub unmount {
+    system("fusermount3 -u mnt || fusermount -u mnt");
+    system("rm -f $image");
+}
+
+# Time $iters calls of $op; $bytes is the data each call moves, if any.
+sub bench {
+    my ($name, $iters, $bytes, $op) = @_;
+    my $start = time();
+    for my $i (0 .. $iters - 1) {
+        $op->($i);
+    }
+    my $elapsed = (time() - $start) * 1e9;
+    my $json = sprintf('{"name": "%s", "iterations": %d, "ns_per_op": %.1f',
+                       $name, $iters, $elapsed / $iters);
+    if ($bytes) {
+        $json .= sprintf(', "mb_per_s": %.1f', $bytes * $iters / $elapsed * 1e3);
+    }
+    push @results, "$json}";
+}
+
+mount();
+
+say STDERR "# Small-file storm";
+my $count = 5000;
+mkdir "mnt/small" or die "mkdir: $!";
+bench("create", $count, 0, sub {
+    open my $fh, ">", "mnt/small/f$_[0]" or die "create: $!";
+    close $fh;
+});
+bench("stat", $count, 0, sub { stat("mnt/small/f$_[0]") or die "stat: $!"; });
+bench("unlink", $count, 0, sub { unlink("mnt/small/f$_[0]") or die "unlink: $!"; });
+
+say STDERR "# Sequential and random I/O";
+for my $size (4096, 65536, 1024 * 1024) {
+    my $chunks = $file_size / $size;
+    my $iters = $chunks < 16384 ? $chunks : 16384;
+    my $buf = "x" x $size;
+    my $kb = $size / 1024;
+
+    sysopen my $fh, "mnt/data.bin", O_RDWR | O_CREAT or die "open: $!";
+    bench("write_seq_${kb}k", $iters, $size, sub {
+        syswrite($fh, $buf) == $size or die "write: $!";
+    });
+    sysseek($fh, 0, SEEK_SET);
+    bench("read_seq_${kb}k", $iters, $size, sub {
+        sysread($fh, my $data, $size) == $size or die "read: $!";
+    });
+
+    srand(42);
+    bench("write_rand_${kb}k", $iters, $size, sub {
+        sysseek($fh, int(rand($chunks)) * $size, SEEK_SET);
+        syswrite($fh, $buf) == $size or die "write: $!";
+    });
+    bench("read_rand_${kb}k", $iters, $size, sub {
+        sysseek($fh, int(rand($chunks)) * $size, SEEK_SET);
+        sysread($fh, my $data, $size) == $size or die "read: $!";
+    });
+    close $fh;
+    unlink "mnt/data.bin";
+}
+
+say STDERR "# Large directory";
+mkdir "mnt/big" or die "mkdir: $!";
+for my $i (0 .. 9999) {
+    open my $fh, ">", "mnt/big/entry$i" or die "create: $!";
+    close $fh;
+}
+bench("list_10000", 20, 0, sub {
+    opendir my $dh, "mnt/big" or die "opendir: $!";
+    my @names = readdir $dh;
+    @names == 10002 or die "listed " . scalar(@names) . " entries";
+    closedir $dh;
+});
+
+say STDERR "# Deep path lookup";
+my $path = "mnt";
+for (1 .. 32) {
+    $path .= "/d";
+    mkdir $path or die "mkdir: $!";
+}
+bench("stat_depth32", 20000, 0, sub { stat($path) or die "stat: $!"; });
+
+unmount();
+
+say "{";
+say '  "suite": "macro",';
+say '  "results": [';
+say join(",\n", map { "    $_" } @results);
+say "  ]";
+say "}";
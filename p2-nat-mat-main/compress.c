@@ -0,0 +1,154 @@
+/**
+ * @file compress.c
+ * @brief Transparent compression of file data
+ *
+ * The decompressed cache is direct-mapped by the first block of the
+ * compressed extent, one mutex per slot. A compressed extent belongs to a
+ * single file and is never shared, and it is only freed under that file's
+ * write lock, which no reader of the file can be holding; forgetting it
+ * then is enough to keep a stale cluster from being served.
+ */
+
+ #include <errno.h>
+ #include <pthread.h>
+ #include <stdlib.h>
+ #include <string.h>
+
+ #include "compress.h"
+ #include "helpers/blocks.h"
+ #include "helpers/lz4.h"
+
+ /**
+  * Number of decompressed clusters kept
+  */
+ #define COMPRESS_CACHE_SLOTS 64
+
+ typedef struct compress_slot {
+     pthread_mutex_t lock;
+     int pblk;      /* First block of the cached extent, or 0 if empty */
+     char *data;    /* Its decompressed cluster, allocated on first use */
+ } compress_slot_t;
+
+ static compress_slot_t slots[COMPRESS_CACHE_SLOTS];
+ static compress_stats_t stats;
+
+ #define compress_count(counter) \
+     __atomic_fetch_add(&stats.counter, 1, __ATOMIC_RELAXED)
+
+ /**
+  * @brief Empty the decompressed cache and reset the counters
+  */
+ void compress_init() {
+     for (int i = 0; i < COMPRESS_CACHE_SLOTS; i++) {
+         free(slots[i].data);  /* The block size may have changed */
+         slots[i].data = NULL;
+         slots[i].pblk = 0;
+         pthread_mutex_init(&slots[i].lock, NULL);
+     }
+     memset(&stats, 0, sizeof(stats));
+ }
+
+ /**
+  * @brief Compress a cluster into the layout of a compressed extent
+  */
+ int compress_pack(const char *data, size_t len, char *out, size_t cap) {
+     if (cap <= sizeof(compress_header_t)) return -1;
+
+     compress_header_t *hdr = (compress_header_t *)out;
+     int n = lz4_compress(data, len, out + sizeof(*hdr), cap - sizeof(*hdr));
+     if (n == 0) return -1;
+
+     hdr->len = n;
+     hdr->codec = COMPRESS_LZ4;
+     return sizeof(*hdr) + n;
+ }
+
+ /**
+  * @brief Decompress a whole extent
+  *
+  * @return 0 on success, -EIO if the extent is damaged
+  */
+ static int compress_unpack(const extent_t *ext, char *out) {
+     // The caller's buffer holds one cluster, and a packed cluster is
+     // smaller than it unpacks to; anything else is a damaged map
+     if (ext->len <= 0 || ext->len > COMPRESS_CLUSTER_BLOCKS ||
+         ext->plen <= 0 || ext->plen > ext->len ||
+         ext->pblk < (int)blocks_get_superblock()->data_start ||
+         ext->pblk > BLOCK_COUNT - ext->plen) {
+         return -EIO;
+     }
+
+     compress_header_t *hdr = blocks_get_block(ext->pblk);
+     size_t room = (size_t)ext->plen * BLOCK_SIZE - sizeof(*hdr);
+     if (hdr->codec != COMPRESS_LZ4 || hdr->len > room) return -EIO;
+
+     int want = ext->len * BLOCK_SIZE;
+     int n = lz4_decompress((char *)(hdr + 1), hdr->len, out, want);
+     return n == want ? 0 : -EIO;
+ }
+
+ /**
+  * @brief Read bytes out of a compressed extent
+  */
+ int compress_read(const extent_t *ext, size_t skip, char *buf, size_t len) {
+     compress_slot_t *slot = &slots[ext->pblk % COMPRESS_CACHE_SLOTS];
+     pthread_mutex_lock(&slot->lock);
+
+     if (slot->pblk != ext->pblk) {
+         if (!slot->data) {
+             slot->data = malloc((size_t)COMPRESS_CLUSTER_BLOCKS * BLOCK_SIZE);
+         }
+         if (!slot->data || compress_unpack(ext, slot->data) < 0) {
+             slot->pblk = 0;
+             pthread_mutex_unlock(&slot->lock);
+             return -EIO;
+         }
+         slot->pblk = ext->pblk;
+         compress_count(misses);
+     } else {
+         compress_count(hits);
+     }
+
+     memcpy(buf, slot->data + skip, len);
+     pthread_mutex_unlock(&slot->lock);
+     return 0;
+ }
+
+ /**
+  * @brief Drop a compressed extent from the cache
+  */
+ void compress_forget(int pblk) {
+     compress_slot_t *slot = &slots[pblk % COMPRESS_CACHE_SLOTS];
+     pthread_mutex_lock(&slot->lock);
+     if (slot->pblk == pblk) slot->pblk = 0;
+     pthread_mutex_unlock(&slot->lock);
+ }
+
+ /**
+  * @brief Count a cluster stored compressed, or left as it was
+  */
+ void compress_count_pack(int packed) {
+     if (packed) {
+         compress_count(packed);
+     } else {
+         compress_count(skipped);
+     }
+ }
+
+ /**
+  * @brief Count a compressed extent turned back into plain blocks
+  */
+ void compress_count_unpack() {
+     compress_count(unpacked);
+ }
+
+ /**
+  * @brief Read the counters
+  */
+ void compress_get_stats(compress_stats_t *st) {
+     st->packed = __atomic_load_n(&stats.packed, __ATOMIC_RELAXED);
+     st->skipped = __atomic_load_n(&stats.skipped, __ATOMIC_RELAXED);
+     st->unpacked = __atomic_load_n(&stats.unpacked, __ATOMIC_RELAXED);
+     st->hits = __atomic_load_n(&stats.hits, __ATOMIC_RELAXED);
+     st->misses = __atomic_load_n(&stats.misses, __ATOMIC_RELAXED);
+ }
@@ -0,0 +1,120 @@
+/**
+ * @file compress.h
+ * @brief Transparent compression of file data
+ *
+ * A file is compressed when it carries INODE_COMPRESS, which is set with
+ * the user.nufs.compress extended attribute and inherited from the
+ * directory a file is created in. When the last handle that wrote to such
+ * a file is released, every cluster of COMPRESS_CLUSTER_BLOCKS blocks it
+ * wrote is compressed, and stored as a single compressed extent if that
+ * saves at least one block (see inode_compress()).
+ *
+ * Reads decompress whole clusters through a small cache. Anything that
+ * changes a compressed extent turns it back into plain blocks first, so
+ * the rest of the filesystem only ever modifies uncompressed data. All
+ * calls are thread-safe.
+ */
+
+ #ifndef COMPRESS_H
+ #define COMPRESS_H
+
+ #include <stddef.h>
+ #include <stdint.h>
+
+ #include "inode.h"
+
+ /**
+  * Number of file blocks compressed together
+  */
+ #define COMPRESS_CLUSTER_BLOCKS 16
+
+ /**
+  * Codec identifiers recorded in a compressed extent's header
+  */
+ #define COMPRESS_LZ4 1
+
+ /**
+  * @struct compress_header
+  * @brief Start of the first block of a compressed extent
+  *
+  * The compressed data follows it directly.
+  */
+ typedef struct compress_header {
+     uint32_t len;     /* Bytes of compressed data after the header */
+     uint32_t codec;   /* COMPRESS_LZ4 */
+ } compress_header_t;
+
+ /**
+  * @struct compress_stats
+  * @brief Counters for the statistics report
+  */
+ typedef struct compress_stats {
+     uint64_t packed;     /* Clusters stored compressed */
+     uint64_t skipped;    /* Clusters left alone because they did not shrink */
+     uint64_t unpacked;   /* Compressed extents turned back into plain blocks */
+     uint64_t hits;       /* Reads served from the decompressed cache */
+     uint64_t misses;     /* Reads that had to decompress a cluster */
+ } compress_stats_t;
+
+ /**
+  * @brief Empty the decompressed cache and reset the counters
+  *
+  * Called when an image is mounted, after blocks_init().
+  */
+ void compress_init();
+
+ /**
+  * @brief Compress a cluster into the layout of a compressed extent
+  *
+  * @param data The cluster's bytes
+  * @param len Number of bytes, a whole number of blocks
+  * @param out Filled with a compress_header_t and the compressed data
+  * @param cap Capacity of out; anything larger is not worth storing
+  * @return Number of bytes of out used, or -1 if they would not fit in cap
+  */
+ int compress_pack(const char *data, size_t len, char *out, size_t cap);
+
+ /**
+  * @brief Read bytes out of a compressed extent
+  *
+  * The extent's cluster is decompressed into the cache unless it is there
+  * already. The caller holds the file's lock, shared or exclusive.
+  *
+  * @param ext The compressed extent
+  * @param skip Offset of the first byte wanted from the start of the extent
+  * @param buf Filled with the bytes
+  * @param len Number of bytes, all inside the extent
+  * @return 0 on success, -EIO if the extent does not decompress
+  */
+ int compress_read(const extent_t *ext, size_t skip, char *buf, size_t len);
+
+ /**
+  * @brief Drop a compressed extent from the cache
+  *
+  * Must be called before the extent's blocks are freed, since they may be
+  * reused for another compressed extent.
+  *
+  * @param pblk First block of the extent
+  */
+ void compress_forget(int pblk);
+
+ /**
+  * @brief Count a cluster stored compressed, or left as it was
+  *
+  * @param packed Nonzero if the cluster was stored compressed
+  */
+ void compress_count_pack(int packed);
+
+ /**
+  * @brief Count a compressed extent turned back into plain blocks
+  */
+ void compress_count_unpack();
+
+ /**
+  * @brief Read the counters
+  *
+  * @param st Filled with the current counters
+  */
+ void compress_get_stats(compress_stats_t *st);
+
+ #endif
@@ -0,0 +1,218 @@
+/**
+ * @file dcache.c
+ * @brief In-memory cache of name lookups
+ *
+ * Both tables are direct-mapped: a key hashes to exactly one slot and a new
+ * entry simply replaces whatever was there. Memory use is fixed and every
+ * operation is a hash plus one compare.
+ *
+ * Full paths are invalidated all at once by bumping a generation number;
+ * a path slot is only valid if it was filled in the current generation.
+ *
+ * Slots are guarded by a small array of striped mutexes, so lookups in
+ * different slots rarely contend. The generation and the counters are
+ * updated atomically.
+ */
+
+ #include <pthread.h>
+ #include <string.h>
+ 
+ #include "dcache.h"
+ #include "directory.h"
+ 
+ /**
+  * Number of slots in the (parent, name) table
+  */
+ #define DCACHE_SLOTS 4096
+ 
+ /**
+  * Number of slots in the full-path table, and the longest path cached
+  */
+ #define DCACHE_PATH_SLOTS 1024
+ #define DCACHE_PATH_LENGTH 256
+ 
+ /**
+  * Number of mutexes striped across each table's slots
+  */
+ #define DCACHE_LOCKS 64
+ 
+ typedef struct dcache_entry {
+     char name[DIR_NAME_LENGTH];  /* Entry name (empty if the slot is free) */
+     int parent;                  /* Inode number of the directory */
+     int inum;                    /* Inode the name resolves to */
+ } dcache_entry_t;
+ 
+ typedef struct dcache_path {
+     char path[DCACHE_PATH_LENGTH];
+     uint64_t generation;         /* Generation the slot was filled in */
+     int inum;
+ } dcache_path_t;
+ 
+ static dcache_entry_t entries[DCACHE_SLOTS];
+ static dcache_path_t paths[DCACHE_PATH_SLOTS];
+ static uint64_t path_generation = 1;  /* Slots start at 0, i.e. invalid */
+ static int path_cache_enabled = 1;
+ static dcache_stats_t stats;
+ static pthread_mutex_t entry_locks[DCACHE_LOCKS];
+ static pthread_mutex_t path_locks[DCACHE_LOCKS];
+ 
+ #define dcache_count(counter) \
+     __atomic_fetch_add(&stats.counter, 1, __ATOMIC_RELAXED)
+ 
+ /**
+  * @brief Pick the slot for a (parent, name) key
+  */
+ static dcache_entry_t *dcache_slot(int parent_inum, const char *name) {
+     uint32_t hash = directory_hash(name) ^ ((uint32_t)parent_inum * 2654435761u);
+     return &entries[hash % DCACHE_SLOTS];
+ }
+ 
+ /**
+  * @brief Pick the mutex guarding a (parent, name) slot
+  */
+ static pthread_mutex_t *dcache_slot_lock(dcache_entry_t *slot) {
+     return &entry_locks[(slot - entries) % DCACHE_LOCKS];
+ }
+ 
+ /**
+  * @brief Pick the slot for a full path
+  */
+ static dcache_path_t *dcache_path_slot(const char *path) {
+     return &paths[directory_hash(path) % DCACHE_PATH_SLOTS];
+ }
+ 
+ /**
+  * @brief Pick the mutex guarding a full-path slot
+  */
+ static pthread_mutex_t *dcache_path_lock(dcache_path_t *slot) {
+     return &path_locks[(slot - paths) % DCACHE_LOCKS];
+ }
+ 
+ /**
+  * @brief Empty both tables
+  */
+ void dcache_init() {
+     memset(entries, 0, sizeof(entries));
+     memset(paths, 0, sizeof(paths));
+     memset(&stats, 0, sizeof(stats));
+     path_generation = 1;
+     for (int i = 0; i < DCACHE_LOCKS; i++) {
+         pthread_mutex_init(&entry_locks[i], NULL);
+         pthread_mutex_init(&path_locks[i], NULL);
+     }
+ }
+ 
+ /**
+  * @brief Turn the full-path table on or off
+  */
+ void dcache_set_path_cache(int enabled) {
+     path_cache_enabled = enabled;
+     __atomic_fetch_add(&path_generation, 1, __ATOMIC_ACQ_REL);
+ }
+ 
+ /**
+  * @brief Look up a cached directory entry
+  */
+ int dcache_lookup(int parent_inum, const char *name) {
+     dcache_entry_t *slot = dcache_slot(parent_inum, name);
+     int inum = -1;
+ 
+     pthread_mutex_lock(dcache_slot_lock(slot));
+     if (slot->parent == parent_inum && slot->name[0] != '\0' &&
+         strcmp(slot->name, name) == 0) {
+         inum = slot->inum;
+     }
+     pthread_mutex_unlock(dcache_slot_lock(slot));
+ 
+     if (inum >= 0) {
+         dcache_count(hits);
+     } else {
+         dcache_count(misses);
+     }
+     return inum;
+ }
+ 
+ /**
+  * @brief Remember a directory entry
+  */
+ void dcache_insert(int parent_inum, const char *name, int inum) {
+     if (strlen(name) >= DIR_NAME_LENGTH) return;
+     if (strcmp(name, ".") == 0 || strcmp(name, "..") == 0) return;
+ 
+     dcache_entry_t *slot = dcache_slot(parent_inum, name);
+     pthread_mutex_lock(dcache_slot_lock(slot));
+     strcpy(slot->name, name);
+     slot->parent = parent_inum;
+     slot->inum = inum;
+     pthread_mutex_unlock(dcache_slot_lock(slot));
+ }
+ 
+ /**
+  * @brief Forget a directory entry and every cached full path
+  */
+ void dcache_invalidate(int parent_inum, const char *name) {
+     dcache_entry_t *slot = dcache_slot(parent_inum, name);
+     pthread_mutex_lock(dcache_slot_lock(slot));
+     if (slot->parent == parent_inum && strcmp(slot->name, name) == 0) {
+         slot->name[0] = '\0';
+     }
+     pthread_mutex_unlock(dcache_slot_lock(slot));
+     __atomic_fetch_add(&path_generation, 1, __ATOMIC_ACQ_REL);
+ }
+ 
+ /**
+  * @brief Look up a cached full path
+  */
+ int dcache_path_lookup(const char *path) {
+     if (!path_cache_enabled) return -1;
+ 
+     dcache_path_t *slot = dcache_path_slot(path);
+     int inum = -1;
+ 
+     pthread_mutex_lock(dcache_path_lock(slot));
+     if (slot->generation == dcache_path_generation() &&
+         strcmp(slot->path, path) == 0) {
+         inum = slot->inum;
+     }
+     pthread_mutex_unlock(dcache_path_lock(slot));
+ 
+     if (inum >= 0) {
+         dcache_count(path_hits);
+     } else {
+         dcache_count(path_misses);
+     }
+     return inum;
+ }
+ 
+ /**
+  * @brief Read the current full-path generation
+  */
+ uint64_t dcache_path_generation() {
+     return __atomic_load_n(&path_generation, __ATOMIC_ACQUIRE);
+ }
+ 
+ /**
+  * @brief Remember the inode a full path resolved to
+  */
+ void dcache_path_insert(const char *path, int inum, uint64_t generation) {
+     if (!path_cache_enabled || strlen(path) >= DCACHE_PATH_LENGTH) return;
+ 
+     // Stamped with the generation from before the walk, the slot is
+     // already stale if anything was invalidated in the meantime
+     dcache_path_t *slot = dcache_path_slot(path);
+     pthread_mutex_lock(dcache_path_lock(slot));
+     strcpy(slot->path, path);
+     slot->generation = generation;
+     slot->inum = inum;
+     pthread_mutex_unlock(dcache_path_lock(slot));
+ }
+ 
+ /**
+  * @brief Read the hit and miss counters
+  */
+ void dcache_get_stats(dcache_stats_t *st) {
+     st->hits = __atomic_load_n(&stats.hits, __ATOMIC_RELAXED);
+     st->misses = __atomic_load_n(&stats.misses, __ATOMIC_RELAXED);
+     st->path_hits = __atomic_load_n(&stats.path_hits, __ATOMIC_RELAXED);
+     st->path_misses = __atomic_load_n(&stats.path_misses, __ATOMIC_RELAXED);
+ }
@@ -0,0 +1,114 @@
+/**
+ * @file dcache.h
+ * @brief In-memory cache of name lookups
+ *
+ * Caches the results of path resolution so hot files can be found without
+ * walking their directories. Two tables are kept: one keyed by
+ * (parent inode, name) for single components, and one keyed by the full
+ * path. Only successful lookups are cached.
+ *
+ * The directory code invalidates entries as names are removed, so the
+ * cache never has to be flushed by callers. All calls are thread-safe.
+ */
+
+ #ifndef DCACHE_H
+ #define DCACHE_H
+ 
+ #include <stdint.h>
+ 
+ /**
+  * @struct dcache_stats
+  * @brief Hit and miss counters for both tables
+  */
+ typedef struct dcache_stats {
+     uint64_t hits;         /* (parent, name) lookups answered from the cache */
+     uint64_t misses;       /* (parent, name) lookups that went to the directory */
+     uint64_t path_hits;    /* Full paths answered from the cache */
+     uint64_t path_misses;  /* Full paths that had to be walked */
+ } dcache_stats_t;
+ 
+ /**
+  * @brief Empty both tables
+  *
+  * Called when an image is mounted.
+  */
+ void dcache_init();
+ 
+ /**
+  * @brief Turn the full-path table on or off
+  *
+  * The (parent, name) table is always on.
+  *
+  * @param enabled Nonzero to cache full paths (the default)
+  */
+ void dcache_set_path_cache(int enabled);
+ 
+ /**
+  * @brief Look up a cached directory entry
+  *
+  * @param parent_inum Inode number of the directory
+  * @param name Entry name
+  * @return The cached inode number, or -1 on a miss
+  */
+ int dcache_lookup(int parent_inum, const char *name);
+ 
+ /**
+  * @brief Remember a directory entry
+  *
+  * "." and ".." are never cached: they change meaning when a directory is
+  * removed and its inode reused, without any entry being deleted.
+  *
+  * @param parent_inum Inode number of the directory
+  * @param name Entry name
+  * @param inum Inode number the name resolves to
+  */
+ void dcache_insert(int parent_inum, const char *name, int inum);
+ 
+ /**
+  * @brief Forget a directory entry that is being removed or replaced
+  *
+  * Also drops every cached full path, since any of them may run through
+  * the removed name.
+  *
+  * @param parent_inum Inode number of the directory
+  * @param name Entry name
+  */
+ void dcache_invalidate(int parent_inum, const char *name);
+ 
+ /**
+  * @brief Look up a cached full path
+  *
+  * @param path Absolute path
+  * @return The cached inode number, or -1 on a miss
+  */
+ int dcache_path_lookup(const char *path);
+ 
+ /**
+  * @brief Read the current full-path generation
+  *
+  * Take this before walking a path and give it to dcache_path_insert, so a
+  * name removed during the walk cannot leave a stale path behind.
+  *
+  * @return The generation number
+  */
+ uint64_t dcache_path_generation();
+ 
+ /**
+  * @brief Remember the inode a full path resolved to
+  *
+  * Paths longer than the table's key length are not cached.
+  *
+  * @param path Absolute path
+  * @param inum Inode number the path resolves to
+  * @param generation Value of dcache_path_generation() from before the walk
+  */
+ void dcache_path_insert(const char *path, int inum, uint64_t generation);
+ 
+ /**
+  * @brief Read the hit and miss counters
+  *
+  * @param st Filled with the current counters
+  */
+ void dcache_get_stats(dcache_stats_t *st);
+ 
+ #endif /* DCACHE_H */
@@ -0,0 +1,143 @@
+/**
+ * @file dedup.c
+ * @brief Content-addressed sharing of file data blocks
+ *
+ * The index is direct-mapped like the dcache: a fingerprint picks exactly
+ * one slot, and a new block replaces whatever was there. A slot is only a
+ * hint. Before a block is shared a reference to it is taken, which fails
+ * if its owner has claimed it for writing or freed it, and only then are
+ * the contents compared, so a block that changed since it was indexed is
+ * never shared.
+ */
+
+ #include <pthread.h>
+ #include <stdlib.h>
+ #include <string.h>
+ 
+ #include "dedup.h"
+ #include "helpers/blocks.h"
+ 
+ /**
+  * Bounds on the number of index slots; the index is sized at one slot
+  * for every four blocks of the largest image
+  */
+ #define DEDUP_MIN_SLOTS (1 << 12)
+ #define DEDUP_MAX_SLOTS (1 << 22)
+ 
+ /**
+  * Number of mutexes striped across the slots
+  */
+ #define DEDUP_LOCKS 64
+ 
+ #define DEDUP_PRIME1 0x9E3779B185EBCA87ull
+ #define DEDUP_PRIME2 0xC2B2AE3D27D4EB4Full
+ #define DEDUP_PRIME3 0x165667B19E3779F9ull
+ 
+ typedef struct dedup_entry {
+     uint64_t hash;   /* Fingerprint of the block when it was indexed */
+     int bnum;        /* The block, or 0 if the slot is free */
+ } dedup_entry_t;
+ 
+ static dedup_entry_t *entries = NULL;
+ static size_t slot_mask = 0;
+ static dedup_stats_t stats;
+ static pthread_mutex_t locks[DEDUP_LOCKS];
+ 
+ #define dedup_count(counter) \
+     __atomic_fetch_add(&stats.counter, 1, __ATOMIC_RELAXED)
+ 
+ /**
+  * @brief Size and empty the fingerprint index
+  */
+ void dedup_init() {
+     free(entries);
+     entries = NULL;
+     memset(&stats, 0, sizeof(stats));
+     if (!blocks_dedup_enabled()) return;
+ 
+     size_t want = blocks_get_superblock()->max_block_count / 4;
+     size_t slots = DEDUP_MIN_SLOTS;
+     while (slots < want && slots < DEDUP_MAX_SLOTS) slots *= 2;
+     entries = calloc(slots, sizeof(dedup_entry_t));
+     slot_mask = slots - 1;
+     for (int i = 0; i < DEDUP_LOCKS; i++) {
+         pthread_mutex_init(&locks[i], NULL);
+     }
+ }
+ 
+ static inline uint64_t dedup_rotl(uint64_t x, int r) {
+     return (x << r) | (x >> (64 - r));
+ }
+ 
+ /**
+  * @brief Fingerprint a buffer
+  */
+ uint64_t dedup_hash(const void *data, size_t len) {
+     const uint64_t *words = data;
+     uint64_t lanes[4] = {DEDUP_PRIME1 + DEDUP_PRIME2, DEDUP_PRIME2, 0,
+                          -DEDUP_PRIME1};
+ 
+     for (size_t i = 0; i + 4 <= len / 8; i += 4) {
+         for (int l = 0; l < 4; l++) {
+             lanes[l] = dedup_rotl(lanes[l] + words[i + l] * DEDUP_PRIME2, 31)
+                        * DEDUP_PRIME1;
+         }
+     }
+ 
+     uint64_t h = dedup_rotl(lanes[0], 1) + dedup_rotl(lanes[1], 7) +
+                  dedup_rotl(lanes[2], 12) + dedup_rotl(lanes[3], 18) + len;
+     h ^= h >> 33;
+     h *= DEDUP_PRIME2;
+     h ^= h >> 29;
+     h *= DEDUP_PRIME3;
+     h ^= h >> 32;
+     return h;
+ }
+ 
+ /**
+  * @brief Find where a freshly written block's data should live
+  */
+ int dedup_block(int bnum) {
+     if (!entries) return bnum;
+ 
+     void *data = blocks_get_block(bnum);
+     uint64_t hash = dedup_hash(data, BLOCK_SIZE);
+     dedup_count(hashed);
+ 
+     dedup_entry_t *slot = &entries[hash & slot_mask];
+     pthread_mutex_t *lock = &locks[(hash & slot_mask) % DEDUP_LOCKS];
+     pthread_mutex_lock(lock);
+ 
+     int match = slot->bnum;
+     if (match != 0 && match != bnum && slot->hash == hash &&
+         block_hold(match) == 0) {
+         if (memcmp(blocks_get_block(match), data, BLOCK_SIZE) == 0) {
+             pthread_mutex_unlock(lock);
+             dedup_count(shared);
+             return match;
+         }
+         free_block(match); // Changed since it was indexed
+     }
+ 
+     block_track(bnum);
+     slot->hash = hash;
+     slot->bnum = bnum;
+     pthread_mutex_unlock(lock);
+     return bnum;
+ }
+ 
+ /**
+  * @brief Count a shared block copied before a write
+  */
+ void dedup_count_copy() {
+     dedup_count(copied);
+ }
+ 
+ /**
+  * @brief Read the counters
+  */
+ void dedup_get_stats(dedup_stats_t *st) {
+     st->hashed = __atomic_load_n(&stats.hashed, __ATOMIC_RELAXED);
+     st->shared = __atomic_load_n(&stats.shared, __ATOMIC_RELAXED);
+     st->copied = __atomic_load_n(&stats.copied, __ATOMIC_RELAXED);
+ }
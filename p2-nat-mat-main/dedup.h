@@ -0,0 +1,77 @@
+/**
+ * @file dedup.h
+ * @brief Content-addressed sharing of file data blocks
+ *
+ * On images formatted with dedup, every data block a file writes is
+ * fingerprinted, and a block whose contents match one already on disk is
+ * replaced by a reference to it. Shared blocks are copied before they are
+ * changed (see inode_unshare()), and freed once their last reference goes.
+ *
+ * The fingerprint index lives in memory only. It starts empty on every
+ * mount, so data written before the mount is shared again only once it
+ * is rewritten. All calls are thread-safe.
+ */
+
+ #ifndef DEDUP_H
+ #define DEDUP_H
+ 
+ #include <stddef.h>
+ #include <stdint.h>
+ 
+ /**
+  * @struct dedup_stats
+  * @brief Counters for the statistics report
+  */
+ typedef struct dedup_stats {
+     uint64_t hashed;   /* Blocks fingerprinted */
+     uint64_t shared;   /* Blocks found already on disk and shared */
+     uint64_t copied;   /* Shared blocks copied so they could be written */
+ } dedup_stats_t;
+ 
+ /**
+  * @brief Size and empty the fingerprint index
+  *
+  * Called when an image is mounted, after blocks_init(). Does nothing if
+  * the image keeps no reference counts.
+  */
+ void dedup_init();
+ 
+ /**
+  * @brief Fingerprint a buffer
+  *
+  * A 64-bit hash run over four independent lanes of eight bytes each, so
+  * the loop vectorizes; it is not meant to resist deliberate collisions,
+  * and matches are always confirmed by comparing the data.
+  *
+  * @param data Bytes to hash, 8-byte aligned
+  * @param len Number of bytes, a multiple of 32
+  * @return The fingerprint
+  */
+ uint64_t dedup_hash(const void *data, size_t len);
+ 
+ /**
+  * @brief Find where a freshly written block's data should live
+  *
+  * If another block holding the same bytes is known, a reference to it is
+  * taken and it is returned; the caller maps it in place of bnum and frees
+  * bnum. Otherwise bnum becomes the block known for its fingerprint, its
+  * reference count starts at 1, and bnum is returned.
+  *
+  * @param bnum An untracked block owned by the caller alone
+  * @return The block to use, bnum or a shared one
+  */
+ int dedup_block(int bnum);
+ 
+ /**
+  * @brief Count a shared block copied before a write
+  */
+ void dedup_count_copy();
+ 
+ /**
+  * @brief Read the counters
+  *
+  * @param st Filled with the current counters
+  */
+ void dedup_get_stats(dedup_stats_t *st);
+ 
+ #endif
@@ -14,9 +14,11 @@
  #include <errno.h>
  #include <fcntl.h>
  #include <sys/stat.h>
+ #include "dcache.h"
  #include "directory.h"
  #include "helpers/bitmap.h"
  #include "helpers/blocks.h"
+ #include "helpers/journal.h"
  #include "inode.h"
  #include "storage.h"
  #include "helpers/slist.h"
@@ -31,6 +33,426 @@
      // Handled in storage_init()
  }
  
+ /**
+  * Number of entry slots in one bucket block
+  */
+ #define DIR_ENTRIES_PER_BUCKET (BLOCK_SIZE / sizeof(dir_entry_t))
+ 
+ /**
+  * @brief Hash a name for placement in a directory's buckets
+  * 
+  * @param name Entry name
+  * @return uint32_t 32-bit FNV-1a hash of the name
+  */
+ uint32_t directory_hash(const char *name) {
+     uint32_t hash = 2166136261u;
+     for (const unsigned char *p = (const unsigned char *)name; *p; p++) {
+         hash ^= *p;
+         hash *= 16777619u;
+     }
+     return hash;
+ }
+ 
+ /**
+  * @brief Get the number of buckets in a directory
+  * 
+  * @param dir Pointer to the directory's inode
+  * @return int Bucket count (0 if unallocated)
+  */
+ static int directory_buckets(inode_t *dir) {
+     return dir->size / BLOCK_SIZE;
+ }
+ 
+ /**
+  * @brief Get the largest power of two not above a bucket count
+  * 
+  * Buckets below it that were already split, and those from it upwards,
+  * are addressed by one more hash bit than the rest.
+  * 
+  * @param buckets Bucket count, at least 1
+  * @return int The power of two
+  */
+ static int directory_level(int buckets) {
+     int low = 1;
+     while (low <= buckets / 2) low *= 2;
+     return low;
+ }
+ 
+ /**
+  * @brief Get the bucket a hash belongs in
+  * 
+  * @param dir Pointer to the directory's inode, with at least one bucket
+  * @param hash directory_hash() of a name
+  * @return int Bucket index
+  */
+ int directory_home(inode_t *dir, uint32_t hash) {
+     int buckets = directory_buckets(dir);
+     uint32_t low = directory_level(buckets);
+     uint32_t bucket = hash & (2 * low - 1);
+     return bucket < (uint32_t)buckets ? (int)bucket : (int)(hash & (low - 1));
+ }
+ 
+ /**
+  * @brief Get one page of a bucket's chain
+  * 
+  * @param dir Pointer to the directory's inode
+  * @param bucket Bucket index
+  * @param page 0 for the bucket block itself, 1 and up for its overflow
+  * @return dir_entry_t* Pointer to the page's first slot, or NULL if the
+  *         chain is shorter
+  */
+ static dir_entry_t *directory_page(inode_t *dir, int bucket, int page) {
+     int bnum = inode_get_bnum(dir, page * DIR_MAX_BUCKETS + bucket);
+     return bnum < 0 ? NULL : blocks_get_meta_block(bnum);
+ }
+ 
+ /**
+  * @brief Count the used slots of a page
+  * 
+  * @param entries Pointer to the page's first slot
+  * @return int Number of slots holding an entry
+  */
+ static int directory_page_used(dir_entry_t *entries) {
+     int used = 0;
+     for (int i = 0; i < DIR_ENTRIES_PER_BUCKET; i++) {
+         if (entries[i].name[0] != '\0') used++;
+     }
+     return used;
+ }
+ 
+ /**
+  * @brief Get a free slot in a bucket's chain, adding an overflow page if
+  *        every page is full
+  * 
+  * @param dir Pointer to the directory's inode
+  * @param bucket Bucket index
+  * @param page Where to start looking; set to the page the slot is in
+  * @return dir_entry_t* The slot, or NULL if the chain cannot grow
+  */
+ static dir_entry_t *directory_free_slot(inode_t *dir, int bucket, int *page) {
+     for (;; (*page)++) {
+         dir_entry_t *entries = directory_page(dir, bucket, *page);
+         if (!entries) break;
+         for (int i = 0; i < DIR_ENTRIES_PER_BUCKET; i++) {
+             if (entries[i].name[0] == '\0') return &entries[i];
+         }
+     }
+ 
+     // Mapped past the end of the buckets, so the size does not change
+     if (*page > DIR_MAX_CHAIN) return NULL;
+     off_t lblk = (off_t)*page * DIR_MAX_BUCKETS + bucket;
+     if (reserve_inode(dir, lblk * BLOCK_SIZE, BLOCK_SIZE) < 0) return NULL;
+     return directory_page(dir, bucket, *page);
+ }
+ 
+ /**
+  * @brief Free the overflow pages at the end of a bucket's chain that no
+  *        longer hold any entry
+  * 
+  * @param dir Pointer to the directory's inode
+  * @param bucket Bucket index
+  */
+ static void directory_trim_chain(inode_t *dir, int bucket) {
+     int pages = 1;
+     while (directory_page(dir, bucket, pages)) pages++;
+     while (pages > 1 &&
+            directory_page_used(directory_page(dir, bucket, pages - 1)) == 0) {
+         pages--;
+         off_t lblk = (off_t)pages * DIR_MAX_BUCKETS + bucket;
+         punch_inode(dir, lblk * BLOCK_SIZE, BLOCK_SIZE);
+     }
+ }
+ 
+ /**
+  * @brief Tell whether an entry should move out of a bucket's chain
+  * 
+  * @param dir Pointer to the directory's inode
+  * @param entry A used slot
+  * @param to Bucket the entries move to, or -1 to move them all
+  * @return int Nonzero if the entry moves
+  */
+ static int directory_moves(inode_t *dir, dir_entry_t *entry, int to) {
+     return to < 0 || directory_home(dir, entry->hash) == to;
+ }
+ 
+ /**
+  * @brief Add pages to a bucket's chain until it has room for more entries
+  * 
+  * @param dir Pointer to the directory's inode
+  * @param bucket Bucket index
+  * @param more Number of entries to make room for
+  * @return int 0 on success, or -ENOSPC if the chain cannot grow, in which
+  *             case the pages added are freed again
+  */
+ static int directory_make_room(inode_t *dir, int bucket, int more) {
+     int used = 0, pages = 0;
+     for (dir_entry_t *entries;
+          (entries = directory_page(dir, bucket, pages)); pages++) {
+         used += directory_page_used(entries);
+     }
+     int need = (used + more + DIR_ENTRIES_PER_BUCKET - 1) / DIR_ENTRIES_PER_BUCKET;
+     if (need > DIR_MAX_CHAIN + 1) return -ENOSPC;
+ 
+     // Mapped past the end of the buckets, so the size does not change
+     for (; pages < need; pages++) {
+         off_t lblk = (off_t)pages * DIR_MAX_BUCKETS + bucket;
+         if (reserve_inode(dir, lblk * BLOCK_SIZE, BLOCK_SIZE) < 0) {
+             directory_trim_chain(dir, bucket);
+             return -ENOSPC;
+         }
+     }
+     return 0;
+ }
+ 
+ /**
+  * @brief Move entries from one bucket's chain into another's
+  * 
+  * Only the slots that change are logged: each emptied slot as zeros, and
+  * each run of slots filled one after another as one record.
+  * 
+  * @param dir Pointer to the directory's inode
+  * @param from Bucket the entries leave
+  * @param to Bucket they join
+  * @param all Nonzero to move every entry, zero to move only those whose
+  *            home is now to
+  * 
+  * @assumption The caller made room in to's chain (directory_make_room())
+  */
+ static void directory_move(inode_t *dir, int from, int to, int all) {
+     int page = 0;
+     dir_entry_t *first = NULL, *last = NULL;
+ 
+     dir_entry_t *src;
+     for (int p = 0; (src = directory_page(dir, from, p)); p++) {
+         for (int i = 0; i < DIR_ENTRIES_PER_BUCKET; i++) {
+             if (src[i].name[0] == '\0' ||
+                 !directory_moves(dir, &src[i], all ? -1 : to)) {
+                 continue;
+             }
+ 
+             dir_entry_t *dst = directory_free_slot(dir, to, &page);
+             if (first && dst != last + 1) {
+                 journal_log(first, (last - first + 1) * sizeof(*dst));
+                 first = NULL;
+             }
+             if (!first) first = dst;
+             last = dst;
+ 
+             *dst = src[i];
+             memset(&src[i], 0, sizeof(dir_entry_t));
+             journal_log_zero(&src[i], sizeof(dir_entry_t));
+         }
+     }
+     if (first) journal_log(first, (last - first + 1) * sizeof(*first));
+ }
+ 
+ /**
+  * @brief Count the entries of a bucket's chain that would move
+  * 
+  * @param dir Pointer to the directory's inode
+  * @param from Bucket index
+  * @param to As for directory_moves()
+  * @return int Number of entries
+  */
+ static int directory_count_moves(inode_t *dir, int from, int to) {
+     int count = 0;
+     dir_entry_t *entries;
+     for (int p = 0; (entries = directory_page(dir, from, p)); p++) {
+         for (int i = 0; i < DIR_ENTRIES_PER_BUCKET; i++) {
+             if (entries[i].name[0] != '\0' &&
+                 directory_moves(dir, &entries[i], to)) {
+                 count++;
+             }
+         }
+     }
+     return count;
+ }
+ 
+ /**
+  * @brief Split one bucket in two by one more hash bit
+  * 
+  * Buckets are split in order, so the directory grows by one block at a
+  * time (linear hashing): the one split is bucket b = n - low, and its
+  * entries that now belong in bucket n move there.
+  * 
+  * @param dir Pointer to the directory's inode
+  * @return int 0 on success, or -ENOSPC if the directory cannot grow, in
+  *             which case nothing is changed
+  */
+ static int directory_split(inode_t *dir) {
+     int buckets = directory_buckets(dir);
+     if (buckets >= DIR_MAX_BUCKETS) return -ENOSPC;
+ 
+     // The new bucket comes back zeroed, i.e. with every slot free
+     off_t size = (off_t)buckets * BLOCK_SIZE;
+     int rv = reserve_inode(dir, size, BLOCK_SIZE);
+     if (rv < 0) return rv;
+     dir->size = size + BLOCK_SIZE;
+ 
+     int from = buckets - directory_level(buckets);
+     rv = directory_make_room(dir, buckets,
+                              directory_count_moves(dir, from, buckets));
+     if (rv < 0) {
+         punch_inode(dir, size, BLOCK_SIZE);
+         dir->size = size;
+         return rv;
+     }
+     directory_move(dir, from, buckets, 0);
+     directory_trim_chain(dir, from);
+     return 0;
+ }
+ 
+ /**
+  * @brief Undo the last split, merging the last bucket into the one it
+  *        was split from
+  * 
+  * @param dir Pointer to the directory's inode
+  * @return int 0 on success, or -EAGAIN if the pair does not fit in one
+  *             chain, in which case nothing is changed
+  */
+ static int directory_merge(inode_t *dir) {
+     int last = directory_buckets(dir) - 1;
+     int into = last - directory_level(last);
+     if (directory_make_room(dir, into,
+                             directory_count_moves(dir, last, -1)) < 0) {
+         return -EAGAIN;
+     }
+     directory_move(dir, last, into, 1);
+ 
+     int pages = 1;
+     while (directory_page(dir, last, pages)) pages++;
+     while (pages-- > 0) {
+         off_t lblk = (off_t)pages * DIR_MAX_BUCKETS + last;
+         punch_inode(dir, lblk * BLOCK_SIZE, BLOCK_SIZE);
+     }
+     directory_trim_chain(dir, into);
+     dir->size = (off_t)last * BLOCK_SIZE;
+     return 0;
+ }
+ 
+ /**
+  * @brief Tell whether deletes have left a directory sparse enough to shrink
+  * 
+  * @param dir Pointer to the directory's inode
+  * @return int Nonzero if it has more than one bucket and at most one slot
+  *             in DIR_SPARSE_RATIO is used
+  */
+ int directory_sparse(inode_t *dir) {
+     int buckets = directory_buckets(dir);
+     return buckets > 1 &&
+            (dir->nentries - 2) * DIR_SPARSE_RATIO <=
+                buckets * (int)DIR_ENTRIES_PER_BUCKET;
+ }
+ 
+ /**
+  * @brief Shrink a sparse directory by merging its buckets
+  * 
+  * @param dir Pointer to the directory's inode
+  * @return int Number of buckets merged away, or -EAGAIN if the directory
+  *             is sparse but its last bucket does not merge
+  * 
+  * @assumption At most DIR_MERGE_BATCH buckets are merged per call, so one
+  *             delete never costs more than a few blocks
+  * @assumption Cached lookups stay valid, since entries keep their names
+  */
+ int directory_compact(inode_t *dir) {
+     int merged = 0;
+     while (merged < DIR_MERGE_BATCH && directory_sparse(dir)) {
+         int rv = directory_merge(dir);
+         if (rv < 0) return merged > 0 ? merged : rv;
+         merged++;
+     }
+     return merged;
+ }
+ 
+ /**
+  * @brief Get a directory entry slot by number
+  * 
+  * @param dir Pointer to the directory's inode
+  * @param slot Slot number, as directory_next() hands out
+  * @return dir_entry_t* The slot, or NULL if no page holds it
+  */
+ dir_entry_t *directory_slot(inode_t *dir, int64_t slot) {
+     if (!dir || !S_ISDIR(dir->mode) || slot < 0) return NULL;
+     int64_t lblk = slot / DIR_ENTRIES_PER_BUCKET;
+     if (lblk >= (int64_t)(DIR_MAX_CHAIN + 1) * DIR_MAX_BUCKETS) return NULL;
+ 
+     int bnum = inode_get_bnum(dir, (int)lblk);
+     if (bnum < 0) return NULL;
+     dir_entry_t *entries = blocks_get_meta_block(bnum);
+     return &entries[slot % DIR_ENTRIES_PER_BUCKET];
+ }
+ 
+ /**
+  * @brief Walk the slots of a directory
+  * 
+  * @param dir Pointer to the directory's inode
+  * @param slot Slot number to start from, 0 for the first; set to the
+  *             number of the slot returned
+  * @return dir_entry_t* The slot, used or free, or NULL once every page
+  *         was visited
+  * 
+  * @assumption Holes between the buckets and the overflow pages are
+  *             skipped a whole run at a time
+  */
+ dir_entry_t *directory_next(inode_t *dir, int64_t *slot) {
+     if (!dir || !S_ISDIR(dir->mode)) return NULL;
+     while (*slot >= 0) {
+         dir_entry_t *entry = directory_slot(dir, *slot);
+         if (entry) return entry;
+ 
+         size_t hole = 0;
+         off_t at = (*slot / DIR_ENTRIES_PER_BUCKET) * BLOCK_SIZE;
+         if (at >= (off_t)(DIR_MAX_CHAIN + 1) * DIR_MAX_BUCKETS * BLOCK_SIZE ||
+             inode_locate(dir, at, &hole) >= 0 || hole == SIZE_MAX) {
+             break;
+         }
+         *slot = (at + (off_t)hole) / BLOCK_SIZE * DIR_ENTRIES_PER_BUCKET;
+     }
+     return NULL;
+ }
+ 
+ /**
+  * @brief Get the bucket a slot belongs to
+  * 
+  * @param slot Slot number
+  * @return int Bucket index, whether the slot is in the bucket's own block
+  *             or in one of its overflow pages
+  */
+ int directory_slot_bucket(int64_t slot) {
+     return (slot / DIR_ENTRIES_PER_BUCKET) % DIR_MAX_BUCKETS;
+ }
+ 
+ /**
+  * @brief Find the slot holding a name
+  * 
+  * @param dir Pointer to the directory's inode
+  * @param name Name of the entry, not "." or ".."
+  * @param home Set to the bucket the name belongs in, if not NULL
+  * @param page Set to the page of the chain the slot is in, if not NULL
+  * @return dir_entry_t* The slot, or NULL if the name is not present
+  */
+ static dir_entry_t *directory_find(inode_t *dir, const char *name,
+                                    int *home, int *page) {
+     if (directory_buckets(dir) == 0) return NULL;
+ 
+     uint32_t hash = directory_hash(name);
+     int bucket = directory_home(dir, hash);
+     if (home) *home = bucket;
+ 
+     dir_entry_t *entries;
+     for (int p = 0; (entries = directory_page(dir, bucket, p)); p++) {
+         for (int i = 0; i < DIR_ENTRIES_PER_BUCKET; i++) {
+             if (entries[i].hash == hash && entries[i].name[0] != '\0' &&
+                 strcmp(entries[i].name, name) == 0) {
+                 if (page) *page = p;
+                 return &entries[i];
+             }
+         }
+     }
+     return NULL;
+ }
+ 
  /**
   * @brief Look up an entry in a directory by name
   * 
@@ -40,64 +462,65 @@
   *         -EINVAL if arguments are invalid
   *         -ENOENT if the entry is not found
   * 
-  * @assumption Directory block contains contiguous directory entries
+  * @assumption Only the chain of the bucket the name hashes to is scanned
+  * @assumption "." and ".." are answered from the inode, not stored
   */
  int directory_lookup(inode_t *dir, const char *name) {
      if (!dir || !name) return -EINVAL;
+     if (strcmp(name, ".") == 0) return dir->inum;
+     if (strcmp(name, "..") == 0) return dir->parent;
      
-     dir_entry_t *entries = blocks_get_block(dir->block);
-     int count = dir->size / sizeof(dir_entry_t);
-     
-     // Iterate through all entries in the directory
-     for (int i = 0; i < count; i++) {
-         if (strcmp(entries[i].name, name) == 0) {
-             return entries[i].inum;
-         }
-     }
-     return -ENOENT;
+     dir_entry_t *entry = directory_find(dir, name, NULL, NULL);
+     return entry ? entry->inum : -ENOENT;
  }
  
  /**
-  * @brief Add or update an entry in a directory
+  * @brief Add an entry to a directory
   * 
   * @param dir Pointer to the directory's inode
   * @param name Name for the new directory entry
   * @param inum Inode number to associate with the entry
   * @return int 0 on success, or negative error code:
   *         -ENOTDIR if dir is not a directory
-  *         -ENOSPC if there's no space left in the directory block
+  *         -EEXIST if the name is already present
+  *         -ENAMETOOLONG if the name does not fit in an entry
+  *         -ENOSPC if the directory cannot grow any further
   * 
-  * @assumption The function first tries to reuse empty slots before appending
-  * @assumption Directory entries are stored in a single block (max entries = BLOCK_SIZE/sizeof(dir_entry_t))
+  * @assumption A full bucket takes an overflow page; the directory then
+  *             splits one bucket, as it does once it is DIR_SPLIT_LOAD
+  *             percent full, so no insert moves more than one bucket
   */
  int directory_put(inode_t *dir, const char *name, int inum) {
      if (!dir || !S_ISDIR(dir->mode)) return -ENOTDIR;
+     if (!name || name[0] == '\0') return -EINVAL;
+     if (strcmp(name, ".") == 0 || strcmp(name, "..") == 0) return -EEXIST;
+     if (strlen(name) >= DIR_NAME_LENGTH) return -ENAMETOOLONG;
  
-     dir_entry_t *entries = blocks_get_block(dir->block);
-     int count = dir->size / sizeof(dir_entry_t);
- 
-     // Look for empty slot to reuse
-     for (int i = 0; i < count; i++) {
-         if (entries[i].name[0] == '\0') {
-             strncpy(entries[i].name, name, DIR_NAME_LENGTH - 1);
-             entries[i].name[DIR_NAME_LENGTH - 1] = '\0'; // Ensure null-termination
-             entries[i].inum = inum;
-             return 0;
-         }
+     // The first entry allocates the first bucket
+     if (directory_buckets(dir) == 0) {
+         int rv = reserve_inode(dir, 0, BLOCK_SIZE);
+         if (rv == 0) rv = grow_inode(dir, BLOCK_SIZE);
+         if (rv < 0) return rv;
      }
  
-     // No empty slot — append new entry
-     if (count >= (BLOCK_SIZE / sizeof(dir_entry_t))) {
-         return -ENOSPC;  // Directory block is full
-     }
+     int bucket;
+     if (directory_find(dir, name, &bucket, NULL)) return -EEXIST;
  
-     // Add the entry at the end of the directory
-     strncpy(entries[count].name, name, DIR_NAME_LENGTH - 1);
-     entries[count].name[DIR_NAME_LENGTH - 1] = '\0'; // Ensure null-termination
-     entries[count].inum = inum;
-     dir->size += sizeof(dir_entry_t);
+     int page = 0;
+     dir_entry_t *slot = directory_free_slot(dir, bucket, &page);
+     if (!slot) return -ENOSPC;
+     strcpy(slot->name, name);
+     slot->inum = inum;
+     slot->hash = directory_hash(name);
+     journal_log(slot, sizeof(dir_entry_t));
+     dir->nentries += 1;
      dir->mtime = time(NULL);
  
+     // Failing to split only leaves the directory fuller than it should be
+     int64_t slots = (int64_t)directory_buckets(dir) * DIR_ENTRIES_PER_BUCKET;
+     if (page > 0 || (int64_t)(dir->nentries - 2) * 100 > slots * DIR_SPLIT_LOAD) {
+         directory_split(dir);
+     }
      return 0;
  }
  
@@ -111,63 +534,178 @@
   *         -ENOTDIR if dir is not a directory
   *         -ENOENT if the entry is not found
   * 
-  * @assumption After deletion, remaining entries are shifted to maintain contiguity
+  * @assumption The slot is cleared in place; no other entries move
+  * @assumption An overflow page left empty at the end of its chain is freed
+  * @assumption Cached lookups of the name are invalidated
   */
  int directory_delete(inode_t *dir, const char *name) {
      if (!dir || !name) return -EINVAL;
      if (!S_ISDIR(dir->mode)) return -ENOTDIR;
  
-     dir_entry_t *entries = blocks_get_block(dir->block);
-     int count = dir->size / sizeof(dir_entry_t);
+     int bucket, page;
+     dir_entry_t *entry = directory_find(dir, name, &bucket, &page);
+     if (!entry) return -ENOENT;
+ 
+     dcache_invalidate(dir->inum, name);
+     memset(entry, 0, sizeof(dir_entry_t));
+     journal_log(entry, sizeof(dir_entry_t));
+     dir->nentries -= 1;
+     dir->mtime = time(NULL);
+     if (page > 0) directory_trim_chain(dir, bucket);
+     return 0;
+ }
+ 
+ /**
+  * @brief Point an existing entry at another inode
+  * 
+  * @param dir Pointer to the directory's inode
+  * @param name Name of the entry
+  * @param inum Inode number the entry should name from now on
+  * @return int The inode number it named before, or negative error code:
+  *         -EINVAL if arguments are invalid
+  *         -ENOTDIR if dir is not a directory
+  *         -ENOENT if the entry is not found
+  * 
+  * @assumption The entry keeps its slot, so nothing is allocated or moved
+  *             and only that slot is logged
+  * @assumption Cached lookups of the name are invalidated
+  */
+ int directory_replace(inode_t *dir, const char *name, int inum) {
+     if (!dir || !name) return -EINVAL;
+     if (!S_ISDIR(dir->mode)) return -ENOTDIR;
+ 
+     dir_entry_t *entry = directory_find(dir, name, NULL, NULL);
+     if (!entry) return -ENOENT;
+ 
+     int old = entry->inum;
+     dcache_invalidate(dir->inum, name);
+     entry->inum = inum;
+     journal_log(entry, sizeof(dir_entry_t));
+     dir->mtime = time(NULL);
+     return old;
+ }
+ 
+ /**
+  * @brief Reverse the bits of a hash
+  * 
+  * A bucket holds the hashes that end in its index, so in reversed hash
+  * order each bucket covers one contiguous range, whatever the split.
+  * 
+  * @param hash The hash
+  * @return uint32_t Its bits in reverse order
+  */
+ static uint32_t directory_reverse(uint32_t hash) {
+     hash = (hash >> 1 & 0x55555555u) | (hash & 0x55555555u) << 1;
+     hash = (hash >> 2 & 0x33333333u) | (hash & 0x33333333u) << 2;
+     hash = (hash >> 4 & 0x0f0f0f0fu) | (hash & 0x0f0f0f0fu) << 4;
+     hash = (hash >> 8 & 0x00ff00ffu) | (hash & 0x00ff00ffu) << 8;
+     return hash >> 16 | hash << 16;
+ }
  
-     // Find and remove the entry
-     for (int i = 0; i < count; i++) {
-         if (entries[i].name[0] != '\0' && strcmp(entries[i].name, name) == 0) {
-             // Clear the name
-             memset(entries[i].name, 0, sizeof(entries[i].name));
+ /**
+  * @brief Order entries by reversed hash, then by name
+  */
+ static int directory_cookie_cmp(const void *a, const void *b) {
+     const dir_entry_t *x = *(dir_entry_t *const *)a;
+     const dir_entry_t *y = *(dir_entry_t *const *)b;
+     uint32_t rx = directory_reverse(x->hash), ry = directory_reverse(y->hash);
+     if (rx != ry) return rx < ry ? -1 : 1;
+     return strcmp(x->name, y->name);
+ }
  
-             // Shift remaining entries to fill the gap
-             if (i < count - 1) {
-                 memmove(&entries[i], &entries[i+1],
-                         (count - i - 1) * sizeof(dir_entry_t));
+ /**
+  * @brief Visit the entries of a directory in cookie order
+  * 
+  * @param dir Pointer to the directory's inode
+  * @param cookie Where to start: 0 for the first entry, or a cookie fn
+  *               was given
+  * @param fn Called for each entry with the cookie that resumes after it
+  * @param arg Passed to fn
+  * @return int 0 once every entry was visited, what fn returned if it
+  *             stopped the walk, or -ENOMEM
+  * 
+  * @assumption Buckets are visited in the order of the ranges they cover
+  *             in reversed hash space, and each bucket's chain is sorted
+  * @assumption Entries sharing a hash are told apart by their rank in name
+  *             order, so one added or removed among them between calls
+  *             may shift the others by one
+  */
+ int directory_iterate(inode_t *dir, uint64_t cookie, directory_iterate_fn fn,
+                       void *arg) {
+     if (!dir || !S_ISDIR(dir->mode)) return -ENOTDIR;
+     int buckets = directory_buckets(dir);
+     if (buckets == 0) return 0;
+ 
+     int low = directory_level(buckets);
+     int bits = 0;
+     while ((1 << bits) < low) bits++;
+ 
+     dir_entry_t **sorted = NULL;
+     int cap = 0, rv = 0;
+     uint64_t pos = cookie >> DIR_COOKIE_RANK_BITS;
+     uint32_t skip = cookie & ((1u << DIR_COOKIE_RANK_BITS) - 1);
+ 
+     while (rv == 0 && pos <= UINT32_MAX) {
+         uint32_t hash = directory_reverse((uint32_t)pos);
+         int bucket = directory_home(dir, hash);
+         int depth = bucket < buckets - low || bucket >= low ? bits + 1 : bits;
+         uint64_t end = ((pos >> (32 - depth)) + 1) << (32 - depth);
+ 
+         int count = 0;
+         dir_entry_t *entries;
+         for (int p = 0; (entries = directory_page(dir, bucket, p)); p++) {
+             for (int i = 0; i < DIR_ENTRIES_PER_BUCKET; i++) {
+                 if (entries[i].name[0] == '\0') continue;
+                 if (count == cap) {
+                     cap = cap ? cap * 2 : DIR_ENTRIES_PER_BUCKET;
+                     dir_entry_t **grown = realloc(sorted, cap * sizeof(*sorted));
+                     if (!grown) {
+                         free(sorted);
+                         return -ENOMEM;
+                     }
+                     sorted = grown;
+                 }
+                 sorted[count++] = &entries[i];
              }
+         }
+         qsort(sorted, count, sizeof(*sorted), directory_cookie_cmp);
  
-             // Zero out the last slot which is now redundant
-             memset(&entries[count - 1], 0, sizeof(dir_entry_t));
-             dir->size -= sizeof(dir_entry_t);
-             dir->mtime = time(NULL);
-             return 0;
+         for (int i = 0, rank = 0; rv == 0 && i < count; i++) {
+             uint32_t rh = directory_reverse(sorted[i]->hash);
+             rank = i > 0 && sorted[i - 1]->hash == sorted[i]->hash ? rank + 1 : 0;
+             if (rh < pos || (rh == pos && (uint32_t)rank < skip)) continue;
+             rv = fn(sorted[i], ((uint64_t)rh << DIR_COOKIE_RANK_BITS) | (rank + 1),
+                     arg);
          }
+         pos = end;
+         skip = 0;
      }
- 
-     return -ENOENT;
+     free(sorted);
+     return rv;
  }
  
  /**
   * @brief List all entries in a directory except for "." and ".."
   * 
   * @param dir Pointer to the directory's inode
-  * @return slist_t* A linked list of entry names (strings), or NULL if invalid
+  * @param names An empty list that receives the names, in slot order
+  * @return int Number of names listed, or negative error code:
+  *         -ENOTDIR if dir is not a directory
+  *         -ENOMEM if the list cannot grow
   * 
-  * @assumption The caller is responsible for freeing the returned list
-  * @assumption Special entries "." and ".." are filtered out
+  * @assumption The caller frees the list with sn_free(), even on failure
+  * @assumption "." and ".." are not stored, so they are never listed
   */
- slist_t *directory_list(inode_t *dir) {
-     if (!dir || !S_ISDIR(dir->mode)) return NULL;
- 
-     slist_t *list = NULL;
-     dir_entry_t *entries = blocks_get_block(dir->block);
-     int count = dir->size / sizeof(dir_entry_t);
+ int directory_list(inode_t *dir, snames_t *names) {
+     if (!dir || !S_ISDIR(dir->mode)) return -ENOTDIR;
  
-     // Create a list of all entry names, excluding "." and ".."
-     for (int i = 0; i < count; i++) {
-         if (strcmp(entries[i].name, ".") != 0 && 
-             strcmp(entries[i].name, "..") != 0) {
-             list = s_cons(entries[i].name, list);
+     dir_entry_t *entry;
+     for (int64_t slot = 0; (entry = directory_next(dir, &slot)); slot++) {
+         if (entry->name[0] != '\0' && sn_add(names, entry->name) < 0) {
+             return -ENOMEM;
          }
      }
- 
-     return list;
+     return names->count;
  }
  
  /**
@@ -183,11 +721,12 @@
          return;
      }
  
-     dir_entry_t *entries = blocks_get_block(dir->block);
-     int count = dir->size / sizeof(dir_entry_t);
+     dir_entry_t *entry;
  
-     printf("Directory (inode %d, size %d):\n", dir->inum, dir->size);
-     for (int i = 0; i < count; i++) {
-         printf("  %-12s → inode %d\n", entries[i].name, entries[i].inum);
+     printf("Directory (inode %d, size %ld):\n", dir->inum, (long)dir->size);
+     for (int64_t slot = 0; (entry = directory_next(dir, &slot)); slot++) {
+         if (entry->name[0] != '\0') {
+             printf("  %-12s → inode %d\n", entry->name, entry->inum);
+         }
      }
  }
\ No newline at end of file
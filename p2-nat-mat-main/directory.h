@@ -9,6 +9,8 @@
  #ifndef DIRECTORY_H
  #define DIRECTORY_H
  
+ #include <stdint.h>
+ 
  #include "helpers/blocks.h"
  #include "inode.h"
  #include "helpers/slist.h"
@@ -18,17 +20,53 @@
   */
  #define DIR_NAME_LENGTH 48
  
+ /**
+  * Most buckets a directory may split into (each bucket is one block)
+  */
+ #define DIR_MAX_BUCKETS (1 << 16)
+ 
+ /**
+  * Most overflow pages a bucket may chain past its own block
+  */
+ #define DIR_MAX_CHAIN 32
+ 
+ /**
+  * A bucket is split after an insert that leaves more than this percentage
+  * of the buckets' slots in use, or that needed an overflow page
+  */
+ #define DIR_SPLIT_LOAD 75
+ 
+ /**
+  * A directory with more than one bucket shrinks once no more than one
+  * slot in this many holds an entry (see directory_compact())
+  */
+ #define DIR_SPARSE_RATIO 8
+ 
+ /**
+  * Most buckets one call to directory_compact() merges away
+  */
+ #define DIR_MERGE_BATCH 4
+ 
  /**
   * @struct dir_entry
   * @brief Directory entry structure
   *
   * Each entry in a directory contains a filename and associated inode number.
   * The structure is padded to be exactly 64 bytes for storage efficiency.
+  *
+  * A directory is a linear hash table: file blocks 0 to n - 1 are its n
+  * buckets, and an entry lives in the bucket selected by the low bits of
+  * its name hash (see directory_home()). Buckets are split one at a time,
+  * in order, each by one more hash bit, so the directory grows a block at
+  * a time. A full bucket chains overflow pages, page p of bucket b being
+  * file block p * DIR_MAX_BUCKETS + b, past the directory's size. Lookups
+  * scan one bucket's chain, which splitting keeps short.
   */
  typedef struct dir_entry {
-     char name[DIR_NAME_LENGTH];  /* Entry name */
+     char name[DIR_NAME_LENGTH];  /* Entry name (empty if the slot is free) */
      int inum;                    /* Inode number */
-     char _reserved[12];          /* Padding to make 64 bytes total */
+     uint32_t hash;               /* directory_hash() of the name */
+     char _reserved[8];           /* Padding to make 64 bytes total */
  } dir_entry_t;
  
  /**
@@ -39,6 +77,57 @@
   */
  void directory_init();
  
+ /**
+  * @brief Hash a name for placement in a directory's buckets
+  *
+  * @param name Entry name
+  * @return 32-bit FNV-1a hash of the name
+  */
+ uint32_t directory_hash(const char *name);
+ 
+ /**
+  * @brief Get the bucket a hash belongs in
+  *
+  * @param dir Pointer to the directory's inode, with at least one bucket
+  * @param hash directory_hash() of a name
+  * @return Bucket index
+  */
+ int directory_home(inode_t *dir, uint32_t hash);
+ 
+ /**
+  * @brief Get a directory entry slot by number
+  *
+  * Slot s is entry s % (BLOCK_SIZE / sizeof(dir_entry_t)) of the
+  * directory's file block s / (BLOCK_SIZE / sizeof(dir_entry_t)).
+  *
+  * @param dir Pointer to the directory's inode
+  * @param slot Slot number
+  * @return Pointer to the slot, whose name is empty if it is unused,
+  *         or NULL if no block of the directory holds it
+  */
+ dir_entry_t *directory_slot(inode_t *dir, int64_t slot);
+ 
+ /**
+  * @brief Walk the slots of a directory, buckets first, then overflow pages
+  *
+  * @param dir Pointer to the directory's inode
+  * @param slot Slot number to start from, 0 for the first; set to the
+  *             number of the slot returned, so the caller adds one to
+  *             carry on
+  * @return Pointer to the slot, used or free, or NULL once every block
+  *         was visited
+  */
+ dir_entry_t *directory_next(inode_t *dir, int64_t *slot);
+ 
+ /**
+  * @brief Get the bucket a slot belongs to
+  *
+  * @param slot Slot number
+  * @return Bucket index, whether the slot is in the bucket's own block or
+  *         in one of its overflow pages
+  */
+ int directory_slot_bucket(int64_t slot);
+ 
  /**
   * @brief Look up an entry in a directory
   *
@@ -58,7 +147,9 @@
   * @param inum Inode number to associate with the entry
   * @return 0 on success, or negative error code:
   *         -ENOTDIR if di is not a directory
-  *         -ENOSPC if there's no space left in the directory block
+  *         -EEXIST if the name is already present
+  *         -ENAMETOOLONG if the name does not fit in an entry
+  *         -ENOSPC if the directory cannot grow any further
   */
  int directory_put(inode_t *di, const char *name, int inum);
  
@@ -75,13 +166,92 @@
  int directory_delete(inode_t *di, const char *name);
  
  /**
-  * @brief Return a list of files in the directory
+  * @brief Point an existing entry at another inode, in place
+  *
+  * @param di Pointer to the directory's inode
+  * @param name Name of the entry
+  * @param inum Inode number the entry should name from now on
+  * @return The inode number it named before, or negative error code:
+  *         -EINVAL if arguments are invalid
+  *         -ENOTDIR if di is not a directory
+  *         -ENOENT if the entry is not found
+  */
+ int directory_replace(inode_t *di, const char *name, int inum);
+ 
+ /**
+  * @brief Tell whether deletes have left a directory sparse enough to shrink
+  *
+  * @param dir Pointer to the directory's inode
+  * @return Nonzero if it has more than one bucket and at most one slot in
+  *         DIR_SPARSE_RATIO is used
+  */
+ int directory_sparse(inode_t *dir);
+ 
+ /**
+  * @brief Shrink a sparse directory by merging its buckets
+  *
+  * Undoes the last splits, one bucket at a time, for as long as the
+  * directory stays sparse but at most DIR_MERGE_BATCH times, freeing each
+  * merged bucket's blocks.
+  *
+  * @param dir Pointer to the directory's inode
+  * @return Number of buckets merged away, or -EAGAIN if the directory is
+  *         sparse but its last bucket cannot be merged into the one it
+  *         came from, as the pair would chain past DIR_MAX_CHAIN or the
+  *         disk is full
+  */
+ int directory_compact(inode_t *dir);
+ 
+ /**
+  * Low bits of a readdir cookie that count entries sharing one hash
+  */
+ #define DIR_COOKIE_RANK_BITS 16
+ 
+ /**
+  * Called by directory_iterate() for each entry.
+  *
+  * @param entry The entry; valid until the directory's lock is released
+  * @param cookie Cookie that resumes the walk right after this entry
+  * @param arg The argument given to directory_iterate()
+  * @return 0 to go on, or a value that stops the walk and is returned
+  */
+ typedef int (*directory_iterate_fn)(dir_entry_t *entry, uint64_t cookie,
+                                     void *arg);
+ 
+ /**
+  * @brief Visit the entries of a directory in hash order, from a cookie
+  *
+  * Entries are ordered by their hash with its bits reversed, and a cookie
+  * names a position in that order rather than a slot, so it stays valid
+  * however buckets are split or merged in between, as ext4's htree cookies
+  * do. Entries added or removed meanwhile may or may not be seen, but no
+  * other entry is seen twice or missed. Cookies are below 1 << 48.
+  *
+  * @param dir Pointer to the directory's inode, locked by the caller
+  * @param cookie 0 to start with the first entry, or a cookie fn was given
+  * @param fn Called for each entry
+  * @param arg Passed to fn
+  * @return 0 once every entry was visited, what fn returned if it stopped
+  *         the walk, or negative error code:
+  *         -ENOTDIR if dir is not a directory
+  *         -ENOMEM if a bucket cannot be sorted
+  */
+ int directory_iterate(inode_t *dir, uint64_t cookie, directory_iterate_fn fn,
+                       void *arg);
+ 
+ /**
+  * @brief List the names in a directory
+  *
+  * The names are packed into one buffer, however many there are.
   *
   * @param dir Pointer to the directory's inode
-  * @return A linked list of entry names (strings), or NULL if invalid
-  *         The caller is responsible for freeing this list.
+  * @param names An empty list (see sn_init()) that receives the names;
+  *              the caller frees it with sn_free(), even on failure
+  * @return Number of names listed, or negative error code:
+  *         -ENOTDIR if dir is not a directory
+  *         -ENOMEM if the list cannot grow
   */
- slist_t *directory_list(inode_t *dir);
+ int directory_list(inode_t *dir, snames_t *names);
  
  /**
   * @brief Print the contents of a directory for debugging
@@ -0,0 +1,923 @@
+/**
+ * @file fsck.c
+ * @brief Consistency checking of the image
+ *
+ * A check runs in passes, each split across the worker threads:
+ *
+ *   1. Every allocated inode is checked on its own, and the blocks of its
+ *      extent map are counted in a table with one entry per block.
+ *   2. The directory tree is walked from the root, directories being
+ *      handed out to the workers as they are found. Each entry is checked
+ *      and counted as a link to the inode it names; a directory reached a
+ *      second time is a second name for it. Directories the walk did not
+ *      reach are then walked from the top of each detached subtree.
+ *   3. Link counts and ".." links are compared with what the walk found,
+ *      and inodes no entry names are dealt with.
+ *   4. The block bitmap and reference counts are compared with the table.
+ *
+ * Repairs that allocate (moving entries, reconnecting inodes) wait until
+ * the passes are over, so that nothing they allocate is taken for
+ * space that leaked.
+ */
+
+ #define _GNU_SOURCE
+ #include <errno.h>
+ #include <pthread.h>
+ #include <sched.h>
+ #include <stdarg.h>
+ #include <stdio.h>
+ #include <stdlib.h>
+ #include <string.h>
+ #include <sys/resource.h>
+ #include <sys/stat.h>
+ #include <time.h>
+ #include <unistd.h>
+
+ #include "fsck.h"
+ #include "directory.h"
+ #include "inode.h"
+ #include "storage.h"
+ #include "helpers/bitmap.h"
+ #include "helpers/blocks.h"
+ #include "helpers/journal.h"
+ #include "helpers/log.h"
+
+ /**
+  * Inodes or blocks a worker takes from a pass at a time
+  */
+ #define FSCK_CHUNK 1024
+
+ /**
+  * Inodes the scrubber checks between pauses, and the pauses
+  */
+ #define FSCK_SCRUB_BATCH 64
+ #define FSCK_SCRUB_PAUSE_MS 50
+ #define FSCK_SCRUB_INTERVAL_S 600
+
+ /* What pass 1 made of each inode */
+ #define FSCK_FREE 0    /* Not allocated, or cleared by a repair */
+ #define FSCK_OK 1      /* Sound enough to be linked and walked */
+ #define FSCK_BAD 2     /* Damaged beyond repair; its entries are dropped */
+
+ /* found_parent values besides a directory's inode number */
+ #define FSCK_UNREACHED (-1)
+ #define FSCK_DETACHED (-2)  /* Top of a subtree the root does not reach */
+
+ /**
+  * An entry found in the wrong bucket, moved once the passes are over
+  */
+ typedef struct fsck_move {
+     int dir;
+     int64_t slot;
+ } fsck_move_t;
+
+ /**
+  * State of the check in progress; there is only ever one
+  */
+ static struct {
+     int repair;
+     int root;
+     FILE *out;
+     fsck_report_t *report;
+     pthread_mutex_t lock;      /* Guards out, the queue and the lists */
+
+     uint8_t *kind;             /* Per inode: FSCK_FREE, FSCK_OK, FSCK_BAD */
+     int *links;                /* Per inode: entries naming it (atomic) */
+     int *found_parent;         /* Per directory: whose entry names it (atomic) */
+     int *owner;                /* Per block: first inode seen holding it (atomic) */
+     uint32_t *uses;            /* Per block: references found (atomic) */
+
+     int cursor;                /* Next chunk of the pass in progress (atomic) */
+
+     pthread_cond_t queue_cond;
+     int *queue;                /* Directories still to be walked */
+     int queued, queue_cap;
+     int busy;                  /* Workers walking a directory */
+
+     int *lost;                 /* Inodes no entry names, to reconnect */
+     int nlost, lost_cap;
+     fsck_move_t *moves;        /* Entries in the wrong bucket */
+     int nmoves, moves_cap;
+     int oom;                   /* A list could not grow */
+ } ck = { .lock = PTHREAD_MUTEX_INITIALIZER,
+          .queue_cond = PTHREAD_COND_INITIALIZER };
+
+ #define fsck_count(counter, n) \
+     __atomic_fetch_add(&ck.report->counter, n, __ATOMIC_RELAXED)
+
+ /**
+  * @brief Report a problem
+  *
+  * @param fixed Nonzero if the caller repairs it when repairing
+  * @param fmt printf-style format, without a trailing newline
+  */
+ __attribute__((format(printf, 2, 3)))
+ static void fsck_problem(int fixed, const char *fmt, ...) {
+     char msg[256];
+     va_list ap;
+     va_start(ap, fmt);
+     vsnprintf(msg, sizeof(msg), fmt, ap);
+     va_end(ap);
+
+     fixed = fixed && ck.repair;
+     fsck_count(errors, 1);
+     if (fixed) fsck_count(repaired, 1);
+
+     const char *note = fixed ? ", fixed" : "";
+     if (ck.out) {
+         pthread_mutex_lock(&ck.lock);
+         fprintf(ck.out, "%s%s\n", msg, note);
+         pthread_mutex_unlock(&ck.lock);
+     } else {
+         log_warn("fsck: %s%s", msg, note);
+     }
+ }
+
+ /**
+  * @brief Append to one of the lists, under ck.lock
+  *
+  * @return 0, or -1 (and ck.oom set) if the list could not grow
+  */
+ static int fsck_append(void **list, int *count, int *cap, size_t size,
+                        const void *item) {
+     pthread_mutex_lock(&ck.lock);
+     if (*count == *cap) {
+         int want = *cap ? *cap * 2 : 64;
+         void *grown = realloc(*list, want * size);
+         if (!grown) {
+             ck.oom = 1;
+             pthread_mutex_unlock(&ck.lock);
+             return -1;
+         }
+         *list = grown;
+         *cap = want;
+     }
+     memcpy((char *)*list + *count * size, item, size);
+     (*count)++;
+     pthread_mutex_unlock(&ck.lock);
+     return 0;
+ }
+
+ /**
+  * @brief Run a worker on every thread and wait for them all
+  */
+ static void fsck_parallel(void *(*worker)(void *), int threads) {
+     pthread_t tids[threads];
+     int started = 0;
+     __atomic_store_n(&ck.cursor, 0, __ATOMIC_RELAXED);
+     for (; started < threads - 1; started++) {
+         if (pthread_create(&tids[started], NULL, worker, NULL) != 0) break;
+     }
+     worker(NULL);  /* The calling thread takes a share too */
+     for (int i = 0; i < started; i++) {
+         pthread_join(tids[i], NULL);
+     }
+ }
+
+ /**
+  * @brief Take the next chunk of a pass over count items
+  *
+  * @return 1 with [*lo, *hi) set, or 0 once the pass is done
+  */
+ static int fsck_next_chunk(int count, int *lo, int *hi) {
+     int first = __atomic_fetch_add(&ck.cursor, FSCK_CHUNK, __ATOMIC_RELAXED);
+     if (first >= count) return 0;
+     *lo = first;
+     *hi = count - first < FSCK_CHUNK ? count : first + FSCK_CHUNK;
+     return 1;
+ }
+
+ /**
+  * @brief inode_walk callback that only lets the map be checked
+  */
+ static int fsck_visit_none(int pblk, int len, int lblk, void *arg) {
+     return 0;
+ }
+
+ /**
+  * @brief inode_walk callback counting an inode's blocks in the table
+  *
+  * @param arg Pointer to the inode number
+  */
+ static int fsck_visit_claim(int pblk, int len, int lblk, void *arg) {
+     int inum = *(int *)arg;
+     for (int b = pblk; b < pblk + len; b++) {
+         __atomic_fetch_add(&ck.uses[b], 1, __ATOMIC_RELAXED);
+         int prev = -1;
+         if (__atomic_compare_exchange_n(&ck.owner[b], &prev, inum, 0,
+                                         __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+             continue;
+         }
+         // Only deduplicated data blocks may be shared
+         if (!blocks_dedup_enabled() || lblk < 0) {
+             fsck_problem(0, "block %d is held by inode %d and inode %d", b,
+                          prev, inum);
+         }
+     }
+     fsck_count(blocks, len);
+     return 0;
+ }
+
+ /**
+  * @brief inode_walk callback releasing the blocks of an inode being freed
+  *
+  * Blocks the table says nothing else holds are freed here, and shared
+  * ones lose a reference, so that the block pass does not report what
+  * the inode held as leaked.
+  */
+ static int fsck_visit_release(int pblk, int len, int lblk, void *arg) {
+     for (int b = pblk; b < pblk + len; b++) {
+         int left = __atomic_sub_fetch(&ck.uses[b], 1, __ATOMIC_RELAXED);
+         if (left == 0) {
+             block_set_refs(b, 0);
+             blocks_set_allocated(b, 0);
+         } else if (block_refs(b) > left) {
+             block_set_refs(b, left);
+         }
+     }
+     return 0;
+ }
+
+ /**
+  * @brief Mark an inode free in the inode bitmap, leaving its blocks to
+  *        the block pass
+  */
+ static void fsck_clear_inode(int inum) {
+     void *ibm = get_inode_bitmap();
+     if (bitmap_test_and_clear(ibm, inum)) {
+         blocks_adjust_free_inodes(1);
+         journal_log_bits(ibm, inum, 1, 0);
+     }
+     ck.kind[inum] = FSCK_FREE;
+ }
+
+ /**
+  * @brief inode_walk callback checking a directory maps only its buckets
+  *        and their overflow pages
+  *
+  * @param arg Pointer to the directory's bucket count
+  */
+ static int fsck_visit_dir(int pblk, int len, int lblk, void *arg) {
+     int buckets = *(int *)arg;
+     for (int b = lblk; lblk >= 0 && b < lblk + len; b++) {
+         if (b >= (DIR_MAX_CHAIN + 1) * DIR_MAX_BUCKETS ||
+             (b >= buckets && b % DIR_MAX_BUCKETS >= buckets)) {
+             return 1;
+         }
+     }
+     return 0;
+ }
+ 
+ /**
+  * @brief Check a directory's buckets are all mapped, and nothing else is
+  *        besides their overflow pages
+  *
+  * @return Nonzero if its slots can be read
+  */
+ static int fsck_dir_mapped(inode_t *dir) {
+     int64_t buckets = dir->size / BLOCK_SIZE;
+     if (dir->size % BLOCK_SIZE || buckets > DIR_MAX_BUCKETS) {
+         return 0;
+     }
+     for (int b = 0; b < buckets; b++) {
+         if (inode_get_bnum(dir, b) < 0) return 0;
+     }
+     int n = buckets;
+     return inode_walk(dir, fsck_visit_dir, &n) == 0;
+ }
+
+ /**
+  * @brief Pass 1: check each allocated inode and count its blocks
+  */
+ static void *fsck_inode_worker(void *arg) {
+     void *ibm = get_inode_bitmap();
+     int lo, hi;
+     while (fsck_next_chunk(INODE_COUNT, &lo, &hi)) {
+         for (int inum = lo; inum < hi; inum++) {
+             if (!bitmap_get(ibm, inum)) continue;
+             fsck_count(inodes, 1);
+             inode_t *node = get_inode(inum);
+
+             if (node->inum != inum) {
+                 fsck_problem(1, "inode %d records number %d", inum, node->inum);
+                 if (ck.repair) {
+                     node->inum = inum;
+                     journal_log(node, sizeof(inode_t));
+                 }
+             }
+
+             const char *damage = NULL;
+             if (!S_ISREG(node->mode) && !S_ISDIR(node->mode)) {
+                 damage = "has no valid file type";
+             } else if (node->size < 0) {
+                 damage = "has a negative size";
+             } else if (inode_walk(node, fsck_visit_none, NULL) < 0) {
+                 damage = "has a damaged extent map";
+             } else if (S_ISDIR(node->mode) && !fsck_dir_mapped(node)) {
+                 damage = "is a directory with missing buckets";
+             }
+             if (damage) {
+                 fsck_problem(1, "inode %d %s", inum, damage);
+                 ck.kind[inum] = FSCK_BAD;
+                 continue;
+             }
+
+             inode_walk(node, fsck_visit_claim, &inum);
+             ck.kind[inum] = FSCK_OK;
+         }
+     }
+     return NULL;
+ }
+
+ /**
+  * @brief Hand a directory to the tree walk
+  */
+ static void fsck_push_dir(int inum) {
+     fsck_append((void **)&ck.queue, &ck.queued, &ck.queue_cap, sizeof(int),
+                 &inum);
+     pthread_cond_signal(&ck.queue_cond);
+ }
+
+ /**
+  * @brief Check one entry of a directory
+  *
+  * @return Nonzero if the entry should be dropped
+  */
+ static int fsck_check_entry(int d, dir_entry_t *entry) {
+     if (!memchr(entry->name, '\0', DIR_NAME_LENGTH) ||
+         strcmp(entry->name, ".") == 0 || strcmp(entry->name, "..") == 0) {
+         fsck_problem(1, "directory %d has an entry with an invalid name", d);
+         return 1;
+     }
+
+     int child = entry->inum;
+     if (child < 0 || child >= INODE_COUNT || ck.kind[child] != FSCK_OK) {
+         const char *what = child < 0 || child >= INODE_COUNT ? "no"
+                            : ck.kind[child] == FSCK_BAD ? "damaged"
+                                                          : "free";
+         fsck_problem(1, "directory %d: entry %s names %s inode %d", d,
+                      entry->name, what, child);
+         return 1;
+     }
+
+     if (S_ISDIR(get_inode(child)->mode)) {
+         int none = FSCK_UNREACHED;
+         if (!__atomic_compare_exchange_n(&ck.found_parent[child], &none, d, 0,
+                                          __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+             fsck_problem(1, "directory %d: entry %s is a second name for "
+                          "directory %d", d, entry->name, child);
+             return 1;
+         }
+         fsck_push_dir(child);
+     }
+     __atomic_fetch_add(&ck.links[child], 1, __ATOMIC_RELAXED);
+     return 0;
+ }
+
+ /**
+  * @brief Check every entry of a directory, and its entry counts
+  */
+ static void fsck_scan_dir(int d) {
+     inode_t *dir = get_inode(d);
+     int live = 0, subdirs = 0;
+     fsck_count(directories, 1);
+
+     dir_entry_t *entry;
+     for (int64_t slot = 0; (entry = directory_next(dir, &slot)); slot++) {
+         if (entry->name[0] == '\0') continue;
+
+         if (fsck_check_entry(d, entry)) {
+             if (ck.repair) {
+                 memset(entry, 0, sizeof(*entry));
+                 journal_log(entry, sizeof(*entry));
+             }
+             continue;
+         }
+
+         uint32_t hash = directory_hash(entry->name);
+         if (entry->hash != hash ||
+             directory_home(dir, hash) != directory_slot_bucket(slot)) {
+             fsck_problem(1, "directory %d: entry %s is in the wrong bucket", d,
+                          entry->name);
+             fsck_move_t move = {d, slot};
+             if (ck.repair) {
+                 fsck_append((void **)&ck.moves, &ck.nmoves, &ck.moves_cap,
+                             sizeof(move), &move);
+             }
+         }
+         live++;
+         if (S_ISDIR(get_inode(entry->inum)->mode)) subdirs++;
+     }
+
+     if (dir->nentries != live + 2 || dir->nsubdirs != subdirs) {
+         fsck_problem(1, "directory %d counts %d entries and %d subdirectories, "
+                      "holds %d and %d", d, dir->nentries - 2, dir->nsubdirs,
+                      live, subdirs);
+         if (ck.repair) {
+             dir->nentries = live + 2;
+             dir->nsubdirs = subdirs;
+             journal_log(dir, sizeof(inode_t));
+         }
+     }
+ }
+
+ /**
+  * @brief Pass 2: walk directories from the queue until none are left
+  *        and no other worker can add more
+  */
+ static void *fsck_tree_worker(void *arg) {
+     pthread_mutex_lock(&ck.lock);
+     for (;;) {
+         while (ck.queued == 0 && ck.busy > 0) {
+             pthread_cond_wait(&ck.queue_cond, &ck.lock);
+         }
+         if (ck.queued == 0) break;
+         int d = ck.queue[--ck.queued];
+         ck.busy++;
+         pthread_mutex_unlock(&ck.lock);
+
+         fsck_scan_dir(d);
+
+         pthread_mutex_lock(&ck.lock);
+         ck.busy--;
+     }
+     pthread_cond_broadcast(&ck.queue_cond);
+     pthread_mutex_unlock(&ck.lock);
+     return NULL;
+ }
+
+ /**
+  * @brief Pass 3: compare link counts and ".." links with the walk
+  */
+ static void *fsck_link_worker(void *arg) {
+     int lo, hi;
+     while (fsck_next_chunk(INODE_COUNT, &lo, &hi)) {
+         for (int inum = lo; inum < hi; inum++) {
+             if (ck.kind[inum] == FSCK_BAD) {
+                 if (ck.repair) fsck_clear_inode(inum);
+                 continue;
+             }
+             if (ck.kind[inum] != FSCK_OK) continue;
+
+             inode_t *node = get_inode(inum);
+             int dir = S_ISDIR(node->mode);
+             int links = ck.links[inum];
+             int parent = dir ? ck.found_parent[inum] : 0;
+
+             if (dir ? parent == FSCK_DETACHED : links == 0) {
+                 if (node->refs <= 0 && (!dir || node->nentries <= 2)) {
+                     // Removed while open when the image was last used
+                     fsck_problem(1, "inode %d is an orphan", inum);
+                     if (ck.repair) {
+                         inode_walk(node, fsck_visit_release, NULL);
+                         fsck_clear_inode(inum);
+                     }
+                 } else {
+                     fsck_problem(1, "inode %d is not in any directory", inum);
+                     if (ck.repair) {
+                         fsck_append((void **)&ck.lost, &ck.nlost, &ck.lost_cap,
+                                     sizeof(int), &inum);
+                     }
+                 }
+                 continue;
+             }
+
+             int want = inum == ck.root ? 1 : links;
+             if (dir && inum != ck.root && node->parent != parent) {
+                 fsck_problem(1, "directory %d has .. pointing at %d, not %d",
+                              inum, node->parent, parent);
+                 if (ck.repair) node->parent = parent;
+             }
+             if (dir && inum == ck.root && node->parent != inum) {
+                 fsck_problem(1, "root directory has .. pointing at %d",
+                              node->parent);
+                 if (ck.repair) node->parent = inum;
+             }
+             if (node->refs != want) {
+                 fsck_problem(1, "inode %d has a link count of %d, %d entries "
+                              "name it", inum, node->refs, links);
+                 if (ck.repair) node->refs = want;
+             }
+             if (ck.repair) journal_log(node, sizeof(inode_t));
+         }
+     }
+     return NULL;
+ }
+
+ /**
+  * @brief Report a run of blocks with the same problem
+  */
+ static void fsck_report_run(const char *what, int first, int last) {
+     if (first == last) {
+         fsck_problem(1, "block %d %s", first, what);
+     } else {
+         fsck_problem(1, "blocks %d-%d %s", first, last, what);
+     }
+ }
+
+ /**
+  * @brief Pass 4: compare the block bitmap and reference counts with
+  *        the blocks inodes were found to hold
+  */
+ static void *fsck_block_worker(void *arg) {
+     superblock_t *sb = blocks_get_superblock();
+     void *bbm = get_blocks_bitmap();
+     int lo, hi;
+     while (fsck_next_chunk(BLOCK_COUNT, &lo, &hi)) {
+         const char *run = NULL;
+         int run_first = 0;
+         for (int b = lo; b <= hi; b++) {
+             const char *what = NULL;
+             int allocated = b < hi && bitmap_get(bbm, b);
+             uint32_t uses = b < hi ? ck.uses[b] : 0;
+             if (b == hi) {
+                 what = NULL;
+             } else if (b < sb->data_start) {
+                 if (!allocated) what = "of the metadata area is marked free";
+             } else if (allocated && uses == 0) {
+                 what = "allocated but held by no inode";
+             } else if (!allocated && uses > 0) {
+                 what = "held by an inode but marked free";
+             }
+
+             // Keep runs to one line each; a leak can span many blocks
+             if (what != run) {
+                 if (run) fsck_report_run(run, run_first, b - 1);
+                 run = what;
+                 run_first = b;
+             }
+             if (b == hi) break;
+             if (what && ck.repair) {
+                 if (allocated && uses == 0) block_set_refs(b, 0);
+                 blocks_set_allocated(b, !allocated);
+             }
+
+             int refs = block_refs(b);
+             if (blocks_dedup_enabled() && b >= sb->data_start &&
+                 (uses > 1 ? refs != (int)uses : refs > 1 || (!uses && refs))) {
+                 fsck_problem(1, "block %d has a reference count of %d, %u "
+                              "references found", b, refs, uses);
+                 if (ck.repair) block_set_refs(b, uses > 1 ? uses : 0);
+             }
+         }
+     }
+     return NULL;
+ }
+
+ /**
+  * @brief Find the top of a detached subtree holding a directory
+  *
+  * Follows ".." links while they lead to directories the walk has not
+  * reached, stopping at a loop.
+  */
+ static int fsck_detached_top(int inum) {
+     for (int steps = 0; steps < INODE_COUNT; steps++) {
+         int up = get_inode(inum)->parent;
+         if (up < 0 || up >= INODE_COUNT || up == inum ||
+             ck.kind[up] != FSCK_OK || !S_ISDIR(get_inode(up)->mode) ||
+             ck.found_parent[up] != FSCK_UNREACHED) {
+             break;
+         }
+         inum = up;
+     }
+     return inum;
+ }
+
+ /**
+  * @brief Pass 2, continued: walk what the root did not reach
+  *
+  * Each detached subtree is walked from its top, which is left marked
+  * FSCK_DETACHED, so that only tops are reconnected and the rest of the
+  * subtree keeps its names. A loop of directories is broken where the
+  * walk comes back round to its top.
+  */
+ static void fsck_walk_detached(int threads) {
+     for (int inum = 0; inum < INODE_COUNT; inum++) {
+         if (ck.kind[inum] != FSCK_OK || !S_ISDIR(get_inode(inum)->mode) ||
+             ck.found_parent[inum] != FSCK_UNREACHED) {
+             continue;
+         }
+         int top = fsck_detached_top(inum);
+         ck.found_parent[top] = FSCK_DETACHED;
+         fsck_push_dir(top);
+         fsck_parallel(fsck_tree_worker, threads);
+     }
+ }
+
+ /**
+  * @brief Move the entries found in the wrong bucket to the right one
+  *
+  * Every entry is taken out before any is put back, since putting one may
+  * split a bucket and move the others' slots.
+  */
+ static void fsck_move_entries() {
+     if (ck.nmoves == 0) return;
+     dir_entry_t *copies = malloc(ck.nmoves * sizeof(dir_entry_t));
+     if (!copies) {
+         ck.oom = 1;
+         return;
+     }
+
+     for (int i = 0; i < ck.nmoves; i++) {
+         inode_t *dir = get_inode(ck.moves[i].dir);
+         dir_entry_t *entry = directory_slot(dir, ck.moves[i].slot);
+         copies[i] = *entry;
+         memset(entry, 0, sizeof(*entry));
+         journal_log(entry, sizeof(*entry));
+         dir->nentries--;
+     }
+     for (int i = 0; i < ck.nmoves; i++) {
+         inode_t *dir = get_inode(ck.moves[i].dir);
+         if (directory_put(dir, copies[i].name, copies[i].inum) < 0) {
+             fsck_problem(0, "directory %d: entry %s could not be moved",
+                          ck.moves[i].dir, copies[i].name);
+             if (S_ISDIR(get_inode(copies[i].inum)->mode)) dir->nsubdirs--;
+         }
+         journal_log(dir, sizeof(inode_t));
+     }
+     free(copies);
+ }
+
+ /**
+  * @brief Link the inodes no entry names into /lost+found
+  */
+ static void fsck_reconnect() {
+     if (ck.nlost == 0) return;
+     int lf = storage_lookup_at(ck.root, "lost+found");
+     if (lf < 0) lf = storage_mkdir_at(ck.root, "lost+found", 0700);
+     if (lf < 0 || !S_ISDIR(get_inode(lf)->mode)) {
+         fsck_problem(0, "lost+found cannot be used; %d inodes left "
+                      "unconnected", ck.nlost);
+         return;
+     }
+
+     inode_t *dir = get_inode(lf);
+     for (int i = 0; i < ck.nlost; i++) {
+         int inum = ck.lost[i];
+         inode_t *node = get_inode(inum);
+         char name[DIR_NAME_LENGTH];
+         snprintf(name, sizeof(name), "#%d", inum);
+         if (directory_put(dir, name, inum) < 0) {
+             fsck_problem(0, "inode %d could not be linked into lost+found",
+                          inum);
+             continue;
+         }
+         node->refs = 1;
+         if (S_ISDIR(node->mode)) {
+             node->parent = lf;
+             dir->nsubdirs++;
+         }
+         journal_log(node, sizeof(inode_t));
+     }
+     journal_log(dir, sizeof(inode_t));
+ }
+
+ /**
+  * @brief Free the tables of the check
+  */
+ static void fsck_free() {
+     free(ck.kind);
+     free(ck.links);
+     free(ck.found_parent);
+     free(ck.owner);
+     free(ck.uses);
+     free(ck.queue);
+     free(ck.lost);
+     free(ck.moves);
+     ck.kind = NULL;
+     ck.links = ck.found_parent = ck.owner = ck.queue = ck.lost = NULL;
+     ck.uses = NULL;
+     ck.moves = NULL;
+     ck.queued = ck.queue_cap = ck.nlost = ck.lost_cap = 0;
+     ck.nmoves = ck.moves_cap = ck.busy = ck.oom = 0;
+ }
+
+ /**
+  * @brief Check, and optionally repair, the mounted image
+  */
+ int fsck_check(int threads, int repair, FILE *out, fsck_report_t *report) {
+     memset(report, 0, sizeof(*report));
+     ck.repair = repair;
+     ck.out = out;
+     ck.report = report;
+     ck.root = blocks_get_root_block();
+     if (threads < 1) threads = 1;
+
+     // Blocks freed since the last commit still have their bits set
+     journal_commit();
+
+     ck.kind = calloc(INODE_COUNT, sizeof(uint8_t));
+     ck.links = calloc(INODE_COUNT, sizeof(int));
+     ck.found_parent = malloc(INODE_COUNT * sizeof(int));
+     ck.owner = malloc((size_t)BLOCK_COUNT * sizeof(int));
+     ck.uses = calloc(BLOCK_COUNT, sizeof(uint32_t));
+     if (!ck.kind || !ck.links || !ck.found_parent || !ck.owner || !ck.uses) {
+         fsck_free();
+         return -ENOMEM;
+     }
+     memset(ck.found_parent, 0xff, INODE_COUNT * sizeof(int));  /* -1 */
+     memset(ck.owner, 0xff, (size_t)BLOCK_COUNT * sizeof(int));
+
+     fsck_parallel(fsck_inode_worker, threads);
+     if (ck.root < 0 || ck.root >= INODE_COUNT || ck.kind[ck.root] != FSCK_OK ||
+         !S_ISDIR(get_inode(ck.root)->mode)) {
+         fsck_problem(0, "the root directory is damaged");
+         fsck_free();
+         return -EIO;
+     }
+
+     ck.found_parent[ck.root] = ck.root;
+     fsck_push_dir(ck.root);
+     fsck_parallel(fsck_tree_worker, threads);
+     fsck_walk_detached(threads);
+     fsck_parallel(fsck_link_worker, threads);
+     fsck_parallel(fsck_block_worker, threads);
+
+     if (repair) {
+         fsck_move_entries();
+         fsck_reconnect();
+     }
+     int summary = blocks_check_summary(repair);
+     if (summary) {
+         fsck_problem(1, "the free space summary is out of date in %d places",
+                      summary);
+     }
+
+     int oom = ck.oom;
+     fsck_free();
+     if (oom) return -ENOMEM;
+     return report->errors > report->repaired ? -EIO : 0;
+ }
+
+ /* ========================== SCRUBBING ========================== */
+
+ static pthread_t scrub_thread;
+ static int scrub_running = 0;
+ static int scrub_stopping = 0;
+ static pthread_mutex_t scrub_lock = PTHREAD_MUTEX_INITIALIZER;
+ static pthread_cond_t scrub_cond = PTHREAD_COND_INITIALIZER;
+ static fsck_scrub_stats_t scrub_stats;
+
+ #define scrub_count(counter, n) \
+     __atomic_fetch_add(&scrub_stats.counter, n, __ATOMIC_RELAXED)
+
+ /**
+  * @brief Report a problem the scrubber found
+  */
+ #define scrub_problem(...) do { \
+     scrub_count(problems, 1); \
+     log_warn("scrub: " __VA_ARGS__); \
+ } while (0)
+
+ /**
+  * @brief inode_walk callback checking an inode's blocks are allocated
+  *
+  * @param arg Pointer to the inode number
+  */
+ static int scrub_visit(int pblk, int len, int lblk, void *arg) {
+     void *bbm = get_blocks_bitmap();
+     for (int b = pblk; b < pblk + len; b++) {
+         if (!bitmap_get(bbm, b)) {
+             scrub_problem("inode %d holds block %d, which is marked free",
+                           *(int *)arg, b);
+             return 1;
+         }
+     }
+     return 0;
+ }
+
+ /**
+  * @brief Check one inode of the mounted image
+  *
+  * The caller holds the inode's lock, shared.
+  */
+ static void scrub_inode(int inum) {
+     inode_t *node = get_inode(inum);
+     scrub_count(inodes, 1);
+     if (!S_ISREG(node->mode) && !S_ISDIR(node->mode)) {
+         scrub_problem("inode %d has no valid file type", inum);
+         return;
+     }
+     int rv = inode_walk(node, scrub_visit, &inum);
+     if (rv < 0) {
+         scrub_problem("inode %d has a damaged extent map", inum);
+     }
+     if (rv != 0 || !S_ISDIR(node->mode)) return;
+
+     if (!fsck_dir_mapped(node)) {
+         scrub_problem("directory %d has missing buckets", inum);
+         return;
+     }
+     void *ibm = get_inode_bitmap();
+     dir_entry_t *entry;
+     for (int64_t slot = 0; (entry = directory_next(node, &slot)); slot++) {
+         if (entry->name[0] == '\0') continue;
+         if (!memchr(entry->name, '\0', DIR_NAME_LENGTH)) {
+             scrub_problem("directory %d has an entry with an invalid name", inum);
+         } else if (entry->inum < 0 || entry->inum >= INODE_COUNT ||
+                    !bitmap_get(ibm, entry->inum)) {
+             scrub_problem("directory %d: entry %s names free inode %d", inum,
+                           entry->name, entry->inum);
+         } else if (entry->hash != directory_hash(entry->name) ||
+                    directory_home(node, entry->hash) !=
+                        directory_slot_bucket(slot)) {
+             scrub_problem("directory %d: entry %s is in the wrong bucket", inum,
+                           entry->name);
+         }
+     }
+ }
+
+ /**
+  * @brief Wait, returning early if the scrubber is being stopped
+  *
+  * @return Nonzero if it is being stopped
+  */
+ static int scrub_pause(long ms) {
+     struct timespec until;
+     clock_gettime(CLOCK_REALTIME, &until);
+     until.tv_sec += ms / 1000;
+     until.tv_nsec += (ms % 1000) * 1000000;
+     if (until.tv_nsec >= 1000000000) {
+         until.tv_sec++;
+         until.tv_nsec -= 1000000000;
+     }
+     pthread_mutex_lock(&scrub_lock);
+     while (!scrub_stopping &&
+            pthread_cond_timedwait(&scrub_cond, &scrub_lock, &until) == 0) {
+     }
+     int stopping = scrub_stopping;
+     pthread_mutex_unlock(&scrub_lock);
+     return stopping;
+ }
+
+ /**
+  * @brief Body of the scrubbing thread
+  */
+ static void *scrub_main(void *arg) {
+     // Only use the CPU when nothing else wants it
+     struct sched_param param = {0};
+     pthread_setschedparam(pthread_self(), SCHED_IDLE, &param);
+     setpriority(PRIO_PROCESS, gettid(), 19);
+
+     void *ibm = get_inode_bitmap();
+     int inum = 0;
+     for (;;) {
+         for (int n = 0; n < FSCK_SCRUB_BATCH && inum < INODE_COUNT; inum++) {
+             if (!bitmap_get(ibm, inum)) continue;
+             inode_rdlock(inum);
+             // A claimed inode has no mode until its creator sets one
+             if (bitmap_get(ibm, inum) && get_inode(inum)->mode != 0) {
+                 scrub_inode(inum);
+             }
+             inode_unlock(inum);
+             n++;
+         }
+
+         long pause = FSCK_SCRUB_PAUSE_MS;
+         if (inum == INODE_COUNT) {
+             inum = 0;
+             scrub_count(passes, 1);
+             log_info("scrub: pass %lu done",
+                      (unsigned long)__atomic_load_n(&scrub_stats.passes,
+                                                     __ATOMIC_RELAXED));
+             pause = FSCK_SCRUB_INTERVAL_S * 1000L;
+         }
+         if (scrub_pause(pause)) break;
+     }
+     return NULL;
+ }
+
+ /**
+  * @brief Start scrubbing the mounted image in the background
+  */
+ void fsck_scrub_start() {
+     if (scrub_running) return;
+     scrub_stopping = 0;
+     if (pthread_create(&scrub_thread, NULL, scrub_main, NULL) == 0) {
+         scrub_running = 1;
+     } else {
+         log_warn("scrub: cannot start the scrubbing thread");
+     }
+ }
+
+ /**
+  * @brief Stop the scrubber and wait for it to finish its batch
+  */
+ void fsck_scrub_stop() {
+     if (!scrub_running) return;
+     pthread_mutex_lock(&scrub_lock);
+     scrub_stopping = 1;
+     pthread_cond_signal(&scrub_cond);
+     pthread_mutex_unlock(&scrub_lock);
+     pthread_join(scrub_thread, NULL);
+     scrub_running = 0;
+ }
+
+ /**
+  * @brief Read the scrubber's counters
+  */
+ void fsck_get_scrub_stats(fsck_scrub_stats_t *st) {
+     st->passes = __atomic_load_n(&scrub_stats.passes, __ATOMIC_RELAXED);
+     st->inodes = __atomic_load_n(&scrub_stats.inodes, __ATOMIC_RELAXED);
+     st->problems = __atomic_load_n(&scrub_stats.problems, __ATOMIC_RELAXED);
+ }
@@ -0,0 +1,84 @@
+/**
+ * @file fsck.h
+ * @brief Consistency checking of the image
+ *
+ * fsck_check() cross-checks a whole image that nothing else is using: it
+ * walks the inode table and the directory tree on several threads, and
+ * compares the block and inode bitmaps, the reference counts of shared
+ * blocks, link counts, ".." links and the free space summary with what it
+ * finds. It can repair what it finds wrong. The nufsck tool runs it on an
+ * unmounted image.
+ *
+ * The scrubber checks a mounted image instead, a few inodes at a time on
+ * a low priority thread, taking each inode's lock only while it looks at
+ * that inode. It only reports problems: every block an inode holds must
+ * be marked allocated, and every directory entry must be well formed and
+ * name an allocated inode.
+ */
+
+ #ifndef FSCK_H
+ #define FSCK_H
+
+ #include <stdint.h>
+ #include <stdio.h>
+
+ /**
+  * @struct fsck_report
+  * @brief What a check found
+  */
+ typedef struct fsck_report {
+     uint64_t inodes;       /* Allocated inodes checked */
+     uint64_t directories;  /* Directories reached from the root */
+     uint64_t blocks;       /* Blocks found held by inodes */
+     uint64_t errors;       /* Problems found */
+     uint64_t repaired;     /* Problems fixed */
+ } fsck_report_t;
+
+ /**
+  * @struct fsck_scrub_stats
+  * @brief Counters for the statistics report
+  */
+ typedef struct fsck_scrub_stats {
+     uint64_t passes;       /* Complete passes over the inode table */
+     uint64_t inodes;       /* Allocated inodes scrubbed */
+     uint64_t problems;     /* Problems found */
+ } fsck_scrub_stats_t;
+
+ /**
+  * @brief Check, and optionally repair, the mounted image
+  *
+  * Called after storage_init(), with no other thread using the image.
+  * Each problem is printed as one line. Repairs are logged in the journal
+  * and are durable once blocks_flush() has run.
+  *
+  * @param threads Worker threads, at least 1
+  * @param repair Nonzero to fix what can be fixed
+  * @param out Where problems are printed, or NULL to log them as warnings
+  * @param report Filled with what was found
+  * @return 0 if the image was consistent, -EIO if problems were left
+  *         unrepaired, -ENOMEM if the checker ran out of memory
+  */
+ int fsck_check(int threads, int repair, FILE *out, fsck_report_t *report);
+
+ /**
+  * @brief Start scrubbing the mounted image in the background
+  *
+  * Call once the process has daemonized, since threads do not survive
+  * fork(). A pass over the inode table goes a batch of inodes at a time,
+  * and the next pass starts after a pause.
+  */
+ void fsck_scrub_start();
+
+ /**
+  * @brief Stop the scrubber and wait for it to finish its batch
+  */
+ void fsck_scrub_stop();
+
+ /**
+  * @brief Read the scrubber's counters
+  *
+  * @param st Filled with the current counters
+  */
+ void fsck_get_scrub_stats(fsck_scrub_stats_t *st);
+
+ #endif
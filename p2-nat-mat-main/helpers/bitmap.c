@@ -3,35 +3,204 @@
  * @author CS3650 staff
  *
  * Bitmap implementation.
+ *
+ * Bits are read and written with atomic operations, so threads may update
+ * neighbouring bits of the same byte concurrently without losing changes.
+ *
+ * The search functions read the bitmap a 64-bit word at a time. Bit i is
+ * bit i % 8 of byte i / 8, which on a little-endian machine is bit i % 64
+ * of word i / 64, so a word can be searched with ctz and popcount.
  */
+#include <stddef.h>
 #include <stdint.h>
 #include <stdio.h>
 
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define BITMAP_HAVE_AVX2 1
+#endif
+
 #include "bitmap.h"
 
 #define nth_bit_mask(n) (1 << (n))
 #define byte_index(n) ((n) / 8)
 #define bit_index(n) ((n) % 8)
 
+#define WORD_BITS 64
+#define word_index(n) ((n) / WORD_BITS)
+#define word_bit(n) ((n) % WORD_BITS)
+
+// Mask of the bits at and above bit n of a word.
+#define bits_from(n) (~0ULL << (n))
+
+// Read one 64-bit word of the bitmap.
+static inline uint64_t bitmap_word(const uint64_t *words, size_t w) {
+  return __atomic_load_n(&words[w], __ATOMIC_RELAXED);
+}
+
+// Return the first word in [from, to) that is not all ones, or to.
+static size_t skip_full_words_scalar(const uint64_t *words, size_t from,
+                                     size_t to) {
+  while (from < to && bitmap_word(words, from) == ~0ULL) {
+    from++;
+  }
+  return from;
+}
+
+#ifdef BITMAP_HAVE_AVX2
+// Same as skip_full_words_scalar, comparing four words per instruction.
+__attribute__((target("avx2")))
+static size_t skip_full_words_avx2(const uint64_t *words, size_t from,
+                                   size_t to) {
+  const __m256i ones = _mm256_set1_epi64x(-1);
+  while (from + 4 <= to) {
+    __m256i v = _mm256_loadu_si256((const __m256i *)(words + from));
+    if (_mm256_movemask_epi8(_mm256_cmpeq_epi64(v, ones)) != -1) {
+      break;
+    }
+    from += 4;
+  }
+  return skip_full_words_scalar(words, from, to);
+}
+#endif
+
+static size_t (*skip_full_words)(const uint64_t *, size_t, size_t) =
+    skip_full_words_scalar;
+
+// Pick the widest word scan this CPU supports, once at startup.
+__attribute__((constructor))
+static void bitmap_select_scan() {
+#ifdef BITMAP_HAVE_AVX2
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx2")) {
+    skip_full_words = skip_full_words_avx2;
+  }
+#endif
+}
+
 // Get the given bit from the bitmap.
 int bitmap_get(void *bm, int i) {
   uint8_t *base = (uint8_t *) bm;
 
-  return (base[byte_index(i)] >> bit_index(i)) & 1;
+  return (__atomic_load_n(&base[byte_index(i)], __ATOMIC_RELAXED) >>
+          bit_index(i)) & 1;
 }
 
 // Set the given bit in the bitmap to the given value.
 void bitmap_put(void *bm, int i, int v) {
+  if (v) {
+    bitmap_test_and_set(bm, i);
+  } else {
+    bitmap_test_and_clear(bm, i);
+  }
+}
+
+// Atomically set a bit, returning its old value.
+int bitmap_test_and_set(void *bm, int i) {
   uint8_t *base = (uint8_t *) bm;
+  uint8_t bit_mask = nth_bit_mask(bit_index(i));
 
-  long bit_mask = nth_bit_mask(bit_index(i));
+  uint8_t old = __atomic_fetch_or(&base[byte_index(i)], bit_mask,
+                                  __ATOMIC_ACQ_REL);
+  return (old & bit_mask) != 0;
+}
 
-  if (v) {
-    base[byte_index(i)] |= bit_mask;
-  } else {
-    bit_mask = ~bit_mask;
-    base[byte_index(i)] &= bit_mask;
+// Atomically clear a bit, returning its old value.
+int bitmap_test_and_clear(void *bm, int i) {
+  uint8_t *base = (uint8_t *) bm;
+  uint8_t bit_mask = nth_bit_mask(bit_index(i));
+
+  uint8_t old = __atomic_fetch_and(&base[byte_index(i)], (uint8_t)~bit_mask,
+                                   __ATOMIC_ACQ_REL);
+  return (old & bit_mask) != 0;
+}
+
+// Find the first clear bit in [start, end).
+int bitmap_find_zero(void *bm, int start, int end) {
+  const uint64_t *words = (const uint64_t *) bm;
+  if (start >= end) {
+    return -1;
+  }
+
+  // The first word may be partial: treat the bits before start as set.
+  size_t w = word_index(start);
+  uint64_t word = bitmap_word(words, w) | ~bits_from(word_bit(start));
+  if (word == ~0ULL) {
+    w = skip_full_words(words, w + 1, word_index(end - 1) + 1);
+    if (w > word_index(end - 1)) {
+      return -1;
+    }
+    word = bitmap_word(words, w);
+  }
+
+  int64_t bit = (int64_t)w * WORD_BITS + __builtin_ctzll(~word);
+  return bit < end ? (int)bit : -1;
+}
+
+// Find the first set bit in [start, end), or -1.
+static int bitmap_find_one(const uint64_t *words, int start, int end) {
+  if (start >= end) {
+    return -1;
+  }
+
+  size_t w = word_index(start);
+  size_t last = word_index(end - 1);
+  uint64_t word = bitmap_word(words, w) & bits_from(word_bit(start));
+  while (word == 0 && w < last) {
+    word = bitmap_word(words, ++w);
+  }
+  if (word == 0) {
+    return -1;
+  }
+
+  int64_t bit = (int64_t)w * WORD_BITS + __builtin_ctzll(word);
+  return bit < end ? (int)bit : -1;
+}
+
+// Find the first run of len clear bits in [start, end).
+int bitmap_find_zero_run(void *bm, int start, int end, int len) {
+  const uint64_t *words = (const uint64_t *) bm;
+  if (len <= 0) {
+    return -1;
+  }
+
+  while (start < end) {
+    int first = bitmap_find_zero(bm, start, end);
+    if (first < 0 || end - first < len) {
+      return -1;
+    }
+
+    // The run is long enough unless a set bit interrupts it.
+    int set = bitmap_find_one(words, first, first + len);
+    if (set < 0) {
+      return first;
+    }
+    start = set + 1;
+  }
+  return -1;
+}
+
+// Count the set bits in [start, end).
+int bitmap_popcount(void *bm, int start, int end) {
+  const uint64_t *words = (const uint64_t *) bm;
+  if (start >= end) {
+    return 0;
+  }
+
+  size_t w = word_index(start);
+  size_t last = word_index(end - 1);
+  uint64_t last_mask = ~0ULL;
+  if (word_bit(end) != 0) {
+    last_mask = ~bits_from(word_bit(end));
+  }
+
+  uint64_t word = bitmap_word(words, w) & bits_from(word_bit(start));
+  int count = 0;
+  while (w < last) {
+    count += __builtin_popcountll(word);
+    word = bitmap_word(words, ++w);
   }
+  return count + __builtin_popcountll(word & last_mask);
 }
 
 // Pretty-print the bitmap (with the given no. of bits).
@@ -26,6 +26,67 @@ int bitmap_get(void *bm, int i);
  */
 void bitmap_put(void *bm, int i, int v);
 
+/**
+ * Atomically set the given bit and report its previous value.
+ *
+ * Two threads racing for the same clear bit cannot both see 0, so this
+ * claims a bit without any lock.
+ *
+ * @param bm Pointer to the start of the bitmap.
+ * @param i Bit index.
+ *
+ * @return The state of the bit before it was set (0 or 1).
+ */
+int bitmap_test_and_set(void *bm, int i);
+
+/**
+ * Atomically clear the given bit and report its previous value.
+ *
+ * @param bm Pointer to the start of the bitmap.
+ * @param i Bit index.
+ *
+ * @return The state of the bit before it was cleared (0 or 1).
+ */
+int bitmap_test_and_clear(void *bm, int i);
+
+/**
+ * Find the first clear bit in a range.
+ *
+ * Whole 64-bit words are skipped at a time, and runs of full words are
+ * skipped 256 bits at a time on CPUs with AVX2. The bitmap must be 8-byte
+ * aligned and readable up to the end of the word holding bit end - 1.
+ *
+ * @param bm Pointer to the start of the bitmap.
+ * @param start First bit index to consider.
+ * @param end One past the last bit index to consider.
+ *
+ * @return The index of the first clear bit, or -1 if every bit is set.
+ */
+int bitmap_find_zero(void *bm, int start, int end);
+
+/**
+ * Find the first run of clear bits of the given length in a range.
+ *
+ * @param bm Pointer to the start of the bitmap (8-byte aligned).
+ * @param start First bit index to consider.
+ * @param end One past the last bit index to consider.
+ * @param len Number of consecutive clear bits wanted.
+ *
+ * @return The index of the first bit of the run, or -1 if there is none.
+ */
+int bitmap_find_zero_run(void *bm, int start, int end, int len);
+
+/**
+ * Count the set bits in a range.
+ *
+ * @param bm Pointer to the start of the bitmap (8-byte aligned).
+ * @param start First bit index to count.
+ * @param end One past the last bit index to count.
+ *
+ * @return The number of set bits.
+ */
+int bitmap_popcount(void *bm, int start, int end);
+
 /**
  * Pretty-print a bitmap. 
  *
@@ -26,5 +26,10 @@ int main(int argc, char **argv) {
   bitmap_put(bm, 255, 1);
   bitmap_print(bm, SIZE);
 
+  printf("\nFirst zero from 0: %d\n", bitmap_find_zero(bm, 0, SIZE));
+  printf("First zero from 65: %d\n", bitmap_find_zero(bm, 65, SIZE));
+  printf("First run of 100 zeros: %d\n", bitmap_find_zero_run(bm, 0, SIZE, 100));
+  printf("Bits set: %d\n", bitmap_popcount(bm, 0, SIZE));
+
   return 0;
 }
@@ -5,12 +5,12 @@
  * Implementation of a block-based abstraction over a disk image file.
  */
 #define _GNU_SOURCE
-#define ROOT_INODE_BYTES sizeof(int)
 #include <string.h>
 
 #include <assert.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <pthread.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <sys/mman.h>
@@ -21,19 +21,77 @@
 
 #include "bitmap.h"
 #include "blocks.h"
+#include "journal.h"
+#include "log.h"
 
-const int BLOCK_COUNT = 256; // we split the "disk" into 256 blocks
-const int BLOCK_SIZE = 4096; // = 4K
-const int NUFS_SIZE = BLOCK_SIZE * BLOCK_COUNT; // = 1MB
+int BLOCK_COUNT = 0;       // loaded from the superblock
+int BLOCK_SIZE = 0;        // loaded from the superblock
+int64_t NUFS_SIZE = 0;     // = BLOCK_SIZE * BLOCK_COUNT
+int BLOCK_BITMAP_SIZE = 0; // sized for the superblock's max_block_count
+int INODE_COUNT = 0;       // loaded from the superblock
 
-const int BLOCK_BITMAP_SIZE = BLOCK_COUNT / 8;
-// Note: assumes block count is divisible by 8
+// Grow the image once no more than 1/BLOCKS_LOW_WATER of it is free
+#define BLOCKS_LOW_WATER 8
+
+// Largest reference count a block can reach; it is then no longer shared
+#define BLOCK_REFS_MAX 255
+
+// Bounds on the journal picked for a new image: 1/16 of its blocks
+#define JOURNAL_MIN_BLOCKS 16
+#define JOURNAL_MAX_BLOCKS 1024
+
+// Alignment of the mapping, so that huge pages can back it
+#define BLOCKS_HUGE_PAGE (2 << 20)
+
+// Smallest group of the free space summary, in blocks
+#define BLOCKS_GROUP_MIN 4096
 
 static int blocks_fd = -1;
 static void *blocks_base = 0;
+static int64_t blocks_reserved = 0; // address space reserved for growth
+static void *blocks_reservation = 0; // the reservation, before alignment
+static void *blocks_meta_base = 0;  // private view for metadata blocks
+static void *blocks_meta_reservation = 0;
+static int64_t blocks_private_end = 0; // bytes of blocks_base mapped private
+static int blocks_huge_pages = 0;   // ask for huge pages for the mapping
+static superblock_t *sb = 0;
+static int blocks_free_count = 0;   // unallocated blocks below BLOCK_COUNT
+static int blocks_reserved_count = 0; // of those, reserved in memory
+static int blocks_free_inodes = 0;  // unallocated inodes
+static uint32_t *groups = 0;        // free blocks per group, after sb
+static pthread_mutex_t blocks_grow_lock = PTHREAD_MUTEX_INITIALIZER;
+static int blocks_cursor = 0;       // next-fit: where the last search ended
+static blocks_stats_t stats;        // updated with relaxed atomic adds
+static uint8_t *refcounts = 0;      // one count per block, or NULL
+
+// A freed block waiting for the batch that freed it to be durable
+typedef struct pending_free {
+  int bnum;
+  uint64_t batch;
+} pending_free_t;
+
+static pthread_mutex_t blocks_pending_lock = PTHREAD_MUTEX_INITIALIZER;
+static pending_free_t *blocks_pending = 0;
+static int blocks_npending = 0;
+static int blocks_pending_cap = 0;
+static void *blocks_pending_bits = 0; // blocks in blocks_pending
+
+// A run of newly mapped data blocks to write back before the next batch
+typedef struct ordered_run {
+  int bnum;
+  int count;
+} ordered_run_t;
+
+static pthread_mutex_t blocks_ordered_lock = PTHREAD_MUTEX_INITIALIZER;
+static ordered_run_t *blocks_ordered = 0;
+static int blocks_nordered = 0;
+static int blocks_ordered_cap = 0;
+
+#define blocks_count(counter, n) \
+  __atomic_fetch_add(&stats.counter, n, __ATOMIC_RELAXED)
 
 // Get the number of blocks needed to store the given number of bytes.
-int bytes_to_blocks(int bytes) {
+int bytes_to_blocks(int64_t bytes) {
   int quo = bytes / BLOCK_SIZE;
   int rem = bytes % BLOCK_SIZE;
   if (rem == 0) {
@@ -43,81 +101,888 @@ int bytes_to_blocks(int bytes) {
   }
 }
 
+// Round a block count up so the image always ends on a page boundary,
+// which mmap() needs when the mapping is extended.
+static int64_t round_to_pages(int64_t blocks, int block_size) {
+  int64_t per_page = sysconf(_SC_PAGESIZE) / block_size;
+  if (per_page <= 1) {
+    return blocks;
+  }
+  return (blocks + per_page - 1) / per_page * per_page;
+}
+
+static uint32_t blocks_for(int64_t bytes, int block_size) {
+  return (bytes + block_size - 1) / block_size;
+}
+
+static void format_fail(const char *what) {
+  fprintf(stderr, "Error: cannot format image: %s\n", what);
+  exit(1);
+}
+
+// Write a fresh superblock laying out the image for the given geometry.
+static void blocks_format(const blocks_geometry_t *geo) {
+  int bs = geo->block_size;
+  if (bs < 1024 || bs > 65536 || (bs & (bs - 1)) != 0) {
+    format_fail("block size must be a power of two from 1K to 64K");
+  }
+  if (geo->inode_size > bs) {
+    format_fail("block size is smaller than an inode");
+  }
+
+  int64_t count = round_to_pages(blocks_for(geo->size, bs), bs);
+  int64_t max_count = round_to_pages(blocks_for(geo->max_size, bs), bs);
+  if (max_count < count) {
+    max_count = count;
+  }
+  if (max_count > INT32_MAX) {
+    format_fail("too many blocks");
+  }
+
+  superblock_t fresh = {0};
+  fresh.magic = NUFS_MAGIC;
+  fresh.version = NUFS_VERSION;
+  fresh.block_size = bs;
+  fresh.block_count = count;
+  fresh.max_block_count = max_count;
+  fresh.inode_count = (geo->inode_count + 7) / 8 * 8;
+  fresh.inode_size = geo->inode_size;
+
+  // block 0 holds the superblock, the bitmaps and inode table follow,
+  // with the reference counts (if any) next to the block bitmap
+  fresh.bbitmap_start = 1;
+  fresh.bbitmap_blocks = blocks_for((max_count + 7) / 8, bs);
+  fresh.refcount_start = fresh.bbitmap_start + fresh.bbitmap_blocks;
+  fresh.refcount_blocks = geo->dedup ? blocks_for(max_count, bs) : 0;
+  fresh.ibitmap_start = fresh.refcount_start + fresh.refcount_blocks;
+  fresh.ibitmap_blocks = blocks_for(fresh.inode_count / 8, bs);
+  fresh.itable_start = fresh.ibitmap_start + fresh.ibitmap_blocks;
+  fresh.itable_blocks =
+      blocks_for((int64_t)fresh.inode_count * fresh.inode_size, bs);
+
+  // the journal sits between the inode table and the data
+  int64_t journal = blocks_for(geo->journal_size, bs);
+  if (journal == 0) {
+    journal = count / 16;
+    if (journal < JOURNAL_MIN_BLOCKS) journal = JOURNAL_MIN_BLOCKS;
+    if (journal > JOURNAL_MAX_BLOCKS) journal = JOURNAL_MAX_BLOCKS;
+  }
+  if (journal < 2 || journal > INT32_MAX) {
+    format_fail("the journal needs at least two blocks");
+  }
+  fresh.journal_start = fresh.itable_start + fresh.itable_blocks;
+  fresh.journal_blocks = journal;
+  fresh.data_start = fresh.journal_start + fresh.journal_blocks;
+  fresh.root_inum = -1;
+
+  // a large growth limit can need more bitmap than the requested size
+  // holds; start big enough that metadata is at most half the image
+  if (fresh.data_start >= fresh.block_count) {
+    count = round_to_pages((int64_t)fresh.data_start * 2, bs);
+    if (count > max_count) {
+      format_fail("maximum size is too small for its metadata");
+    }
+    fresh.block_count = count;
+  }
+
+  // start from an all-zero image, then record the layout
+  int rv = ftruncate(blocks_fd, 0);
+  assert(rv == 0);
+  rv = ftruncate(blocks_fd, (int64_t)count * bs);
+  assert(rv == 0);
+  rv = pwrite(blocks_fd, &fresh, sizeof(fresh), 0);
+  assert(rv == sizeof(fresh));
+}
+
+// Add delta to the free counts of the groups holding [first, first + n).
+static void groups_add(int first, int n, int delta) {
+  int64_t gb = sb->group_blocks;
+  while (n > 0) {
+    int g = first / gb;
+    int take = (g + 1) * gb - first;
+    if (take > n) {
+      take = n;
+    }
+    __atomic_fetch_add(&groups[g], (uint32_t)(take * delta), __ATOMIC_RELAXED);
+    first += take;
+    n -= take;
+  }
+}
+
+// Find the next stretch of [lo, hi) made of groups with free blocks, so
+// searches can step over full groups without reading their bitmap. Returns
+// its first block and sets *end past its last, or returns -1.
+static int groups_stretch(int lo, int hi, int *end) {
+  int64_t gb = sb->group_blocks;
+  int64_t g = lo / gb;
+  while (lo < hi && __atomic_load_n(&groups[g], __ATOMIC_RELAXED) == 0) {
+    g++;
+    lo = g * gb < hi ? g * gb : hi;
+  }
+  if (lo >= hi) {
+    return -1;
+  }
+  int64_t stop = (g + 1) * gb;
+  while (stop < hi && __atomic_load_n(&groups[stop / gb], __ATOMIC_RELAXED) > 0) {
+    stop += gb;
+  }
+  *end = stop < hi ? stop : hi;
+  return lo;
+}
+
+// Store the free counts in the superblock. The journal logs it, with the
+// summary, at the end of every batch.
+static void blocks_refresh_summary() {
+  sb->free_blocks = __atomic_load_n(&blocks_free_count, __ATOMIC_RELAXED);
+  sb->free_inodes = __atomic_load_n(&blocks_free_inodes, __ATOMIC_RELAXED);
+}
+
+// Whether the summary in block 0 can be used as it is.
+static int summary_usable(int64_t room) {
+  int64_t covered = (int64_t)sb->group_blocks * sb->group_count;
+  return sb->journal_blocks > 0 && sb->group_count > 0 &&
+         sb->group_count <= room && covered >= sb->max_block_count &&
+         sb->free_blocks <= sb->block_count - sb->data_start &&
+         sb->free_inodes <= sb->inode_count;
+}
+
+// Count the free blocks of a group in the bitmap.
+static uint32_t group_scan(int g) {
+  int64_t gb = sb->group_blocks;
+  int64_t lo = g * gb < sb->data_start ? sb->data_start : g * gb;
+  int64_t hi = (g + 1) * gb < BLOCK_COUNT ? (g + 1) * gb : BLOCK_COUNT;
+  return lo < hi ? (hi - lo) - bitmap_popcount(get_blocks_bitmap(), lo, hi) : 0;
+}
+
+// Build the summary by scanning the bitmaps. An image without a journal
+// gets this at every mount, since nothing keeps it in step with them.
+static void build_summary(int64_t room) {
+  int64_t gb = ((int64_t)sb->max_block_count + room - 1) / room;
+  gb = (gb + 63) / 64 * 64;
+  if (gb < BLOCKS_GROUP_MIN) {
+    gb = BLOCKS_GROUP_MIN;
+  }
+  sb->group_blocks = gb;
+  sb->group_count = (sb->max_block_count + gb - 1) / gb;
+
+  int free_count = 0;
+  for (int g = 0; g < sb->group_count; g++) {
+    groups[g] = group_scan(g);
+    free_count += groups[g];
+  }
+  sb->free_blocks = free_count;
+  sb->free_inodes =
+      INODE_COUNT - bitmap_popcount(get_inode_bitmap(), 0, INODE_COUNT);
+  journal_log(sb, sizeof(superblock_t) + sb->group_count * sizeof(uint32_t));
+  log_info("+ built free space summary: %d groups of %d blocks",
+           sb->group_count, sb->group_blocks);
+}
+
+// Reserve address space for a view of the largest image, aligned to a huge
+// page. Returns the reservation and sets *base to the aligned start.
+static void *reserve(void **base) {
+  void *area = mmap(0, blocks_reserved + BLOCKS_HUGE_PAGE, PROT_NONE,
+                    MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+  assert(area != MAP_FAILED);
+  *base = (void *)(((uintptr_t)area + BLOCKS_HUGE_PAGE - 1) &
+                   ~(uintptr_t)(BLOCKS_HUGE_PAGE - 1));
+  return area;
+}
+
+// Clear the bits of freed blocks once the batches freeing them are
+// durable. Called by the journal after each commit.
+static void release_frees(uint64_t durable) {
+  void *bbm = get_blocks_bitmap();
+  pthread_mutex_lock(&blocks_pending_lock);
+  int kept = 0;
+  for (int ii = 0; ii < blocks_npending; ++ii) {
+    pending_free_t p = blocks_pending[ii];
+    if (p.batch > durable) {
+      blocks_pending[kept++] = p;
+      continue;
+    }
+    // Pending first, so a free racing the release is not lost
+    bitmap_put(blocks_pending_bits, p.bnum, 0);
+    bitmap_test_and_clear(bbm, p.bnum);
+  }
+  blocks_npending = kept;
+  pthread_mutex_unlock(&blocks_pending_lock);
+}
+
+static int ordered_run_cmp(const void *a, const void *b) {
+  int x = ((const ordered_run_t *)a)->bnum;
+  int y = ((const ordered_run_t *)b)->bnum;
+  return (x > y) - (x < y);
+}
+
+// Write back the data blocks mapped since the last batch was cut, so the
+// extents pointing at them are never durable before their contents. Runs
+// are sorted and joined first, for one msync per stretch of the image.
+// Called by the journal before it writes each batch.
+static void write_back_ordered() {
+  pthread_mutex_lock(&blocks_ordered_lock);
+  ordered_run_t *runs = blocks_ordered;
+  int n = blocks_nordered;
+  blocks_ordered = 0;
+  blocks_nordered = blocks_ordered_cap = 0;
+  pthread_mutex_unlock(&blocks_ordered_lock);
+  if (n == 0) {
+    free(runs);
+    return;
+  }
+
+  qsort(runs, n, sizeof(ordered_run_t), ordered_run_cmp);
+  long page = sysconf(_SC_PAGESIZE);
+  for (int ii = 0; ii < n;) {
+    int64_t start = (int64_t)runs[ii].bnum * BLOCK_SIZE;
+    int64_t stop = start + (int64_t)runs[ii].count * BLOCK_SIZE;
+    for (ii++; ii < n && (int64_t)runs[ii].bnum * BLOCK_SIZE <= stop; ii++) {
+      int64_t end = (int64_t)(runs[ii].bnum + runs[ii].count) * BLOCK_SIZE;
+      stop = end > stop ? end : stop;
+    }
+    start -= start % page;
+    if (msync((char *)blocks_base + start, stop - start, MS_SYNC) != 0) {
+      log_warn("blocks: writing back data at %lld failed: %s",
+               (long long)start, strerror(errno));
+    }
+  }
+  free(runs);
+}
+
+// Ask for huge pages to back part of the mapping.
+static void advise_huge_pages(void *addr, int64_t len) {
+  if (blocks_huge_pages && madvise(addr, len, MADV_HUGEPAGE) != 0) {
+    log_warn("huge pages unavailable for the image: %s", strerror(errno));
+  }
+}
+
+// Choose whether the next blocks_init() backs the image with huge pages.
+void blocks_set_huge_pages(int enabled) { blocks_huge_pages = enabled; }
+
 // Load and initialize the given disk image.
-void blocks_init(const char *image_path) {
+void blocks_init(const char *image_path, const blocks_geometry_t *geo) {
   blocks_fd = open(image_path, O_CREAT | O_RDWR, 0644);
   assert(blocks_fd != -1);
 
-  // make sure the disk image is exactly 1MB
-  int rv = ftruncate(blocks_fd, NUFS_SIZE);
+  superblock_t disk = {0};
+  int rv = pread(blocks_fd, &disk, sizeof(disk), 0);
+  int formatted = rv != sizeof(disk) || disk.magic != NUFS_MAGIC;
+  if (formatted) {
+    blocks_format(geo);
+    rv = pread(blocks_fd, &disk, sizeof(disk), 0);
+    assert(rv == sizeof(disk));
+  } else if (disk.version != NUFS_VERSION || disk.inode_size != geo->inode_size) {
+    fprintf(stderr, "Error: %s was formatted by an incompatible version\n",
+            image_path);
+    exit(1);
+  }
+
+  // finish the metadata changes committed before the last shutdown; they
+  // may include the superblock itself
+  if (journal_open(blocks_fd, image_path, &disk) > 0) {
+    rv = pread(blocks_fd, &disk, sizeof(disk), 0);
+    assert(rv == sizeof(disk));
+  }
+
+  BLOCK_SIZE = disk.block_size;
+  BLOCK_COUNT = disk.block_count;
+  NUFS_SIZE = (int64_t)BLOCK_SIZE * BLOCK_COUNT;
+  BLOCK_BITMAP_SIZE = (disk.max_block_count + 7) / 8;
+  INODE_COUNT = disk.inode_count;
+
+  // make sure the disk image is as large as the superblock says
+  struct stat st;
+  rv = fstat(blocks_fd, &st);
   assert(rv == 0);
+  if (st.st_size < NUFS_SIZE) {
+    rv = ftruncate(blocks_fd, NUFS_SIZE);
+    assert(rv == 0);
+  }
+
+  // Reserve address space for the largest image up front, so growing the
+  // mapping never moves it and block pointers stay valid. It starts on a
+  // huge page boundary, so huge pages can back it from the first block.
+  blocks_reserved = (int64_t)disk.max_block_count * BLOCK_SIZE;
+  blocks_reservation = reserve(&blocks_base);
 
-  // map the image to memory
-  blocks_base =
-      mmap(0, NUFS_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, blocks_fd, 0);
-  assert(blocks_base != MAP_FAILED);
+  // map the image to memory; the superblock, bitmaps and inode table are
+  // touched by every operation, so they are prefaulted
+  int64_t page = sysconf(_SC_PAGESIZE);
+  int64_t meta_end = disk.itable_start + disk.itable_blocks;
+  int64_t meta = (meta_end * BLOCK_SIZE + page - 1) / page * page;
+  if (meta > NUFS_SIZE) {
+    meta = NUFS_SIZE;
+  }
 
-  // block 0 stores the block bitmap and the inode bitmap
+  // With a journal, metadata is changed in private copies of its pages,
+  // which the kernel never writes back; only the journal puts changes in
+  // the file, once they are committed. Data blocks cannot share a page
+  // with the inode table for that, so a journal smaller than a page
+  // leaves the metadata shared, as it is without a journal.
+  int private = disk.journal_blocks >= 2;
+  if (private && meta > (int64_t)disk.data_start * BLOCK_SIZE) {
+    log_warn("journal of %s is too small to keep metadata private",
+             image_path);
+    private = 0;
+  }
+  blocks_private_end = private ? meta : 0;
+  void *mapped = mmap(blocks_base, meta, PROT_READ | PROT_WRITE,
+                      (private ? MAP_PRIVATE : MAP_SHARED) | MAP_FIXED |
+                          MAP_POPULATE,
+                      blocks_fd, 0);
+  assert(mapped == blocks_base);
+  if (meta < NUFS_SIZE) {
+    mapped = mmap((char *)blocks_base + meta, NUFS_SIZE - meta,
+                  PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED, blocks_fd,
+                  meta);
+    assert(mapped == (char *)blocks_base + meta);
+  }
+  advise_huge_pages(blocks_base, NUFS_SIZE);
+
+  // directory buckets and extent map blocks sit among the data blocks, and
+  // get a private view of the whole image of their own
+  if (private) {
+    blocks_meta_reservation = reserve(&blocks_meta_base);
+    mapped = mmap(blocks_meta_base, NUFS_SIZE, PROT_READ | PROT_WRITE,
+                  MAP_PRIVATE | MAP_FIXED, blocks_fd, 0);
+    assert(mapped == blocks_meta_base);
+  } else {
+    blocks_meta_base = blocks_base;
+  }
+
+  // bitmaps and inodes are looked at one at a time, so reading ahead
+  // around a fault there would only bring in unrelated metadata
+  madvise(blocks_base, meta, MADV_RANDOM);
+  sb = blocks_base;
+  if (sb->refcount_blocks > 0) {
+    refcounts = blocks_get_block(sb->refcount_start);
+  }
+
+  // the superblock, bitmaps and inode table are never handed out
   void *bbm = get_blocks_bitmap();
-  bitmap_put(bbm, 0, 1);
+  if (formatted) {
+    for (int ii = 0; ii < sb->data_start; ++ii) {
+      bitmap_put(bbm, ii, 1);
+    }
+    journal_log_bits(bbm, 0, sb->data_start, 1);
+  }
+  blocks_pending_bits = calloc(BLOCK_BITMAP_SIZE, 1);
+  assert(blocks_pending_bits);
+
+  // the free counts come from the superblock, so mounting takes the same
+  // time however large the image is
+  groups = (uint32_t *)(sb + 1);
+  int64_t room = (BLOCK_SIZE - sizeof(superblock_t)) / sizeof(uint32_t);
+  if (!summary_usable(room)) {
+    build_summary(room);
+  }
+  blocks_free_count = sb->free_blocks;
+  blocks_reserved_count = 0;
+  blocks_free_inodes = sb->free_inodes;
+  journal_set_summary(blocks_refresh_summary, sb,
+                      sizeof(superblock_t) + sb->group_count * sizeof(uint32_t));
+  journal_set_durable(release_frees);
+  journal_set_ordered(write_back_ordered);
+  blocks_cursor = sb->data_start;
 }
 
 // Close the disk image.
 void blocks_free() {
-  int rv = munmap(blocks_base, NUFS_SIZE);
+  // The checkpoint releases the pending frees, unless the journal was
+  // aborted: their batches never became durable, so they are dropped
+  journal_close();
+  assert(blocks_nordered == 0);
+  int rv = munmap(blocks_reservation, blocks_reserved + BLOCKS_HUGE_PAGE);
   assert(rv == 0);
+  if (blocks_meta_reservation) {
+    rv = munmap(blocks_meta_reservation, blocks_reserved + BLOCKS_HUGE_PAGE);
+    assert(rv == 0);
+  }
+  close(blocks_fd);
+  blocks_fd = -1;
+  blocks_meta_base = blocks_meta_reservation = 0;
+  blocks_private_end = 0;
+  free(blocks_pending);
+  free(blocks_pending_bits);
+  blocks_pending = blocks_pending_bits = 0;
+  blocks_pending_cap = 0;
+  sb = 0;
+  groups = 0;
+  refcounts = 0;
+}
+
+// Return the superblock of the mounted image.
+superblock_t *blocks_get_superblock() { return sb; }
+
+// Grow the image to the given number of blocks.
+//
+// Growth is serialized, and BLOCK_COUNT is only raised once the new tail is
+// mapped, so other threads never see blocks they cannot touch.
+int blocks_grow(int block_count) {
+  // A full-size image cannot grow; don't queue every allocation on the lock
+  int count = __atomic_load_n(&BLOCK_COUNT, __ATOMIC_ACQUIRE);
+  if (count >= (int)sb->max_block_count || block_count <= count) {
+    return -1;
+  }
+
+  pthread_mutex_lock(&blocks_grow_lock);
+  int rv = -1;
+
+  if (block_count > sb->max_block_count) {
+    block_count = sb->max_block_count;
+  }
+  block_count = round_to_pages(block_count, BLOCK_SIZE);
+  if (block_count <= BLOCK_COUNT) {
+    goto out;
+  }
+
+  int64_t new_size = (int64_t)block_count * BLOCK_SIZE;
+  if (ftruncate(blocks_fd, new_size) != 0) {
+    goto out;
+  }
+
+  // map the new tail right after the existing mapping
+  void *tail = mmap((char *)blocks_base + NUFS_SIZE, new_size - NUFS_SIZE,
+                    PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED, blocks_fd,
+                    NUFS_SIZE);
+  if (tail == MAP_FAILED) {
+    goto out;
+  }
+  if (blocks_meta_base != blocks_base &&
+      mmap((char *)blocks_meta_base + NUFS_SIZE, new_size - NUFS_SIZE,
+           PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_FIXED, blocks_fd,
+           NUFS_SIZE) == MAP_FAILED) {
+    goto out;
+  }
+  advise_huge_pages(tail, new_size - NUFS_SIZE);
+
+  __atomic_fetch_add(&blocks_free_count, block_count - BLOCK_COUNT,
+                     __ATOMIC_RELAXED);
+  groups_add(BLOCK_COUNT, block_count - BLOCK_COUNT, 1);
+  sb->block_count = block_count;
+  journal_log(sb, sizeof(superblock_t));
+  __atomic_store_n(&NUFS_SIZE, new_size, __ATOMIC_RELEASE);
+  __atomic_store_n(&BLOCK_COUNT, block_count, __ATOMIC_RELEASE);
+  rv = 0;
+  blocks_count(grows, 1);
+
+  log_info("+ blocks_grow() -> %d blocks", block_count);
+out:
+  pthread_mutex_unlock(&blocks_grow_lock);
+  return rv;
 }
 
 // Get the given block, returning a pointer to its start.
-void *blocks_get_block(int bnum) { return blocks_base + BLOCK_SIZE * bnum; }
+void *blocks_get_block(int bnum) {
+  return (char *)blocks_base + (int64_t)BLOCK_SIZE * bnum;
+}
+
+// Get the given block as metadata, in the private view.
+void *blocks_get_meta_block(int bnum) {
+  return (char *)blocks_meta_base + (int64_t)BLOCK_SIZE * bnum;
+}
+
+// Return the byte position in the image of an address in either view.
+int64_t blocks_image_pos(const void *addr) {
+  const char *meta = blocks_meta_base;
+  if (meta != blocks_base && (const char *)addr >= meta &&
+      (const char *)addr < meta + blocks_reserved) {
+    return (const char *)addr - meta;
+  }
+  return (const char *)addr - (const char *)blocks_base;
+}
+
+// Whether the file holds the current contents of the byte at pos.
+int blocks_pos_shared(int64_t pos) { return pos >= blocks_private_end; }
+
+// Give the kernel a hint about a range of the image.
+void blocks_advise(int64_t pos, int64_t len, int advice) {
+  int64_t page = sysconf(_SC_PAGESIZE);
+  int64_t start = pos / page * page;
+  int64_t end = pos + len;
+  if (end > NUFS_SIZE) {
+    end = NUFS_SIZE;
+  }
+  if (start < end) {
+    madvise((char *)blocks_base + start, end - start, advice);
+  }
+}
+
+// Return the file descriptor of the disk image.
+int blocks_get_fd() { return blocks_fd; }
 
 // Return a pointer to the beginning of the block bitmap.
 // The size is BLOCK_BITMAP_SIZE bytes.
+void *get_blocks_bitmap() { return blocks_get_block(sb->bbitmap_start); }
 
-void *get_blocks_bitmap() {
-  return (void *)((char *)blocks_get_block(0) + ROOT_INODE_BYTES);
-}
 // Return a pointer to the beginning of the inode table bitmap.
-void *get_inode_bitmap() {
-  return (void *)((char *)get_blocks_bitmap() + BLOCK_BITMAP_SIZE);
+void *get_inode_bitmap() { return blocks_get_block(sb->ibitmap_start); }
+
+// Claim the first free block in [lo, hi), or return -1.
+static int claim_block(void *bbm, int lo, int hi) {
+  int end;
+  for (lo = groups_stretch(lo, hi, &end); lo >= 0;
+       lo = groups_stretch(end, hi, &end)) {
+    for (int ii = bitmap_find_zero(bbm, lo, end); ii >= 0;
+         ii = bitmap_find_zero(bbm, ii + 1, end)) {
+      if (!bitmap_test_and_set(bbm, ii)) {
+        return ii;
+      }
+    }
+  }
+  return -1;
+}
+
+// Find the first free run of len blocks in [lo, hi), or return -1. A run
+// never crosses a full group, so only stretches of other groups are read.
+static int find_run(void *bbm, int lo, int hi, int len) {
+  int end;
+  for (lo = groups_stretch(lo, hi, &end); lo >= 0;
+       lo = groups_stretch(end, hi, &end)) {
+    int first = bitmap_find_zero_run(bbm, lo, end, len);
+    if (first >= 0) {
+      return first;
+    }
+  }
+  return -1;
+}
+
+// Claim up to len free blocks starting exactly at first, stopping at the
+// first one that is taken or at limit. Returns how many were claimed.
+static int claim_run(void *bbm, int first, int len, int limit) {
+  int n = 0;
+  while (n < len && first + n < limit && !bitmap_test_and_set(bbm, first + n)) {
+    n++;
+  }
+  return n;
+}
+
+// Claim a run of free bits, preferably starting at goal, without logging
+// or counting them. Returns the first block and sets *got, or returns -1.
+//
+// Safe to call from several threads: free bits are claimed with an atomic
+// test-and-set, and a thread that loses a race moves on. Searches are
+// next-fit, starting where the previous one ended and wrapping around once.
+static int claim_blocks(int goal, int len, int *got) {
+  assert(len > 0);
+  int count = __atomic_load_n(&BLOCK_COUNT, __ATOMIC_ACQUIRE);
+  int free_count = __atomic_load_n(&blocks_free_count, __ATOMIC_RELAXED) -
+                   __atomic_load_n(&blocks_reserved_count, __ATOMIC_RELAXED);
+  if (count < (int)sb->max_block_count &&
+      (free_count <= count / BLOCKS_LOW_WATER || free_count < len)) {
+    blocks_grow(count + (len > count ? len : count));
+    count = __atomic_load_n(&BLOCK_COUNT, __ATOMIC_ACQUIRE);
+  }
+
+  void *bbm = get_blocks_bitmap();
+  int lo = sb->data_start;
+  int first = -1;
+  int n = 0;
+
+  // 1. Continue right where the caller's last run ended
+  if (goal >= lo && goal < count) {
+    n = claim_run(bbm, goal, len, count);
+    first = goal;
+  }
+
+  // 2. Find a free run of the whole length
+  int start = __atomic_load_n(&blocks_cursor, __ATOMIC_RELAXED);
+  if (start < lo || start >= count) {
+    start = lo;
+  }
+  while (n == 0) {
+    first = find_run(bbm, start, count, len);
+    if (first < 0 && start > lo) {
+      first = find_run(bbm, lo, count, len);
+    }
+    if (first < 0) {
+      break;
+    }
+    n = claim_run(bbm, first, len, count);
+  }
+
+  // 3. Settle for the next free block and whatever follows it
+  if (n == 0) {
+    first = claim_block(bbm, start, count);
+    if (first < 0) {
+      first = claim_block(bbm, lo, start);
+    }
+    if (first < 0) {
+      return -1;
+    }
+    n = 1 + claim_run(bbm, first + 1, len - 1, count);
+  }
+
+  __atomic_store_n(&blocks_cursor, first + n, __ATOMIC_RELAXED);
+  if (first == goal) {
+    blocks_count(goal_hits, 1);
+  }
+  *got = n;
+  return first;
+}
+
+// Count and log claimed blocks as allocated.
+static void note_allocated(int first, int n) {
+  __atomic_fetch_sub(&blocks_free_count, n, __ATOMIC_RELAXED);
+  groups_add(first, n, -1);
+  journal_log_bits(get_blocks_bitmap(), first, n, 1);
+  blocks_count(runs, 1);
+  blocks_count(allocated, n);
+}
+
+// Allocate a run of contiguous blocks, preferably starting at goal.
+int alloc_block_run(int goal, int len, int *got) {
+  int first = claim_blocks(goal, len, got);
+  if (first < 0) {
+    return -1;
+  }
+  note_allocated(first, *got);
+  log_debug("+ alloc_block_run(%d, %d) -> %d x %d", goal, len, first, *got);
+  return first;
+}
+
+// Reserve a run of contiguous blocks in memory only.
+//
+// Their bits are set so no one else is handed them, but nothing is logged
+// and the free counts are left alone, so the batches committed meanwhile
+// still describe them as free; a crash simply forgets the reservation.
+int reserve_block_run(int goal, int len, int *got) {
+  int first = claim_blocks(goal, len, got);
+  if (first >= 0) {
+    __atomic_fetch_add(&blocks_reserved_count, *got, __ATOMIC_RELAXED);
+    log_debug("+ reserve_block_run(%d, %d) -> %d x %d", goal, len, first,
+              *got);
+  }
+  return first;
+}
+
+// Allocate reserved blocks, now that they are mapped into a file.
+void blocks_take_reserved(int first, int n) {
+  __atomic_fetch_sub(&blocks_reserved_count, n, __ATOMIC_RELAXED);
+  note_allocated(first, n);
+}
+
+// Give reserved blocks back. They were never logged, so nothing is.
+void blocks_unreserve(int first, int n) {
+  void *bbm = get_blocks_bitmap();
+  for (int ii = 0; ii < n; ++ii) {
+    bitmap_test_and_clear(bbm, first + ii);
+  }
+  __atomic_fetch_sub(&blocks_reserved_count, n, __ATOMIC_RELAXED);
 }
+
 // Allocate a new block and return its index.
 int alloc_block() {
+  int got;
+  return alloc_block_run(0, 1, &got);
+}
+
+
+// Deallocate the block with the given index.
+void free_block(int bnum) {
+  log_debug("+ free_block(%d)", bnum);
+  if (bnum < (int)sb->data_start || bnum >= BLOCK_COUNT) {
+    return;
+  }
+
+  // Drop one reference; only the last one releases the block
+  if (refcounts) {
+    uint8_t count = __atomic_load_n(&refcounts[bnum], __ATOMIC_ACQUIRE);
+    while (count > 0) {
+      if (__atomic_compare_exchange_n(&refcounts[bnum], &count, count - 1, 1,
+                                      __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+        journal_log(&refcounts[bnum], 1);
+        if (count > 1) {
+          return;
+        }
+        break;
+      }
+    }
+  }
+
+  // The bit is cleared once the batch freeing the block is durable; until
+  // then the block is not handed out again, so nothing new is written to it
+  // while a crash could still bring back the file that held it. The counts
+  // already include it, as the summary logged with that batch must.
   void *bbm = get_blocks_bitmap();
+  if (!bitmap_get(bbm, bnum) ||
+      bitmap_test_and_set(blocks_pending_bits, bnum)) {
+    return;
+  }
+  __atomic_fetch_add(&blocks_free_count, 1, __ATOMIC_RELAXED);
+  groups_add(bnum, 1, 1);
+  uint64_t batch = journal_log_bits(bbm, bnum, 1, 0);
+  blocks_count(freed, 1);
+  if (batch == 0) {
+    bitmap_put(blocks_pending_bits, bnum, 0);
+    bitmap_test_and_clear(bbm, bnum);
+    return;
+  }
 
-  for (int ii = 5; ii < BLOCK_COUNT; ++ii) { // SKIP USELESS BITS
-      if (!bitmap_get(bbm, ii)) {
-          bitmap_put(bbm, ii, 1);
-          printf("+ alloc_block() -> %d\n", ii);
-          return ii;
+  pthread_mutex_lock(&blocks_pending_lock);
+  if (blocks_npending == blocks_pending_cap) {
+    blocks_pending_cap = blocks_pending_cap ? blocks_pending_cap * 2 : 256;
+    blocks_pending = realloc(blocks_pending,
+                             blocks_pending_cap * sizeof(pending_free_t));
+    assert(blocks_pending);
+  }
+  blocks_pending[blocks_npending++] = (pending_free_t){bnum, batch};
+  pthread_mutex_unlock(&blocks_pending_lock);
+}
+
+// Note new data blocks to write back before the batch mapping them.
+void blocks_order_data(int bnum, int count) {
+  pthread_mutex_lock(&blocks_ordered_lock);
+  int n = blocks_nordered;
+  if (n > 0 && blocks_ordered[n - 1].bnum + blocks_ordered[n - 1].count == bnum) {
+    blocks_ordered[n - 1].count += count;
+  } else {
+    if (blocks_nordered == blocks_ordered_cap) {
+      blocks_ordered_cap = blocks_ordered_cap ? blocks_ordered_cap * 2 : 64;
+      blocks_ordered = realloc(blocks_ordered,
+                               blocks_ordered_cap * sizeof(ordered_run_t));
+      assert(blocks_ordered);
+    }
+    blocks_ordered[blocks_nordered++] = (ordered_run_t){bnum, count};
+  }
+  pthread_mutex_unlock(&blocks_ordered_lock);
+}
+
+// Mark a block allocated or free, for repairs by the checker.
+int blocks_set_allocated(int bnum, int allocated) {
+  void *bbm = get_blocks_bitmap();
+  int changed = allocated ? !bitmap_test_and_set(bbm, bnum)
+                          : bitmap_test_and_clear(bbm, bnum);
+  if (changed) {
+    __atomic_fetch_add(&blocks_free_count, allocated ? -1 : 1,
+                       __ATOMIC_RELAXED);
+    groups_add(bnum, 1, allocated ? -1 : 1);
+    journal_log_bits(bbm, bnum, 1, allocated);
+  }
+  return changed;
+}
+
+// Set the reference count of a block, for repairs by the checker.
+void block_set_refs(int bnum, int count) {
+  if (refcounts) {
+    __atomic_store_n(&refcounts[bnum], count, __ATOMIC_RELEASE);
+    journal_log(&refcounts[bnum], 1);
+  }
+}
+
+// Compare the free counts and the summary with the bitmaps.
+int blocks_check_summary(int repair) {
+  int wrong = 0;
+  int free_count = 0;
+  for (int g = 0; g < sb->group_count; g++) {
+    uint32_t real = group_scan(g);
+    if (groups[g] != real) {
+      log_warn("group %d: summary says %u free blocks, bitmap has %u", g,
+               groups[g], real);
+      wrong++;
+      if (repair) {
+        groups[g] = real;
       }
+    }
+    free_count += real;
+  }
+
+  int free_inodes =
+      INODE_COUNT - bitmap_popcount(get_inode_bitmap(), 0, INODE_COUNT);
+  if (blocks_free_count != free_count || blocks_free_inodes != free_inodes) {
+    log_warn("free counts are %d blocks and %d inodes, bitmaps have %d and %d",
+             blocks_free_count, blocks_free_inodes, free_count, free_inodes);
+    wrong++;
+  }
+  if (wrong && repair) {
+    blocks_free_count = free_count;
+    blocks_free_inodes = free_inodes;
+    blocks_refresh_summary();
+    journal_log(sb, sizeof(superblock_t) + sb->group_count * sizeof(uint32_t));
   }
+  return wrong;
+}
+
+// Account for inodes allocated or freed in the inode bitmap.
+void blocks_adjust_free_inodes(int delta) {
+  __atomic_fetch_add(&blocks_free_inodes, delta, __ATOMIC_RELAXED);
+}
+
+// Whether the image keeps block reference counts.
+int blocks_dedup_enabled() { return refcounts != 0; }
+
+// Return the number of references counted for a block.
+int block_refs(int bnum) {
+  return refcounts ? __atomic_load_n(&refcounts[bnum], __ATOMIC_ACQUIRE) : 0;
+}
 
+// Start counting references to a block with a single owner.
+void block_track(int bnum) {
+  if (refcounts) {
+    __atomic_store_n(&refcounts[bnum], 1, __ATOMIC_RELEASE);
+    journal_log(&refcounts[bnum], 1);
+  }
+}
+
+// Take another reference to a tracked block.
+//
+// The count only ever rises from 1 or more, so a block its owner has
+// claimed for writing in place cannot be picked up on the way.
+int block_hold(int bnum) {
+  if (!refcounts) {
+    return -1;
+  }
+  uint8_t count = __atomic_load_n(&refcounts[bnum], __ATOMIC_ACQUIRE);
+  while (count > 0 && count < BLOCK_REFS_MAX) {
+    if (__atomic_compare_exchange_n(&refcounts[bnum], &count, count + 1, 1,
+                                    __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+      journal_log(&refcounts[bnum], 1);
+      return 0;
+    }
+  }
   return -1;
 }
 
+// Make a block safe for its owner to change in place.
+int block_claim(int bnum) {
+  if (!refcounts) {
+    return 1;
+  }
+  uint8_t count = __atomic_load_n(&refcounts[bnum], __ATOMIC_ACQUIRE);
+  while (count == 1) {
+    if (__atomic_compare_exchange_n(&refcounts[bnum], &count, 0, 1,
+                                    __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+      journal_log(&refcounts[bnum], 1);
+      return 1;
+    }
+  }
+  return count == 0;
+}
 
-// Deallocate the block with the given index.
-void free_block(int bnum) {
-  printf("+ free_block(%d)\n", bnum);
-  void *bbm = get_blocks_bitmap();
-  bitmap_put(bbm, bnum, 0);
+// Read the allocator counters.
+void blocks_get_stats(blocks_stats_t *st) {
+  st->runs = __atomic_load_n(&stats.runs, __ATOMIC_RELAXED);
+  st->goal_hits = __atomic_load_n(&stats.goal_hits, __ATOMIC_RELAXED);
+  st->allocated = __atomic_load_n(&stats.allocated, __ATOMIC_RELAXED);
+  st->freed = __atomic_load_n(&stats.freed, __ATOMIC_RELAXED);
+  st->grows = __atomic_load_n(&stats.grows, __ATOMIC_RELAXED);
+  st->free_count = __atomic_load_n(&blocks_free_count, __ATOMIC_RELAXED);
+  st->free_inodes = __atomic_load_n(&blocks_free_inodes, __ATOMIC_RELAXED);
 }
 
-// for getting the root block so I can see where it starts.
+// for getting the root inode recorded in the superblock.
 int blocks_get_root_block() {
-  int *root_slot = (int *)blocks_get_block(0); // first 4 bytes
-  return *root_slot;
+  return sb->root_inum;
 }
 
-// For setting my root block in my init.
+// For setting my root inode in my init.
 void blocks_set_root_block(int root_inum) {
-  int *root_slot = (int *)blocks_get_block(0); // first 4 bytes
-  *root_slot = root_inum;
+  sb->root_inum = root_inum;
+  journal_log(sb, sizeof(superblock_t));
 }
 
 // for flushing the disk image
 void blocks_flush() {
-  fsync(blocks_fd);  // flush all changes to the disk image
-  printf("Flushed %d blocks to disk\n", BLOCK_COUNT);
-}
\ No newline at end of file
+  journal_checkpoint();  // flush all changes to the disk image
+  log_debug("Flushed %d blocks to disk", BLOCK_COUNT);
+}
@@ -9,13 +9,82 @@
 #ifndef BLOCKS_H
 #define BLOCKS_H
 
+#include <stdint.h>
 #include <stdio.h>
 
-extern const int BLOCK_COUNT; // we split the "disk" into blocks (default = 256)
-extern const int BLOCK_SIZE;  // default = 4K
-extern const int NUFS_SIZE;   // default = 1MB
+#define NUFS_MAGIC 0x5346554e // "NUFS" in little-endian byte order
+#define NUFS_VERSION 2
 
-extern const int BLOCK_BITMAP_SIZE; // default = 256 / 8 = 32
+/**
+ * On-disk superblock, stored at the start of block 0.
+ *
+ * Records the geometry chosen when the image was formatted. Everything
+ * else is located through it, so images of any size can be mounted.
+ *
+ * It is followed in block 0 by the free space summary: a uint32_t count of
+ * free blocks for each group of group_blocks blocks. The summary and the
+ * free counts are logged with every journal batch, so mounting and statfs
+ * never have to scan the bitmaps. Images mounted before the summary
+ * existed have it built on their first mount.
+ */
+typedef struct superblock {
+  uint32_t magic;           // NUFS_MAGIC
+  uint32_t version;         // NUFS_VERSION
+  uint32_t block_size;      // bytes per block
+  uint32_t block_count;     // blocks currently in the image
+  uint32_t max_block_count; // growth limit; the block bitmap is sized for it
+  uint32_t inode_count;     // number of inodes in the table
+  uint32_t inode_size;      // bytes per inode record
+  uint32_t bbitmap_start;   // first block of the block bitmap
+  uint32_t bbitmap_blocks;
+  uint32_t ibitmap_start;   // first block of the inode bitmap
+  uint32_t ibitmap_blocks;
+  uint32_t itable_start;    // first block of the inode table
+  uint32_t itable_blocks;
+  uint32_t data_start;      // first block handed out by alloc_block()
+  int32_t root_inum;        // inode of the root directory (-1 if none yet)
+  uint32_t journal_start;   // first block of the metadata journal
+  uint32_t journal_blocks;  // 0 for images formatted without one
+  uint32_t refcount_start;  // first block of the block reference counts
+  uint32_t refcount_blocks; // 0 for images formatted without dedup
+  uint32_t free_blocks;     // unallocated blocks below block_count
+  uint32_t free_inodes;     // unallocated inodes
+  uint32_t group_blocks;    // blocks per group of the free space summary
+  uint32_t group_count;     // groups summarized, 0 until the summary is built
+} superblock_t;
+
+/**
+ * Allocator counters, for the statistics report.
+ */
+typedef struct blocks_stats {
+  uint64_t runs;        // successful alloc_block_run() calls
+  uint64_t goal_hits;   // runs that started at the requested goal
+  uint64_t allocated;   // blocks handed out
+  uint64_t freed;       // blocks returned with free_block()
+  uint64_t grows;       // times the image was grown
+  int free_count;       // unallocated blocks right now
+  int free_inodes;      // unallocated inodes right now
+} blocks_stats_t;
+
+/**
+ * Geometry used to format a new disk image.
+ */
+typedef struct blocks_geometry {
+  int block_size;   // bytes per block, a power of two
+  int64_t size;     // initial image size in bytes
+  int64_t max_size; // largest size online growth may reach
+  int inode_count;  // number of inodes, a multiple of 8
+  int inode_size;   // bytes per inode record
+  int64_t journal_size; // bytes for the metadata journal, 0 to pick one
+  int dedup;        // keep block reference counts so blocks can be shared
+} blocks_geometry_t;
+
+// The geometry below is loaded from the superblock by blocks_init()
+extern int BLOCK_COUNT;       // blocks currently in the image (default = 256)
+extern int BLOCK_SIZE;        // default = 4K
+extern int64_t NUFS_SIZE;     // BLOCK_COUNT * BLOCK_SIZE (default = 1MB)
+extern int BLOCK_BITMAP_SIZE; // bytes in the block bitmap
+extern int INODE_COUNT;       // inodes in the inode table (default = 256)
 
 /** 
  * Compute the number of blocks needed to store the given number of bytes.
@@ -24,20 +93,70 @@ extern const int BLOCK_BITMAP_SIZE; // default = 256 / 8 = 32
  *
  * @return Number of blocks needed to store the given number of bytes.
  */
-int bytes_to_blocks(int bytes);
+int bytes_to_blocks(int64_t bytes);
+
+/**
+ * Choose whether the disk image is backed by transparent huge pages.
+ *
+ * Takes effect at the next blocks_init(). Whether huge pages are used for
+ * a file mapping depends on the filesystem holding the image (tmpfs
+ * mounted with huge=advise supports them); where they are not, the
+ * mapping works as usual.
+ *
+ * @param enabled Nonzero to ask for huge pages.
+ */
+void blocks_set_huge_pages(int enabled);
 
 /**
  * Load and initialize the given disk image.
  *
+ * The superblock, bitmaps and inode table are prefaulted and marked for
+ * random access; the rest of the image is faulted in as it is used.
+ *
+ * An image without a valid superblock is formatted with the given geometry;
+ * an existing image keeps the geometry recorded in its superblock.
+ *
  * @param image_path Path to the disk image file.
+ * @param geo Geometry to format a new image with.
+ */
+void blocks_init(const char *image_path, const blocks_geometry_t *geo);
+
+/**
+ * Return the superblock of the mounted image.
+ *
+ * @return Pointer to the superblock in block 0.
  */
-void blocks_init(const char *image_path);
+superblock_t *blocks_get_superblock();
+
+/**
+ * Grow the image to the given number of blocks.
+ *
+ * The mapping is extended in place, so pointers returned by
+ * blocks_get_block() stay valid.
+ *
+ * @param block_count New block count, capped at the superblock's limit.
+ *
+ * @return 0 on success, -1 if the image cannot grow.
+ */
+int blocks_grow(int block_count);
 
 /**
  * Close the disk image.
  */
 void blocks_free();
 
+/**
+ * Give the kernel a hint about how a range of the image will be used.
+ *
+ * The range is widened to whole pages and clipped to the image. Hints are
+ * only advice, so failures are ignored.
+ *
+ * @param pos Byte position of the range in the image.
+ * @param len Length of the range in bytes.
+ * @param advice An MADV_* value, as for madvise().
+ */
+void blocks_advise(int64_t pos, int64_t len, int advice);
+
 /**
  * Get the block with the given index, returning a pointer to its start.
  *
@@ -47,6 +166,57 @@ void blocks_free();
  */
 void *blocks_get_block(int bnum);
 
+/**
+ * Get a block that holds metadata, such as a directory bucket or an extent
+ * map block, returning a pointer to its start.
+ *
+ * With a journal, metadata lives in a private view of the image, so the
+ * kernel cannot write back changes before they are committed; the journal
+ * puts them in the file. The superblock, bitmaps and inode table returned
+ * by blocks_get_block() are private the same way. Without a journal this
+ * is the same as blocks_get_block().
+ *
+ * @param bnum Block number (index).
+ *
+ * @return Pointer to the beginning of the block in memory.
+ */
+void *blocks_get_meta_block(int bnum);
+
+/**
+ * Return the byte offset in the image of an address in either view.
+ *
+ * @param addr An address returned by blocks_get_block() or
+ * blocks_get_meta_block(), or inside a block they returned.
+ *
+ * @return The offset of addr from the start of the image.
+ */
+int64_t blocks_image_pos(const void *addr);
+
+/**
+ * Return whether the file holds what the mapping shows at a position.
+ *
+ * Data blocks are shared with the file; the start of the image, through
+ * the inode table, is not when it is kept private (see
+ * blocks_get_meta_block()), so file data stored inline in an inode must be
+ * read and written through the mapping rather than the file descriptor.
+ *
+ * @param pos Byte offset in the image.
+ *
+ * @return Nonzero if the file descriptor sees the same bytes as the mapping.
+ */
+int blocks_pos_shared(int64_t pos);
+
+/**
+ * Return the file descriptor of the open disk image.
+ *
+ * Block bnum starts at byte offset bnum * BLOCK_SIZE of the file, and the
+ * file and the mapping share the same page cache, so data blocks can be
+ * read through either (see blocks_pos_shared()).
+ *
+ * @return The image's file descriptor.
+ */
+int blocks_get_fd();
+
 /**
  * Return a pointer to the beginning of the block bitmap.
  *
@@ -64,24 +234,203 @@ void *get_inode_bitmap();
 /**
  * Allocate a new block and return its number.
  *
- * Grabs the first unused block and marks it as allocated.
+ * Grabs the next unused block after the previous allocation, wrapping
+ * around to the start of the data area, and marks it as allocated. The image is
+ * grown first when few free blocks are left. Safe to call from several
+ * threads at once, as is free_block().
  *
  * @return The index of the newly allocated block.
  */
 int alloc_block();
 
+/**
+ * Allocate a run of physically contiguous blocks.
+ *
+ * The run starts at goal if that block is free, so a file can be extended
+ * in place from the end of its last extent. Otherwise the first free run
+ * of len blocks is used, and failing that the next free block and as many
+ * free blocks as directly follow it. Safe to call from several threads.
+ *
+ * @param goal Preferred first block, or 0 for no preference.
+ * @param len Number of blocks wanted, at least 1.
+ * @param got Set to the number of blocks allocated, from 1 to len.
+ *
+ * @return The first block of the run, or -1 if the disk is full.
+ */
+int alloc_block_run(int goal, int len, int *got);
+
+/**
+ * Reserve a run of physically contiguous blocks without allocating them.
+ *
+ * The run is found as by alloc_block_run() and no one else is handed its
+ * blocks, but the reservation lives in memory only: nothing is logged and
+ * the free counts still include the blocks, so a crash leaks none of them.
+ * Each block must later be passed to blocks_take_reserved() or
+ * blocks_unreserve(). On an image without a journal the bitmap is written
+ * back as it is, so the reservation can reach the disk there.
+ *
+ * @param goal Preferred first block, or 0 for no preference.
+ * @param len Number of blocks wanted, at least 1.
+ * @param got Set to the number of blocks reserved, from 1 to len.
+ *
+ * @return The first block of the run, or -1 if the disk is full.
+ */
+int reserve_block_run(int goal, int len, int *got);
+
+/**
+ * Allocate blocks reserved with reserve_block_run(), logging them.
+ *
+ * @param first First block, reserved.
+ * @param n Number of blocks.
+ */
+void blocks_take_reserved(int first, int n);
+
+/**
+ * Give back blocks reserved with reserve_block_run().
+ *
+ * @param first First block, reserved.
+ * @param n Number of blocks.
+ */
+void blocks_unreserve(int first, int n);
+
 /**
  * Deallocate the block with the given number.
  *
+ * A block shared by several files only loses one reference; it is
+ * released when the last one goes. A released block is counted as free at
+ * once, but with a journal it is not handed out again until the batch
+ * that freed it is durable, so a crash before then cannot bring back a
+ * file whose blocks hold someone else's data.
+ *
  * @param bnun The block number to deallocate.
  */
 void free_block(int bnum);
 
 /**
- * Use to free a specific block number.
+ * Note data blocks just mapped into a file, to be written back before the
+ * journal batch that maps them.
+ *
+ * Their extents are logged and committed with the metadata, but the blocks
+ * themselves are written through the shared mapping; without this a crash
+ * after the commit could leave a file pointing at whatever the blocks held
+ * before. Each batch first syncs the blocks noted since the one before it.
+ *
+ * @param bnum First block of the run.
+ * @param count Number of blocks in the run.
+ */
+void blocks_order_data(int bnum, int count);
+
+/**
+ * Mark a block allocated or free, for repairs by the consistency checker.
+ *
+ * The free counts and the summary follow, and the change is logged. The
+ * block's reference count is left alone.
+ *
+ * @param bnum The block number.
+ * @param allocated 1 to mark the block allocated, 0 to mark it free.
+ *
+ * @return 1 if the bitmap changed, 0 if it already said so.
+ */
+int blocks_set_allocated(int bnum, int allocated);
+
+/**
+ * Set the reference count of a block, for repairs by the checker.
+ *
+ * Does nothing on images without reference counts.
+ *
+ * @param bnum The block number.
+ * @param count The new count, 0 for a block with one untracked owner.
+ */
+void block_set_refs(int bnum, int count);
+
+/**
+ * Compare the free counts and the free space summary with the bitmaps.
+ *
+ * Each mismatch is logged. Must not run while blocks are being allocated
+ * or freed.
+ *
+ * @param repair Nonzero to rewrite the counts and the summary from the
+ *               bitmaps when they disagree.
+ *
+ * @return The number of groups, plus one for the totals, that disagreed.
+ */
+int blocks_check_summary(int repair);
+
+/**
+ * Account for inodes allocated or freed in the inode bitmap.
+ *
+ * @param delta Change in the number of free inodes.
+ */
+void blocks_adjust_free_inodes(int delta);
+
+/**
+ * Whether the image keeps block reference counts.
+ *
+ * Only images formatted with dedup do. Without them every block has one
+ * owner and the calls below do nothing.
+ *
+ * @return 1 if blocks can be shared, 0 if not.
+ */
+int blocks_dedup_enabled();
+
+/**
+ * Return the number of references counted for a block.
+ *
+ * A count of 0 means the block is not tracked: it has one owner, who may
+ * change it in place, and it cannot be shared.
+ *
+ * @param bnum The block number.
+ *
+ * @return The reference count.
+ */
+int block_refs(int bnum);
+
+/**
+ * Start counting references to a block with a single owner.
+ *
+ * Its count goes from 0 to 1, after which block_hold() can share it.
+ *
+ * @param bnum The block number.
+ */
+void block_track(int bnum);
+
+/**
+ * Take another reference to a tracked block.
+ *
+ * @param bnum The block number.
+ *
+ * @return 0 on success, -1 if the block is not tracked or its count is
+ *         at the maximum.
+ */
+int block_hold(int bnum);
+
+/**
+ * Make a block safe for its owner to change in place.
+ *
+ * A block with one reference stops being tracked, so nobody can start
+ * sharing it; a shared block is left alone and must be copied instead.
+ *
+ * @param bnum The block number.
+ *
+ * @return 1 if the caller is the only owner, 0 if the block is shared.
+ */
+int block_claim(int bnum);
+
+/**
+ * Make every change to the image durable.
+ *
+ * Syncs the whole image and checkpoints the journal; use journal_commit()
+ * when only the metadata logged so far needs to be durable.
  */
 void blocks_flush();
 
+/**
+ * Read the allocator counters.
+ *
+ * @param st Filled with the current counters.
+ */
+void blocks_get_stats(blocks_stats_t *st);
+
 /**
  * Use to get the root block.
  */
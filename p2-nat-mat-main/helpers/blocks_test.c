@@ -6,7 +6,8 @@
 #define TEST_NAME "block_test.img"
 
 int main(int argc, char **argv) {
-  blocks_init(TEST_NAME);
+  blocks_geometry_t geo = {4096, 1 << 20, 1 << 20, 256, 128};
+  blocks_init(TEST_NAME, &geo);
 
   printf("Block bitmap at the beginning:\n");
   bitmap_print(get_blocks_bitmap(), BLOCK_COUNT);
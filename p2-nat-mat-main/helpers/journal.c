@@ -0,0 +1,671 @@
+/**
+ * @file journal.c
+ *
+ * Implementation of the metadata redo journal.
+ *
+ * The journal region starts with a header block naming the current epoch,
+ * followed by records appended in batches. Each batch ends with a commit
+ * record holding a checksum of the batch, so a batch torn by a crash is
+ * recognized and ignored. Starting a new epoch empties the journal without
+ * having to erase it: records of older epochs no longer count.
+ *
+ * The image file only receives metadata from the journal, when a
+ * checkpoint or a replay applies the committed batches to it. A block can
+ * be freed and then rewritten as file data, which is never logged, before
+ * that happens, so changes logged for a block in or before the batch that
+ * freed it are revoked: applying them would clobber the new data.
+ */
+#define _GNU_SOURCE
+#include <assert.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "journal.h"
+#include "log.h"
+
+#define JOURNAL_MAGIC 0x4c4e524a        // "JRNL" in little-endian byte order
+#define JOURNAL_RECORD_MAGIC 0x4345524a // "JREC" in little-endian byte order
+
+// Commit once this many bytes of records have collected
+#define JOURNAL_BATCH_MAX (256 * 1024)
+
+// Record types
+#define JOURNAL_DATA 1       // payload is the new bytes at pos
+#define JOURNAL_ZERO 2       // payload is a uint64_t count of zeroed bytes
+#define JOURNAL_SET_BITS 3   // payload is a journal_bits_t, pos the bitmap
+#define JOURNAL_CLEAR_BITS 4 // payload is a journal_bits_t, pos the bitmap
+#define JOURNAL_COMMIT 5     // ends a batch; checksum covers the batch
+
+typedef struct journal_header {
+  uint32_t magic;   // JOURNAL_MAGIC
+  uint32_t _pad;
+  uint64_t epoch;   // only records of this epoch are live
+} journal_header_t;
+
+typedef struct journal_record {
+  uint32_t magic;    // JOURNAL_RECORD_MAGIC
+  uint32_t type;     // JOURNAL_DATA, ...
+  uint32_t len;      // payload bytes following the record, before padding
+  uint32_t checksum; // FNV-1a of the batch, for commit records
+  uint64_t epoch;    // epoch the record was written in
+  uint64_t pos;      // byte offset in the image the record applies to
+} journal_record_t;
+
+typedef struct journal_bits {
+  uint32_t first;
+  uint32_t count;
+} journal_bits_t;
+
+static int journal_fd = -1;          // the image
+static int journal_sync_fd = -1;     // the image again, opened O_DSYNC
+static int64_t journal_base = 0;     // byte offset of the header block
+static int64_t journal_start = 0;    // byte offset of the first record
+static int64_t journal_capacity = 0; // bytes for records; 0 if no journal
+static size_t journal_batch_limit = 0;
+static int64_t journal_block_size = 0;
+static int64_t journal_data_start = 0; // byte offset of the first data block
+static int64_t journal_bbitmap = 0;    // byte offset of the block bitmap
+
+// Owned by the thread committing (journal_writing set)
+static int64_t journal_tail = 0;     // bytes of records written this epoch
+static uint64_t journal_epoch = 0;
+
+static pthread_mutex_t journal_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t journal_cond = PTHREAD_COND_INITIALIZER;
+static char *journal_buf = NULL;     // records of the batch being filled
+static size_t journal_used = 0;
+static size_t journal_last = 0;      // offset of the last record appended
+static size_t journal_size = 0;
+static int journal_active = 0;       // operations between begin and end
+static int journal_cutting = 0;      // a commit waits for them to finish
+static int journal_writing = 0;      // a commit is in progress
+static uint64_t journal_batch = 1;   // id of the batch being filled
+static uint64_t journal_durable = 0; // id of the last batch made durable
+static int journal_aborted = 0;      // a batch was too big to write
+
+static __thread int journal_depth = 0; // nesting of journal_begin()
+
+// Refreshed and logged at the end of every batch (see journal_set_summary)
+static void (*journal_refresh)(void) = NULL;
+static const void *journal_summary = NULL;
+static size_t journal_summary_len = 0;
+
+// Told about every batch made durable (see journal_set_durable)
+static void (*journal_durable_hook)(uint64_t batch) = NULL;
+
+// Called before every batch is written (see journal_set_ordered)
+static void (*journal_write_back)(void) = NULL;
+
+// A data block freed by a batch of the log being applied
+typedef struct journal_revoke {
+  uint32_t bnum;
+  uint32_t batch; // index of the last batch freeing it
+} journal_revoke_t;
+
+static size_t pad8(size_t n) { return (n + 7) & ~(size_t)7; }
+
+// 32-bit FNV-1a, as used for directory names.
+static uint32_t journal_checksum(const char *data, size_t len) {
+  uint32_t hash = 2166136261u;
+  for (size_t ii = 0; ii < len; ++ii) {
+    hash ^= (unsigned char)data[ii];
+    hash *= 16777619u;
+  }
+  return hash;
+}
+
+// Start a new epoch, emptying the journal. Only the committing thread, or
+// journal_open() before any other thread exists, may call this.
+static void journal_reset() {
+  journal_header_t head = {JOURNAL_MAGIC, 0, ++journal_epoch};
+  int rv = pwrite(journal_sync_fd, &head, sizeof(head), journal_base);
+  assert(rv == sizeof(head));
+  journal_tail = 0;
+}
+
+// Apply a set or clear record to the bitmap at pos.
+static void journal_apply_bits(int64_t pos, const journal_bits_t *bits,
+                               int value) {
+  if (bits->count == 0) {
+    return;
+  }
+  int64_t lo = bits->first / 8;
+  int64_t hi = ((int64_t)bits->first + bits->count - 1) / 8;
+  size_t len = hi - lo + 1;
+  unsigned char *bytes = malloc(len);
+  assert(bytes);
+  int rv = pread(journal_fd, bytes, len, pos + lo);
+  assert(rv == (int)len);
+
+  for (uint32_t ii = bits->first; ii < bits->first + bits->count; ++ii) {
+    unsigned char mask = 1 << (ii % 8);
+    if (value) {
+      bytes[ii / 8 - lo] |= mask;
+    } else {
+      bytes[ii / 8 - lo] &= ~mask;
+    }
+  }
+
+  rv = pwrite(journal_fd, bytes, len, pos + lo);
+  assert(rv == (int)len);
+  free(bytes);
+}
+
+// Write zeros over part of the image.
+static void journal_apply_zero(int64_t pos, uint64_t len) {
+  static const char zeros[4096];
+  for (uint64_t done = 0; done < len;) {
+    size_t n = len - done < sizeof(zeros) ? len - done : sizeof(zeros);
+    int rv = pwrite(journal_fd, zeros, n, pos + done);
+    assert(rv == (int)n);
+    done += n;
+  }
+}
+
+static int journal_revoke_cmp(const void *a, const void *b) {
+  const journal_revoke_t *x = a, *y = b;
+  if (x->bnum != y->bnum) {
+    return x->bnum < y->bnum ? -1 : 1;
+  }
+  return x->batch < y->batch ? -1 : x->batch > y->batch;
+}
+
+// Whether block bnum is freed by batch index batch or a later one.
+static int journal_revoked(const journal_revoke_t *revokes, size_t n,
+                           uint32_t bnum, uint32_t batch) {
+  size_t lo = 0, hi = n;
+  while (lo < hi) {
+    size_t mid = lo + (hi - lo) / 2;
+    if (revokes[mid].bnum < bnum) {
+      lo = mid + 1;
+    } else {
+      hi = mid;
+    }
+  }
+  // Sorted by batch within a block, so the last entry is the latest free
+  size_t last = lo;
+  while (last < n && revokes[last].bnum == bnum) {
+    last++;
+  }
+  return last > lo && revokes[last - 1].batch >= batch;
+}
+
+// Apply one record of batch index batch to the image, skipping the parts
+// that fall in data blocks the log frees later.
+static void journal_apply(const journal_record_t *rec, const char *payload,
+                          uint32_t batch, const journal_revoke_t *revokes,
+                          size_t nrevokes) {
+  if (rec->type == JOURNAL_SET_BITS || rec->type == JOURNAL_CLEAR_BITS) {
+    journal_apply_bits(rec->pos, (const journal_bits_t *)payload,
+                       rec->type == JOURNAL_SET_BITS);
+    return;
+  }
+  if (rec->type != JOURNAL_DATA && rec->type != JOURNAL_ZERO) {
+    return;
+  }
+
+  int64_t len = rec->len;
+  if (rec->type == JOURNAL_ZERO) {
+    len = *(const uint64_t *)payload;
+  }
+  int64_t end = rec->pos + len;
+  int64_t at = rec->pos;
+  while (at < end) {
+    int64_t next = end;
+    if (at >= journal_data_start) {
+      next = (at / journal_block_size + 1) * journal_block_size;
+      if (next > end) {
+        next = end;
+      }
+      uint32_t bnum = at / journal_block_size;
+      if (journal_revoked(revokes, nrevokes, bnum, batch)) {
+        at = next;
+        continue;
+      }
+    } else if (next > journal_data_start) {
+      next = journal_data_start;
+    }
+
+    if (rec->type == JOURNAL_DATA) {
+      int rv = pwrite(journal_fd, payload + (at - rec->pos), next - at, at);
+      assert(rv == next - at);
+    } else {
+      journal_apply_zero(at, next - at);
+    }
+    at = next;
+  }
+}
+
+// Apply the complete batches of the current epoch found in a copy of the
+// log. Returns the number of records applied.
+static int journal_apply_log(const char *log, size_t got) {
+  // Find the batches, and the data blocks each of them frees
+  size_t nbatches = 0;
+  size_t *ends = NULL; // where each batch's commit record starts
+  journal_revoke_t *revokes = NULL;
+  size_t nrevokes = 0, revokes_cap = 0;
+  size_t batch = 0;
+  size_t pos = 0;
+  while (pos + sizeof(journal_record_t) <= got) {
+    const journal_record_t *rec = (const journal_record_t *)(log + pos);
+    size_t size = sizeof(journal_record_t) + pad8(rec->len);
+    if (rec->magic != JOURNAL_RECORD_MAGIC || rec->epoch != journal_epoch ||
+        pos + size > got) {
+      break;
+    }
+
+    if (rec->type == JOURNAL_COMMIT) {
+      if (rec->checksum != journal_checksum(log + batch, pos - batch)) {
+        break; // torn batch: the rest was never committed
+      }
+      for (size_t at = batch; at < pos;) {
+        const journal_record_t *r = (const journal_record_t *)(log + at);
+        const journal_bits_t *bits = (const journal_bits_t *)(r + 1);
+        if (r->type == JOURNAL_CLEAR_BITS &&
+            (int64_t)r->pos == journal_bbitmap) {
+          for (uint32_t ii = 0; ii < bits->count; ++ii) {
+            if (nrevokes == revokes_cap) {
+              revokes_cap = revokes_cap ? revokes_cap * 2 : 256;
+              revokes = realloc(revokes, revokes_cap * sizeof(*revokes));
+              assert(revokes);
+            }
+            revokes[nrevokes++] =
+                (journal_revoke_t){bits->first + ii, (uint32_t)nbatches};
+          }
+        }
+        at += sizeof(journal_record_t) + pad8(r->len);
+      }
+      ends = realloc(ends, (nbatches + 1) * sizeof(*ends));
+      assert(ends);
+      ends[nbatches++] = pos;
+      batch = pos + size;
+    }
+    pos += size;
+  }
+  qsort(revokes, nrevokes, sizeof(*revokes), journal_revoke_cmp);
+
+  int applied = 0;
+  pos = 0;
+  for (size_t ii = 0; ii < nbatches; ++ii) {
+    while (pos < ends[ii]) {
+      const journal_record_t *rec = (const journal_record_t *)(log + pos);
+      journal_apply(rec, log + pos + sizeof(journal_record_t), ii, revokes,
+                    nrevokes);
+      pos += sizeof(journal_record_t) + pad8(rec->len);
+      applied++;
+    }
+    pos += sizeof(journal_record_t); // the commit record
+  }
+
+  free(ends);
+  free(revokes);
+  return applied;
+}
+
+// Apply the first len bytes of the journal to the image. Returns the
+// number of records applied.
+static int journal_replay(int64_t len) {
+  char *log = malloc(len > 0 ? len : 1);
+  assert(log);
+  ssize_t got = pread(journal_fd, log, len, journal_start);
+  if (got < 0) {
+    got = 0;
+  }
+  int applied = journal_apply_log(log, got);
+  free(log);
+  return applied;
+}
+
+// Replay the journal of an image that is not mapped yet.
+int journal_open(int fd, const char *path, const superblock_t *sb) {
+  journal_fd = fd;
+  journal_capacity = 0;
+  journal_aborted = 0;
+  if (sb->journal_blocks < 2) {
+    return 0; // formatted without a journal
+  }
+
+  journal_block_size = sb->block_size;
+  journal_data_start = (int64_t)sb->data_start * sb->block_size;
+  journal_bbitmap = (int64_t)sb->bbitmap_start * sb->block_size;
+  journal_base = (int64_t)sb->journal_start * sb->block_size;
+  journal_start = journal_base + sb->block_size;
+  journal_capacity = (int64_t)(sb->journal_blocks - 1) * sb->block_size;
+  journal_batch_limit = journal_capacity / 4;
+  if (journal_batch_limit > JOURNAL_BATCH_MAX) {
+    journal_batch_limit = JOURNAL_BATCH_MAX;
+  }
+
+  journal_sync_fd = open(path, O_WRONLY | O_DSYNC);
+  assert(journal_sync_fd != -1);
+
+  int replayed = 0;
+  journal_header_t head = {0};
+  int rv = pread(fd, &head, sizeof(head), journal_base);
+  if (rv == sizeof(head) && head.magic == JOURNAL_MAGIC) {
+    journal_epoch = head.epoch;
+    replayed = journal_replay(journal_capacity);
+    if (replayed > 0) {
+      fsync(fd);
+      log_info("+ journal_open() -> replayed %d records", replayed);
+    }
+  } else {
+    journal_epoch = 0;
+  }
+
+  journal_reset();
+  return replayed;
+}
+
+// Append a record to the batch being filled. The caller holds journal_lock.
+static void journal_append(uint32_t type, const void *addr, const void *payload,
+                           uint32_t len) {
+  // Bits that continue the last record's run just lengthen it, so a run of
+  // blocks freed one at a time costs one record
+  if ((type == JOURNAL_SET_BITS || type == JOURNAL_CLEAR_BITS) &&
+      journal_used > journal_last) {
+    journal_record_t *last = (journal_record_t *)(journal_buf + journal_last);
+    journal_bits_t *run = (journal_bits_t *)(last + 1);
+    const journal_bits_t *bits = payload;
+    if (last->type == type && last->pos == (uint64_t)blocks_image_pos(addr) &&
+        run->first + run->count == bits->first) {
+      run->count += bits->count;
+      return;
+    }
+  }
+
+  // Always leave room for the commit record that will end the batch
+  size_t need = journal_used + 2 * sizeof(journal_record_t) + pad8(len);
+  if (need > journal_size) {
+    size_t size = journal_size ? journal_size : 4096;
+    while (size < need) {
+      size *= 2;
+    }
+    journal_buf = realloc(journal_buf, size);
+    assert(journal_buf);
+    journal_size = size;
+  }
+
+  journal_record_t *rec = (journal_record_t *)(journal_buf + journal_used);
+  rec->magic = JOURNAL_RECORD_MAGIC;
+  rec->type = type;
+  rec->len = len;
+  rec->checksum = 0;
+  rec->epoch = 0; // stamped when the batch is written
+  rec->pos = blocks_image_pos(addr);
+
+  char *data = (char *)(rec + 1);
+  memcpy(data, payload, len);
+  memset(data + len, 0, pad8(len) - len);
+  journal_last = journal_used;
+  journal_used += sizeof(journal_record_t) + pad8(len);
+}
+
+// Log the current contents of part of the mapped image.
+void journal_log(const void *addr, size_t len) {
+  if (!journal_capacity || len == 0) {
+    return;
+  }
+  pthread_mutex_lock(&journal_lock);
+  journal_append(JOURNAL_DATA, addr, addr, len);
+  pthread_mutex_unlock(&journal_lock);
+}
+
+// Log that part of the mapped image was filled with zeros.
+void journal_log_zero(const void *addr, size_t len) {
+  if (!journal_capacity || len == 0) {
+    return;
+  }
+  uint64_t count = len;
+  pthread_mutex_lock(&journal_lock);
+  journal_append(JOURNAL_ZERO, addr, &count, sizeof(count));
+  pthread_mutex_unlock(&journal_lock);
+}
+
+// Log that a range of bits in a mapped bitmap was set or cleared.
+uint64_t journal_log_bits(void *bm, int first, int count, int value) {
+  if (!journal_capacity || count <= 0) {
+    return 0;
+  }
+  journal_bits_t bits = {first, count};
+  pthread_mutex_lock(&journal_lock);
+  journal_append(value ? JOURNAL_SET_BITS : JOURNAL_CLEAR_BITS, bm, &bits,
+                 sizeof(bits));
+  uint64_t batch = journal_batch;
+  pthread_mutex_unlock(&journal_lock);
+  return batch;
+}
+
+static void journal_flush(int checkpoint);
+
+// Start an operation whose changes must be committed together.
+void journal_begin() {
+  if (journal_depth++ > 0 || !journal_capacity) {
+    return;
+  }
+  pthread_mutex_lock(&journal_lock);
+  // Hold new operations back while a batch is cut, and once the one being
+  // filled is full, so it grows past its limit only by what the operations
+  // already in progress log
+  while (journal_cutting || journal_used >= journal_batch_limit) {
+    if (!journal_cutting && !journal_writing) {
+      journal_flush(0);
+    } else {
+      pthread_cond_wait(&journal_cond, &journal_lock);
+    }
+  }
+  journal_active++;
+  pthread_mutex_unlock(&journal_lock);
+}
+
+// Finish an operation, committing if enough of the log has collected.
+void journal_end() {
+  assert(journal_depth > 0);
+  if (--journal_depth > 0 || !journal_capacity) {
+    return;
+  }
+  pthread_mutex_lock(&journal_lock);
+  if (--journal_active == 0 && journal_cutting) {
+    pthread_cond_broadcast(&journal_cond);
+  }
+  int full = journal_used >= journal_batch_limit;
+  pthread_mutex_unlock(&journal_lock);
+
+  if (full) {
+    journal_commit();
+  }
+}
+
+// Whether the batch being filled is full enough to be committed.
+int journal_batch_full() {
+  if (!journal_capacity) {
+    return 0;
+  }
+  pthread_mutex_lock(&journal_lock);
+  int full = journal_used >= journal_batch_limit;
+  pthread_mutex_unlock(&journal_lock);
+  return full;
+}
+
+// Sync an image that has no journal, refreshing the summary first.
+static void journal_sync_image() {
+  pthread_mutex_lock(&journal_lock);
+  if (journal_refresh) {
+    journal_refresh();
+  }
+  void (*write_back)(void) = journal_write_back;
+  pthread_mutex_unlock(&journal_lock);
+  if (write_back) {
+    write_back();
+  }
+  fsync(journal_fd);
+}
+
+// Stamp a batch of used bytes with the current epoch and end it with its
+// commit record, for which journal_append() left room.
+static void journal_seal(char *buf, size_t used) {
+  for (size_t at = 0; at < used;) {
+    journal_record_t *rec = (journal_record_t *)(buf + at);
+    rec->epoch = journal_epoch;
+    at += sizeof(journal_record_t) + pad8(rec->len);
+  }
+  journal_record_t *commit = (journal_record_t *)(buf + used);
+  memset(commit, 0, sizeof(*commit));
+  commit->magic = JOURNAL_RECORD_MAGIC;
+  commit->type = JOURNAL_COMMIT;
+  commit->checksum = journal_checksum(buf, used);
+  commit->epoch = journal_epoch;
+}
+
+// Apply the batches written so far to the image, sync the whole image and
+// empty the journal. Only the committing thread may call this.
+static void journal_apply_file() {
+  if (journal_tail > 0) {
+    journal_replay(journal_tail);
+  }
+  fsync(journal_fd);
+  journal_reset();
+}
+
+// Cut the batch being filled and write it out; with checkpoint set, the
+// journal is then applied to the image and emptied. Called with
+// journal_lock held and no commit running; returns with it held.
+static void journal_flush(int checkpoint) {
+  journal_writing = 1;
+
+  // Wait for operations in progress, so the batch holds only whole ones
+  journal_cutting = 1;
+  while (journal_active > 0) {
+    pthread_cond_wait(&journal_cond, &journal_lock);
+  }
+  if (journal_refresh && (checkpoint || journal_used > 0)) {
+    journal_refresh();
+    journal_append(JOURNAL_DATA, journal_summary, journal_summary,
+                   journal_summary_len);
+  }
+  char *buf = journal_buf;
+  size_t used = journal_used;
+  uint64_t id = journal_batch++;
+  journal_buf = NULL;
+  journal_used = journal_size = journal_last = 0;
+  journal_cutting = 0;
+  void (*write_back)(void) = journal_write_back;
+  pthread_cond_broadcast(&journal_cond);
+  pthread_mutex_unlock(&journal_lock);
+
+  // Data the batch maps goes first, so it is never durable without it
+  if (write_back && (used > 0 || checkpoint)) {
+    write_back();
+  }
+  if (used > 0) {
+    size_t size = used + sizeof(journal_record_t);
+    if (journal_tail + (int64_t)size > journal_capacity) {
+      journal_apply_file(); // no room left in the journal; empty it first
+    }
+    journal_seal(buf, used);
+    if ((int64_t)size > journal_capacity || journal_aborted) {
+      // One operation logged more than the whole journal holds. Writing it
+      // in place could tear it, so the journal stops committing instead and
+      // the image keeps the last batch that fit
+      if (!journal_aborted) {
+        log_error("journal: batch of %zu bytes does not fit, journal aborted;"
+                  " nothing more will be written", size);
+      }
+      journal_aborted = 1;
+    } else {
+      // One synchronous write; O_DSYNC syncs just this range of the image
+      int rv = pwrite(journal_sync_fd, buf, size, journal_start + journal_tail);
+      assert(rv == (int)size);
+      journal_tail += size;
+    }
+  }
+  if (checkpoint) {
+    journal_apply_file();
+  }
+  free(buf);
+  if (journal_durable_hook && !journal_aborted) {
+    journal_durable_hook(id); // frees of a dropped batch must stay pending
+  }
+
+  pthread_mutex_lock(&journal_lock);
+  journal_durable = id;
+  journal_writing = 0;
+  pthread_cond_broadcast(&journal_cond);
+}
+
+// Register a function told about every batch made durable.
+void journal_set_durable(void (*durable)(uint64_t batch)) {
+  pthread_mutex_lock(&journal_lock);
+  journal_durable_hook = durable;
+  pthread_mutex_unlock(&journal_lock);
+}
+
+// Register a function called before every batch is written.
+void journal_set_ordered(void (*write_back)(void)) {
+  pthread_mutex_lock(&journal_lock);
+  journal_write_back = write_back;
+  pthread_mutex_unlock(&journal_lock);
+}
+
+// Register a part of the image to refresh and log whenever a batch is cut.
+void journal_set_summary(void (*refresh)(void), const void *addr, size_t len) {
+  pthread_mutex_lock(&journal_lock);
+  journal_refresh = refresh;
+  journal_summary = addr;
+  journal_summary_len = len;
+  pthread_mutex_unlock(&journal_lock);
+}
+
+// Make everything logged so far durable.
+void journal_commit() {
+  assert(journal_depth == 0);
+  if (!journal_capacity) {
+    journal_sync_image();
+    return;
+  }
+
+  pthread_mutex_lock(&journal_lock);
+  uint64_t target = journal_used ? journal_batch : journal_batch - 1;
+  while (journal_durable < target) {
+    if (journal_writing) {
+      pthread_cond_wait(&journal_cond, &journal_lock);
+    } else {
+      journal_flush(0);
+    }
+  }
+  pthread_mutex_unlock(&journal_lock);
+}
+
+// Apply the journal to the image, sync it and empty the journal.
+void journal_checkpoint() {
+  assert(journal_depth == 0);
+  if (!journal_capacity) {
+    journal_sync_image();
+    return;
+  }
+
+  pthread_mutex_lock(&journal_lock);
+  while (journal_writing) {
+    pthread_cond_wait(&journal_cond, &journal_lock);
+  }
+  journal_flush(1);
+  pthread_mutex_unlock(&journal_lock);
+}
+
+// Checkpoint and close the journal.
+void journal_close() {
+  journal_checkpoint();
+  if (journal_sync_fd != -1) {
+    close(journal_sync_fd);
+    journal_sync_fd = -1;
+  }
+  journal_capacity = 0;
+  journal_set_summary(NULL, NULL, 0);
+  journal_set_durable(NULL);
+  journal_set_ordered(NULL);
+}
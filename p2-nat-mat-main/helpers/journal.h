@@ -0,0 +1,174 @@
+/**
+ * @file journal.h
+ *
+ * A redo journal for the metadata in the disk image.
+ *
+ * Metadata (bitmaps, inodes, directory entries, extent maps) is changed in
+ * a private view of the image (see blocks_get_meta_block()), and each
+ * change is also logged here. Log records collect in memory and are
+ * written to the journal region of the image in batches, one synchronous
+ * write per batch, so many operations share the cost of making themselves
+ * durable. Nothing else writes metadata to the image file, so it only ever
+ * holds committed changes; at mount, every complete batch is replayed over
+ * it before it is mapped.
+ *
+ * Operations bracket their changes with journal_begin() and journal_end();
+ * a batch is only cut when no operation is half done, so each one is
+ * either wholly in a batch or not at all. Calls nest, and are safe from
+ * several threads at once.
+ *
+ * When the journal fills up it is checkpointed: the committed batches are
+ * applied to the image file and the whole image is synced, after which the
+ * log is no longer needed and starts over.
+ *
+ * A batch is never written to the image unlogged. Should one operation log
+ * more than the whole journal holds, the journal is aborted instead: it
+ * stops committing, and the image keeps the last batch that fit.
+ *
+ * Images formatted without a journal region still work; logging is then a
+ * no-op and a commit syncs the whole image.
+ */
+#ifndef JOURNAL_H
+#define JOURNAL_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "blocks.h"
+
+/**
+ * Replay the journal of an image that is not mapped yet.
+ *
+ * Every complete batch is written over the image and made durable, and the
+ * journal is emptied. Called by blocks_init() before it trusts the
+ * superblock, which the journal may have changed.
+ *
+ * @param fd File descriptor of the image.
+ * @param path Path of the image, reopened for synchronous journal writes.
+ * @param sb The superblock as read from disk.
+ *
+ * @return The number of records replayed.
+ */
+int journal_open(int fd, const char *path, const superblock_t *sb);
+
+/**
+ * Start an operation whose changes must be committed together.
+ *
+ * Call before taking any lock the operation needs. May wait for a commit
+ * that is cutting a batch, or commit the batch being filled itself if it
+ * is full, so no batch grows much past the size it is cut at.
+ */
+void journal_begin();
+
+/**
+ * Finish an operation started with journal_begin().
+ *
+ * Commits the log if enough of it has collected.
+ */
+void journal_end();
+
+/**
+ * Tell whether the batch being filled is full enough to be committed.
+ *
+ * An operation that may log more than a batch holds checks this at points
+ * where its changes so far stand on their own; if it is, it releases its
+ * locks, ends itself and begins again, so it is committed in several
+ * batches rather than outgrowing the journal.
+ *
+ * @return 1 if the batch is full, 0 if not or with no journal.
+ */
+int journal_batch_full();
+
+/**
+ * Log the current contents of part of the mapped image.
+ *
+ * @param addr Start of the changed bytes, inside the mapping.
+ * @param len Number of changed bytes.
+ */
+void journal_log(const void *addr, size_t len);
+
+/**
+ * Log that part of the mapped image was filled with zeros.
+ *
+ * @param addr Start of the zeroed bytes, inside the mapping.
+ * @param len Number of zeroed bytes.
+ */
+void journal_log_zero(const void *addr, size_t len);
+
+/**
+ * Log that a range of bits in a mapped bitmap was set or cleared.
+ *
+ * Bits are logged one range at a time rather than by the bytes holding
+ * them, so bits claimed by other threads in the same word are not swept
+ * into the record.
+ *
+ * @param bm Start of the bitmap, inside the mapping.
+ * @param first First bit changed.
+ * @param count Number of bits changed.
+ * @param value Whether the bits were set (1) or cleared (0).
+ *
+ * @return The id of the batch the record went into, or 0 with no journal.
+ */
+uint64_t journal_log_bits(void *bm, int first, int count, int value);
+
+/**
+ * Register a function to call whenever a batch has been made durable.
+ *
+ * durable() is called by the committing thread, outside the journal's
+ * lock, with the id of the batch, so it can finish work that had to wait
+ * for it; every batch with a smaller id is durable too. It must not call
+ * into the journal.
+ *
+ * @param durable The function, or NULL to stop.
+ */
+void journal_set_durable(void (*durable)(uint64_t batch));
+
+/**
+ * Register a function to call before each batch is written.
+ *
+ * write_back() is called by the committing thread, outside the journal's
+ * lock, once the batch is cut and before it is written, so the data its
+ * records point at can be made durable first. It is also called before a
+ * checkpoint or, without a journal, before the image is synced. It must
+ * not call into the journal.
+ *
+ * @param write_back The function, or NULL to stop.
+ */
+void journal_set_ordered(void (*write_back)(void));
+
+/**
+ * Register a part of the image to refresh and log whenever a batch is cut.
+ *
+ * refresh() is called with no operation half done, so what it stores is
+ * consistent with every record in the batch, and the range is then logged
+ * as the batch's last record. Counters kept in memory between batches are
+ * made transactional this way. It is also called before a checkpoint syncs
+ * the image. refresh() must not call into the journal.
+ *
+ * @param refresh Fills in the range, or NULL to stop.
+ * @param addr Start of the range, inside the mapping.
+ * @param len Number of bytes in the range.
+ */
+void journal_set_summary(void (*refresh)(void), const void *addr, size_t len);
+
+/**
+ * Make everything logged so far durable.
+ *
+ * Writes the batch in progress, or waits for the commit already writing
+ * it, so concurrent callers share one write. Must not be called between
+ * journal_begin() and journal_end().
+ */
+void journal_commit();
+
+/**
+ * Apply the journal to the image, sync the whole image and empty the
+ * journal.
+ */
+void journal_checkpoint();
+
+/**
+ * Checkpoint and close the journal.
+ */
+void journal_close();
+
+#endif
@@ -0,0 +1,113 @@
+#include <assert.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "blocks.h"
+#include "journal.h"
+
+#define TEST_NAME "journal_test.img"
+
+int main(int argc, char **argv) {
+  blocks_geometry_t geo = {4096, 1 << 20, 1 << 20, 256, 128, 0};
+  blocks_init(TEST_NAME, &geo);
+
+  superblock_t *sb = blocks_get_superblock();
+  printf("Journal: %d blocks at block %d\n", sb->journal_blocks,
+         sb->journal_start);
+
+  journal_begin();
+  int block_num = alloc_block();
+  char *block = blocks_get_meta_block(block_num);
+  strcpy(block, "logged");
+  journal_log(block, strlen(block) + 1);
+  journal_end();
+
+  printf("Committing block %d\n", block_num);
+  journal_commit();
+
+  // Reopening replays the commit, then empties the journal
+  blocks_free();
+  blocks_init(TEST_NAME, &geo);
+  printf("Block %d after reopening: %s\n", block_num,
+         (char *)blocks_get_meta_block(block_num));
+
+  // Free the block and reuse it for data, which is never logged; the
+  // checkpoint must not put the logged metadata back over it
+  journal_begin();
+  block = blocks_get_meta_block(block_num);
+  strcpy(block, "stale");
+  journal_log(block, strlen(block) + 1);
+  journal_end();
+  free_block(block_num);
+  journal_commit();
+
+  int got = 0;
+  int reused = alloc_block_run(block_num, 1, &got);
+  strcpy(blocks_get_block(reused), "data");
+  printf("Block %d reused for data\n", reused);
+
+  blocks_free();
+  blocks_init(TEST_NAME, &geo);
+  printf("Block %d after reopening: %s\n", reused,
+         (char *)blocks_get_block(reused));
+  assert(strcmp(blocks_get_block(reused), "data") == 0);
+  blocks_free();
+
+  // Commit one change and leave another uncommitted, then stop without a
+  // checkpoint, as a crash would
+  int committed = block_num + 1, pending = block_num + 2;
+  if (fork() == 0) {
+    blocks_init(TEST_NAME, &geo);
+    journal_begin();
+    strcpy(blocks_get_meta_block(committed), "committed");
+    journal_log(blocks_get_meta_block(committed), 10);
+    journal_end();
+    journal_commit();
+    journal_begin();
+    strcpy(blocks_get_meta_block(pending), "pending");
+    journal_log(blocks_get_meta_block(pending), 8);
+    journal_end();
+    _exit(0);
+  }
+  wait(NULL);
+
+  // The commit is only in the journal region so far
+  char disk[16] = {0};
+  FILE *image = fopen(TEST_NAME, "r");
+  fseek(image, (long)committed * geo.block_size, SEEK_SET);
+  fread(disk, 1, sizeof(disk) - 1, image);
+  fclose(image);
+  printf("Block %d in the image before replay: \"%s\"\n", committed, disk);
+  assert(strcmp(disk, "committed") != 0);
+
+  blocks_init(TEST_NAME, &geo);
+  printf("Block %d after replay: %s\n", committed,
+         (char *)blocks_get_meta_block(committed));
+  printf("Block %d after replay: \"%s\"\n", pending,
+         (char *)blocks_get_meta_block(pending));
+  assert(strcmp(blocks_get_meta_block(committed), "committed") == 0);
+  assert(strcmp(blocks_get_meta_block(pending), "pending") != 0);
+
+  // One operation logging more than the journal holds aborts it, rather
+  // than reaching the image unlogged
+  int64_t room = (int64_t)(blocks_get_superblock()->journal_blocks - 1) *
+                 geo.block_size;
+  journal_begin();
+  strcpy(blocks_get_meta_block(pending), "too big");
+  for (int64_t ii = 0; ii <= room / geo.block_size; ++ii) {
+    journal_log(blocks_get_meta_block(pending), geo.block_size);
+  }
+  journal_end();
+  journal_commit();
+  blocks_free();
+
+  blocks_init(TEST_NAME, &geo);
+  printf("Block %d after an aborted batch: \"%s\"\n", pending,
+         (char *)blocks_get_meta_block(pending));
+  assert(strcmp(blocks_get_meta_block(pending), "too big") != 0);
+  blocks_free();
+
+  return 0;
+}
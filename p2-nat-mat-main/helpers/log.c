@@ -0,0 +1,162 @@
+/**
+ * @file log.c
+ *
+ * Implementation of leveled logging.
+ *
+ * The ring is a bounded multi-producer queue: each slot carries a sequence
+ * number saying whether it is free for the writer at a given position or
+ * holds a message for the reader. Writers claim positions with a
+ * compare-and-swap and never wait; the single reader polls.
+ */
+#define _GNU_SOURCE
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "log.h"
+
+#define LOG_SLOTS 1024   // a power of two
+#define LOG_MESSAGE 240  // longest message kept, with its newline
+
+// How long the reader sleeps when the ring is empty
+#define LOG_POLL_NS (10 * 1000 * 1000)
+
+typedef struct log_slot {
+  uint64_t seq;        // position + 1 once written, position + LOG_SLOTS once read
+  int len;
+  char text[LOG_MESSAGE];
+} log_slot_t;
+
+int log_level = LOG_INFO;
+
+static log_slot_t ring[LOG_SLOTS];
+static uint64_t ring_tail = 0;    // next position to write
+static uint64_t ring_head = 0;    // next position to read (reader only)
+static uint64_t ring_dropped = 0; // messages lost to a full ring
+static int ring_running = 0;
+static pthread_t ring_thread;
+
+static const char *level_names[] = {"", "error", "warn", "info", "debug"};
+
+// Claim the next free slot, or return NULL if the ring is full.
+static log_slot_t *ring_claim() {
+  uint64_t pos = __atomic_load_n(&ring_tail, __ATOMIC_RELAXED);
+  for (;;) {
+    log_slot_t *slot = &ring[pos & (LOG_SLOTS - 1)];
+    uint64_t seq = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+    int64_t diff = (int64_t)(seq - pos);
+    if (diff == 0) {
+      if (__atomic_compare_exchange_n(&ring_tail, &pos, pos + 1, 1,
+                                      __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+        return slot;
+      }
+    } else if (diff < 0) {
+      return NULL; // the reader has not caught up
+    } else {
+      pos = __atomic_load_n(&ring_tail, __ATOMIC_RELAXED);
+    }
+  }
+}
+
+// Write out every message in the ring. Only the reader calls this.
+static void ring_drain() {
+  char batch[16 * LOG_MESSAGE];
+  size_t used = 0;
+  for (;;) {
+    log_slot_t *slot = &ring[ring_head & (LOG_SLOTS - 1)];
+    uint64_t seq = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+    if (seq != ring_head + 1) {
+      break;
+    }
+    if (used + slot->len > sizeof(batch)) {
+      write(STDERR_FILENO, batch, used);
+      used = 0;
+    }
+    memcpy(batch + used, slot->text, slot->len);
+    used += slot->len;
+    __atomic_store_n(&slot->seq, ring_head + LOG_SLOTS, __ATOMIC_RELEASE);
+    ring_head++;
+  }
+  if (used > 0) {
+    write(STDERR_FILENO, batch, used);
+  }
+
+  uint64_t dropped = __atomic_exchange_n(&ring_dropped, 0, __ATOMIC_RELAXED);
+  if (dropped > 0) {
+    dprintf(STDERR_FILENO, "[warn] log ring full, %lu messages dropped\n",
+            (unsigned long)dropped);
+  }
+}
+
+static void *ring_reader(void *arg) {
+  struct timespec poll = {0, LOG_POLL_NS};
+  while (__atomic_load_n(&ring_running, __ATOMIC_ACQUIRE)) {
+    ring_drain();
+    nanosleep(&poll, NULL);
+  }
+  ring_drain();
+  return NULL;
+}
+
+// Format one message into buf, returning its length with the newline.
+static int log_format(char *buf, size_t size, int level, const char *fmt,
+                      va_list ap) {
+  int len = snprintf(buf, size, "[%s] ", level_names[level]);
+  int n = vsnprintf(buf + len, size - len, fmt, ap);
+  len = (n < 0) ? len : len + n;
+  if (len > (int)size - 2) {
+    len = size - 2; // truncated
+  }
+  buf[len++] = '\n';
+  buf[len] = '\0';
+  return len;
+}
+
+// Format and emit one message.
+void log_write(int level, const char *fmt, ...) {
+  va_list ap;
+  va_start(ap, fmt);
+  if (level >= LOG_INFO && __atomic_load_n(&ring_running, __ATOMIC_ACQUIRE)) {
+    log_slot_t *slot = ring_claim();
+    if (slot) {
+      slot->len = log_format(slot->text, sizeof(slot->text), level, fmt, ap);
+      uint64_t pos = slot->seq;
+      __atomic_store_n(&slot->seq, pos + 1, __ATOMIC_RELEASE);
+    } else {
+      __atomic_fetch_add(&ring_dropped, 1, __ATOMIC_RELAXED);
+    }
+  } else {
+    char buf[LOG_MESSAGE];
+    int len = log_format(buf, sizeof(buf), level, fmt, ap);
+    write(STDERR_FILENO, buf, len);
+  }
+  va_end(ap);
+}
+
+// Start the thread that drains the ring buffer.
+void log_start() {
+  if (ring_running) {
+    return;
+  }
+  for (uint64_t ii = 0; ii < LOG_SLOTS; ++ii) {
+    ring[ii].seq = ring_tail + ii; // every slot starts out free
+  }
+  ring_head = ring_tail;
+  __atomic_store_n(&ring_running, 1, __ATOMIC_RELEASE);
+  if (pthread_create(&ring_thread, NULL, ring_reader, NULL) != 0) {
+    ring_running = 0;
+  }
+}
+
+// Drain the ring buffer and stop the thread.
+void log_stop() {
+  if (!ring_running) {
+    return;
+  }
+  __atomic_store_n(&ring_running, 0, __ATOMIC_RELEASE);
+  pthread_join(ring_thread, NULL);
+}
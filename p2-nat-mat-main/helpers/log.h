@@ -0,0 +1,83 @@
+/**
+ * @file log.h
+ *
+ * Leveled logging.
+ *
+ * Messages above NUFS_LOG_LEVEL are compiled out completely, arguments
+ * and all; build with -DNUFS_LOG_LEVEL=0 for none at all. The rest are
+ * filtered at run time by log_level.
+ *
+ * Errors and warnings are written to stderr straight away. Info and debug
+ * messages go through a ring buffer drained by a background thread once
+ * log_start() has been called, so a caller never waits on stderr; when
+ * the ring is full they are dropped and counted instead.
+ */
+#ifndef LOG_H
+#define LOG_H
+
+#define LOG_ERROR 1
+#define LOG_WARN 2
+#define LOG_INFO 3
+#define LOG_DEBUG 4
+
+#ifndef NUFS_LOG_LEVEL
+#define NUFS_LOG_LEVEL LOG_DEBUG
+#endif
+
+// Highest level logged at run time (default LOG_INFO)
+extern int log_level;
+
+/**
+ * Format and emit one message; use the macros below instead.
+ *
+ * @param level LOG_ERROR to LOG_DEBUG.
+ * @param fmt printf-style format, without a trailing newline.
+ */
+void log_write(int level, const char *fmt, ...)
+    __attribute__((format(printf, 2, 3)));
+
+/**
+ * Start the thread that drains the ring buffer.
+ *
+ * Until then every message is written synchronously. Call after the
+ * process has daemonized, since threads do not survive fork().
+ */
+void log_start();
+
+/**
+ * Drain the ring buffer and stop the thread.
+ */
+void log_stop();
+
+#define log_at(level, ...)                                                     \
+  do {                                                                         \
+    if ((level) <= log_level) {                                                \
+      log_write(level, __VA_ARGS__);                                           \
+    }                                                                          \
+  } while (0)
+
+#if NUFS_LOG_LEVEL >= LOG_ERROR
+#define log_error(...) log_at(LOG_ERROR, __VA_ARGS__)
+#else
+#define log_error(...) ((void)0)
+#endif
+
+#if NUFS_LOG_LEVEL >= LOG_WARN
+#define log_warn(...) log_at(LOG_WARN, __VA_ARGS__)
+#else
+#define log_warn(...) ((void)0)
+#endif
+
+#if NUFS_LOG_LEVEL >= LOG_INFO
+#define log_info(...) log_at(LOG_INFO, __VA_ARGS__)
+#else
+#define log_info(...) ((void)0)
+#endif
+
+#if NUFS_LOG_LEVEL >= LOG_DEBUG
+#define log_debug(...) log_at(LOG_DEBUG, __VA_ARGS__)
+#else
+#define log_debug(...) ((void)0)
+#endif
+
+#endif
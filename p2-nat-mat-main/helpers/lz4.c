@@ -0,0 +1,188 @@
+/**
+ * @file lz4.c
+ *
+ * Implementation of the LZ4 block format.
+ *
+ * A block is a series of sequences. Each starts with a token byte whose
+ * high nibble is the number of literals and low nibble the match length
+ * less 4, with 15 meaning more length bytes follow (each 255 adds 255 and
+ * goes on). Then come the literals, a 2-byte little-endian distance back
+ * to the match, and the match's extra length bytes. The last sequence is
+ * literals only. The format requires the last 5 bytes to be literals and
+ * no match to start in the last 12.
+ */
+#include <stdint.h>
+#include <string.h>
+
+#include "lz4.h"
+
+#define LZ4_HASH_BITS 12
+#define LZ4_MIN_MATCH 4
+#define LZ4_LAST_LITERALS 5
+#define LZ4_MATCH_LIMIT 12  // no match may start this close to the end
+#define LZ4_MAX_DISTANCE 65535
+
+// Misses before the search stride grows by one byte
+#define LZ4_SKIP_SHIFT 6
+
+static uint32_t read32(const char *p) {
+  uint32_t v;
+  memcpy(&v, p, sizeof(v));
+  return v;
+}
+
+static uint32_t lz4_hash(uint32_t seq) {
+  return (seq * 2654435761u) >> (32 - LZ4_HASH_BITS);
+}
+
+// Room needed to encode a length of n past the nibble.
+static int length_bytes(int n) {
+  return n < 15 ? 0 : (n - 15) / 255 + 1;
+}
+
+// Append the bytes continuing a length of n past the nibble.
+static char *put_length(char *op, int n) {
+  if (n < 15) {
+    return op;
+  }
+  for (n -= 15; n >= 255; n -= 255) {
+    *op++ = (char)255;
+  }
+  *op++ = (char)n;
+  return op;
+}
+
+// Append one sequence, or return NULL if it does not fit before oend.
+static char *put_sequence(char *op, char *oend, const char *lit, int nlit,
+                          int distance, int mlen) {
+  int mcode = mlen - LZ4_MIN_MATCH;
+  long need = 1 + length_bytes(nlit) + nlit;
+  if (mlen > 0) {
+    need += 2 + length_bytes(mcode);
+  }
+  if (need > oend - op) {
+    return NULL;
+  }
+
+  int token = (nlit < 15 ? nlit : 15) << 4;
+  if (mlen > 0) {
+    token |= mcode < 15 ? mcode : 15;
+  }
+  *op++ = (char)token;
+  op = put_length(op, nlit);
+  memcpy(op, lit, nlit);
+  op += nlit;
+  if (mlen > 0) {
+    *op++ = (char)(distance & 0xff);
+    *op++ = (char)(distance >> 8);
+    op = put_length(op, mcode);
+  }
+  return op;
+}
+
+int lz4_compress(const char *src, int len, char *dst, int cap) {
+  int table[1 << LZ4_HASH_BITS];
+  memset(table, 0, sizeof(table));
+
+  char *op = dst;
+  char *oend = dst + cap;
+  int anchor = 0;
+  int ip = 1; // position 0 is what empty table slots point at
+  int limit = len - LZ4_MATCH_LIMIT;
+
+  while (ip < limit) {
+    uint32_t seq = read32(src + ip);
+    uint32_t h = lz4_hash(seq);
+    int ref = table[h];
+    table[h] = ip;
+    if (ip - ref > LZ4_MAX_DISTANCE || read32(src + ref) != seq) {
+      ip += 1 + ((ip - anchor) >> LZ4_SKIP_SHIFT);
+      continue;
+    }
+
+    // Go back over literals that match too, then extend forwards
+    while (ip > anchor && ref > 0 && src[ip - 1] == src[ref - 1]) {
+      ip--;
+      ref--;
+    }
+    int mlen = LZ4_MIN_MATCH;
+    int mmax = len - LZ4_LAST_LITERALS - ip;
+    while (mlen < mmax && src[ref + mlen] == src[ip + mlen]) {
+      mlen++;
+    }
+
+    op = put_sequence(op, oend, src + anchor, ip - anchor, ip - ref, mlen);
+    if (!op) {
+      return 0;
+    }
+    ip += mlen;
+    anchor = ip;
+  }
+
+  op = put_sequence(op, oend, src + anchor, len - anchor, 0, 0);
+  return op ? (int)(op - dst) : 0;
+}
+
+// Read the bytes continuing a length, or return -1 past the end of input.
+static long get_length(const unsigned char **ip, const unsigned char *iend,
+                       long n) {
+  if (n < 15) {
+    return n;
+  }
+  unsigned char b;
+  do {
+    if (*ip >= iend) {
+      return -1;
+    }
+    b = *(*ip)++;
+    n += b;
+  } while (b == 255);
+  return n;
+}
+
+int lz4_decompress(const char *src, int len, char *dst, int cap) {
+  const unsigned char *ip = (const unsigned char *)src;
+  const unsigned char *iend = ip + len;
+  char *op = dst;
+  char *oend = dst + cap;
+
+  while (ip < iend) {
+    int token = *ip++;
+    long nlit = get_length(&ip, iend, token >> 4);
+    if (nlit < 0 || nlit > iend - ip || nlit > oend - op) {
+      return -1;
+    }
+    memcpy(op, ip, nlit);
+    op += nlit;
+    ip += nlit;
+    if (ip == iend) {
+      break; // the last sequence has no match
+    }
+
+    if (iend - ip < 2) {
+      return -1;
+    }
+    long distance = ip[0] | (ip[1] << 8);
+    ip += 2;
+    long mlen = get_length(&ip, iend, token & 15);
+    if (distance == 0 || distance > op - dst || mlen < 0) {
+      return -1;
+    }
+    mlen += LZ4_MIN_MATCH;
+    if (mlen > oend - op) {
+      return -1;
+    }
+
+    const char *match = op - distance;
+    if (distance >= mlen) {
+      memcpy(op, match, mlen);
+      op += mlen;
+    } else {
+      // The match overlaps what it produces, repeating a short pattern
+      while (mlen-- > 0) {
+        *op++ = *match++;
+      }
+    }
+  }
+  return (int)(op - dst);
+}
@@ -0,0 +1,40 @@
+/**
+ * @file lz4.h
+ *
+ * Compression in the LZ4 block format.
+ *
+ * A small greedy compressor: each position is looked up in a table of
+ * recently seen 4-byte sequences, and runs of misses are skipped over at
+ * a growing stride, so incompressible data costs little. The output can
+ * be read by any LZ4 block decoder, and lz4_decompress reads any valid
+ * block.
+ */
+#ifndef LZ4_H
+#define LZ4_H
+
+/**
+ * Compress a buffer.
+ *
+ * @param src Bytes to compress.
+ * @param len Number of bytes.
+ * @param dst Buffer for the compressed block.
+ * @param cap Capacity of dst.
+ * @return Size of the compressed block, or 0 if it does not fit in cap.
+ */
+int lz4_compress(const char *src, int len, char *dst, int cap);
+
+/**
+ * Decompress a block.
+ *
+ * Never reads or writes outside the buffers, whatever src holds.
+ *
+ * @param src The compressed block.
+ * @param len Size of the compressed block.
+ * @param dst Buffer for the data.
+ * @param cap Capacity of dst.
+ * @return Number of bytes written to dst, or -1 if the block is corrupt or
+ *         its data does not fit in cap.
+ */
+int lz4_decompress(const char *src, int len, char *dst, int cap);
+
+#endif
@@ -0,0 +1,46 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "lz4.h"
+
+#define SIZE 65536
+
+static void round_trip(const char *name, const char *data, int len) {
+  static char packed[SIZE + SIZE / 255 + 16];
+  static char unpacked[SIZE];
+
+  int n = lz4_compress(data, len, packed, sizeof(packed));
+  int m = lz4_decompress(packed, n, unpacked, sizeof(unpacked));
+  printf("%s: %d bytes -> %d, back to %d, %s\n", name, len, n, m,
+         m == len && memcmp(data, unpacked, len) == 0 ? "same" : "DIFFERENT");
+}
+
+int main(int argc, char **argv) {
+  static char data[SIZE];
+
+  memset(data, 0, SIZE);
+  round_trip("Zeros", data, SIZE);
+
+  for (int i = 0; i < SIZE; i++) {
+    data[i] = "the quick brown fox "[i % 20] + (i / 4096);
+  }
+  round_trip("Text", data, SIZE);
+
+  srandom(1);
+  for (int i = 0; i < SIZE; i++) {
+    data[i] = random();
+  }
+  round_trip("Random", data, SIZE);
+  round_trip("Short", data, 7);
+
+  // Too small a buffer, and a truncated block
+  char small[512];
+  printf("Random into %d bytes: %d\n", (int)sizeof(small),
+         lz4_compress(data, SIZE, small, sizeof(small)));
+  memset(data, 'a', SIZE);
+  int n = lz4_compress(data, SIZE, small, sizeof(small));
+  printf("Truncated block: %d\n", lz4_decompress(small, n - 1, data, SIZE));
+
+  return 0;
+}
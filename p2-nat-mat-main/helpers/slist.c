@@ -7,12 +7,14 @@
  * This might be useful for directory listings and for manipulating paths.
  */
 
-#include <alloca.h>
 #include <stdlib.h>
 #include <string.h>
 
 #include "slist.h"
 
+// Bytes a list of names starts with
+#define SNAMES_MIN_SIZE 256
+
 slist_t *s_cons(const char *text, slist_t *rest) {
   slist_t *xs = malloc(sizeof(slist_t));
   xs->data = strdup(text);
@@ -22,20 +24,39 @@ slist_t *s_cons(const char *text, slist_t *rest) {
 }
 
 void s_free(slist_t *xs) {
-  if (xs == 0) {
-    return;
-  }
-
-  xs->refs -= 1;
+  // Iterative, so a long list cannot run out of stack
+  while (xs != 0) {
+    xs->refs -= 1;
+    if (xs->refs != 0) {
+      return;
+    }
 
-  if (xs->refs == 0) {
-    s_free(xs->next);
+    slist_t *next = xs->next;
     free(xs->data);
     free(xs);
+    xs = next;
   }
 }
 
 slist_t *s_explode(const char *text, char delim) {
+  slist_t *head = 0;
+  slist_t **tail = &head;
+
+  const char *part;
+  int plen;
+  while ((part = s_next_part(&text, delim, &plen)) != 0) {
+    slist_t *xs = malloc(sizeof(slist_t));
+    xs->data = strndup(part, plen);
+    xs->refs = 1;
+    xs->next = 0;
+    *tail = xs;
+    tail = &xs->next;
+  }
+  return head;
+}
+
+const char *s_next_part(const char **cursor, char delim, int *len) {
+  const char *text = *cursor;
   if (*text == 0) {
     return 0;
   }
@@ -45,15 +66,59 @@ slist_t *s_explode(const char *text, char delim) {
     plen += 1;
   }
 
-  int skip = 0;
-  if (text[plen] == delim) {
-    skip = 1;
+  *cursor = text[plen] == delim ? text + plen + 1 : text + plen;
+  *len = plen;
+  return text;
+}
+
+void sn_init(snames_t *names) {
+  memset(names, 0, sizeof(snames_t));
+}
+
+int sn_add(snames_t *names, const char *text) {
+  size_t len = strlen(text) + 1;
+  size_t need = (names->count + 1) * sizeof(uint32_t) + names->text + len;
+
+  if (need > names->size) {
+    size_t size = names->size ? names->size : SNAMES_MIN_SIZE;
+    while (size < need) {
+      size *= 2;
+    }
+    char *buf = realloc(names->buf, size);
+    if (!buf) {
+      return -1;
+    }
+    // Offsets count back from the end, so the names just move with it
+    if (names->text > 0) {
+      memmove(buf + size - names->text, buf + names->size - names->text,
+              names->text);
+    }
+    names->buf = buf;
+    names->size = size;
+  }
+
+  names->text += len;
+  memcpy(names->buf + names->size - names->text, text, len);
+  ((uint32_t *)names->buf)[names->count++] = names->text;
+  return 0;
+}
+
+const char *sn_get(const snames_t *names, int i) {
+  if (i < 0 || i >= names->count) {
+    return 0;
   }
+  return names->buf + names->size - ((uint32_t *)names->buf)[i];
+}
 
-  slist_t *rest = s_explode(text + plen + skip, delim);
-  char *part = alloca(plen + 2);
-  memcpy(part, text, plen);
-  part[plen] = 0;
+const char *sn_next(const snames_t *names, int *pos) {
+  const char *name = sn_get(names, *pos);
+  if (name) {
+    *pos += 1;
+  }
+  return name;
+}
 
-  return s_cons(part, rest);
+void sn_free(snames_t *names) {
+  free(names->buf);
+  sn_init(names);
 }
@@ -9,6 +9,9 @@
 #ifndef SLIST_H
 #define SLIST_H
 
+#include <stddef.h>
+#include <stdint.h>
+
 typedef struct slist {
   char *data;
   int refs;
@@ -44,4 +47,79 @@ void s_free(slist_t *xs);
  */
 slist_t *s_explode(const char *text, char delim);
 
+/**
+ * Find the next part of a string split on a delimiter, without copying.
+ *
+ * Parts are the ones s_explode would return, found one at a time in
+ * place, so splitting a path of any depth allocates nothing.
+ *
+ * @param cursor Where the rest of the string starts; moved past the part
+ *               and the delimiter after it.
+ * @param delim A single character to use as the delimiter.
+ * @param len Set to the length of the part, which may be 0.
+ *
+ * @return Start of the part, or NULL once the string is used up.
+ */
+const char *s_next_part(const char **cursor, char delim, int *len);
+
+/**
+ * A list of names packed into one buffer.
+ *
+ * The front of the buffer is an array of offsets and the names are packed
+ * down from its back; when the two meet it doubles. A list of any length
+ * costs a few allocations to build and one free to release, and is read
+ * by index, so a listing can resume from a saved position.
+ */
+typedef struct snames {
+  char *buf;   // offsets at the front, names at the back
+  size_t size; // bytes in buf
+  size_t text; // bytes of names, at the end of buf
+  int count;   // names held
+} snames_t;
+
+/**
+ * Start an empty list of names.
+ *
+ * @param names List to initialize.
+ */
+void sn_init(snames_t *names);
+
+/**
+ * Append a copy of a name.
+ *
+ * @param names List to add to.
+ * @param text Name to copy.
+ *
+ * @return 0 on success, or -1 if out of memory (the list is unchanged).
+ */
+int sn_add(snames_t *names, const char *text);
+
+/**
+ * Get a name by its position.
+ *
+ * @param names List to read.
+ * @param i Position, from 0 to count - 1.
+ *
+ * @return The name, valid until the list is next added to or freed, or
+ *         NULL if i is out of range.
+ */
+const char *sn_get(const snames_t *names, int i);
+
+/**
+ * Step through a list of names.
+ *
+ * @param names List to read.
+ * @param pos Position of the next name, 0 to start; advanced past it.
+ *
+ * @return The name, or NULL past the end.
+ */
+const char *sn_next(const snames_t *names, int *pos);
+
+/**
+ * Free the buffer of a list of names, leaving it empty.
+ *
+ * @param names List to free.
+ */
+void sn_free(snames_t *names);
+
 #endif
@@ -28,5 +28,33 @@ int main(int argc, char **argv) {
 
   s_free(list1);
   s_free(list2);
+
+  // Packed names, grown well past their first buffer
+  snames_t names;
+  sn_init(&names);
+  char name[16];
+  for (int i = 0; i < 1000; i++) {
+    snprintf(name, sizeof(name), "name%d", i);
+    sn_add(&names, name);
+  }
+  int pos = 998;
+  const char *next;
+  printf("\nPacked %d names:", names.count);
+  printf(" first %s", sn_get(&names, 0));
+  while ((next = sn_next(&names, &pos)) != NULL) {
+    printf(" then %s", next);
+  }
+  printf(" (%s past the end)\n", sn_get(&names, 1000) ? "something" : "nothing");
+  sn_free(&names);
+
+  // Splitting in place
+  const char *path = "/a//bc/";
+  const char *part;
+  int len;
+  printf("\nParts of \"%s\":", path);
+  while ((part = s_next_part(&path, '/', &len)) != NULL) {
+    printf(" [%.*s]", len, part);
+  }
+  printf("\n");
   return 0;
 }
@@ -6,17 +6,132 @@
  * It handles inode allocation, deallocation, retrieval, and printing.
  */
 
+ #include <errno.h>
  #include <stdio.h>
  #include <stdlib.h>
  #include <string.h>
+ #include <sys/mman.h>
+ #include <sys/stat.h>
  #include <time.h>
+ #include <unistd.h>
  #include "inode.h"
+ #include "compress.h"
+ #include "dedup.h"
  #include "helpers/bitmap.h"
+ #include "helpers/journal.h"
+ #include "helpers/log.h"
  
- // Inode table starts at block 1 (after block 0 which has bitmaps)
- #define INODE_TABLE_START 1
+ // The inode table's location is recorded in the superblock
  #define INODES_PER_BLOCK (BLOCK_SIZE / sizeof(inode_t))
  
+ // Extents past the direct ones are packed into leaf blocks, and the
+ // indirect block holds the block numbers of those leaves.
+ #define EXTENTS_PER_LEAF (BLOCK_SIZE / sizeof(extent_t))
+ #define LEAVES_PER_INDIRECT (BLOCK_SIZE / sizeof(int))
+ 
+ // Bounds on the window reserved past the end of a file open for writing
+ #define PREALLOC_MIN_BLOCKS 8
+ #define PREALLOC_MAX_BLOCKS 256
+ 
+ static inode_core_t *inode_cores = NULL; // One entry per inode
+
+// The inode the thread's write lock last noted with inode_note_clean(), as
+// it was then
+static __thread inode_t inode_clean;
+static __thread int inode_clean_inum = -1;
+ static int inode_cursor = 0; // next-fit: where the last search ended
+ 
+ /**
+  * Allocates the in-core inode table for the mounted image.
+  */
+ void inodes_init() {
+   free(inode_cores);
+   inode_cores = calloc(INODE_COUNT, sizeof(inode_core_t));
+   if (!inode_cores) {
+     perror("Failed to allocate the in-core inode table");
+     exit(1);
+   }
+   for (int i = 0; i < INODE_COUNT; ++i) {
+     pthread_rwlock_init(&inode_cores[i].lock, NULL);
+   }
+   inode_cursor = 0;
+ }
+ 
+ /**
+  * Retrieves the in-core state of an inode.
+  * 
+  * @param inum The inode number
+  * @return Pointer to the in-core state, or NULL if the inode number is invalid
+  */
+ inode_core_t *get_inode_core(int inum) {
+   if (inum < 0 || inum >= INODE_COUNT || !inode_cores) {
+     return NULL;
+   }
+   return &inode_cores[inum];
+ }
+ 
+ /**
+  * Locks an inode for reading.
+  * 
+  * @param inum The inode number
+  */
+ void inode_rdlock(int inum) {
+   pthread_rwlock_rdlock(&get_inode_core(inum)->lock);
+ }
+ 
+ /**
+  * Locks an inode for writing.
+  * 
+  * Also joins the thread's current journal operation, or starts one, so
+  * everything changed until the matching unlock is committed together.
+  * 
+  * @param inum The inode number
+  */
+ void inode_wrlock(int inum) {
+   inode_core_t *core = get_inode_core(inum);
+   journal_begin();
+   pthread_rwlock_wrlock(&core->lock);
+   core->wrlocked = 1;
+ }
+ 
+ /**
+  * Releases an inode lock.
+  * 
+  * Releasing a write lock logs the inode, which covers every change made
+  * to it under the lock, unless inode_note_clean() shows it unchanged.
+  * 
+  * @param inum The inode number
+  */
+ void inode_unlock(int inum) {
+   inode_core_t *core = get_inode_core(inum);
+   int wrlocked = core->wrlocked;
+   if (wrlocked) {
+     core->wrlocked = 0;
+     inode_t *node = get_inode(inum);
+     if (inode_clean_inum != inum ||
+         memcmp(&inode_clean, node, sizeof(inode_t)) != 0) {
+       journal_log(node, sizeof(inode_t));
+     }
+     if (inode_clean_inum == inum) {
+       inode_clean_inum = -1;
+     }
+   }
+   pthread_rwlock_unlock(&core->lock);
+   if (wrlocked) {
+     journal_end();
+   }
+ }
+ 
+ /**
+  * Remembers an inode as it is, so unlocking it logs it only if changed.
+  * 
+  * @param inum The inode number; the caller holds its write lock
+  */
+ void inode_note_clean(int inum) {
+   inode_clean = *get_inode(inum);
+   inode_clean_inum = inum;
+ }
+ 
  /**
   * Retrieves an inode by its inode number.
   * 
@@ -27,37 +142,72 @@
    if (inum < 0 || inum >= INODE_COUNT) {
      return NULL;
    }
-   int block_num = INODE_TABLE_START + (inum / INODES_PER_BLOCK);
+   int block_num = blocks_get_superblock()->itable_start + (inum / INODES_PER_BLOCK);
    int offset = (inum % INODES_PER_BLOCK) * sizeof(inode_t);
    return (inode_t *)((char *)blocks_get_block(block_num) + offset);
  }
  
+ /**
+  * Claims the first free inode in [lo, hi).
+  * 
+  * @return The inode number, or -1 if the range is full
+  */
+ static int claim_inode(void *ibm, int lo, int hi) {
+   for (int i = bitmap_find_zero(ibm, lo, hi); i >= 0;
+        i = bitmap_find_zero(ibm, i + 1, hi)) {
+     if (!bitmap_test_and_set(ibm, i)) {
+       return i;
+     }
+   }
+   return -1;
+ }
+ 
  /**
   * Allocates a new inode from the inode bitmap.
   * 
-  * Searches the inode bitmap for a free inode, marks it as allocated,
-  * and initializes its basic fields (references, timestamps).
+  * Searches the inode bitmap for a free inode, starting after the last one
+  * handed out and wrapping around once. The inode is claimed with an atomic
+  * test-and-set, so a thread that loses the race keeps scanning, and its
+  * basic fields (references, timestamps) are initialized under its write
+  * lock, so the scrubber never sees them half done. The mode is left 0
+  * for the caller to set.
   * 
   * @return The inode number of the newly allocated inode, or -1 if no free inodes are available
   */
  int alloc_inode() {
    void *ibm = get_inode_bitmap();
-   for (int i = 0; i < INODE_COUNT; ++i) {
-     if (!bitmap_get(ibm, i)) {
-       bitmap_put(ibm, i, 1);
-       
-       // Initialize the inode
-       inode_t *node = get_inode(i);
-       memset(node, 0, sizeof(inode_t));
-       node->inum = i; // Store the inode number in the inode
-       node->refs = 1;
-       node->atime = node->mtime = node->ctime = time(NULL);
-       
-       printf("+ alloc_inode() -> %d\n", i);
-       return i;
-     }
+   int start = __atomic_load_n(&inode_cursor, __ATOMIC_RELAXED);
+   if (start >= INODE_COUNT) start = 0;
+ 
+   int i = claim_inode(ibm, start, INODE_COUNT);
+   if (i < 0) i = claim_inode(ibm, 0, start);
+   if (i < 0) return -1; // No free inodes
+   __atomic_store_n(&inode_cursor, i + 1, __ATOMIC_RELAXED);
+   blocks_adjust_free_inodes(-1);
+ 
+   // Initialize the inode; unlocking logs it
+   inode_wrlock(i);
+   inode_t *node = get_inode(i);
+   memset(node, 0, sizeof(inode_t));
+   node->inum = i; // Store the inode number in the inode
+   node->refs = 1;
+   node->atime = node->mtime = node->ctime = time(NULL);
+   journal_log_bits(ibm, i, 1, 1);
+   inode_core_t *core = get_inode_core(i);
+   if (core) {
+     __atomic_store_n(&core->nlookup, 0, __ATOMIC_RELAXED);
+     core->nwriters = 0;
+     core->prealloc_len = 0;
+     core->pending_mtime = 0;
+     core->pending_atime = 0;
+     core->compact_floor = 0;
+     __atomic_store_n(&core->read_next, 0, __ATOMIC_RELAXED);
+     __atomic_store_n(&core->ra_end, 0, __ATOMIC_RELAXED);
    }
-   return -1; // No free inodes
+   inode_unlock(i);
+   
+   log_debug("+ alloc_inode() -> %d", i);
+   return i;
  }
  
  /**
@@ -69,21 +219,1379 @@
   * @param inum The inode number to free
   */
  void free_inode(int inum) {
-   printf("+ free_inode(%d)\n", inum);
-   void *ibm = get_inode_bitmap();
-   bitmap_put(ibm, inum, 0);
+   log_debug("+ free_inode(%d)", inum);
    
    // Free any blocks associated with this inode
    inode_t *node = get_inode(inum);
-   if (node->block != 0) {
-     free_block(node->block);
+   shrink_inode(node, 0);
+   node->mode = 0; // Until the next alloc_inode() is done with it
+ 
+   void *ibm = get_inode_bitmap();
+   if (bitmap_test_and_clear(ibm, inum)) {
+     blocks_adjust_free_inodes(1);
+     journal_log_bits(ibm, inum, 1, 0);
+   }
+ }
+ 
+ /**
+  * Allocates a zeroed block for extent map metadata.
+  * 
+  * @return The block number, or -1 if the disk is full
+  */
+ static int alloc_zeroed_block() {
+   int bnum = alloc_block();
+   if (bnum >= 0) {
+     memset(blocks_get_meta_block(bnum), 0, BLOCK_SIZE);
+     journal_log_zero(blocks_get_meta_block(bnum), BLOCK_SIZE);
+   }
+   return bnum;
+ }
+ 
+ /**
+  * Returns the slot holding the i-th extent of an inode's map.
+  * 
+  * @param node Pointer to the inode
+  * @param i Index of the extent
+  * @param alloc Whether to allocate the indirect or leaf block if missing
+  * @return Pointer to the extent slot, or NULL if it has no backing block
+  */
+ static extent_t *inode_extent(inode_t *node, int i, int alloc) {
+   if (i < INODE_DIRECT_EXTENTS) {
+     return &node->extents[i];
+   }
+ 
+   i -= INODE_DIRECT_EXTENTS;
+   int leaf = i / EXTENTS_PER_LEAF;
+   if (leaf >= LEAVES_PER_INDIRECT) {
+     return NULL;
+   }
+ 
+   if (node->indirect == 0) {
+     if (!alloc || (node->indirect = alloc_zeroed_block()) < 0) {
+       node->indirect = 0;
+       return NULL;
+     }
+   }
+ 
+   int *leaves = blocks_get_meta_block(node->indirect);
+   if (leaves[leaf] == 0) {
+     if (!alloc || (leaves[leaf] = alloc_zeroed_block()) < 0) {
+       leaves[leaf] = 0;
+       return NULL;
+     }
+     journal_log(&leaves[leaf], sizeof(int));
+   }
+ 
+   extent_t *slots = blocks_get_meta_block(leaves[leaf]);
+   return &slots[i % EXTENTS_PER_LEAF];
+ }
+ 
+ /**
+  * Releases leaf blocks, and the indirect block, no longer holding extents.
+  * 
+  * @param node Pointer to the inode whose map was just shortened
+  */
+ static void inode_release_leaves(inode_t *node) {
+   if (node->indirect == 0) {
+     return;
+   }
+ 
+   int spilled = node->nextents - INODE_DIRECT_EXTENTS;
+   int keep = spilled > 0 ? (spilled + EXTENTS_PER_LEAF - 1) / EXTENTS_PER_LEAF : 0;
+ 
+   // Leaves are allocated in order, so the first empty slot ends the list
+   int *leaves = blocks_get_meta_block(node->indirect);
+   for (int i = keep; i < LEAVES_PER_INDIRECT && leaves[i] != 0; ++i) {
+     free_block(leaves[i]);
+     leaves[i] = 0;
+     journal_log(&leaves[i], sizeof(int));
+   }
+ 
+   if (keep == 0) {
+     free_block(node->indirect);
+     node->indirect = 0;
+   }
+ }
+ 
+ /**
+  * Returns the number of file blocks covered by the extent map.
+  * 
+  * @param node Pointer to the inode
+  * @return One past the last mapped file block, or 0 if nothing is mapped
+  */
+ static int inode_mapped_blocks(inode_t *node) {
+   if (node->nextents == 0) {
+     return 0;
+   }
+   extent_t *last = inode_extent(node, node->nextents - 1, 0);
+   return last->lblk + last->len;
+ }
+ 
+ /**
+  * Returns the blocks reserved past the end of a file to the allocator.
+  * 
+  * @param node Pointer to the inode
+  */
+ void inode_release_prealloc(inode_t *node) {
+   inode_core_t *core = get_inode_core(node->inum);
+   if (!core) {
+     return;
+   }
+   if (core->prealloc_len > 0) {
+     blocks_unreserve(core->prealloc_start, core->prealloc_len);
+   }
+   core->prealloc_len = 0;
+ }
+ 
+ /**
+  * Obtains blocks to append to a file.
+  * 
+  * Blocks come from the file's preallocation window when it starts at
+  * goal. Otherwise a new run is allocated at goal if possible, and if the
+  * file is open for writing the run is made longer and the surplus kept as
+  * the new window. The window is only reserved in memory (see
+  * reserve_block_run()); its blocks are allocated as they are handed out,
+  * so a crash leaks none of them.
+  * 
+  * @param node Pointer to the inode being grown
+  * @param goal The block right after the file's last extent, or 0
+  * @param need Number of blocks wanted
+  * @param got Set to the number of blocks handed out, from 1 to need
+  * @return The first block of the run, or -1 if the disk is full
+  */
+ static int inode_take_blocks(inode_t *node, int goal, int need, int *got) {
+   inode_core_t *core = get_inode_core(node->inum);
+ 
+   if (core && core->prealloc_len > 0) {
+     if (core->prealloc_start == goal) {
+       int bnum = core->prealloc_start;
+       *got = need < core->prealloc_len ? need : core->prealloc_len;
+       blocks_take_reserved(bnum, *got);
+       core->prealloc_start += *got;
+       core->prealloc_len -= *got;
+       return bnum;
+     }
+     inode_release_prealloc(node); // No longer follows the file
+   }
+ 
+   int window = 0;
+   if (core && core->nwriters > 0) {
+     window = inode_mapped_blocks(node);
+     if (window < PREALLOC_MIN_BLOCKS) window = PREALLOC_MIN_BLOCKS;
+     if (window > PREALLOC_MAX_BLOCKS) window = PREALLOC_MAX_BLOCKS;
+   }
+ 
+   if (window == 0) {
+     return alloc_block_run(goal, need, got);
+   }
+ 
+   int bnum = reserve_block_run(goal, need + window, got);
+   if (bnum < 0) {
+     return -1;
+   }
+   if (*got > need) {
+     core->prealloc_start = bnum + need;
+     core->prealloc_len = *got - need;
+     *got = need;
+   }
+   blocks_take_reserved(bnum, *got);
+   return bnum;
+ }
+ 
+ /**
+  * Finds the last extent starting at or before the given file block.
+  * 
+  * @param node Pointer to the inode
+  * @param file_bnum The file block number to look up
+  * @return Index of the extent, or -1 if file_bnum precedes every extent
+  */
+ static int inode_find_extent(inode_t *node, int file_bnum) {
+   int lo = 0;
+   int hi = node->nextents - 1;
+   int found = -1;
+ 
+   while (lo <= hi) {
+     int mid = lo + (hi - lo) / 2;
+     if (inode_extent(node, mid, 0)->lblk <= file_bnum) {
+       found = mid;
+       lo = mid + 1;
+     } else {
+       hi = mid - 1;
+     }
+   }
+   return found;
+ }
+ 
+ /**
+  * Inserts an extent into the map, moving the later ones up a slot.
+  * 
+  * @param node Pointer to the inode
+  * @param i Index the new extent takes
+  * @param ext The new extent
+  * @return 0 on success, -ENOSPC if the map cannot hold another extent
+  */
+ static int inode_insert_extent(inode_t *node, int i, extent_t ext) {
+   if (!inode_extent(node, node->nextents, 1)) {
+     // The indirect block may have been allocated without a leaf
+     inode_release_leaves(node);
+     return -ENOSPC;
+   }
+   for (int j = node->nextents; j > i; --j) {
+     extent_t *dst = inode_extent(node, j, 0);
+     *dst = *inode_extent(node, j - 1, 0);
+     journal_log(dst, sizeof(extent_t));
+   }
+   extent_t *slot = inode_extent(node, i, 0);
+   *slot = ext;
+   journal_log(slot, sizeof(extent_t));
+   node->nextents += 1;
+   return 0;
+ }
+ 
+ /**
+  * Removes an extent from the map, moving the later ones down a slot.
+  * 
+  * The extent's blocks are not freed.
+  * 
+  * @param node Pointer to the inode
+  * @param i Index of the extent to remove
+  */
+ static void inode_remove_extent(inode_t *node, int i) {
+   for (int j = i; j < node->nextents - 1; ++j) {
+     extent_t *dst = inode_extent(node, j, 0);
+     *dst = *inode_extent(node, j + 1, 0);
+     journal_log(dst, sizeof(extent_t));
+   }
+   extent_t *last = inode_extent(node, node->nextents - 1, 0);
+   memset(last, 0, sizeof(extent_t));
+   journal_log(last, sizeof(extent_t));
+   node->nextents -= 1;
+   inode_release_leaves(node);
+ }
+ 
+ /**
+  * Tells whether one extent carries on from another both in the file and
+  * on disk, so the two can be one.
+  * 
+  * @param a The earlier extent
+  * @param b The later extent
+  * @return Nonzero if b continues a; compressed extents never do
+  */
+ static int inode_adjoins(const extent_t *a, const extent_t *b) {
+   return a->plen == 0 && b->plen == 0 && a->lblk + a->len == b->lblk &&
+          a->pblk + a->len == b->pblk;
+ }
+ 
+ /**
+  * Frees the blocks of a compressed extent.
+  * 
+  * @param ext The extent, which the caller removes from the map
+  */
+ static void inode_release_packed(const extent_t *ext) {
+   compress_forget(ext->pblk);
+   for (int k = 0; k < ext->plen; ++k) {
+     free_block(ext->pblk + k);
+   }
+ }
+ 
+ /**
+  * Maps blocks into every hole of a range of file blocks.
+  * 
+  * Each hole is filled from a run aimed at the disk block that keeps the
+  * file's layout linear across it, so a range written in order ends up
+  * in a single extent.
+  * 
+  * @param node Pointer to the inode
+  * @param first First file block of the range
+  * @param end One past the last file block of the range
+  * @return 0 on success, negative error code on failure
+  */
+ static int inode_map_range(inode_t *node, int first, int end) {
+   int b = first;
+   while (b < end) {
+     int i = inode_find_extent(node, b);
+     extent_t *prev = i >= 0 ? inode_extent(node, i, 0) : NULL;
+     if (prev && b < prev->lblk + prev->len) {
+       b = prev->lblk + prev->len; // Already mapped
+       continue;
+     }
+ 
+     extent_t *next = i + 1 < node->nextents ? inode_extent(node, i + 1, 0) : NULL;
+     int hole_end = next && next->lblk < end ? next->lblk : end;
+ 
+     int goal = 0;
+     if (prev) {
+       goal = prev->pblk + (b - prev->lblk);
+     } else if (next && next->pblk >= next->lblk - b) {
+       goal = next->pblk - (next->lblk - b);
+     }
+     int got = 0;
+     int bnum = inode_take_blocks(node, goal, hole_end - b, &got);
+     if (bnum < 0) {
+       return -ENOSPC;
+     }
+     if (S_ISDIR(node->mode)) {
+       // Directory blocks are metadata: their zeroed slots must survive
+       memset(blocks_get_meta_block(bnum), 0, (size_t)got * BLOCK_SIZE);
+       journal_log_zero(blocks_get_meta_block(bnum), (size_t)got * BLOCK_SIZE);
+     } else {
+       memset(blocks_get_block(bnum), 0, (size_t)got * BLOCK_SIZE);
+       blocks_order_data(bnum, got);
+     }
+ 
+     if (prev && prev->plen == 0 && prev->lblk + prev->len == b &&
+         prev->pblk + prev->len == bnum) {
+       // Physically follows the previous extent, so just lengthen it
+       prev->len += got;
+       journal_log(prev, sizeof(extent_t));
+     } else {
+       extent_t ext = {.lblk = b, .pblk = bnum, .len = got};
+       if (inode_insert_extent(node, i + 1, ext) < 0) {
+         for (int k = 0; k < got; ++k) {
+           free_block(bnum + k);
+         }
+         return -ENOSPC;
+       }
+       prev = inode_extent(node, ++i, 0);
+     }
+ 
+     // Join the next extent if the new blocks run straight into it
+     if (i + 1 < node->nextents) {
+       next = inode_extent(node, i + 1, 0);
+       if (inode_adjoins(prev, next)) {
+         prev->len += next->len;
+         journal_log(prev, sizeof(extent_t));
+         inode_remove_extent(node, i + 1);
+       }
+     }
+     b += got;
+   }
+   return 0;
+ }
+ 
+ /**
+  * Merges an extent with its neighbours where they continue each other
+  * both in the file and on disk.
+  * 
+  * @param node Pointer to the inode
+  * @param i Index of the extent
+  */
+ static void inode_join(inode_t *node, int i) {
+   if (i > 0) {
+     extent_t *prev = inode_extent(node, i - 1, 0);
+     extent_t *cur = inode_extent(node, i, 0);
+     if (inode_adjoins(prev, cur)) {
+       prev->len += cur->len;
+       journal_log(prev, sizeof(extent_t));
+       inode_remove_extent(node, i);
+       i -= 1;
+     }
+   }
+   if (i + 1 < node->nextents) {
+     extent_t *cur = inode_extent(node, i, 0);
+     extent_t *next = inode_extent(node, i + 1, 0);
+     if (inode_adjoins(cur, next)) {
+       cur->len += next->len;
+       journal_log(cur, sizeof(extent_t));
+       inode_remove_extent(node, i + 1);
+     }
+   }
+ }
+ 
+ /**
+  * Points a run of blocks inside one extent at different disk blocks.
+  * 
+  * The extent is split around the run as needed, and the run joins its
+  * neighbours when the new blocks line up with them.
+  * 
+  * @param node Pointer to the inode
+  * @param i Index of the extent holding the run
+  * @param first First file block of the run
+  * @param n Number of blocks in the run, all inside extent i
+  * @param pblk Disk block the run now starts at
+  * @return 0 on success, -ENOSPC if the map cannot hold the extra extents
+  */
+ static int inode_replace_run(inode_t *node, int i, int first, int n, int pblk) {
+   extent_t *ext = inode_extent(node, i, 0);
+   int head = first - ext->lblk;
+   int tail = ext->len - head - n;
+   extent_t run = {.lblk = first, .pblk = pblk, .len = n};
+ 
+   if (tail > 0) {
+     extent_t rest = {.lblk = first + n, .pblk = ext->pblk + head + n, .len = tail};
+     if (inode_insert_extent(node, i + 1, rest) < 0) {
+       return -ENOSPC;
+     }
+   }
+   if (head > 0) {
+     if (inode_insert_extent(node, i + 1, run) < 0) {
+       if (tail > 0) {
+         inode_remove_extent(node, i + 1);
+       }
+       return -ENOSPC;
+     }
+     ext = inode_extent(node, i, 0);
+     ext->len = head;
+     journal_log(ext, sizeof(extent_t));
+     i += 1;
+   } else {
+     ext = inode_extent(node, i, 0);
+     *ext = run;
+     journal_log(ext, sizeof(extent_t));
+   }
+ 
+   inode_join(node, i);
+   return 0;
+ }
+ 
+ /**
+  * Removes a range of file blocks from the extent map, freeing the blocks.
+  * 
+  * Extents are trimmed or split at the edges of the range. A compressed
+  * extent cannot be split, so one that is not wholly inside the range
+  * must have been unpacked first.
+  * 
+  * @param node Pointer to the inode
+  * @param first First file block of the range
+  * @param last One past the last file block of the range
+  * @return 0 on success, -ENOSPC if splitting an extent needs a map slot
+  *         that cannot be had
+  */
+ static int inode_unmap(inode_t *node, int first, int last) {
+   int i = inode_find_extent(node, first);
+   if (i < 0) {
+     i = 0;
+   } else if (inode_extent(node, i, 0)->lblk + inode_extent(node, i, 0)->len <= first) {
+     i += 1;
+   }
+   while (i < node->nextents) {
+     extent_t *ext = inode_extent(node, i, 0);
+     if (ext->lblk >= last) {
+       break;
+     }
+     int ext_end = ext->lblk + ext->len;
+     if (ext->plen) {
+       // Wholly inside the range: callers unpack the extents at its edges
+       inode_release_packed(ext);
+       inode_remove_extent(node, i);
+       continue;
+     }
+     int lo = ext->lblk > first ? ext->lblk : first;
+     int hi = ext_end < last ? ext_end : last;
+ 
+     if (lo > ext->lblk && hi < ext_end) {
+       // The range lies inside this extent: keep both ends as two extents
+       extent_t right = {.lblk = hi, .pblk = ext->pblk + (hi - ext->lblk),
+                         .len = ext_end - hi};
+       if (inode_insert_extent(node, i + 1, right) < 0) {
+         return -ENOSPC;
+       }
+       ext = inode_extent(node, i, 0);
+     }
+ 
+     for (int b = lo; b < hi; ++b) {
+       free_block(ext->pblk + (b - ext->lblk));
+     }
+ 
+     if (lo == ext->lblk && hi == ext_end) {
+       inode_remove_extent(node, i);
+       continue;
+     }
+     if (lo == ext->lblk) {
+       ext->pblk += hi - ext->lblk;
+       ext->len = ext_end - hi;
+       ext->lblk = hi;
+     } else {
+       ext->len = lo - ext->lblk;
+     }
+     journal_log(ext, sizeof(extent_t));
+     i += 1;
+   }
+   return 0;
+ }
+ 
+ /**
+  * Copies a cluster's worth of file blocks out of the image.
+  * 
+  * @param node Pointer to the inode
+  * @param first First file block
+  * @param n Number of blocks
+  * @param data Filled with their contents
+  * @return 1 if every block is mapped, uncompressed and not shared, else 0
+  */
+ static int inode_gather(inode_t *node, int first, int n, char *data) {
+   for (int b = first; b < first + n;) {
+     int run = 0;
+     int bnum = inode_get_run(node, b, &run);
+     if (bnum < 0) {
+       return 0;
+     }
+     if (run > first + n - b) {
+       run = first + n - b;
+     }
+     for (int k = 0; k < run; ++k) {
+       if (block_refs(bnum + k) > 1) {
+         return 0;
+       }
+     }
+     memcpy(data + (size_t)(b - first) * BLOCK_SIZE, blocks_get_block(bnum),
+            (size_t)run * BLOCK_SIZE);
+     b += run;
+   }
+   return 1;
+ }
+ 
+ /**
+  * Copies data into mapped, uncompressed file blocks.
+  * 
+  * @param node Pointer to the inode
+  * @param first First file block
+  * @param n Number of blocks
+  * @param data Their new contents
+  */
+ static void inode_scatter(inode_t *node, int first, int n, const char *data) {
+   for (int b = first; b < first + n;) {
+     int run = 0;
+     int bnum = inode_get_run(node, b, &run);
+     if (run > first + n - b) {
+       run = first + n - b;
+     }
+     memcpy(blocks_get_block(bnum), data + (size_t)(b - first) * BLOCK_SIZE,
+            (size_t)run * BLOCK_SIZE);
+     b += run;
+   }
+ }
+ 
+ /**
+  * Turns a compressed extent back into plain blocks.
+  * 
+  * The compressed blocks are only freed once the plain ones are mapped,
+  * so on failure the extent is put back as it was.
+  * 
+  * @param node Pointer to the inode
+  * @param i Index of the compressed extent
+  * @return 0 on success, negative error code on failure
+  */
+ static int inode_unpack_extent(inode_t *node, int i) {
+   extent_t packed = *inode_extent(node, i, 0);
+   size_t size = (size_t)packed.len * BLOCK_SIZE;
+   char *data = malloc(size);
+   if (!data) {
+     return -ENOMEM;
+   }
+ 
+   int rv = compress_read(&packed, 0, data, size);
+   if (rv == 0) {
+     inode_remove_extent(node, i);
+     rv = inode_map_range(node, packed.lblk, packed.lblk + packed.len);
+     if (rv < 0) {
+       inode_unmap(node, packed.lblk, packed.lblk + packed.len);
+       if (inode_insert_extent(node, inode_find_extent(node, packed.lblk) + 1,
+                               packed) < 0) {
+         log_error("inode %d: lost compressed blocks %d-%d", node->inum,
+                   packed.lblk, packed.lblk + packed.len - 1);
+       }
+     }
+   }
+   if (rv == 0) {
+     inode_scatter(node, packed.lblk, packed.len, data);
+     inode_release_packed(&packed);
+     compress_count_unpack();
    }
+   free(data);
+   return rv;
+ }
+ 
+ /**
+  * Turns the compressed extents touching a byte range into plain blocks.
+  * 
+  * @param node Pointer to the inode
+  * @param offset First byte of the range
+  * @param len Number of bytes in the range
+  * @return 0 on success, negative error code on failure
+  */
+ int inode_unpack(inode_t *node, off_t offset, off_t len) {
+   if ((node->flags & INODE_INLINE) || len <= 0) {
+     return 0;
+   }
+ 
+   int first = offset / BLOCK_SIZE;
+   int end = bytes_to_blocks(offset + len);
+   int i = inode_find_extent(node, first);
+   if (i < 0) {
+     i = 0;
+   }
+   while (i < node->nextents) {
+     extent_t *ext = inode_extent(node, i, 0);
+     if (ext->lblk >= end) {
+       break;
+     }
+     if (ext->plen == 0 || ext->lblk + ext->len <= first) {
+       i += 1;
+       continue;
+     }
+     int rv = inode_unpack_extent(node, i);
+     if (rv < 0) {
+       return rv;
+     }
+     // The new blocks may have joined their neighbours, so look again
+     i = inode_find_extent(node, first);
+     if (i < 0) {
+       i = 0;
+     }
+   }
+   return 0;
+ }
+ 
+ /**
+  * Does the work of inode_store_packed once the map has room.
+  */
+ static int inode_store_packed_run(inode_t *node, int first, int n,
+                                   const char *data, const char *packed,
+                                   int used) {
+   int plen = bytes_to_blocks(used);
+   int got = 0;
+   int pblk = alloc_block_run(inode_get_bnum(node, first), plen, &got);
+   if (pblk < 0) {
+     return 0;
+   }
+   if (got < plen) {
+     for (int k = 0; k < got; ++k) {
+       free_block(pblk + k);
+     }
+     return 0;
+   }
+   char *disk = blocks_get_block(pblk);
+   memcpy(disk, packed, used);
+   memset(disk + used, 0, (size_t)plen * BLOCK_SIZE - used);
+ 
+   extent_t ext = {.lblk = first, .pblk = pblk, .len = n, .plen = plen};
+   int rv = inode_unmap(node, first, first + n);
+   if (rv == 0) {
+     rv = inode_insert_extent(node, inode_find_extent(node, first) + 1, ext);
+   }
+   if (rv == 0) {
+     return pblk;
+   }
+ 
+   // Only reached if the blocks just freed were taken by someone else
+   for (int k = 0; k < plen; ++k) {
+     free_block(pblk + k);
+   }
+   inode_unmap(node, first, first + n);
+   if (inode_map_range(node, first, first + n) < 0) {
+     log_error("inode %d: lost blocks %d-%d", node->inum, first, first + n - 1);
+     return -ENOSPC;
+   }
+   inode_scatter(node, first, n, data);
+   return 0;
+ }
+ 
+ /**
+  * Replaces a run of file blocks with a compressed extent.
+  * 
+  * @param node Pointer to the inode
+  * @param first First file block of the cluster
+  * @param n Number of blocks in the cluster, all mapped
+  * @param data The cluster's current contents
+  * @param packed The cluster compressed by compress_pack()
+  * @param used Bytes of packed used
+  * @return First disk block of the new extent, 0 if it could not be
+  *         stored and the cluster was left as it was, or -ENOSPC if the
+  *         cluster could not be put back either
+  */
+ static int inode_store_packed(inode_t *node, int first, int n,
+                               const char *data, const char *packed, int used) {
+   // Room for the extent map to split one extent and gain another, made
+   // before anything changes so that running out of it cannot lose data
+   int rv = 0;
+   if (inode_extent(node, node->nextents + 1, 1)) {
+     rv = inode_store_packed_run(node, first, n, data, packed, used);
+   }
+   // The map may not have needed the room after all
+   inode_release_leaves(node);
+   return rv;
+ }
+ 
+ /**
+  * Stores the clusters of a byte range compressed where that saves space.
+  * 
+  * @param node Pointer to the inode
+  * @param offset First byte of the range
+  * @param len Number of bytes in the range
+  * @return 0 on success, negative error code on failure
+  */
+ int inode_compress(inode_t *node, off_t offset, off_t len) {
+   if (!(node->flags & INODE_COMPRESS) || (node->flags & INODE_INLINE) ||
+       !S_ISREG(node->mode) || len <= 0) {
+     return 0;
+   }
+ 
+   size_t cluster = (size_t)COMPRESS_CLUSTER_BLOCKS * BLOCK_SIZE;
+   char *data = malloc(cluster);
+   char *packed = malloc(cluster);
+   if (!data || !packed) {
+     free(data);
+     free(packed);
+     return -ENOMEM;
+   }
+ 
+   int nblocks = bytes_to_blocks(node->size);
+   int end = bytes_to_blocks(offset + len);
+   if (end > nblocks) {
+     end = nblocks;
+   }
+   int first = offset / BLOCK_SIZE;
+   first -= first % COMPRESS_CLUSTER_BLOCKS;
+ 
+   int rv = 0;
+   long page = sysconf(_SC_PAGESIZE);
+   for (int c = first; c < end && rv == 0; c += COMPRESS_CLUSTER_BLOCKS) {
+     int n = nblocks - c < COMPRESS_CLUSTER_BLOCKS ? nblocks - c
+                                                   : COMPRESS_CLUSTER_BLOCKS;
+     if (n < 2 || !inode_gather(node, c, n, data)) {
+       continue;
+     }
+     // Only worth storing if it saves a block
+     int used = compress_pack(data, (size_t)n * BLOCK_SIZE, packed,
+                              (size_t)(n - 1) * BLOCK_SIZE);
+     compress_count_pack(used > 0);
+     if (used < 0) {
+       continue;
+     }
+     int pblk = inode_store_packed(node, c, n, data, packed, used);
+     if (pblk < 0) {
+       rv = pblk;
+     } else if (pblk > 0) {
+       // Sync just the blocks this cluster was written to
+       int64_t start = (int64_t)pblk * BLOCK_SIZE;
+       int64_t stop = start + (int64_t)bytes_to_blocks(used) * BLOCK_SIZE;
+       start -= start % page;
+       if (msync((char *)blocks_get_block(0) + start, stop - start,
+                 MS_SYNC) != 0) {
+         rv = -errno;
+       }
+     }
+   }
+   free(data);
+   free(packed);
+   return rv;
+ }
+ 
+ /**
+  * Reads bytes of a file that inode_locate reported as INODE_LOCATE_PACKED.
+  * 
+  * @param node Pointer to the inode
+  * @param offset File offset of the first byte
+  * @param buf Filled with the data
+  * @param len Number of bytes, all inside one compressed extent
+  * @return 0 on success, -EIO if the extent is damaged
+  */
+ int inode_read_packed(inode_t *node, off_t offset, char *buf, size_t len) {
+   int i = inode_find_extent(node, offset / BLOCK_SIZE);
+   extent_t *ext = inode_extent(node, i, 0);
+   return compress_read(ext, offset - (off_t)ext->lblk * BLOCK_SIZE, buf, len);
+ }
+ 
+ /**
+  * Makes the blocks of a byte range safe to change in place.
+  * 
+  * Blocks the file alone owns are claimed from the dedup layer; blocks it
+  * shares with others are copied to new blocks first.
+  * 
+  * @param node Pointer to the inode
+  * @param offset First byte of the range
+  * @param len Number of bytes in the range
+  * @return 0 on success, -ENOSPC if a shared block cannot be copied
+  */
+ int inode_unshare(inode_t *node, off_t offset, off_t len) {
+   if (!blocks_dedup_enabled() || (node->flags & INODE_INLINE) || len <= 0) {
+     return 0;
+   }
+ 
+   int b = offset / BLOCK_SIZE;
+   int end = bytes_to_blocks(offset + len);
+   while (b < end) {
+     int i = inode_find_extent(node, b);
+     extent_t *ext = i >= 0 ? inode_extent(node, i, 0) : NULL;
+     if (!ext || b >= ext->lblk + ext->len) {
+       b += 1; // A hole
+       continue;
+     }
+     if (ext->plen) {
+       b = ext->lblk + ext->len; // Compressed extents are never shared
+       continue;
+     }
+     int old = ext->pblk + (b - ext->lblk);
+     if (block_claim(old)) {
+       b += 1;
+       continue;
+     }
+ 
+     // Copy the shared blocks that follow in this extent together
+     int n = 1;
+     int limit = ext->lblk + ext->len < end ? ext->lblk + ext->len : end;
+     while (b + n < limit && !block_claim(old + n)) {
+       n += 1;
+     }
+     int goal = b > 0 ? inode_get_bnum(node, b - 1) + 1 : 0;
+     int got = 0;
+     int bnum = alloc_block_run(goal, n, &got);
+     if (bnum < 0) {
+       return -ENOSPC;
+     }
+     memcpy(blocks_get_block(bnum), blocks_get_block(old), (size_t)got * BLOCK_SIZE);
+     blocks_order_data(bnum, got);
+     if (inode_replace_run(node, i, b, got, bnum) < 0) {
+       for (int k = 0; k < got; ++k) {
+         free_block(bnum + k);
+       }
+       return -ENOSPC;
+     }
+     for (int k = 0; k < got; ++k) {
+       free_block(old + k); // Drops this file's reference only
+       dedup_count_copy();
+     }
+     b += got;
+   }
+   return 0;
+ }
+ 
+ /**
+  * Shares the blocks of a byte range with identical blocks already on disk.
+  * 
+  * @param node Pointer to the inode
+  * @param offset First byte of the range
+  * @param len Number of bytes in the range
+  */
+ void inode_dedup(inode_t *node, off_t offset, off_t len) {
+   if (!blocks_dedup_enabled() || (node->flags & INODE_INLINE) || len <= 0) {
+     return;
+   }
+ 
+   int end = bytes_to_blocks(offset + len);
+   for (int b = offset / BLOCK_SIZE; b < end; ++b) {
+     int i = inode_find_extent(node, b);
+     extent_t *ext = i >= 0 ? inode_extent(node, i, 0) : NULL;
+     if (!ext || b >= ext->lblk + ext->len || ext->plen) {
+       continue;
+     }
+     int bnum = ext->pblk + (b - ext->lblk);
+     if (block_refs(bnum) != 0) {
+       continue; // Already indexed or shared
+     }
+     int match = dedup_block(bnum);
+     if (match == bnum) {
+       continue;
+     }
+     if (inode_replace_run(node, i, b, 1, match) < 0) {
+       free_block(match);
+       return;
+     }
+     free_block(bnum);
+   }
+ }
+ 
+ /**
+  * Maps the blocks of one file into a hole of another, sharing them.
+  * 
+  * @param dst Inode receiving the blocks; the target range must be a hole
+  * @param dst_first First file block of the target range
+  * @param src Inode the blocks come from
+  * @param src_first First file block of the source range
+  * @param count Number of blocks
+  * @return 0 on success, -ENOSPC if the map or the disk is full
+  */
+ int inode_clone(inode_t *dst, int dst_first, inode_t *src, int src_first,
+                 int count) {
+   if ((dst->flags & INODE_INLINE) || (src->flags & INODE_INLINE)) {
+     return -EINVAL;
+   }
+   int rv = inode_unpack(src, (off_t)src_first * BLOCK_SIZE,
+                         (off_t)count * BLOCK_SIZE);
+   if (rv < 0) {
+     return rv;
+   }
+ 
+   int b = 0;
+   while (b < count) {
+     int sb = src_first + b;
+     int i = inode_find_extent(src, sb);
+     extent_t *ext = i >= 0 ? inode_extent(src, i, 0) : NULL;
+     if (!ext || sb >= ext->lblk + ext->len) {
+       // A hole stays a hole
+       int next = i + 1 < src->nextents ? inode_extent(src, i + 1, 0)->lblk : sb + count;
+       b = next - src_first < count ? next - src_first : count;
+       continue;
+     }
+ 
+     int pblk = ext->pblk + (sb - ext->lblk);
+     int n = ext->lblk + ext->len - sb;
+     if (n > count - b) {
+       n = count - b;
+     }
+ 
+     // Take a reference to each block; one whose count is full is copied
+     int held = 0;
+     while (held < n) {
+       if (block_refs(pblk + held) == 0) {
+         block_track(pblk + held);
+       }
+       if (block_hold(pblk + held) < 0) {
+         break;
+       }
+       held += 1;
+     }
+     if (held == 0) {
+       int got = 0;
+       pblk = alloc_block_run(0, 1, &got);
+       if (pblk < 0) {
+         return -ENOSPC;
+       }
+       memcpy(blocks_get_block(pblk), blocks_get_block(ext->pblk + (sb - ext->lblk)),
+              BLOCK_SIZE);
+       blocks_order_data(pblk, 1);
+       held = 1;
+     }
+ 
+     extent_t run = {.lblk = dst_first + b, .pblk = pblk, .len = held};
+     int j = inode_find_extent(dst, run.lblk) + 1;
+     if (inode_insert_extent(dst, j, run) < 0) {
+       for (int k = 0; k < held; ++k) {
+         free_block(pblk + k);
+       }
+       return -ENOSPC;
+     }
+     inode_join(dst, j);
+     b += held;
+   }
+   return 0;
+ }
+ 
+ /**
+  * Moves an inline file's data to a block so the file can grow past
+  * INODE_INLINE_SIZE.
+  * 
+  * @param node Pointer to the inline inode
+  * @return 0 on success, negative error code on failure
+  */
+ static int inode_spill(inode_t *node) {
+   char data[INODE_INLINE_SIZE];
+   memcpy(data, node->inline_data, sizeof(data));
+   memset(node->inline_data, 0, sizeof(data));
+   node->flags &= ~INODE_INLINE;
+   if (node->size == 0) {
+     return 0;
+   }
+ 
+   int rv = inode_map_range(node, 0, 1);
+   if (rv < 0) {
+     memcpy(node->inline_data, data, sizeof(data));
+     node->flags |= INODE_INLINE;
+     return rv;
+   }
+   memcpy(blocks_get_block(node->extents[0].pblk), data, node->size);
+   return 0;
+ }
+ 
+ /**
+  * Increases the size of an inode.
+  * 
+  * @param node Pointer to the inode to grow
+  * @param size The new size in bytes
+  * @return 0 on success, negative error code on failure
+  */
+ int grow_inode(inode_t *node, off_t size) {
+   if (!node || size < 0) {
+     return -EINVAL;
+   }
+ 
+   if ((node->flags & INODE_INLINE) && size > INODE_INLINE_SIZE) {
+     int rv = inode_spill(node);
+     if (rv < 0) {
+       return rv;
+     }
+   }
+ 
+   // The bytes past the old end read back as zeros already
+   if (size > node->size) {
+     node->size = size;
+   }
+   return 0;
+ }
+ 
+ /**
+  * Maps blocks for a byte range without changing the file size.
+  * 
+  * @param node Pointer to the inode
+  * @param offset First byte of the range
+  * @param len Number of bytes in the range
+  * @return 0 on success, negative error code on failure
+  */
+ int reserve_inode(inode_t *node, off_t offset, off_t len) {
+   if (!node || offset < 0 || len < 0) {
+     return -EINVAL;
+   }
+   if (node->flags & INODE_INLINE) {
+     if (offset + len <= INODE_INLINE_SIZE) {
+       return 0;
+     }
+     int rv = inode_spill(node);
+     if (rv < 0) {
+       return rv;
+     }
+   }
+   if (len == 0) {
+     return 0;
+   }
+   int rv = inode_unpack(node, offset, len);
+   if (rv < 0) {
+     return rv;
+   }
+   return inode_map_range(node, offset / BLOCK_SIZE,
+                          bytes_to_blocks(offset + len));
+ }
+ 
+ /**
+  * Decreases the size of an inode, potentially freeing blocks.
+  * 
+  * @param node Pointer to the inode to shrink
+  * @param size The new size in bytes
+  * @return 0 on success, negative error code on failure
+  */
+ int shrink_inode(inode_t *node, off_t size) {
+   if (!node || size < 0 || size > node->size) {
+     return -EINVAL;
+   }
+ 
+   if (node->flags & INODE_INLINE) {
+     memset(node->inline_data + size, 0, node->size - size);
+     node->size = size;
+     return 0;
+   }
+ 
+   // An extent trimmed below, or whose last block has its tail zeroed,
+   // must not be compressed
+   int tail = size % BLOCK_SIZE;
+   int keep = bytes_to_blocks(size);
+   if (keep > 0) {
+     int i = inode_find_extent(node, keep - 1);
+     extent_t *ext = i >= 0 ? inode_extent(node, i, 0) : NULL;
+     if (ext && ext->plen && keep - 1 < ext->lblk + ext->len &&
+         (keep < ext->lblk + ext->len || tail != 0)) {
+       int rv = inode_unpack_extent(node, i);
+       if (rv < 0) {
+         return rv;
+       }
+     }
+   }
+ 
+   // The tail of the new last block is zeroed below, so it must be private
+   if (tail != 0 && inode_unshare(node, size, BLOCK_SIZE - tail) < 0) {
+     return -ENOSPC;
+   }
+ 
+   inode_release_prealloc(node);
+ 
+   // Drop whole extents from the end, then trim the one straddling keep
+   while (node->nextents > 0) {
+     extent_t *ext = inode_extent(node, node->nextents - 1, 0);
+     if (ext->lblk + ext->len <= keep) {
+       break;
+     }
+ 
+     int first_freed = keep > ext->lblk ? keep - ext->lblk : 0;
+     if (ext->plen) {
+       inode_release_packed(ext); // Wholly past keep, as seen to above
+     } else {
+       for (int i = first_freed; i < ext->len; ++i) {
+         free_block(ext->pblk + i);
+       }
+     }
+ 
+     if (first_freed > 0) {
+       ext->len = first_freed;
+       journal_log(ext, sizeof(extent_t));
+       break;
+     }
+     memset(ext, 0, sizeof(extent_t));
+     journal_log(ext, sizeof(extent_t));
+     node->nextents -= 1;
+   }
+   inode_release_leaves(node);
+ 
+   // Zero the rest of the last block so growing again reads back zeros
+   if (tail != 0) {
+     int bnum = inode_get_bnum(node, size / BLOCK_SIZE);
+     if (bnum >= 0) {
+       memset((char *)blocks_get_block(bnum) + tail, 0, BLOCK_SIZE - tail);
+     }
+   }
+ 
+   // An emptied file starts over inline; the whole map is zero by now
+   if (size == 0 && S_ISREG(node->mode)) {
+     node->flags |= INODE_INLINE;
+   }
+ 
+   node->size = size;
+   return 0;
+ }
+ 
+ /**
+  * Zeroes the mapped bytes of a range within one block; holes are left.
+  * 
+  * @param node Pointer to the inode
+  * @param from First byte of the range
+  * @param to One past the last byte, in the same block as from
+  * @return 0 on success, -ENOSPC if the block is shared and cannot be copied
+  */
+ static int inode_zero_bytes(inode_t *node, off_t from, off_t to) {
+   if (to <= from) {
+     return 0;
+   }
+   int rv = inode_unshare(node, from, to - from);
+   if (rv < 0) {
+     return rv;
+   }
+   int bnum = inode_get_bnum(node, from / BLOCK_SIZE);
+   if (bnum >= 0) {
+     memset((char *)blocks_get_block(bnum) + from % BLOCK_SIZE, 0, to - from);
+   }
+   return 0;
+ }
+ 
+ /**
+  * Releases the blocks of a byte range, leaving a hole.
+  * 
+  * @param node Pointer to the inode
+  * @param offset First byte of the range
+  * @param len Number of bytes in the range
+  * @return 0 on success, negative error code on failure
+  */
+ int punch_inode(inode_t *node, off_t offset, off_t len) {
+   if (!node || offset < 0 || len < 0) {
+     return -EINVAL;
+   }
+ 
+   off_t end = offset + len;
+   if (node->flags & INODE_INLINE) {
+     if (offset < INODE_INLINE_SIZE) {
+       off_t stop = end < INODE_INLINE_SIZE ? end : INODE_INLINE_SIZE;
+       memset(node->inline_data + offset, 0, stop - offset);
+     }
+     return 0;
+   }
+ 
+   // Compressed extents are only released whole, so unpack those at the edges
+   int rv = inode_unpack(node, offset, 1);
+   if (rv == 0) {
+     rv = inode_unpack(node, end - 1, 1);
+   }
+   if (rv < 0) {
+     return rv;
+   }
+ 
+   // Only whole blocks are released; the partial ones at the edges are zeroed
+   int first = bytes_to_blocks(offset);
+   int last = end / BLOCK_SIZE;
+   if (offset / BLOCK_SIZE == last) {
+     return inode_zero_bytes(node, offset, end);
+   }
+   if (inode_zero_bytes(node, offset, (off_t)first * BLOCK_SIZE) < 0 ||
+       inode_zero_bytes(node, (off_t)last * BLOCK_SIZE, end) < 0) {
+     return -ENOSPC;
+   }
+   if (first >= last) {
+     return 0;
+   }
+   inode_release_prealloc(node);
+   return inode_unmap(node, first, last);
+ }
+ 
+ /**
+  * Counts the data blocks mapped into a file.
+  * 
+  * @param node Pointer to the inode
+  * @return Number of disk blocks held by the file's extents
+  */
+ int inode_data_blocks(inode_t *node) {
+   int count = 0;
+   for (int i = 0; i < node->nextents; ++i) {
+     extent_t *ext = inode_extent(node, i, 0);
+     count += ext->plen ? ext->plen : ext->len;
+   }
+   return count;
+ }
+ 
+ /**
+  * Whether a run of blocks lies inside the data area of the image.
+  * 
+  * @param pblk First block of the run
+  * @param len Number of blocks
+  * @return Nonzero if the run can belong to a file
+  */
+ static int inode_run_valid(int pblk, int len) {
+   int lo = blocks_get_superblock()->data_start;
+   return len > 0 && pblk >= lo && pblk <= BLOCK_COUNT - len;
+ }
+ 
+ /**
+  * Visits every disk block an inode holds, checking the map on the way.
+  * 
+  * @param node Pointer to the inode
+  * @param fn Called for each run, in map order
+  * @param arg Passed to fn
+  * @return 0, what fn returned to stop the walk, or -EIO if the map is
+  *         damaged
+  */
+ int inode_walk(inode_t *node, inode_walk_fn fn, void *arg) {
+   if (node->flags & INODE_INLINE) {
+     return node->size <= INODE_INLINE_SIZE ? 0 : -EIO;
+   }
+   int max = INODE_DIRECT_EXTENTS + LEAVES_PER_INDIRECT * EXTENTS_PER_LEAF;
+   if (node->nextents < 0 || node->nextents > max) {
+     return -EIO;
+   }
+ 
+   int *leaves = NULL;
+   int rv;
+   if (node->indirect != 0) {
+     if (!inode_run_valid(node->indirect, 1)) {
+       return -EIO;
+     }
+     if ((rv = fn(node->indirect, 1, -1, arg)) != 0) {
+       return rv;
+     }
+     leaves = blocks_get_meta_block(node->indirect);
+ 
+     // Every linked leaf is held, including any the extents do not reach
+     for (int leaf = 0; leaf < LEAVES_PER_INDIRECT; ++leaf) {
+       if (leaves[leaf] == 0) {
+         continue;
+       }
+       if (!inode_run_valid(leaves[leaf], 1)) {
+         return -EIO;
+       }
+       if ((rv = fn(leaves[leaf], 1, -1, arg)) != 0) {
+         return rv;
+       }
+     }
+   }
+ 
+   int64_t next = 0; // Extents are sorted, so each starts past the last
+   for (int i = 0; i < node->nextents; ++i) {
+     extent_t *ext = &node->extents[i];
+     if (i >= INODE_DIRECT_EXTENTS) {
+       int j = i - INODE_DIRECT_EXTENTS;
+       int leaf = j / EXTENTS_PER_LEAF;
+       if (!leaves || leaves[leaf] == 0) {
+         return -EIO;
+       }
+       ext = (extent_t *)blocks_get_meta_block(leaves[leaf]) +
+             j % EXTENTS_PER_LEAF;
+     }
+ 
+     int plen = ext->plen ? ext->plen : ext->len;
+     if (ext->lblk < next || ext->len <= 0 || !inode_run_valid(ext->pblk, plen)) {
+       return -EIO;
+     }
+     next = (int64_t)ext->lblk + ext->len;
+     if ((rv = fn(ext->pblk, plen, ext->lblk, arg)) != 0) {
+       return rv;
+     }
+   }
+   return 0;
+ }
+ 
+ /**
+  * Maps a file block number to the run of disk blocks holding it.
+  * 
+  * @param node Pointer to the inode
+  * @param file_bnum The file block number to look up
+  * @param count Set to the number of contiguous blocks from the returned one
+  * @return The filesystem block number, or -1 if invalid or compressed
+  */
+ int inode_get_run(inode_t *node, int file_bnum, int *count) {
+   if (!node || file_bnum < 0) {
+     return -1;
+   }
+ 
+   int i = inode_find_extent(node, file_bnum);
+   if (i < 0) {
+     return -1;
+   }
+ 
+   extent_t *ext = inode_extent(node, i, 0);
+   int delta = file_bnum - ext->lblk;
+   if (delta >= ext->len || ext->plen) {
+     return -1;
+   }
+ 
+   if (count) {
+     *count = ext->len - delta;
+   }
+   return ext->pblk + delta;
+ }
+ 
+ /**
+  * Finds where a byte of a file lives in the disk image.
+  * 
+  * @param node Pointer to the inode
+  * @param offset File offset of the byte
+  * @param avail Set to the number of contiguous bytes from there, or to
+  *              the length of the hole
+  * @return Byte position in the image, -1 if offset is in a hole, or
+  *         INODE_LOCATE_PACKED if it is in a compressed extent
+  */
+ int64_t inode_locate(inode_t *node, off_t offset, size_t *avail) {
+   if (node->flags & INODE_INLINE) {
+     if (offset >= INODE_INLINE_SIZE) {
+       *avail = SIZE_MAX;
+       return -1;
+     }
+     *avail = INODE_INLINE_SIZE - offset;
+     return (node->inline_data + offset) - (char *)blocks_get_block(0);
+   }
+ 
+   int file_bnum = offset / BLOCK_SIZE;
+   int i = inode_find_extent(node, file_bnum);
+   if (i >= 0) {
+     extent_t *ext = inode_extent(node, i, 0);
+     int delta = file_bnum - ext->lblk;
+     if (delta < ext->len) {
+       size_t in_block = offset % BLOCK_SIZE;
+       *avail = (size_t)(ext->len - delta) * BLOCK_SIZE - in_block;
+       if (ext->plen) {
+         return INODE_LOCATE_PACKED;
+       }
+       return (int64_t)(ext->pblk + delta) * BLOCK_SIZE + in_block;
+     }
+   }
+ 
+   // A hole, lasting up to the next extent
+   if (i + 1 < node->nextents) {
+     *avail = (int64_t)inode_extent(node, i + 1, 0)->lblk * BLOCK_SIZE - offset;
+   } else {
+     *avail = SIZE_MAX;
+   }
+   return -1;
+ }
+ 
+ /**
+  * Maps a file block number to a filesystem block number.
+  * 
+  * @param node Pointer to the inode
+  * @param file_bnum The file block number to look up
+  * @return The filesystem block number, or -1 if invalid
+  */
+ int inode_get_bnum(inode_t *node, int file_bnum) {
+   return inode_get_run(node, file_bnum, NULL);
  }
  
  /**
   * Prints the contents of an inode for debugging.
   * 
-  * Displays the inode's reference count, mode, size, and associated block.
+  * Displays the inode's reference count, mode, size, and extent count.
   *
   * @param node Pointer to the inode to print
   */
@@ -92,6 +1600,6 @@
      printf("NULL inode\n");
      return;
    }
-   printf("inode{refs: %d, mode: %04o, size: %d, block: %d}\n",
-          node->refs, node->mode, node->size, node->block);
+   printf("inode{refs: %d, mode: %04o, size: %ld, extents: %d}\n",
+          node->refs, node->mode, (long)node->size, node->nextents);
  }
\ No newline at end of file
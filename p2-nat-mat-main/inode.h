@@ -10,30 +10,155 @@
  #define INODE_H
  
  #include "helpers/blocks.h"
+ #include <pthread.h>
+ #include <stdint.h>
  #include <sys/time.h>
+ #include <sys/types.h>
  
- /** Total number of inodes supported by the file system */
- #define INODE_COUNT 256
- /** Size of the inode bitmap in bytes */
+ /** Size of the inode bitmap in bytes (INODE_COUNT comes from the superblock) */
  #define INODE_BITMAP_SIZE (INODE_COUNT / 8)
  
+ /** Number of extents stored directly in the inode */
+ #define INODE_DIRECT_EXTENTS 4
+ 
+ /** Largest file whose data is kept in the inode instead of in blocks */
+ #define INODE_INLINE_SIZE 176
+ 
+ /** Inode flag: the data lives in inline_data and the extent map is unused */
+ #define INODE_INLINE 0x1
+ 
+ /** Inode flag: data is compressed when written (see compress.h); on a
+  *  directory, files and directories created in it get the flag too */
+ #define INODE_COMPRESS 0x2
+ 
+ /** What inode_locate returns for a byte inside a compressed extent */
+ #define INODE_LOCATE_PACKED (-2)
+ 
+ /**
+  * A run of physically contiguous blocks backing part of a file.
+  *
+  * Extents in an inode's map are kept sorted by lblk and never overlap.
+  * A compressed extent (plen > 0) holds its len file blocks as one
+  * compressed cluster in plen disk blocks from pblk instead.
+  */
+ typedef struct extent {
+   int lblk;      // First file block covered by this extent
+   int pblk;      // Disk block backing lblk
+   int len;       // Number of blocks in the run
+   int plen;      // Disk blocks of a compressed extent, or 0 if stored as is
+ } extent_t;
+ 
  /**
   * Inode structure representing file metadata.
   * 
   * This structure stores all metadata for a file or directory,
-  * including permission mode, size, block pointers, and timestamps.
+  * including permission mode, size, the extent map, and timestamps.
+  *
+  * The first INODE_DIRECT_EXTENTS extents live in the inode itself. Further
+  * extents are stored in leaf blocks, whose block numbers are listed in the
+  * single indirect block. Extent i (counting from 0) is therefore reachable
+  * in constant time, which lets lookups binary-search the whole map. File
+  * blocks not covered by any extent are holes and read back as zeros.
+  *
+  * A regular file of at most INODE_INLINE_SIZE bytes keeps its data in the
+  * space of the extent map instead (INODE_INLINE), and moves it to a block
+  * when it grows past that. Bytes past the end of inline data are zero.
   */
  typedef struct inode {
    int inum;      // Inode number - unique identifier
    int refs;      // Reference count - number of directory entries pointing to this inode
    int mode;      // Permission bits and file type flags
-   int size;      // Size in bytes
-   int block;     // Single block pointer (simplified implementation)
+   int nextents;  // Number of extents in the map
+   int64_t size;  // Size in bytes
+   union {
+     struct {
+       extent_t extents[INODE_DIRECT_EXTENTS]; // Direct extents
+       int indirect;  // Block listing the extent leaf blocks (0 if none)
+     };
+     char inline_data[INODE_INLINE_SIZE]; // File data (INODE_INLINE only)
+   };
+   int nentries;  // Live entries, including . and .. (directories only)
+   int nsubdirs;  // Entries that are directories, excluding . and .. (directories only)
+   int flags;     // INODE_INLINE, INODE_COMPRESS
+   int parent;    // Directory holding the entry for this one, i.e. ".." (directories only)
    time_t atime;  // Last access time
    time_t mtime;  // Last modification time
    time_t ctime;  // Creation time
+   char _reserved[16]; // Padding to make 256 bytes total
  } inode_t;
  
+ /**
+  * In-memory state kept for each inode while the image is mounted.
+  *
+  * None of this is written to disk; it is rebuilt empty at every mount.
+  */
+ typedef struct inode_core {
+   pthread_rwlock_t lock; // Shared to read the inode, exclusive to change it
+   uint64_t nlookup; // Kernel references handed out by lookup and not yet forgotten (atomic)
+   int nwriters;     // Open file handles that may write
+   int prealloc_start; // First block reserved past the end of the file
+   int prealloc_len;   // Number of reserved blocks (0 if none)
+   time_t pending_mtime; // Time of the last write not yet stamped on the inode (0 if none)
+   time_t pending_atime; // Time of the last read not yet stamped on the inode (0 if none, atomic)
+   int wrlocked;     // Set while a writer holds the lock; unlocking then logs the inode
+   int pack_first;   // First file block written since the file was last compressed
+   int pack_end;     // One past the last such block (0 if none)
+   int compact_floor; // Directory: live entries below which compacting is next tried (0 for any)
+   off_t read_next;  // Where a sequential read would continue (atomic)
+   off_t ra_end;     // End of the range last advised for reading ahead (atomic)
+ } inode_core_t;
+ 
+ /**
+  * Allocates the in-core inode table for the mounted image.
+  *
+  * Must be called after blocks_init, once INODE_COUNT is known.
+  */
+ void inodes_init();
+ 
+ /**
+  * Retrieves the in-core state of an inode.
+  * 
+  * @param inum The inode number
+  * @return Pointer to the in-core state, or NULL if the inode number is invalid
+  */
+ inode_core_t *get_inode_core(int inum);
+ 
+ /**
+  * Locks an inode for reading.
+  * 
+  * Holding an inode's lock covers its metadata, its extent map and, for a
+  * directory, its entries. See storage.c for the order in which several
+  * inodes are locked.
+  * 
+  * @param inum The inode number
+  */
+ void inode_rdlock(int inum);
+ 
+ /**
+  * Locks an inode for writing.
+  * 
+  * @param inum The inode number
+  */
+ void inode_wrlock(int inum);
+ 
+ /**
+  * Releases a lock taken with inode_rdlock or inode_wrlock.
+  * 
+  * @param inum The inode number
+  */
+ void inode_unlock(int inum);
+
+ /**
+  * Notes an inode's contents under a write lock, so the unlock logs it
+  * only if they change.
+  * 
+  * For operations, such as overwriting file data, that usually leave the
+  * inode alone. Only the last inode noted by a thread is remembered.
+  * 
+  * @param inum The inode number; the caller holds its write lock
+  */
+ void inode_note_clean(int inum);
+ 
  /**
   * Prints the contents of an inode for debugging.
   * 
@@ -52,6 +177,8 @@
  /**
   * Allocates a new inode from the inode bitmap.
   * 
+  * Safe to call from several threads at once.
+  * 
   * @return The inode number of the newly allocated inode, or -1 if no free inodes are available
   */
  int alloc_inode();
@@ -64,30 +191,235 @@
  void free_inode(int inum);
  
  /**
-  * Increases the size of an inode, allocating new blocks if necessary.
+  * Increases the size of an inode.
+  * 
+  * No blocks are mapped: the new range is a hole that reads back as zeros
+  * until something is written there. An inline file that grows past
+  * INODE_INLINE_SIZE has its data moved to a block first.
   * 
   * @param node Pointer to the inode to grow
   * @param size The new size in bytes
   * @return 0 on success, negative error code on failure
   */
- int grow_inode(inode_t *node, int size);
+ int grow_inode(inode_t *node, off_t size);
+ 
+ /**
+  * Maps blocks for a byte range without changing the file size.
+  * 
+  * Holes in the range are filled with zeroed blocks, which are added to
+  * the extent map. Blocks are requested in runs that continue the extent
+  * before the hole, so a file written in order stays in one extent. While
+  * the file is open for writing, a window of further blocks is reserved
+  * past its end so that files written concurrently do not interleave.
+  * 
+  * @param node Pointer to the inode
+  * @param offset First byte of the range
+  * @param len Number of bytes in the range
+  * @return 0 on success, negative error code on failure
+  */
+ int reserve_inode(inode_t *node, off_t offset, off_t len);
+ 
+ /**
+  * Returns the blocks reserved past the end of a file to the allocator.
+  * 
+  * The caller holds the inode's write lock.
+  * 
+  * @param node Pointer to the inode
+  */
+ void inode_release_prealloc(inode_t *node);
  
  /**
   * Decreases the size of an inode, potentially freeing blocks.
   * 
+  * Blocks past the new end of file are released and the tail of the last
+  * block is zeroed so a later grow reads back zeros.
+  * 
   * @param node Pointer to the inode to shrink
   * @param size The new size in bytes
   * @return 0 on success, negative error code on failure
   */
- int shrink_inode(inode_t *node, int size);
+ int shrink_inode(inode_t *node, off_t size);
+ 
+ /**
+  * Releases the blocks of a byte range, leaving a hole.
+  * 
+  * Blocks wholly inside the range go back to the allocator; the parts of
+  * the range in the blocks at either edge are zeroed instead. The file
+  * size does not change. The caller holds the inode's write lock.
+  * 
+  * @param node Pointer to the inode
+  * @param offset First byte of the range
+  * @param len Number of bytes in the range
+  * @return 0 on success, -ENOSPC if splitting an extent needs a map slot
+  *         that cannot be had, or another negative error code
+  */
+ int punch_inode(inode_t *node, off_t offset, off_t len);
+ 
+ /**
+  * Makes the blocks of a byte range safe to change in place.
+  * 
+  * On images with dedup, blocks the file shares with others are copied to
+  * new blocks, and the ones it alone owns are withdrawn from sharing until
+  * inode_dedup() looks at them again. Holes are left alone. Call before
+  * writing into the range; the caller holds the inode's write lock.
+  * 
+  * @param node Pointer to the inode
+  * @param offset First byte of the range
+  * @param len Number of bytes in the range
+  * @return 0 on success, -ENOSPC if a shared block cannot be copied
+  */
+ int inode_unshare(inode_t *node, off_t offset, off_t len);
+ 
+ /**
+  * Shares the blocks of a byte range with identical blocks already on disk.
+  * 
+  * On images with dedup, each block of the range not yet known to the dedup
+  * layer is fingerprinted and, if its contents are already on disk, mapped
+  * to that block instead. Call once data has been written into the range;
+  * the caller holds the inode's write lock.
+  * 
+  * @param node Pointer to the inode
+  * @param offset First byte of the range
+  * @param len Number of bytes in the range
+  */
+ void inode_dedup(inode_t *node, off_t offset, off_t len);
+ 
+ /**
+  * Maps the blocks of one file into a hole of another, sharing them.
+  * 
+  * Needs an image with dedup: each block gains a reference, so both files
+  * see the same data until one of them writes to it and inode_unshare()
+  * gives that file its own copy. Holes in the source stay holes. Neither
+  * file may be inline; the caller holds both write locks.
+  * 
+  * @param dst Inode receiving the blocks; the target range must be a hole
+  * @param dst_first First file block of the target range
+  * @param src Inode the blocks come from (may be dst, with the ranges apart)
+  * @param src_first First file block of the source range
+  * @param count Number of blocks
+  * @return 0 on success, -ENOSPC if the map or the disk is full
+  */
+ int inode_clone(inode_t *dst, int dst_first, inode_t *src, int src_first,
+                 int count);
+ 
+ /**
+  * Stores the clusters of a byte range compressed where that saves space.
+  * 
+  * Only files with INODE_COMPRESS are compressed. Each cluster of
+  * COMPRESS_CLUSTER_BLOCKS blocks touching the range that is wholly mapped,
+  * uncompressed and not shared is compressed, and replaced by a compressed
+  * extent if that takes at least one block fewer; the last cluster of the
+  * file may be shorter. The new blocks are written back before returning,
+  * so the journal never maps a compressed extent whose data did not reach
+  * the disk. The caller holds the inode's write lock.
+  * 
+  * @param node Pointer to the inode
+  * @param offset First byte of the range
+  * @param len Number of bytes in the range
+  * @return 0 on success, negative error code on failure
+  */
+ int inode_compress(inode_t *node, off_t offset, off_t len);
+ 
+ /**
+  * Turns the compressed extents touching a byte range into plain blocks.
+  * 
+  * Everything that changes blocks in place or moves them between files
+  * calls this first; reserve_inode(), shrink_inode(), punch_inode() and
+  * inode_clone() do so themselves. The caller holds the inode's write lock.
+  * 
+  * @param node Pointer to the inode
+  * @param offset First byte of the range
+  * @param len Number of bytes in the range
+  * @return 0 on success, -ENOSPC if the plain blocks cannot be had, or
+  *         -EIO if a compressed extent is damaged
+  */
+ int inode_unpack(inode_t *node, off_t offset, off_t len);
+ 
+ /**
+  * Reads bytes of a file that inode_locate reported as INODE_LOCATE_PACKED.
+  * 
+  * @param node Pointer to the inode, locked by the caller
+  * @param offset File offset of the first byte
+  * @param buf Filled with the data
+  * @param len Number of bytes, all inside the same compressed extent
+  * @return 0 on success, -EIO if the extent is damaged
+  */
+ int inode_read_packed(inode_t *node, off_t offset, char *buf, size_t len);
+ 
+ /**
+  * Counts the data blocks mapped into a file.
+  * 
+  * @param node Pointer to the inode
+  * @return Number of disk blocks held by the file's extents, counting
+  *         compressed extents at their compressed size
+  */
+ int inode_data_blocks(inode_t *node);
+ 
+ /**
+  * Finds where a byte of a file lives in the disk image.
+  * 
+  * Works for inline files as well as mapped ones, so callers can read or
+  * write any file through the image without caring which it is.
+  * 
+  * @param node Pointer to the inode
+  * @param offset File offset of the byte
+  * @param avail Set to the number of contiguous bytes from there, up to the
+  *              end of the run of blocks or of the inline data; for a hole,
+  *              its length (SIZE_MAX if nothing is mapped after it)
+  * @return Byte position in the image, -1 if offset is in a hole, or
+  *         INODE_LOCATE_PACKED if it is in a compressed extent, which has no
+  *         position of its own in the image (see inode_read_packed)
+  */
+ int64_t inode_locate(inode_t *node, off_t offset, size_t *avail);
  
  /**
   * Maps a file block number to a filesystem block number.
   * 
   * @param node Pointer to the inode
   * @param file_bnum The file block number to look up
-  * @return The filesystem block number, or -1 if invalid
+  * @return The filesystem block number, or -1 if invalid or compressed
   */
  int inode_get_bnum(inode_t *node, int file_bnum);
  
+ /**
+  * Maps a file block number to the run of disk blocks holding it.
+  * 
+  * @param node Pointer to the inode
+  * @param file_bnum The file block number to look up
+  * @param count Set to the number of contiguous blocks, starting at the
+  *              returned one, that back file_bnum and the blocks after it
+  * @return The filesystem block number, or -1 if invalid or compressed
+  */
+ int inode_get_run(inode_t *node, int file_bnum, int *count);
+ 
+ /**
+  * Called by inode_walk for each run of disk blocks an inode holds.
+  * 
+  * @param pblk First block of the run
+  * @param len Number of blocks in the run
+  * @param lblk First file block the run backs, or -1 for a block of the
+  *             extent map itself (the indirect block or a leaf)
+  * @param arg The argument given to inode_walk
+  * @return 0 to go on, or a value that stops the walk and is returned
+  */
+ typedef int (*inode_walk_fn)(int pblk, int len, int lblk, void *arg);
+ 
+ /**
+  * Visits every disk block an inode holds, for the consistency checker.
+  * 
+  * Unlike the rest of this module it does not trust the extent map: block
+  * numbers are checked to lie in the data area before they are followed,
+  * and extents must be in order and must not overlap. Compressed extents
+  * are reported at their compressed size, and inline files hold no blocks.
+  * The indirect block and every leaf it links are visited first, whether or
+  * not any extent lies in them.
+  * 
+  * @param node Pointer to the inode
+  * @param fn Called for each run, in map order
+  * @param arg Passed to fn
+  * @return 0 once every run was visited, what fn returned if it stopped
+  *         the walk, or -EIO if the map is damaged
+  */
+ int inode_walk(inode_t *node, inode_walk_fn fn, void *arg);
+ 
  #endif
\ No newline at end of file
@@ -1,8 +1,13 @@
 /**
  * NUFS (Null File System) implementation using FUSE
- * 
- * This file contains the main FUSE operations for our simple filesystem.
- * Each function corresponds to a standard filesystem operation.
+ *
+ * This file contains the FUSE operations for our simple filesystem. It uses
+ * the low-level API, so the kernel names files by inode number and we never
+ * resolve paths: each function corresponds to a standard filesystem
+ * operation on an inode.
+ *
+ * Kernel inode numbers are ours plus one, because the kernel reserves 1
+ * (FUSE_ROOT_ID) for the root and never uses 0.
  */
 
  #include <features.h>
@@ -12,639 +17,1520 @@
  #include <unistd.h>
  #include <stdlib.h>
  
- #define FUSE_USE_VERSION 26
- #include <fuse.h>
+ #define FUSE_USE_VERSION 35
+ #include <fuse_lowlevel.h>
  
  #include <assert.h>
+ #include <ctype.h>
  #include <errno.h>
+ #include <stddef.h>
  #include <stdio.h>
  #include <string.h>
  #include <sys/types.h>
+ #include <sys/xattr.h>
+ #include <time.h>
  
  #include "storage.h"
  #include "inode.h"
  #include "directory.h"
+ #include "dcache.h"
+ #include "fsck.h"
+ #include "stats.h"
+ #include "helpers/log.h"
  
- /* ====================== FUSE OPERATION IMPLEMENTATIONS ===================== */
+ /** Default seconds the kernel may cache names and attributes */
+ #define NUFS_DEFAULT_TIMEOUT 1.0
+ 
+ static double entry_timeout = NUFS_DEFAULT_TIMEOUT;
+ static double attr_timeout = NUFS_DEFAULT_TIMEOUT;
+ 
+ /** Whether read replies may be spliced from the image file */
+ static int splice_reads = 0;
+ 
+ /** Whether the image is scrubbed in the background while mounted */
+ static int scrub = 0;
+ 
+ /** Size of the zeros that holes in sparse files are read from */
+ #define NUFS_HOLE_ZEROS (1 << 20)
+ 
+ static char hole_zeros[NUFS_HOLE_ZEROS];
+ 
+ /** The extended attribute that marks files and directories for compression */
+ #define NUFS_XATTR_COMPRESS "user.nufs.compress"
  
  /**
-  * Check if a file exists and is accessible with given permissions
-  * 
-  * @param path The file path to check
-  * @param mask The access mode (R_OK, W_OK, X_OK)
-  * @return 0 if accessible, -errno on error
-  * 
-  * Assumes: Only root directory and "/hello.txt" exist in this simple implementation
+  * Kernel inode numbers of the virtual /.nufs directory and its files,
+  * far above any real inode. The directory is not listed in the root, and
+  * hides a real entry of the same name.
   */
- int nufs_access(const char *path, int mask) {
-     int rv = 0;
+ #define NUFS_VDIR_NAME ".nufs"
+ #define NUFS_VDIR_INO ((fuse_ino_t)1 << 48)
+ #define NUFS_STATS_INO (NUFS_VDIR_INO + 1)
  
-     if (strcmp(path, "/") == 0 || strcmp(path, "/hello.txt") == 0) {
-         rv = 0;  // File exists and is accessible
+ /** Time the file system was mounted, given to the virtual files */
+ static time_t mount_time;
+
+ /**
+  * The session, for telling the kernel about names changed behind its
+  * back; NULL when running single-threaded, where the kernel could be
+  * waiting on a request of ours while we wait on it
+  */
+ static struct fuse_session *notify_session;
+ 
+ /**
+  * Converts a kernel inode number to ours.
+  */
+ static int ino_to_inum(fuse_ino_t ino) {
+     return (int)(ino - FUSE_ROOT_ID);
+ }
+ 
+ /**
+  * Converts our inode number to the kernel's.
+  */
+ static fuse_ino_t inum_to_ino(int inum) {
+     return (fuse_ino_t)inum + FUSE_ROOT_ID;
+ }
+ 
+ /**
+  * Fills in attributes as the kernel expects them.
+  *
+  * @param inum Our inode number
+  * @param st Pointer to stat struct to fill with attributes
+  * @return 0 on success, -errno on error
+  */
+ static int nufs_stat(int inum, struct stat *st) {
+     int rv = storage_stat_inum(inum, st);
+     if (rv < 0) return rv;
+     st->st_ino = inum_to_ino(inum);
+     return 0;
+ }
+ 
+ /**
+  * Replies to a request that created or found a name.
+  *
+  * The reply hands the kernel a lookup reference, which it gives back
+  * through forget. The kernel holds the parent directory locked until the
+  * reply arrives, so the name cannot be unlinked before it is remembered.
+  *
+  * @param req The request
+  * @param inum Our inode number, or a negative error code
+  * @param fi The open file for create, or NULL
+  */
+ static void nufs_reply_entry(fuse_req_t req, int inum,
+                              struct fuse_file_info *fi) {
+     if (inum < 0) {
+         fuse_reply_err(req, -inum);
+         return;
+     }
+ 
+     struct fuse_entry_param e;
+     memset(&e, 0, sizeof(e));
+     int rv = nufs_stat(inum, &e.attr);
+     if (rv < 0) {
+         fuse_reply_err(req, -rv);
+         return;
+     }
+     e.ino = inum_to_ino(inum);
+     e.attr_timeout = attr_timeout;
+     e.entry_timeout = entry_timeout;
+ 
+     storage_remember(inum, 1);
+     if (fi) {
+         storage_open_inum(inum, fi->flags);
+         fuse_reply_create(req, &e, fi);
      } else {
-         rv = -ENOENT;  // File doesn't exist
+         fuse_reply_entry(req, &e);
      }
+ }
  
-     printf("access(%s, %04o) -> %d\n", path, mask, rv);
-     return rv;
+ /**
+  * Tells whether a kernel inode number names a virtual file.
+  */
+ static int nufs_is_virtual(fuse_ino_t ino) {
+     return ino >= NUFS_VDIR_INO;
  }
  
  /**
-  * Get file attributes (metadata)
-  * 
-  * @param path The file path to examine
+  * Fills in the attributes of a virtual file.
+  *
+  * The stats file reports size 0; it is opened with direct_io, so the
+  * kernel reads it to the end anyway.
+  *
+  * @param ino Kernel inode number of the virtual file
   * @param st Pointer to stat struct to fill with attributes
-  * @return 0 on success, -errno on error
-  * 
-  * Fills in: mode, size, nlink, ino, uid
-  * Special handling for directories to count subdirectory links
+  * @return 0 on success, -ENOENT if there is no such virtual file
   */
- int nufs_getattr(const char *path, struct stat *st) {
+ static int nufs_virtual_stat(fuse_ino_t ino, struct stat *st) {
      memset(st, 0, sizeof(struct stat));
+     if (ino == NUFS_VDIR_INO) {
+         st->st_mode = S_IFDIR | 0555;
+         st->st_nlink = 2;
+     } else if (ino == NUFS_STATS_INO) {
+         st->st_mode = S_IFREG | 0444;
+         st->st_nlink = 1;
+     } else {
+         return -ENOENT;
+     }
+     st->st_ino = ino;
      st->st_uid = getuid();
-     
-     int inum = storage_lookup_path(path);
-     if (inum < 0) return -ENOENT;
-     
-     inode_t *node = get_inode(inum);
-     if (!node) return -ENOENT;
-     
-     st->st_mode = node->mode;
-     st->st_size = node->size;
-     st->st_nlink = 1;
-     st->st_ino = inum;
-     
-     // Special handling for directories
-     if (S_ISDIR(node->mode)) {
-         st->st_nlink = 2;  // Default for directories (. and ..)
-         
-         // Count subdirectories (each adds 1 to nlink)
-         dir_entry_t *entries = blocks_get_block(node->block);
-         int count = node->size / sizeof(dir_entry_t);
-         
-         for (int i = 0; i < count; i++) {
-             if (strcmp(entries[i].name, ".") != 0 && 
-                 strcmp(entries[i].name, "..") != 0) {
-                 inode_t *child = get_inode(entries[i].inum);
-                 if (child && S_ISDIR(child->mode)) {
-                     st->st_nlink++;
-                 }
-             }
+     st->st_atime = st->st_mtime = st->st_ctime = mount_time;
+     return 0;
+ }
+ 
+ /**
+  * Answers a lookup of a virtual file.
+  *
+  * Virtual files hold no lookup references, so forgets for them are
+  * ignored.
+  *
+  * @param req The request
+  * @param ino Kernel inode number of the virtual file
+  */
+ static void nufs_reply_virtual_entry(fuse_req_t req, fuse_ino_t ino) {
+     struct fuse_entry_param e;
+     memset(&e, 0, sizeof(e));
+     nufs_virtual_stat(ino, &e.attr);
+     e.ino = ino;
+     e.attr_timeout = attr_timeout;
+     e.entry_timeout = entry_timeout;
+     fuse_reply_entry(req, &e);
+ }
+ 
+ /**
+  * Lists the virtual /.nufs directory.
+  *
+  * A readdirplus reply leaves out the entries' node IDs, so the kernel
+  * looks them up as usual and takes no references.
+  *
+  * @param req The request
+  * @param size Largest reply the kernel accepts
+  * @param offset Entry to resume from; 0 starts at the beginning
+  * @param plus Nonzero for readdirplus
+  */
+ static void nufs_readdir_virtual(fuse_req_t req, size_t size, off_t offset,
+                                  int plus) {
+     static const struct { const char *name; fuse_ino_t ino; } entries[] = {
+         { ".", NUFS_VDIR_INO },
+         { "..", FUSE_ROOT_ID },
+         { "stats", NUFS_STATS_INO },
+     };
+     char buf[1024];
+     if (size > sizeof(buf)) size = sizeof(buf);
+ 
+     size_t used = 0;
+     for (int i = offset; i < 3; i++) {
+         struct fuse_entry_param e;
+         memset(&e, 0, sizeof(e));
+         e.attr.st_ino = entries[i].ino;
+         e.attr.st_mode = i < 2 ? S_IFDIR : S_IFREG;
+         size_t len = plus
+             ? fuse_add_direntry_plus(req, buf + used, size - used,
+                                      entries[i].name, &e, i + 1)
+             : fuse_add_direntry(req, buf + used, size - used,
+                                 entries[i].name, &e.attr, i + 1);
+         if (len > size - used) break;  // Reply is full
+         used += len;
+     }
+     fuse_reply_buf(req, buf, used);
+ }
+ 
+ /**
+  * Opens the stats file, taking a snapshot of the report.
+  *
+  * Every read of the handle sees the same snapshot, so a report read in
+  * pieces is consistent.
+  *
+  * @param req The request
+  * @param fi File information; fh is set to the snapshot
+  */
+ static void nufs_open_stats(fuse_req_t req, struct fuse_file_info *fi) {
+     if ((fi->flags & O_ACCMODE) != O_RDONLY) {
+         fuse_reply_err(req, EACCES);
+         return;
+     }
+     char *text = malloc(NUFS_STATS_TEXT_MAX);
+     if (!text) {
+         fuse_reply_err(req, ENOMEM);
+         return;
+     }
+     stats_format(text, NUFS_STATS_TEXT_MAX);
+     fi->fh = (uintptr_t)text;
+     fi->direct_io = 1;
+     fuse_reply_open(req, fi);
+ }
+ 
+ /**
+  * Reads from the snapshot taken when the stats file was opened.
+  *
+  * @param req The request
+  * @param size Number of bytes to read
+  * @param offset Offset to read from
+  * @param fi File information holding the snapshot
+  */
+ static void nufs_read_stats(fuse_req_t req, size_t size, off_t offset,
+                             struct fuse_file_info *fi) {
+     const char *text = (const char *)(uintptr_t)fi->fh;
+     size_t len = strlen(text);
+     if (offset >= (off_t)len) {
+         fuse_reply_buf(req, NULL, 0);
+         return;
+     }
+     if (size > len - offset) size = len - offset;
+     fuse_reply_buf(req, text + offset, size);
+ }
+ 
+ /* ====================== FUSE OPERATION IMPLEMENTATIONS ===================== */
+ 
+ /**
+  * Look up a name in a directory
+  *
+  * @param req The request
+  * @param parent Directory to search
+  * @param name Entry name
+  *
+  * Missing names are answered with a negative entry, which the kernel
+  * caches for entry_timeout as well.
+  */
+ static void nufs_lookup(fuse_req_t req, fuse_ino_t parent, const char *name) {
+     uint64_t t0 = stats_start();
+     int inum;
+     if (parent == FUSE_ROOT_ID && strcmp(name, NUFS_VDIR_NAME) == 0) {
+         nufs_reply_virtual_entry(req, NUFS_VDIR_INO);
+         goto out;
+     } else if (parent == NUFS_VDIR_INO) {
+         if (strcmp(name, "stats") == 0) {
+             nufs_reply_virtual_entry(req, NUFS_STATS_INO);
+             goto out;
          }
+         inum = -ENOENT;
+     } else {
+         inum = storage_lookup_at(ino_to_inum(parent), name);
      }
-     
-     return 0;
+ 
+     if (inum == -ENOENT) {
+         struct fuse_entry_param e;
+         memset(&e, 0, sizeof(e));
+         e.entry_timeout = entry_timeout;
+         fuse_reply_entry(req, &e);
+     } else {
+         nufs_reply_entry(req, inum, NULL);
+     }
+ out:
+     stats_end(STATS_LOOKUP, t0);
  }
  
  /**
-  * Read directory contents
-  * 
-  * @param path Directory path to read
-  * @param buf Buffer to fill with directory entries
-  * @param filler FUSE function to add entries to buffer
-  * @param offset Current read offset (unused)
+  * Drop lookup references the kernel no longer needs
+  *
+  * @param req The request
+  * @param ino The inode
+  * @param nlookup Number of references to drop
+  */
+ static void nufs_forget(fuse_req_t req, fuse_ino_t ino, uint64_t nlookup) {
+     if (!nufs_is_virtual(ino)) storage_forget(ino_to_inum(ino), nlookup);
+     fuse_reply_none(req);
+ }
+ 
+ /**
+  * Drop lookup references on several inodes at once
+  *
+  * @param req The request
+  * @param count Number of inodes
+  * @param forgets The inodes and their reference counts
+  */
+ static void nufs_forget_multi(fuse_req_t req, size_t count,
+                               struct fuse_forget_data *forgets) {
+     for (size_t i = 0; i < count; i++) {
+         if (nufs_is_virtual(forgets[i].ino)) continue;
+         storage_forget(ino_to_inum(forgets[i].ino), forgets[i].nlookup);
+     }
+     fuse_reply_none(req);
+ }
+ 
+ /**
+  * Check if a file exists and is accessible with given permissions
+  *
+  * @param req The request
+  * @param ino The inode to check
+  * @param mask The access mode (R_OK, W_OK, X_OK)
+  */
+ static void nufs_access(fuse_req_t req, fuse_ino_t ino, int mask) {
+     struct stat st;
+     int rv;
+     if (nufs_is_virtual(ino)) {
+         rv = (mask & W_OK) ? -EACCES : nufs_virtual_stat(ino, &st);
+     } else {
+         rv = nufs_stat(ino_to_inum(ino), &st);
+     }
+     fuse_reply_err(req, -rv);
+ }
+ 
+ /**
+  * Report the space and inodes of the mounted image, for df
+  *
+  * @param req The request
+  * @param ino Any inode of the filesystem (unused)
+  */
+ static void nufs_statfs(fuse_req_t req, fuse_ino_t ino) {
+     struct statvfs st;
+     storage_statfs(&st);
+     fuse_reply_statfs(req, &st);
+ }
+ 
+ /**
+  * Get file attributes (metadata)
+  *
+  * @param req The request
+  * @param ino The inode to examine
   * @param fi File information (unused)
-  * @return 0 on success, -errno on error
-  * 
-  * Lists all entries in the directory using the FUSE filler function
   */
- int nufs_readdir(const char *path, void *buf, fuse_fill_dir_t filler,
-                  off_t offset, struct fuse_file_info *fi) {
-     printf("readdir(%s)\n", path);
+ static void nufs_getattr(fuse_req_t req, fuse_ino_t ino,
+                          struct fuse_file_info *fi) {
+     uint64_t t0 = stats_start();
+     struct stat st;
+     int rv = nufs_is_virtual(ino) ? nufs_virtual_stat(ino, &st)
+                                   : nufs_stat(ino_to_inum(ino), &st);
+     if (rv < 0) {
+         fuse_reply_err(req, -rv);
+     } else {
+         fuse_reply_attr(req, &st, attr_timeout);
+     }
+     stats_end(STATS_GETATTR, t0);
+ }
+ 
+ /**
+  * Change file attributes
+  *
+  * @param req The request
+  * @param ino The inode to change
+  * @param attr New attribute values
+  * @param to_set FUSE_SET_ATTR_* flags saying which values to apply
+  * @param fi File information (unused)
+  *
+  * Handles chmod, truncate and utimens; ownership cannot be changed.
+  */
+ static void nufs_setattr(fuse_req_t req, fuse_ino_t ino, struct stat *attr,
+                          int to_set, struct fuse_file_info *fi) {
+     int inum = ino_to_inum(ino);
+     int rv = 0;
+ 
+     if (nufs_is_virtual(ino)) rv = -EPERM;
+     if (to_set & (FUSE_SET_ATTR_UID | FUSE_SET_ATTR_GID)) rv = -EPERM;
+     if (rv == 0 && (to_set & FUSE_SET_ATTR_MODE)) {
+         rv = storage_chmod_inum(inum, attr->st_mode);
+     }
+     if (rv == 0 && (to_set & FUSE_SET_ATTR_SIZE)) {
+         rv = storage_truncate_inum(inum, attr->st_size);
+     }
+     if (rv == 0 && (to_set & (FUSE_SET_ATTR_ATIME | FUSE_SET_ATTR_MTIME))) {
+         struct timespec ts[2] = { attr->st_atim, attr->st_mtim };
+         if (!(to_set & FUSE_SET_ATTR_ATIME)) ts[0].tv_nsec = UTIME_OMIT;
+         if (to_set & FUSE_SET_ATTR_ATIME_NOW) ts[0].tv_nsec = UTIME_NOW;
+         if (!(to_set & FUSE_SET_ATTR_MTIME)) ts[1].tv_nsec = UTIME_OMIT;
+         if (to_set & FUSE_SET_ATTR_MTIME_NOW) ts[1].tv_nsec = UTIME_NOW;
+         rv = storage_set_time_inum(inum, ts);
+     }
+ 
+     if (rv < 0) {
+         fuse_reply_err(req, -rv);
+         return;
+     }
+     nufs_getattr(req, ino, fi);
+ }
+ 
+ /**
+  * Adds one directory entry to a readdir or readdirplus reply.
+  *
+  * For readdirplus the entry carries the child's attributes and hands the
+  * kernel a lookup reference, except for "." and "..", which the kernel
+  * resolves itself. The caller holds the directory's read lock, so the
+  * child cannot be unlinked meanwhile.
+  *
+  * @param req The request
+  * @param buf Space left in the reply
+  * @param size Bytes left in buf
+  * @param entry The directory entry
+  * @param next Offset to resume from after this entry
+  * @param plus Nonzero for readdirplus
+  * @return Bytes the entry needs; more than size if it did not fit
+  */
+ static size_t nufs_add_direntry(fuse_req_t req, char *buf, size_t size,
+                                 dir_entry_t *entry, off_t next, int plus) {
+     if (!plus) {
+         struct stat st;
+         memset(&st, 0, sizeof(st));
+         st.st_ino = inum_to_ino(entry->inum);
+         st.st_mode = get_inode(entry->inum)->mode;
+         return fuse_add_direntry(req, buf, size, entry->name, &st, next);
+     }
+ 
+     struct fuse_entry_param e;
+     memset(&e, 0, sizeof(e));
+     int dot = strcmp(entry->name, ".") == 0 || strcmp(entry->name, "..") == 0;
+     if (dot) {
+         // Its lock may already be held, or rank above ours
+         e.attr.st_ino = inum_to_ino(entry->inum);
+         e.attr.st_mode = get_inode(entry->inum)->mode;
+     } else if (nufs_stat(entry->inum, &e.attr) == 0) {
+         e.ino = inum_to_ino(entry->inum);
+         e.attr_timeout = attr_timeout;
+         e.entry_timeout = entry_timeout;
+     }
+ 
+     size_t len = fuse_add_direntry_plus(req, buf, size, entry->name, &e, next);
+     if (len <= size && e.ino) storage_remember(entry->inum, 1);
+     return len;
+ }
+ 
+ /**
+  * A readdir or readdirplus reply being filled by directory_iterate().
+  */
+ typedef struct nufs_listing {
+     fuse_req_t req;
+     char *buf;     // The reply
+     size_t size;   // Largest reply the kernel accepts
+     size_t used;   // Bytes filled so far
+     int plus;      // Nonzero for readdirplus
+ } nufs_listing_t;
  
-     // Lookup directory inode
-     int inum = storage_lookup_path(path);
-     if (inum < 0) return -ENOENT;
+ /**
+  * Adds an entry to a listing, at the offset after its cookie.
+  *
+  * @param entry The directory entry
+  * @param cookie Cookie that resumes after the entry
+  * @param arg The listing
+  * @return 0 to go on, 1 once the reply is full
+  */
+ static int nufs_list_entry(dir_entry_t *entry, uint64_t cookie, void *arg) {
+     nufs_listing_t *ls = arg;
+     size_t len = nufs_add_direntry(ls->req, ls->buf + ls->used,
+                                    ls->size - ls->used, entry,
+                                    (off_t)cookie + 2, ls->plus);
+     if (len > ls->size - ls->used) return 1;
+     ls->used += len;
+     return 0;
+ }
  
+ /**
+  * Lists a directory for readdir and readdirplus.
+  *
+  * Each entry's offset is the position after it, so a listing too large
+  * for one reply continues where the previous one stopped. Offsets are
+  * hash-ordered cookies (see directory_iterate()), which stay valid while
+  * the directory changes.
+  *
+  * @param req The request
+  * @param ino Directory to read
+  * @param size Largest reply the kernel accepts
+  * @param offset Position to resume from; 0 starts at the beginning
+  * @param plus Nonzero to include each entry's attributes
+  */
+ static void nufs_list_directory(fuse_req_t req, fuse_ino_t ino, size_t size,
+                                 off_t offset, int plus) {
+     uint64_t t0 = stats_start();
+     if (ino == NUFS_VDIR_INO) {
+         nufs_readdir_virtual(req, size, offset, plus);
+         stats_end(STATS_READDIR, t0);
+         return;
+     }
+ 
+     int inum = ino_to_inum(ino);
      inode_t *dir = get_inode(inum);
-     if (!dir || !S_ISDIR(dir->mode)) return -ENOTDIR;
+     if (!dir || !S_ISDIR(dir->mode)) {
+         fuse_reply_err(req, ENOTDIR);
+         stats_end(STATS_READDIR, t0);
+         return;
+     }
  
-     // Add standard directory entries
-     filler(buf, ".", NULL, 0);
-     filler(buf, "..", NULL, 0);
+     nufs_listing_t ls = {req, malloc(size), size, 0, plus};
+     if (!ls.buf) {
+         fuse_reply_err(req, ENOMEM);
+         stats_end(STATS_READDIR, t0);
+         return;
+     }
  
-     // Get directory contents
-     dir_entry_t *entries = blocks_get_block(dir->block);
-     int count = dir->size / sizeof(dir_entry_t);
+     inode_rdlock(inum);
  
-     // Add valid entries to FUSE listing
-     for (int i = 0; i < count; i++) {
-         if (entries[i].name[0] != '\0' &&
-             strcmp(entries[i].name, ".") != 0 &&
-             strcmp(entries[i].name, "..") != 0) {
-             struct stat st;
-             char full_path[PATH_MAX];
-             snprintf(full_path, sizeof(full_path), "%s/%s", path, entries[i].name);
-             
-             if (nufs_getattr(full_path, &st) == 0) {
-                 filler(buf, entries[i].name, &st, 0);
-             }
+     // "." and ".." are not stored, so they take offsets 0 and 1, and an
+     // entry's cookie comes at offset cookie + 2
+     int rv = 0;
+     for (off_t pos = offset; pos < 2 && rv == 0; pos++) {
+         dir_entry_t dot;
+         memset(&dot, 0, sizeof(dot));
+         strcpy(dot.name, pos == 0 ? "." : "..");
+         dot.inum = pos == 0 ? inum : dir->parent;
+         size_t len = nufs_add_direntry(req, ls.buf + ls.used, size - ls.used,
+                                        &dot, pos + 1, plus);
+         if (len > size - ls.used) {
+             rv = 1;  // Reply is full
+         } else {
+             ls.used += len;
          }
      }
+     if (rv == 0) {
+         rv = directory_iterate(dir, offset > 2 ? offset - 2 : 0,
+                                nufs_list_entry, &ls);
+     }
+     inode_unlock(inum);
  
-     return 0;
+     if (rv < 0) {
+         fuse_reply_err(req, -rv);
+     } else {
+         fuse_reply_buf(req, ls.buf, ls.used);
+     }
+     free(ls.buf);
+     stats_end(STATS_READDIR, t0);
+ }
+ 
+ /**
+  * Read directory contents
+  *
+  * @param req The request
+  * @param ino Directory to read
+  * @param size Largest reply the kernel accepts
+  * @param offset Position to resume from; 0 starts at the beginning
+  * @param fi File information (unused)
+  */
+ static void nufs_readdir(fuse_req_t req, fuse_ino_t ino, size_t size,
+                          off_t offset, struct fuse_file_info *fi) {
+     nufs_list_directory(req, ino, size, offset, 0);
+ }
+ 
+ /**
+  * Read directory contents along with each entry's attributes
+  *
+  * Saves ls -l and find a lookup and getattr per entry; the kernel
+  * caches the attributes as if each name had been looked up.
+  *
+  * @param req The request
+  * @param ino Directory to read
+  * @param size Largest reply the kernel accepts
+  * @param offset Position to resume from; 0 starts at the beginning
+  * @param fi File information (unused)
+  */
+ static void nufs_readdirplus(fuse_req_t req, fuse_ino_t ino, size_t size,
+                              off_t offset, struct fuse_file_info *fi) {
+     nufs_list_directory(req, ino, size, offset, 1);
  }
  
  /**
   * Create a filesystem node (file, device, etc.)
-  * 
-  * @param path Path for new node
+  *
+  * @param req The request
+  * @param parent Directory to create it in
+  * @param name Name of the new node
   * @param mode File type and permissions
   * @param rdev Device number (unused)
-  * @return 0 on success, -errno on error
   */
- int nufs_mknod(const char *path, mode_t mode, dev_t rdev) {
-     printf("mknod(%s, %04o)\n", path, mode);
-     return storage_mknod(path, mode);
+ static void nufs_mknod(fuse_req_t req, fuse_ino_t parent, const char *name,
+                        mode_t mode, dev_t rdev) {
+     uint64_t t0 = stats_start();
+     log_debug("mknod(%s, %04o)", name, mode);
+     nufs_reply_entry(req, storage_mknod_at(ino_to_inum(parent), name, mode),
+                      NULL);
+     stats_end(STATS_MKNOD, t0);
+ }
+ 
+ /**
+  * Create and open a regular file
+  *
+  * @param req The request
+  * @param parent Directory to create it in
+  * @param name Name of the new file
+  * @param mode File permissions
+  * @param fi File information
+  */
+ static void nufs_create(fuse_req_t req, fuse_ino_t parent, const char *name,
+                         mode_t mode, struct fuse_file_info *fi) {
+     uint64_t t0 = stats_start();
+     log_debug("create(%s, %04o)", name, mode);
+     nufs_reply_entry(req, storage_mknod_at(ino_to_inum(parent), name, mode),
+                      fi);
+     stats_end(STATS_MKNOD, t0);
  }
  
  /**
   * Create a new directory
-  * 
-  * @param path Path for new directory
+  *
+  * @param req The request
+  * @param parent Directory to create it in
+  * @param name Name of the new directory
   * @param mode Directory permissions
-  * @return 0 on success, -errno on error
-  * 
-  * Handles path splitting and parent directory lookup
-  */
- int nufs_mkdir(const char *path, mode_t mode) {
-     printf("mkdir(%s)\n", path);
-     
-     // Handle root directory specially
-     if (strcmp(path, "/") == 0) return -EEXIST;
-     
-     // Split path into parent and new directory name
-     char *path_copy = strdup(path);
-     char *dirname = strrchr(path_copy, '/');
-     if (!dirname || strlen(dirname) <= 1) {
-         free(path_copy);
-         return -EINVAL;
-     }
-     
-     *dirname = '\0';
-     dirname++;  // Now points to the new directory name
-     
-     const char *parent_path = (path_copy[0] == '\0') ? "/" : path_copy;
-     int parent_inum = storage_lookup_path(parent_path);
-     if (parent_inum < 0) {
-         free(path_copy);
-         return parent_inum;
-     }
-     
-     // Create the directory
-     int rv = storage_mkdir_at(parent_inum, dirname, mode);
-     free(path_copy);
-     return rv;
+  */
+ static void nufs_mkdir(fuse_req_t req, fuse_ino_t parent, const char *name,
+                        mode_t mode) {
+     log_debug("mkdir(%s)", name);
+     nufs_reply_entry(req, storage_mkdir_at(ino_to_inum(parent), name, mode),
+                      NULL);
  }
  
  /**
   * Write data to a file
-  * 
-  * @param path File path to write to
-  * @param buf Data buffer to write
-  * @param size Number of bytes to write
+  *
+  * Blocks for the whole range are mapped first and the data is then moved
+  * straight from the request into them. A request read from the kernel
+  * through a pipe is spliced into the image file; one already in memory is
+  * copied into the mapping.
+  *
+  * @param req The request
+  * @param ino File to write to
+  * @param bufv Data to write
   * @param offset File offset to write at
   * @param fi File information (unused)
-  * @return Number of bytes written, or -errno on error
   */
- int nufs_write(const char *path, const char *buf, size_t size, off_t offset,
-                struct fuse_file_info *fi) {
-     printf("write(%s, %ld bytes @%ld)\n", path, size, offset);
-     return storage_write(path, buf, size, offset);
- }
+ static void nufs_write_buf(fuse_req_t req, fuse_ino_t ino,
+                            struct fuse_bufvec *bufv, off_t offset,
+                            struct fuse_file_info *fi) {
+     uint64_t t0 = stats_start();
+     int inum = ino_to_inum(ino);
+     size_t size = fuse_buf_size(bufv);
+     log_debug("write_buf(%lu, %ld bytes @%ld)", (unsigned long)ino, size,
+               offset);
  
- /**
-  * Remove a file (unlink)
-  * 
-  * @param path File path to remove
-  * @return 0 on success, -errno on error
-  * 
-  * Handles directory entry removal and inode cleanup
-  */
- int nufs_unlink(const char *path) {
-     printf("unlink(%s)\n", path);
-     
-     // Split path into parent and filename
-     char *path_copy = strdup(path);
-     if (!path_copy) return -ENOMEM;
-     
-     char *filename = strrchr(path_copy, '/');
-     if (!filename) {
-         free(path_copy);
-         return -EINVAL;
-     }
-     *filename++ = '\0';
-     
-     // Lookup parent directory
-     const char *parent_path = path_copy[0] ? path_copy : "/";
-     int parent_inum = storage_lookup_path(parent_path);
-     if (parent_inum < 0) {
-         free(path_copy);
-         return parent_inum;
-     }
-     
-     inode_t *parent = get_inode(parent_inum);
-     if (!parent || !S_ISDIR(parent->mode)) {
-         free(path_copy);
-         return -ENOTDIR;
-     }
-     
-     // Find the file in the directory
-     int file_inum = directory_lookup(parent, filename);
-     if (file_inum < 0) {
-         free(path_copy);
-         return file_inum;
-     }
-     
-     inode_t *node = get_inode(file_inum);
-     if (!node) {
-         free(path_copy);
-         return -ENOENT;
+     int max_spans = size / BLOCK_SIZE + 2;
+     storage_span_t *spans = malloc(max_spans * sizeof(storage_span_t));
+     struct fuse_bufvec *dst = malloc(sizeof(struct fuse_bufvec) +
+                                      max_spans * sizeof(struct fuse_buf));
+     if (!spans || !dst) {
+         fuse_reply_err(req, ENOMEM);
+         goto out;
      }
-     
-     if (S_ISDIR(node->mode)) {
-         free(path_copy);
-         return -EISDIR;  // Can't unlink directories with this function
+ 
+     int count = storage_write_spans(inum, size, offset, spans, max_spans);
+     if (count < 0) {
+         fuse_reply_err(req, -count);
+         goto out;
      }
  
-     // Remove directory entry
-     dir_entry_t *entries = blocks_get_block(parent->block);
-     int count = parent->size / sizeof(dir_entry_t);
-     int found = 0;
-     
+     int to_fd = bufv->buf[bufv->idx].flags & FUSE_BUF_IS_FD;
+     *dst = FUSE_BUFVEC_INIT(0);
+     dst->count = count;
      for (int i = 0; i < count; i++) {
-         if (strcmp(entries[i].name, filename) == 0) {
-             // Clear and shift entries
-             memset(entries[i].name, 0, sizeof(entries[i].name));
-             
-             if (i < count - 1) {
-                 memmove(&entries[i], &entries[i+1], 
-                         (count - i - 1) * sizeof(dir_entry_t));
-             }
-             
-             memset(&entries[count - 1], 0, sizeof(dir_entry_t));
-             parent->size -= sizeof(dir_entry_t);
-             found = 1;
-             break;
+         struct fuse_buf *buf = &dst->buf[i];
+         buf->size = spans[i].len;
+         if (to_fd && blocks_pos_shared(spans[i].pos)) {
+             buf->flags = FUSE_BUF_IS_FD | FUSE_BUF_FD_SEEK;
+             buf->mem = NULL;
+             buf->fd = blocks_get_fd();
+             buf->pos = spans[i].pos;
+         } else {
+             buf->flags = 0;
+             buf->mem = (char *)blocks_get_block(0) + spans[i].pos;
+             buf->fd = -1;
+             buf->pos = 0;
          }
      }
-     
-     if (!found) {
-         free(path_copy);
-         return -ENOENT;
-     }
  
-     // Free file resources
-     if (node->block >= 0) {
-         free_block(node->block);
+     ssize_t rv = count ? fuse_buf_copy(dst, bufv, 0) : 0;
+     storage_write_spans_done(inum, offset, rv > 0 ? offset + rv : -1);
+     if (rv < 0) {
+         fuse_reply_err(req, -rv);
+     } else {
+         fuse_reply_write(req, rv);
      }
-     free_inode(file_inum);
-     
-     // Update parent directory timestamps
-     parent->mtime = parent->ctime = time(NULL);
-     
-     free(path_copy);
-     return 0;
+ out:
+     free(spans);
+     free(dst);
+     stats_end(STATS_WRITE, t0);
+ }
+ 
+ /**
+  * Remove a file (unlink)
+  *
+  * @param req The request
+  * @param parent Directory holding the file
+  * @param name Name of the file
+  *
+  * Open files keep their data until the kernel forgets them.
+  */
+ static void nufs_unlink(fuse_req_t req, fuse_ino_t parent, const char *name) {
+     uint64_t t0 = stats_start();
+     log_debug("unlink(%s)", name);
+     fuse_reply_err(req, -storage_unlink_at(ino_to_inum(parent), name));
+     stats_end(STATS_UNLINK, t0);
  }
  
  /**
-  * Create a hard link (not implemented)
-  * 
-  * @param from Source path
-  * @param to Destination path
-  * @return -1 (not implemented)
+  * Create a hard link
+  *
+  * @param req The request
+  * @param ino Existing file
+  * @param newparent Directory for the new link
+  * @param newname Name of the new link
   */
- int nufs_link(const char *from, const char *to) {
-     int rv = -1;
-     printf("link(%s => %s) -> %d\n", from, to, rv);
-     return rv;
+ static void nufs_link(fuse_req_t req, fuse_ino_t ino, fuse_ino_t newparent,
+                       const char *newname) {
+     if (nufs_is_virtual(ino) || nufs_is_virtual(newparent)) {
+         fuse_reply_err(req, EPERM);
+         return;
+     }
+     int inum = ino_to_inum(ino);
+     int rv = storage_link_at(inum, ino_to_inum(newparent), newname);
+     log_debug("link(%lu => %s) -> %d", (unsigned long)ino, newname, rv);
+     nufs_reply_entry(req, rv < 0 ? rv : inum, NULL);
  }
  
  /**
   * Remove a directory
-  * 
-  * @param path Directory path to remove
-  * @return 0 on success, -errno on error
-  * 
+  *
+  * @param req The request
+  * @param parent Directory holding the one to remove
+  * @param name Name of the directory
+  *
   * Verifies directory is empty before removal
   */
- int nufs_rmdir(const char *path) {
-     printf("\nRMDIR START: %s\n", path);
+ static void nufs_rmdir(fuse_req_t req, fuse_ino_t parent, const char *name) {
+     log_debug("rmdir(%s)", name);
+     fuse_reply_err(req, -storage_rmdir_at(ino_to_inum(parent), name));
+ }
  
-     // 1. Lookup the target directory
-     int dir_inum = storage_lookup_path(path);
-     if (dir_inum < 0) return dir_inum;
+ /**
+  * Rename/move a file or directory
+  *
+  * @param req The request
+  * @param parent Directory holding the entry
+  * @param name Current name
+  * @param newparent Destination directory
+  * @param newname New name
+  * @param flags RENAME_NOREPLACE, RENAME_EXCHANGE or neither
+  */
+ static void nufs_rename(fuse_req_t req, fuse_ino_t parent, const char *name,
+                         fuse_ino_t newparent, const char *newname,
+                         unsigned int flags) {
+     uint64_t t0 = stats_start();
+     fuse_reply_err(req, -storage_rename_at(ino_to_inum(parent), name,
+                                            ino_to_inum(newparent), newname,
+                                            flags));
+     stats_end(STATS_RENAME, t0);
+ }
  
-     inode_t *dir = get_inode(dir_inum);
-     if (!dir || !S_ISDIR(dir->mode)) return -ENOTDIR;
+ /**
+  * Open a file
+  *
+  * @param req The request
+  * @param ino File to open
+  * @param fi File information
+  *
+  * Checks file exists and permissions are valid
+  */
+ static void nufs_open(fuse_req_t req, fuse_ino_t ino,
+                       struct fuse_file_info *fi) {
+     if (ino == NUFS_STATS_INO) {
+         nufs_open_stats(req, fi);
+         return;
+     }
  
-     // 2. Ensure the directory is empty
-     dir_entry_t *entries = blocks_get_block(dir->block);
-     int count = dir->size / sizeof(dir_entry_t);
-     for (int i = 0; i < count; i++) {
-         if (entries[i].name[0] != '\0' &&
-             strcmp(entries[i].name, ".") != 0 &&
-             strcmp(entries[i].name, "..") != 0) {
-             return -ENOTEMPTY;
-         }
+     int rv = storage_open_inum(ino_to_inum(ino), fi->flags);
+     if (rv < 0) {
+         fuse_reply_err(req, -rv);
+         return;
      }
+     fuse_reply_open(req, fi);
+ }
  
-     // 3. Get parent path and directory name
-     char *path_copy = strdup(path);
-     char *dirname = strrchr(path_copy, '/');
-     if (!dirname) {
-         free(path_copy);
-         return -EINVAL;
-     }
-     *dirname = '\0';
-     dirname++;
- 
-     char name_buf[DIR_NAME_LENGTH];
-     strncpy(name_buf, dirname, DIR_NAME_LENGTH);
-     name_buf[DIR_NAME_LENGTH - 1] = '\0';
- 
-     const char *parent_path = (path_copy[0] == '\0') ? "/" : path_copy;
-     int parent_inum = storage_lookup_path(parent_path);
-     free(path_copy);
-     if (parent_inum < 0) return parent_inum;
- 
-     inode_t *parent = get_inode(parent_inum);
-     if (!parent || !S_ISDIR(parent->mode)) return -ENOTDIR;
- 
-     // 4. Remove the entry from parent directory
-     dir_entry_t *parent_entries = blocks_get_block(parent->block);
-     int parent_count = parent->size / sizeof(dir_entry_t);
-     int found = 0;
-     
-     for (int i = 0; i < parent_count; i++) {
-         printf("Checking parent entry: '%s'\n", parent_entries[i].name);
-         if (strcmp(parent_entries[i].name, name_buf) == 0) {
-             memmove(&parent_entries[i], &parent_entries[i + 1],
-                     (parent_count - i - 1) * sizeof(dir_entry_t));
-             memset(&parent_entries[parent_count - 1], 0, sizeof(dir_entry_t));
-             parent->size -= sizeof(dir_entry_t);
-             parent->mtime = time(NULL);
-             found = 1;
-             break;
-         }
+ /**
+  * Close a file
+  *
+  * @param req The request
+  * @param ino File being closed
+  * @param fi File information, with the flags it was opened with
+  *
+  * Closing the last writable handle returns preallocated blocks
+  */
+ static void nufs_release(fuse_req_t req, fuse_ino_t ino,
+                          struct fuse_file_info *fi) {
+     if (ino == NUFS_STATS_INO) {
+         free((char *)(uintptr_t)fi->fh);
+     } else {
+         storage_release_inum(ino_to_inum(ino), fi->flags);
      }
+     fuse_reply_err(req, 0);
+ }
  
-     if (!found) {
-         printf("ERROR: Entry '%s' not found in parent\n", name_buf);
-         return -ENOENT;
+ /**
+  * Flush a file handle being closed
+  *
+  * @param req The request
+  * @param ino File being flushed
+  * @param fi File information (unused)
+  *
+  * Called on every close(); stamps the time of the writes made so far
+  */
+ static void nufs_flush(fuse_req_t req, fuse_ino_t ino,
+                        struct fuse_file_info *fi) {
+     if (nufs_is_virtual(ino)) {
+         fuse_reply_err(req, 0);
+         return;
      }
+     fuse_reply_err(req, -storage_flush_inum(ino_to_inum(ino)));
+ }
  
-     // 5. Free directory resources
-     free_block(dir->block);
-     free_inode(dir_inum);
+ /**
+  * Make a file durable
+  *
+  * @param req The request
+  * @param ino File to sync
+  * @param datasync Nonzero if only the data needs to be durable (unused;
+  *                 the metadata costs no more)
+  * @param fi File information (unused)
+  *
+  * Writes back the file's blocks and commits the metadata journal
+  */
+ static void nufs_fsync(fuse_req_t req, fuse_ino_t ino, int datasync,
+                        struct fuse_file_info *fi) {
+     fuse_reply_err(req, -storage_fsync_inum(ino_to_inum(ino)));
+ }
  
-     printf("RMDIR SUCCESS: %s\n", path);
-     blocks_flush();
-     return 0;
+ /**
+  * Make a directory durable
+  *
+  * @param req The request
+  * @param ino Directory to sync
+  * @param datasync Nonzero if only the contents need to be durable (unused)
+  * @param fi File information (unused)
+  *
+  * Directory changes are all journaled, so this only commits the journal
+  */
+ static void nufs_fsyncdir(fuse_req_t req, fuse_ino_t ino, int datasync,
+                           struct fuse_file_info *fi) {
+     fuse_reply_err(req, -storage_fsync_inum(ino_to_inum(ino)));
  }
  
  /**
-  * Rename/move a file or directory
-  * 
-  * @param from Source path
-  * @param to Destination path
-  * @return 0 on success, -errno on error
-  * 
-  * Implements atomic rename by first adding new entry then removing old
-  */
- int nufs_rename(const char *from, const char *to) {
-     // Verify both paths are absolute
-     if (from[0] != '/' || to[0] != '/') return -EINVAL;
- 
-     // Lookup source
-     int from_inum = storage_lookup_path(from);
-     if (from_inum < 0) return from_inum;
- 
-     // Split paths into parent and name components
-     char *from_copy = strdup(from);
-     char *from_name = strrchr(from_copy, '/');
-     if (!from_name) {
-         free(from_copy);
-         return -EINVAL;
-     }
-     *from_name++ = '\0';
- 
-     char *to_copy = strdup(to);
-     char *to_name = strrchr(to_copy, '/');
-     if (!to_name) {
-         free(from_copy);
-         free(to_copy);
-         return -EINVAL;
-     }
-     *to_name++ = '\0';
- 
-     // Get parent directories
-     const char *from_parent_path = (from_copy[0] == '\0') ? "/" : from_copy;
-     const char *to_parent_path = (to_copy[0] == '\0') ? "/" : to_copy;
- 
-     int from_parent = storage_lookup_path(from_parent_path);
-     int to_parent = storage_lookup_path(to_parent_path);
-     
-     if (from_parent < 0 || to_parent < 0) {
-         free(from_copy);
-         free(to_copy);
-         return -ENOENT;
-     }
+  * Preallocate space for a file
+  *
+  * @param req The request
+  * @param ino File to allocate for
+  * @param mode 0, FALLOC_FL_KEEP_SIZE, or FALLOC_FL_PUNCH_HOLE with
+  *             FALLOC_FL_KEEP_SIZE
+  * @param offset Start of the range
+  * @param length Length of the range
+  * @param fi File information (unused)
+  */
+ static void nufs_fallocate(fuse_req_t req, fuse_ino_t ino, int mode,
+                            off_t offset, off_t length,
+                            struct fuse_file_info *fi) {
+     fuse_reply_err(req, -storage_fallocate_inum(ino_to_inum(ino), mode,
+                                                 offset, length));
+ }
  
-     // Atomic rename: first add to new location
-     int rv = directory_put(get_inode(to_parent), to_name, from_inum);
+ /**
+  * Find the next data or hole in a file
+  *
+  * Only SEEK_DATA and SEEK_HOLE reach the filesystem; the kernel handles
+  * the other kinds of seek itself.
+  *
+  * @param req The request
+  * @param ino File to search
+  * @param off Offset to start from
+  * @param whence SEEK_DATA or SEEK_HOLE
+  * @param fi File information (unused)
+  */
+ static void nufs_lseek(fuse_req_t req, fuse_ino_t ino, off_t off, int whence,
+                        struct fuse_file_info *fi) {
+     if (nufs_is_virtual(ino)) {
+         fuse_reply_err(req, ENXIO); // No size to search within
+         return;
+     }
+     off_t rv = storage_seek_inum(ino_to_inum(ino), off, whence);
      if (rv < 0) {
-         free(from_copy);
-         free(to_copy);
-         return rv;
+         fuse_reply_err(req, -rv);
+     } else {
+         fuse_reply_lseek(req, rv);
      }
+ }
  
-     // Then remove from old location
-     rv = directory_delete(get_inode(from_parent), from_name);
-     if (rv < 0) {
-         // Rollback if delete fails
-         directory_delete(get_inode(to_parent), to_name);
-         free(from_copy);
-         free(to_copy);
-         return rv;
+ /**
+  * Read data from a file
+  *
+  * The reply is built from pieces of the image rather than copied into a
+  * buffer. When the kernel accepts spliced replies each piece names a range
+  * of the image file, and libfuse splices the page cache straight into the
+  * reply; otherwise the pieces point into the mapping and are sent with one
+  * writev. Holes are sent from a buffer of zeros. The file stays
+  * read-locked until the reply has gone out.
+  *
+  * @param req The request
+  * @param ino File to read
+  * @param size Number of bytes to read
+  * @param offset Offset to read from
+  * @param fi File information (unused)
+  */
+ static void nufs_read(fuse_req_t req, fuse_ino_t ino, size_t size,
+                       off_t offset, struct fuse_file_info *fi) {
+     if (ino == NUFS_STATS_INO) {
+         nufs_read_stats(req, size, offset, fi);
+         return;
      }
  
-     free(from_copy);
-     free(to_copy);
-     return 0;
+     uint64_t t0 = stats_start();
+     int inum = ino_to_inum(ino);
+     int max_spans = size / BLOCK_SIZE + 2;
+     int max_bufs = max_spans + size / NUFS_HOLE_ZEROS;  // Holes may split
+     storage_span_t *spans = malloc(max_spans * sizeof(storage_span_t));
+     struct fuse_bufvec *bufv = malloc(sizeof(struct fuse_bufvec) +
+                                       max_bufs * sizeof(struct fuse_buf));
+     char *unpacked = NULL;
+     if (!spans || !bufv) {
+         fuse_reply_err(req, ENOMEM);
+         goto out;
+     }
+ 
+     int count = storage_read_spans(inum, size, offset, spans, max_spans);
+     if (count < 0) {
+         fuse_reply_err(req, -count);
+     } else {
+         // Compressed data is decompressed into a buffer of its own
+         size_t packed = 0;
+         for (int i = 0; i < count; i++) {
+             if (spans[i].pos == STORAGE_SPAN_PACKED) packed += spans[i].len;
+         }
+         int rv = 0;
+         if (packed > 0 && !(unpacked = malloc(packed))) rv = -ENOMEM;
+         char *fill = unpacked;
+         off_t at = offset;
+ 
+         *bufv = FUSE_BUFVEC_INIT(0);
+         bufv->count = 0;
+         for (int i = 0; i < count && rv == 0; i++) {
+             struct fuse_buf *buf = &bufv->buf[bufv->count++];
+             buf->size = spans[i].len;
+             if (spans[i].pos == STORAGE_SPAN_PACKED) {
+                 rv = storage_read_packed(inum, at, fill, spans[i].len);
+                 buf->flags = 0;
+                 buf->mem = fill;
+                 buf->fd = -1;
+                 buf->pos = 0;
+                 fill += spans[i].len;
+             } else if (spans[i].pos < 0) {
+                 // Read holes from the zeros, in pieces if need be
+                 size_t left = spans[i].len;
+                 for (;;) {
+                     buf->size = left < NUFS_HOLE_ZEROS ? left : NUFS_HOLE_ZEROS;
+                     buf->flags = 0;
+                     buf->mem = hole_zeros;
+                     buf->fd = -1;
+                     buf->pos = 0;
+                     left -= buf->size;
+                     if (left == 0) break;
+                     buf = &bufv->buf[bufv->count++];
+                 }
+             } else if (splice_reads && blocks_pos_shared(spans[i].pos)) {
+                 buf->flags = FUSE_BUF_IS_FD | FUSE_BUF_FD_SEEK;
+                 buf->mem = NULL;
+                 buf->fd = blocks_get_fd();
+                 buf->pos = spans[i].pos;
+             } else {
+                 buf->flags = 0;
+                 buf->mem = (char *)blocks_get_block(0) + spans[i].pos;
+                 buf->fd = -1;
+                 buf->pos = 0;
+             }
+             at += spans[i].len;
+         }
+ 
+         if (rv < 0) {
+             fuse_reply_err(req, -rv);
+         } else if (count == 0) {
+             fuse_reply_buf(req, NULL, 0);
+         } else {
+             fuse_reply_data(req, bufv, 0);
+         }
+         storage_read_spans_done(inum);
+     }
+ 
+ out:
+     free(spans);
+     free(bufv);
+     free(unpacked);
+     stats_end(STATS_READ, t0);
  }
  
  /**
-  * Change file permissions (not implemented)
-  * 
-  * @param path File path
-  * @param mode New permissions
-  * @return -1 (not implemented)
+  * Answer a getxattr or listxattr request
+  *
+  * @param req The request
+  * @param data The value or list
+  * @param len Its length
+  * @param size Room the caller gave, or 0 to ask for the length
   */
- int nufs_chmod(const char *path, mode_t mode) {
-     int rv = -1;
-     printf("chmod(%s, %04o) -> %d\n", path, mode, rv);
-     return rv;
+ static void nufs_reply_xattr(fuse_req_t req, const char *data, size_t len,
+                              size_t size) {
+     if (size == 0) {
+         fuse_reply_xattr(req, len);
+     } else if (size < len) {
+         fuse_reply_err(req, ERANGE);
+     } else {
+         fuse_reply_buf(req, data, len);
+     }
  }
  
  /**
-  * Truncate or extend a file
-  * 
-  * @param path File path
-  * @param size New size
-  * @return 0 on success, -errno on error
+  * Set an extended attribute
+  *
+  * @param req The request
+  * @param ino File or directory
+  * @param name Attribute name; only NUFS_XATTR_COMPRESS is supported
+  * @param value "lz4" to compress, "none" not to
+  * @param size Length of value
+  * @param flags XATTR_CREATE or XATTR_REPLACE, or 0
+  *
+  * The attribute exists while the file or directory is marked for
+  * compression.
   */
- int nufs_truncate(const char *path, off_t size) {
-     int inum = storage_lookup_path(path);
-     if (inum < 0) return -ENOENT;
-     
-     inode_t *node = get_inode(inum);
-     if (!node) return -ENOENT;
-     
-     // For now, just update the size
-     node->size = size;
-     return 0;
+ static void nufs_setxattr(fuse_req_t req, fuse_ino_t ino, const char *name,
+                           const char *value, size_t size, int flags) {
+     if (nufs_is_virtual(ino) || strcmp(name, NUFS_XATTR_COMPRESS) != 0) {
+         fuse_reply_err(req, ENOTSUP);
+         return;
+     }
+ 
+     if (size > 0 && value[size - 1] == '\0') size--;
+     int on = -1;
+     if (size == 3 && memcmp(value, "lz4", 3) == 0) on = 1;
+     if (size == 4 && memcmp(value, "none", 4) == 0) on = 0;
+     if (on < 0) {
+         fuse_reply_err(req, EINVAL);
+         return;
+     }
+ 
+     int inum = ino_to_inum(ino);
+     int rv = storage_get_compress_inum(inum);
+     if (rv >= 0 && (flags & XATTR_CREATE) && rv) rv = -EEXIST;
+     if (rv >= 0 && (flags & XATTR_REPLACE) && !rv) rv = -ENODATA;
+     if (rv >= 0) rv = storage_set_compress_inum(inum, on);
+     fuse_reply_err(req, -rv);
  }
  
  /**
-  * Open a file
-  * 
-  * @param path File path
-  * @param fi File information
-  * @return 0 on success, -errno on error
-  * 
-  * Checks file exists and permissions are valid
+  * Read an extended attribute
+  *
+  * @param req The request
+  * @param ino File or directory
+  * @param name Attribute name
+  * @param size Room for the value, or 0 to ask for its length
   */
- int nufs_open(const char *path, struct fuse_file_info *fi) {
-     int inum = storage_lookup_path(path);
-     if (inum < 0) return -ENOENT;
-     
-     inode_t *node = get_inode(inum);
-     if (!node) return -ENOENT;
-     
-     // Check access modes
-     if ((fi->flags & O_ACCMODE) != O_RDONLY) {
-         if ((node->mode & 0222) == 0) return -EACCES;
+ static void nufs_getxattr(fuse_req_t req, fuse_ino_t ino, const char *name,
+                           size_t size) {
+     int rv = -ENODATA;
+     if (!nufs_is_virtual(ino) && strcmp(name, NUFS_XATTR_COMPRESS) == 0) {
+         rv = storage_get_compress_inum(ino_to_inum(ino));
+         if (rv == 0) rv = -ENODATA;
+     }
+     if (rv < 0) {
+         fuse_reply_err(req, -rv);
+     } else {
+         nufs_reply_xattr(req, "lz4", 3, size);
      }
-     
-     return 0;
  }
  
  /**
-  * Read data from a file
-  * 
-  * @param path File path
-  * @param buf Buffer to read into
-  * @param size Number of bytes to read
-  * @param offset Offset to read from
-  * @param fi File information (unused)
-  * @return Number of bytes read, or -errno on error
-  */
- int nufs_read(const char *path, char *buf, size_t size, off_t offset,
-               struct fuse_file_info *fi) {
-     int inum = storage_lookup_path(path);
-     if (inum < 0) return -ENOENT;
-     
-     inode_t *node = get_inode(inum);
-     if (!node || !S_ISREG(node->mode)) return -EISDIR;
-     
-     // Check bounds
-     if (offset >= node->size) return 0;
-     if (offset + size > node->size) size = node->size - offset;
-     
-     // Read data
-     void *block = blocks_get_block(node->block);
-     memcpy(buf, block + offset, size);
-     
-     // Update access time
-     node->atime = time(NULL);
-     
-     return size;
- }
- 
- /**
-  * Update file timestamps
-  * 
-  * @param path File path
-  * @param ts Timespec array (atime, mtime)
-  * @return 0 on success, -errno on error
-  * 
-  * Currently sets both times to current time
-  */
- int nufs_utimens(const char *path, const struct timespec ts[2]) {
-     int inum = storage_lookup_path(path);
-     if (inum < 0) return -ENOENT;
-     
-     inode_t *node = get_inode(inum);
-     if (!node) return -ENOENT;
-     
-     // Update timestamps (simplified to current time)
-     time_t now = time(NULL);
-     node->atime = now;
-     node->mtime = now;
-     
-     return 0;
+  * List extended attributes
+  *
+  * @param req The request
+  * @param ino File or directory
+  * @param size Room for the list, or 0 to ask for its length
+  */
+ static void nufs_listxattr(fuse_req_t req, fuse_ino_t ino, size_t size) {
+     int rv = 0;
+     if (!nufs_is_virtual(ino)) rv = storage_get_compress_inum(ino_to_inum(ino));
+     if (rv < 0) {
+         fuse_reply_err(req, -rv);
+     } else {
+         // Names are listed with their terminating NULs
+         nufs_reply_xattr(req, NUFS_XATTR_COMPRESS,
+                          rv ? sizeof(NUFS_XATTR_COMPRESS) : 0, size);
+     }
  }
  
  /**
-  * IOCTL operation (not implemented)
-  * 
-  * @param path File path
+  * Remove an extended attribute
+  *
+  * @param req The request
+  * @param ino File or directory
+  * @param name Attribute name
+  */
+ static void nufs_removexattr(fuse_req_t req, fuse_ino_t ino, const char *name) {
+     int rv = -ENODATA;
+     if (!nufs_is_virtual(ino) && strcmp(name, NUFS_XATTR_COMPRESS) == 0) {
+         int inum = ino_to_inum(ino);
+         rv = storage_get_compress_inum(inum);
+         if (rv == 0) rv = -ENODATA;
+         if (rv > 0) rv = storage_set_compress_inum(inum, 0);
+     }
+     fuse_reply_err(req, -rv);
+ }
+ 
+ /**
+  * Copy a range of one file into another
+  *
+  * The copy stays inside the filesystem, and on images with dedup whole
+  * blocks are shared instead of copied.
+  *
+  * @param req The request
+  * @param ino_in File to copy from
+  * @param off_in Offset to copy from
+  * @param fi_in File information of the source (unused)
+  * @param ino_out File to copy to
+  * @param off_out Offset to copy to
+  * @param fi_out File information of the target (unused)
+  * @param len Number of bytes to copy
+  * @param flags Must be 0
+  */
+ static void nufs_copy_file_range(fuse_req_t req, fuse_ino_t ino_in,
+                                  off_t off_in, struct fuse_file_info *fi_in,
+                                  fuse_ino_t ino_out, off_t off_out,
+                                  struct fuse_file_info *fi_out, size_t len,
+                                  int flags) {
+     if (flags != 0) {
+         fuse_reply_err(req, EINVAL);
+         return;
+     }
+     if (nufs_is_virtual(ino_in) || nufs_is_virtual(ino_out)) {
+         fuse_reply_err(req, EOPNOTSUPP); // The kernel falls back to a copy
+         return;
+     }
+ 
+     ssize_t rv = storage_copy_range_inum(ino_to_inum(ino_in), off_in,
+                                          ino_to_inum(ino_out), off_out, len);
+     log_debug("copy_file_range(%lu @%ld, %lu @%ld, %zu) -> %zd",
+               (unsigned long)ino_in, off_in, (unsigned long)ino_out, off_out,
+               len, rv);
+     if (rv < 0) {
+         fuse_reply_err(req, -rv);
+     } else {
+         fuse_reply_write(req, rv);
+     }
+ }
+ 
+ /**
+  * Makes an applied batch ready to return to the caller
+  *
+  * Inode numbers are turned into the kernel's, and the kernel is told to
+  * drop what it cached for every name created or removed, since it saw
+  * none of those changes go by.
+  *
+  * @param parent The directory the batch was applied to
+  * @param batch The batch, with its results filled in
+  */
+ static void nufs_batch_finish(fuse_ino_t parent, struct nufs_batch *batch) {
+     for (uint32_t i = 0; i < batch->count; i++) {
+         struct nufs_batch_entry *e = &batch->entries[i];
+         if (e->result != 0) continue;
+         if (e->op != NUFS_BATCH_UNLINK) e->ino = inum_to_ino(e->ino);
+         if (e->op != NUFS_BATCH_STAT && notify_session) {
+             fuse_lowlevel_notify_inval_entry(notify_session, parent, e->name,
+                                              strlen(e->name));
+         }
+     }
+ }
+ 
+ /**
+  * IOCTL operation
+  *
+  * @param req The request
+  * @param ino File the ioctl was issued on
   * @param cmd IOCTL command
   * @param arg Command argument
   * @param fi File information
   * @param flags Additional flags
-  * @param data Additional data
-  * @return -1 (not implemented)
+  * @param in_buf Data copied in from the caller
+  * @param in_bufsz Size of in_buf
+  * @param out_bufsz Room for data copied back out
+  *
+  * NUFS_IOC_STATS returns the statistics report on any file,
+  * NUFS_IOC_CLONE_RANGE clones another file's blocks into this one, and
+  * NUFS_IOC_BATCH applies a batch of operations to names in this
+  * directory; other commands are not supported.
+  */
+ static void nufs_ioctl(fuse_req_t req, fuse_ino_t ino, unsigned int cmd,
+                        void *arg, struct fuse_file_info *fi, unsigned flags,
+                        const void *in_buf, size_t in_bufsz,
+                        size_t out_bufsz) {
+     if (cmd == NUFS_IOC_STATS && out_bufsz >= NUFS_STATS_TEXT_MAX) {
+         char *text = malloc(NUFS_STATS_TEXT_MAX);
+         if (!text) {
+             fuse_reply_err(req, ENOMEM);
+             return;
+         }
+         stats_format(text, NUFS_STATS_TEXT_MAX);
+         fuse_reply_ioctl(req, 0, text, NUFS_STATS_TEXT_MAX);
+         free(text);
+         return;
+     }
+ 
+     int rv = -ENOTTY;
+     if (cmd == NUFS_IOC_CLONE_RANGE) {
+         const struct nufs_clone_range *range = in_buf;
+         if (in_bufsz < sizeof(*range) || nufs_is_virtual(ino) ||
+             range->src_ino < FUSE_ROOT_ID ||
+             range->src_ino - FUSE_ROOT_ID >= (uint64_t)INODE_COUNT) {
+             rv = -EINVAL;
+         } else {
+             rv = storage_clone_range_inum(ino_to_inum(range->src_ino),
+                                           range->src_offset, ino_to_inum(ino),
+                                           range->dest_offset, range->length);
+         }
+         if (rv == 0) {
+             fuse_reply_ioctl(req, 0, NULL, 0);
+             return;
+         }
+     } else if (cmd == NUFS_IOC_BATCH) {
+         struct nufs_batch *batch = NULL;
+         if (in_bufsz < sizeof(*batch) || out_bufsz < sizeof(*batch)) {
+             rv = -EINVAL;
+         } else if (nufs_is_virtual(ino)) {
+             rv = -ENOTDIR;
+         } else if (!(batch = malloc(sizeof(*batch)))) {
+             rv = -ENOMEM;
+         } else {
+             memcpy(batch, in_buf, sizeof(*batch));
+             rv = storage_batch_at(ino_to_inum(ino), batch->entries,
+                                   batch->count);
+         }
+         if (rv >= 0) {
+             batch->done = rv;
+             nufs_batch_finish(ino, batch);
+             fuse_reply_ioctl(req, 0, batch, sizeof(*batch));
+             free(batch);
+             return;
+         }
+         free(batch);
+     }
+     log_debug("ioctl(%lu, %u, ...) -> %d", (unsigned long)ino, cmd, rv);
+     fuse_reply_err(req, -rv);
+ }
+ 
+ /**
+  * Negotiate features with the kernel
+  *
+  * @param userdata Session user data (unused)
+  * @param conn Connection parameters and capabilities
   */
- int nufs_ioctl(const char *path, int cmd, void *arg, struct fuse_file_info *fi,
-                unsigned int flags, void *data) {
-     int rv = -1;
-     printf("ioctl(%s, %d, ...) -> %d\n", path, cmd, rv);
-     return rv;
+ static void nufs_init(void *userdata, struct fuse_conn_info *conn) {
+     if (conn->capable & FUSE_CAP_SPLICE_WRITE) {
+         conn->want |= FUSE_CAP_SPLICE_WRITE;
+         splice_reads = 1;
+     }
+ 
+     // Let write requests arrive in a pipe so write_buf can splice them
+     if (conn->capable & FUSE_CAP_SPLICE_READ) {
+         conn->want |= FUSE_CAP_SPLICE_READ;
+     }
+ 
+     // Started here rather than in main, since daemonizing drops threads
+     if (scrub) fsck_scrub_start();
+ }
+ 
+ /**
+  * Clean up when the file system is unmounted
+  *
+  * @param userdata Session user data (unused)
+  *
+  * The kernel drops all of its references at unmount without sending
+  * forgets, so inodes unlinked while open are freed here.
+  */
+ static void nufs_destroy(void *userdata) {
+     fsck_scrub_stop();
+     storage_forget_all();
+     blocks_flush();
  }
  
  /* ====================== FUSE INITIALIZATION ===================== */
  
+ static const struct fuse_lowlevel_ops nufs_ops = {
+     .init = nufs_init,
+     .destroy = nufs_destroy,
+     .lookup = nufs_lookup,
+     .forget = nufs_forget,
+     .forget_multi = nufs_forget_multi,
+     .access = nufs_access,
+     .statfs = nufs_statfs,
+     .getattr = nufs_getattr,
+     .setattr = nufs_setattr,
+     .readdir = nufs_readdir,
+     .readdirplus = nufs_readdirplus,
+     .mknod = nufs_mknod,
+     .create = nufs_create,
+     .mkdir = nufs_mkdir,
+     .link = nufs_link,
+     .unlink = nufs_unlink,
+     .rmdir = nufs_rmdir,
+     .rename = nufs_rename,
+     .open = nufs_open,
+     .release = nufs_release,
+     .flush = nufs_flush,
+     .fsync = nufs_fsync,
+     .fsyncdir = nufs_fsyncdir,
+     .fallocate = nufs_fallocate,
+     .lseek = nufs_lseek,
+     .copy_file_range = nufs_copy_file_range,
+     .setxattr = nufs_setxattr,
+     .getxattr = nufs_getxattr,
+     .listxattr = nufs_listxattr,
+     .removexattr = nufs_removexattr,
+     .read = nufs_read,
+     .write_buf = nufs_write_buf,
+     .ioctl = nufs_ioctl,
+ };
+ 
  /**
-  * Initialize FUSE operations structure
-  * 
-  * @param ops Pointer to fuse_operations struct to populate
+  * NUFS-specific mount options
+  *
+  * The geometry options are given as
+  * "-o size=1G,max_size=64G,block_size=4096,inodes=65536,journal_size=4M,dedup"
+  * and only matter when the image has no superblock yet.
+  *
+  * "-o scrub" checks the mounted image in the background (see fsck.h).
   */
- void nufs_init_ops(struct fuse_operations *ops) {
-     memset(ops, 0, sizeof(struct fuse_operations));
-     ops->access = nufs_access;
-     ops->getattr = nufs_getattr;
-     ops->readdir = nufs_readdir;
-     ops->mknod = nufs_mknod;
-     ops->mkdir = nufs_mkdir;
-     ops->link = nufs_link;
-     ops->unlink = nufs_unlink;
-     ops->rmdir = nufs_rmdir;
-     ops->rename = nufs_rename;
-     ops->chmod = nufs_chmod;
-     ops->truncate = nufs_truncate;
-     ops->open = nufs_open;
-     ops->read = nufs_read;
-     ops->write = nufs_write;
-     ops->utimens = nufs_utimens;
-     ops->ioctl = nufs_ioctl;
- }
+ typedef struct nufs_config {
+     char *size;            // Initial image size
+     char *max_size;        // Largest size the image may grow to while mounted
+     int block_size;        // Bytes per block
+     int inodes;            // Number of inodes
+     char *journal_size;    // Bytes for the metadata journal
+     int dedup;             // Share blocks with identical contents
+     int log_level;         // Most verbose message level to log
+     int no_path_cache;     // Resolve paths component by component only
+     int atime;             // STORAGE_ATIME_* policy for access times
+     int huge_pages;        // Back the image mapping with huge pages
+     int scrub;             // Check the image in the background
+     double entry_timeout;  // Seconds the kernel may cache names
+     double attr_timeout;   // Seconds the kernel may cache attributes
+ } nufs_config_t;
  
- struct fuse_operations nufs_ops;
+ #define NUFS_OPT(templ, field, value) \
+     { templ, offsetof(nufs_config_t, field), value }
+ 
+ static const struct fuse_opt nufs_opts[] = {
+     NUFS_OPT("size=%s", size, 0),
+     NUFS_OPT("max_size=%s", max_size, 0),
+     NUFS_OPT("block_size=%d", block_size, 0),
+     NUFS_OPT("inodes=%d", inodes, 0),
+     NUFS_OPT("journal_size=%s", journal_size, 0),
+     NUFS_OPT("dedup", dedup, 1),
+     NUFS_OPT("nopathcache", no_path_cache, 1),
+     NUFS_OPT("relatime", atime, STORAGE_ATIME_RELATIVE),
+     NUFS_OPT("strictatime", atime, STORAGE_ATIME_STRICT),
+     NUFS_OPT("noatime", atime, STORAGE_ATIME_NEVER),
+     NUFS_OPT("hugepages", huge_pages, 1),
+     NUFS_OPT("scrub", scrub, 1),
+     NUFS_OPT("entry_timeout=%lf", entry_timeout, 0),
+     NUFS_OPT("attr_timeout=%lf", attr_timeout, 0),
+     NUFS_OPT("log_level=%d", log_level, 0),
+     FUSE_OPT_END
+ };
+ 
+ /**
+  * Parse a byte count with an optional K, M, G or T suffix
+  *
+  * @param text The option value, e.g. "64G"
+  * @return The number of bytes, or -1 if the value is malformed
+  */
+ static int64_t parse_size(const char *text) {
+     char *end;
+     int64_t bytes = strtoll(text, &end, 10);
+     if (end == text || bytes < 0) return -1;
+     if (*end == '\0') return bytes;
+ 
+     const char *units = "KMGT";
+     const char *unit = strchr(units, toupper((unsigned char)*end));
+     if (!unit || end[1] != '\0') return -1;
+     for (const char *u = units; u <= unit; u++) {
+         bytes *= 1024;
+     }
+     return bytes;
+ }
  
  /**
   * Main entry point for NUFS
-  * 
+  *
   * @param argc Argument count
   * @param argv Argument vector
-  * @return FUSE operation result
-  * 
-  * Initializes storage and starts FUSE main loop
+  * @return 0 on a clean unmount, nonzero on error
+  *
+  * Initializes storage, mounts the file system and serves requests until
+  * it is unmounted
   */
  int main(int argc, char *argv[]) {
-     assert(argc > 2 && argc < 6);
-     storage_init(argv[--argc]);  // Initialize with disk image path
-     nufs_init_ops(&nufs_ops);
-     return fuse_main(argc, argv, &nufs_ops, NULL);
- }
\ No newline at end of file
+     assert(argc > 2);
+     const char *image_path = argv[--argc];  // Disk image path is always last
+ 
+     struct fuse_args args = FUSE_ARGS_INIT(argc, argv);
+     nufs_config_t conf = {0};
+     conf.entry_timeout = NUFS_DEFAULT_TIMEOUT;
+     conf.attr_timeout = NUFS_DEFAULT_TIMEOUT;
+     conf.log_level = log_level;
+     if (fuse_opt_parse(&args, &conf, nufs_opts, NULL) == -1) return 1;
+ 
+     struct fuse_cmdline_opts opts;
+     if (fuse_parse_cmdline(&args, &opts) != 0) return 1;
+     if (opts.show_help) {
+         printf("usage: %s [options] <mountpoint> <image>\n\n", argv[0]);
+         fuse_cmdline_help();
+         fuse_lowlevel_help();
+         return 0;
+     }
+     if (!opts.mountpoint) {
+         fprintf(stderr, "usage: %s [options] <mountpoint> <image>\n", argv[0]);
+         return 1;
+     }
+ 
+     blocks_geometry_t geo;
+     storage_default_geometry(&geo);
+     if (conf.size) geo.size = parse_size(conf.size);
+     if (conf.max_size) geo.max_size = parse_size(conf.max_size);
+     if (conf.block_size) geo.block_size = conf.block_size;
+     if (conf.inodes) geo.inode_count = conf.inodes;
+     if (conf.journal_size) geo.journal_size = parse_size(conf.journal_size);
+     geo.dedup = conf.dedup;
+     if (geo.size <= 0 || geo.max_size <= 0 || geo.inode_count <= 0 ||
+         geo.journal_size < 0) {
+         fprintf(stderr, "Error: invalid size or inode count option\n");
+         return 1;
+     }
+     if (conf.entry_timeout < 0 || conf.attr_timeout < 0) {
+         fprintf(stderr, "Error: invalid cache timeout option\n");
+         return 1;
+     }
+     entry_timeout = conf.entry_timeout;
+     log_level = conf.log_level;
+     attr_timeout = conf.attr_timeout;
+     scrub = conf.scrub;
+ 
+     mount_time = time(NULL);
+     blocks_set_huge_pages(conf.huge_pages);
+     storage_init(image_path, &geo);  // Initialize with disk image path
+     dcache_set_path_cache(!conf.no_path_cache);
+     storage_set_atime_mode(conf.atime);
+ 
+     int rv = 1;
+     struct fuse_session *se =
+         fuse_session_new(&args, &nufs_ops, sizeof(nufs_ops), NULL);
+     if (se) {
+         if (!opts.singlethread) notify_session = se;
+         if (fuse_set_signal_handlers(se) == 0) {
+             if (fuse_session_mount(se, opts.mountpoint) == 0) {
+                 fuse_daemonize(opts.foreground);
+                 log_start();  // Threads do not survive daemonizing
+                 if (opts.singlethread) {
+                     rv = fuse_session_loop(se);
+                 } else {
+                     struct fuse_loop_config config = {
+                         .clone_fd = opts.clone_fd,
+                         .max_idle_threads = opts.max_idle_threads,
+                     };
+                     rv = fuse_session_loop_mt(se, &config);
+                 }
+                 fuse_session_unmount(se);
+             }
+             fuse_remove_signal_handlers(se);
+         }
+         fuse_session_destroy(se);
+     }
+     log_stop();
+ 
+     free(opts.mountpoint);
+     fuse_opt_free_args(&args);
+     return rv ? 1 : 0;
+ }
@@ -0,0 +1,100 @@
+/**
+ * @file nufsck.c
+ * @brief Checks and repairs an unmounted disk image
+ *
+ * Usage: nufsck [-n | -y] [-j threads] image
+ *
+ * With -n, the default, problems are only reported; with -y they are
+ * repaired. The exit status follows fsck(8): 0 if the image was
+ * consistent, 1 if problems were found and all repaired, 4 if problems
+ * were left, 8 if the image could not be checked.
+ */
+
+ #include <errno.h>
+ #include <fcntl.h>
+ #include <stdint.h>
+ #include <stdio.h>
+ #include <stdlib.h>
+ #include <string.h>
+ #include <unistd.h>
+
+ #include "fsck.h"
+ #include "storage.h"
+ #include "helpers/blocks.h"
+ #include "helpers/log.h"
+
+ #define NUFSCK_CLEAN 0
+ #define NUFSCK_REPAIRED 1
+ #define NUFSCK_UNREPAIRED 4
+ #define NUFSCK_FAILED 8
+
+ /**
+  * Prints how to run the tool.
+  */
+ static void usage(const char *prog) {
+     fprintf(stderr, "usage: %s [-n | -y] [-j threads] image\n", prog);
+ }
+
+ /**
+  * Checks that a file holds a formatted image, so that storage_init()
+  * does not format whatever it is given.
+  *
+  * @return 0 if it does, or a negative error code
+  */
+ static int check_image(const char *path) {
+     int fd = open(path, O_RDONLY);
+     if (fd < 0) return -errno;
+     uint32_t magic = 0;
+     ssize_t got = pread(fd, &magic, sizeof(magic), 0);
+     close(fd);
+     return got == sizeof(magic) && magic == NUFS_MAGIC ? 0 : -EINVAL;
+ }
+
+ int main(int argc, char *argv[]) {
+     int repair = 0;
+     long threads = sysconf(_SC_NPROCESSORS_ONLN);
+     int opt;
+     while ((opt = getopt(argc, argv, "nyj:")) != -1) {
+         switch (opt) {
+         case 'n': repair = 0; break;
+         case 'y': repair = 1; break;
+         case 'j': threads = atol(optarg); break;
+         default: usage(argv[0]); return NUFSCK_FAILED;
+         }
+     }
+     if (optind != argc - 1 || threads < 1) {
+         usage(argv[0]);
+         return NUFSCK_FAILED;
+     }
+     const char *image = argv[optind];
+
+     int rv = check_image(image);
+     if (rv < 0) {
+         fprintf(stderr, "%s: %s: %s\n", argv[0], image,
+                 rv == -EINVAL ? "not a nufs image" : strerror(-rv));
+         return NUFSCK_FAILED;
+     }
+
+     // Problems go to stdout; the storage layer's own chatter to stderr
+     FILE *out = fdopen(dup(STDOUT_FILENO), "w");
+     dup2(STDERR_FILENO, STDOUT_FILENO);
+     log_level = LOG_WARN;
+
+     // Mounting replays the journal, so the check sees the last commit
+     storage_init(image, NULL);
+
+     fsck_report_t report;
+     rv = fsck_check(threads, repair, out, &report);
+     fprintf(out, "%s: %lu inodes, %lu directories, %lu blocks in use, "
+             "%lu problems, %lu repaired\n", image, (unsigned long)report.inodes,
+             (unsigned long)report.directories, (unsigned long)report.blocks,
+             (unsigned long)report.errors, (unsigned long)report.repaired);
+     fclose(out);
+
+     blocks_flush();
+     blocks_free();
+
+     if (rv == -ENOMEM) return NUFSCK_FAILED;
+     if (rv < 0) return NUFSCK_UNREPAIRED;
+     return report.errors > 0 ? NUFSCK_REPAIRED : NUFSCK_CLEAN;
+ }
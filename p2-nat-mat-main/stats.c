@@ -0,0 +1,193 @@
+/**
+ * @file stats.c
+ * @brief Per-operation counters and latency histograms
+ *
+ * A latency of v nanoseconds goes to bucket v for v < 4. Larger values go
+ * to one of four buckets for their power of two, picked by the two bits
+ * below the leading one, so 64-bit latencies need 256 buckets.
+ */
+
+ #include <stdio.h>
+ #include <time.h>
+
+ #include "stats.h"
+ #include "compress.h"
+ #include "dcache.h"
+ #include "dedup.h"
+ #include "fsck.h"
+ #include "helpers/blocks.h"
+
+ /**
+  * Number of histogram buckets per operation
+  */
+ #define STATS_BUCKETS 256
+
+ typedef struct stats_hist {
+     uint64_t count;                   /* Calls recorded */
+     uint64_t total_ns;                /* Sum of their latencies */
+     uint64_t buckets[STATS_BUCKETS];  /* Calls per latency bucket */
+ } stats_hist_t;
+
+ static stats_hist_t hists[STATS_OP_COUNT];
+
+ static const char *op_names[STATS_OP_COUNT] = {
+     "getattr", "lookup", "read", "write",
+     "readdir", "mknod", "unlink", "rename",
+ };
+
+ /**
+  * @brief Map a latency to its bucket
+  */
+ static int stats_bucket(uint64_t ns) {
+     if (ns < 4) return ns;
+     int e = 63 - __builtin_clzll(ns);
+     return (e - 1) * 4 + ((ns >> (e - 2)) & 3);
+ }
+
+ /**
+  * @brief Smallest latency that falls past the given bucket
+  */
+ static uint64_t stats_bucket_limit(int bucket) {
+     if (bucket < 4) return bucket + 1;
+     int e = bucket / 4 + 1;
+     uint64_t step = (uint64_t)1 << (e - 2);
+     return (4 + bucket % 4) * step + step;
+ }
+
+ /**
+  * @brief Read the monotonic clock in nanoseconds
+  */
+ static uint64_t stats_now() {
+     struct timespec ts;
+     clock_gettime(CLOCK_MONOTONIC, &ts);
+     return (uint64_t)ts.tv_sec * 1000000000u + ts.tv_nsec;
+ }
+
+ uint64_t stats_start() {
+     return stats_now();
+ }
+
+ void stats_end(stats_op_t op, uint64_t start) {
+     uint64_t ns = stats_now() - start;
+     stats_hist_t *h = &hists[op];
+     __atomic_fetch_add(&h->count, 1, __ATOMIC_RELAXED);
+     __atomic_fetch_add(&h->total_ns, ns, __ATOMIC_RELAXED);
+     __atomic_fetch_add(&h->buckets[stats_bucket(ns)], 1, __ATOMIC_RELAXED);
+ }
+
+ /**
+  * @brief Estimate a percentile from a snapshot of the buckets
+  *
+  * @param buckets Bucket counts
+  * @param count Sum of the bucket counts
+  * @param q Fraction of calls that must be at or below the answer
+  * @return Upper bound of the bucket holding the percentile, in
+  *         nanoseconds
+  */
+ static uint64_t stats_percentile(const uint64_t *buckets, uint64_t count,
+                                  double q) {
+     uint64_t want = (uint64_t)(q * count);
+     if (want == 0) want = 1;
+     uint64_t seen = 0;
+     for (int b = 0; b < STATS_BUCKETS; b++) {
+         seen += buckets[b];
+         if (seen >= want) return stats_bucket_limit(b);
+     }
+     return 0;
+ }
+
+ /**
+  * @brief Append to the report, keeping track of the room left
+  */
+ #define stats_printf(...)                                           \
+     do {                                                            \
+         int n = snprintf(buf + len, len < size ? size - len : 0,    \
+                          __VA_ARGS__);                              \
+         if (n > 0) len += n;                                        \
+     } while (0)
+
+ /**
+  * @brief Percentage of part in part + rest, or 0 when both are 0
+  */
+ static double stats_rate(uint64_t part, uint64_t rest) {
+     return part + rest ? 100.0 * part / (part + rest) : 0;
+ }
+
+ size_t stats_format(char *buf, size_t size) {
+     size_t len = 0;
+     if (size == 0) return 0;
+     buf[0] = '\0';
+
+     stats_printf("%-8s %12s %10s %10s %10s %10s\n", "op", "count",
+                  "mean_us", "p50_us", "p99_us", "p999_us");
+     for (int op = 0; op < STATS_OP_COUNT; op++) {
+         // Snapshot the buckets first so the count matches them
+         uint64_t buckets[STATS_BUCKETS];
+         uint64_t count = 0;
+         for (int b = 0; b < STATS_BUCKETS; b++) {
+             buckets[b] = __atomic_load_n(&hists[op].buckets[b],
+                                          __ATOMIC_RELAXED);
+             count += buckets[b];
+         }
+         uint64_t total = __atomic_load_n(&hists[op].total_ns,
+                                          __ATOMIC_RELAXED);
+         double mean = count ? total / 1000.0 / count : 0;
+
+         stats_printf("%-8s %12lu %10.1f %10.1f %10.1f %10.1f\n",
+                      op_names[op], (unsigned long)count, mean,
+                      stats_percentile(buckets, count, 0.50) / 1000.0,
+                      stats_percentile(buckets, count, 0.99) / 1000.0,
+                      stats_percentile(buckets, count, 0.999) / 1000.0);
+     }
+
+     blocks_stats_t bst;
+     blocks_get_stats(&bst);
+     stats_printf("\nblocks: %d free of %d, %lu allocated in %lu runs "
+                  "(%.1f%% at goal), %lu freed, grown %lu times\n",
+                  bst.free_count, BLOCK_COUNT, (unsigned long)bst.allocated,
+                  (unsigned long)bst.runs,
+                  stats_rate(bst.goal_hits, bst.runs - bst.goal_hits),
+                  (unsigned long)bst.freed, (unsigned long)bst.grows);
+
+     stats_printf("inodes: %d used of %d\n", INODE_COUNT - bst.free_inodes,
+                  INODE_COUNT);
+
+     dcache_stats_t dst;
+     dcache_get_stats(&dst);
+     stats_printf("dcache: %lu hits, %lu misses (%.1f%% hit), "
+                  "paths %lu hits, %lu misses (%.1f%% hit)\n",
+                  (unsigned long)dst.hits, (unsigned long)dst.misses,
+                  stats_rate(dst.hits, dst.misses),
+                  (unsigned long)dst.path_hits, (unsigned long)dst.path_misses,
+                  stats_rate(dst.path_hits, dst.path_misses));
+
+     if (blocks_dedup_enabled()) {
+         dedup_stats_t ddst;
+         dedup_get_stats(&ddst);
+         stats_printf("dedup: %lu blocks hashed, %lu shared (%.1f%%), "
+                      "%lu copied on write\n",
+                      (unsigned long)ddst.hashed, (unsigned long)ddst.shared,
+                      stats_rate(ddst.shared, ddst.hashed - ddst.shared),
+                      (unsigned long)ddst.copied);
+     }
+
+     compress_stats_t cst;
+     compress_get_stats(&cst);
+     if (cst.packed || cst.unpacked || cst.misses) {
+         stats_printf("compress: %lu clusters packed, %lu left as they were, "
+                      "%lu unpacked; cache %lu hits, %lu misses (%.1f%%)\n",
+                      (unsigned long)cst.packed, (unsigned long)cst.skipped,
+                      (unsigned long)cst.unpacked, (unsigned long)cst.hits,
+                      (unsigned long)cst.misses, stats_rate(cst.hits, cst.misses));
+     }
+
+     fsck_scrub_stats_t sst;
+     fsck_get_scrub_stats(&sst);
+     if (sst.inodes) {
+         stats_printf("scrub: %lu passes, %lu inodes checked, %lu problems\n",
+                      (unsigned long)sst.passes, (unsigned long)sst.inodes,
+                      (unsigned long)sst.problems);
+     }
+
+     return len < size ? len : size - 1;
+ }
@@ -0,0 +1,74 @@
+/**
+ * @file stats.h
+ * @brief Per-operation counters and latency histograms
+ *
+ * Each instrumented FUSE operation counts its calls and records how long
+ * it took in a histogram with four buckets per power of two nanoseconds,
+ * so percentiles are accurate to within 25%. Everything is updated with
+ * relaxed atomic adds and never locks.
+ *
+ * The report is served as the read-only file /.nufs/stats and by the
+ * NUFS_IOC_STATS ioctl on any file.
+ */
+
+ #ifndef STATS_H
+ #define STATS_H
+
+ #include <stddef.h>
+ #include <stdint.h>
+ #include <sys/ioctl.h>
+
+ /**
+  * @brief Largest report NUFS_IOC_STATS returns
+  */
+ #define NUFS_STATS_TEXT_MAX 8192
+
+ /**
+  * @brief ioctl that copies the report, NUL-terminated, into a buffer of
+  *        NUFS_STATS_TEXT_MAX bytes
+  */
+ #define NUFS_IOC_STATS _IOR('N', 1, char[NUFS_STATS_TEXT_MAX])
+
+ /**
+  * @brief Operations that are timed
+  */
+ typedef enum stats_op {
+     STATS_GETATTR,
+     STATS_LOOKUP,
+     STATS_READ,
+     STATS_WRITE,
+     STATS_READDIR,
+     STATS_MKNOD,
+     STATS_UNLINK,
+     STATS_RENAME,
+     STATS_OP_COUNT
+ } stats_op_t;
+
+ /**
+  * @brief Start timing an operation
+  *
+  * @return Opaque start time to hand to stats_end()
+  */
+ uint64_t stats_start();
+
+ /**
+  * @brief Count an operation and record its latency
+  *
+  * @param op The operation
+  * @param start Value returned by stats_start() when it began
+  */
+ void stats_end(stats_op_t op, uint64_t start);
+
+ /**
+  * @brief Write the report as text
+  *
+  * Lists each operation's count, mean and percentile latencies, followed
+  * by the allocator and cache counters.
+  *
+  * @param buf Buffer for the report, always NUL-terminated
+  * @param size Size of buf
+  * @return Length of the report, truncated to fit
+  */
+ size_t stats_format(char *buf, size_t size);
+
+ #endif /* STATS_H */
@@ -4,20 +4,226 @@
  * This module provides core functionality for a simple file system,
  * including file and directory operations, inode management, and
  * block allocation.
+ *
+ * Every call here may run on several FUSE threads at once. Each inode has
+ * a reader/writer lock (see inode.h) covering its metadata, its data
+ * mapping and, for a directory, its entries. An operation that needs more
+ * than one inode locks them in this order:
+ *
+ *   1. rename_lock, for operations that move entries between directories
+ *      (rename and link)
+ *   2. parent directories, in increasing inode number
+ *   3. the inodes being linked, unlinked or moved, in increasing inode number
+ *
+ * A directory is never locked after one of its children, so the tree
+ * cannot deadlock; rename_lock keeps two concurrent moves from locking
+ * the same pair of directories in opposite orders. Taking an inode's
+ * write lock joins a journal operation; link and rename start theirs
+ * before rename_lock, since journal_begin() may wait for a commit and
+ * must not be called with a lock held.
  */
 
  #define _GNU_SOURCE
  #include <string.h>
+ #include <stdio.h>
  #include <stdlib.h>
  #include <errno.h>
+ #include <fcntl.h>
+ #include <assert.h>
+ #include <pthread.h>
  #include "inode.h"
  #include "helpers/blocks.h"
  #include "storage.h"
  #include "helpers/bitmap.h"
+ #include "helpers/journal.h"
  #include <unistd.h>
+ #include <sys/mman.h>
  #include "directory.h"
+ #include "compress.h"
+ #include "dcache.h"
+ #include "dedup.h"
+ #include "helpers/log.h"
  #include <sys/stat.h>
  
+ static pthread_mutex_t rename_lock = PTHREAD_MUTEX_INITIALIZER;
+ 
+ /** When reads update access times (STORAGE_ATIME_*) */
+ static int atime_mode = STORAGE_ATIME_RELATIVE;
+ 
+ /** Seconds after which relatime updates an access time regardless */
+ #define STORAGE_RELATIME_MAX_AGE (24 * 60 * 60)
+ 
+ /** Bytes past a sequential reader that are advised for reading ahead */
+ #define STORAGE_READAHEAD (1 << 20)
+ 
+ /**
+  * Initializes an empty directory.
+  * 
+  * "." and ".." are not stored as entries, so no block is needed until the
+  * first real entry is added.
+  * 
+  * @param dir Pointer to the directory inode
+  * @param parent_inum Inode number of the parent directory
+  */
+ static void init_directory(inode_t *dir, int parent_inum) {
+     dir->parent = parent_inum;
+     dir->nentries = 2;
+ }
+ 
+ /**
+  * Copies bytes between a file and a buffer, one extent run at a time.
+  * 
+  * Each run, or an inline file's data, is contiguous in the image, so it
+  * is moved with a single memcpy. Holes read back as zeros, and compressed
+  * extents are read through the decompressed cache.
+  * 
+  * @param node The file's inode; a range written to must already be mapped
+  *             and uncompressed
+  * @param buf The caller's buffer
+  * @param size Number of bytes to copy
+  * @param offset File offset of the first byte
+  * @param to_file Nonzero to copy buf into the file, zero to copy out of it
+  * @return 0 on success, -EIO if a compressed extent is damaged
+  */
+ static int storage_copy(inode_t *node, char *buf, size_t size, off_t offset,
+                         int to_file) {
+     char *base = blocks_get_block(0);
+     while (size > 0) {
+         size_t span = 0;
+         int64_t pos = inode_locate(node, offset, &span);
+         assert(pos >= 0 || !to_file);
+         if (span > size) span = size;
+ 
+         char *disk = base + pos;
+         if (pos == INODE_LOCATE_PACKED) {
+             int rv = inode_read_packed(node, offset, buf, span);
+             if (rv < 0) return rv;
+         } else if (pos < 0) {
+             memset(buf, 0, span);
+         } else if (to_file) {
+             memcpy(disk, buf, span);
+         } else {
+             memcpy(buf, disk, span);
+         }
+ 
+         buf += span;
+         size -= span;
+         offset += span;
+     }
+     return 0;
+ }
+ 
+ /**
+  * Notes a write to a file that is compressed, so the clusters it touched
+  * are compressed when the file is released.
+  * 
+  * @param inum The inode number; the caller holds its write lock
+  * @param offset First byte written
+  * @param end One past the last byte written
+  */
+ static void storage_note_pack(int inum, off_t offset, off_t end) {
+     if (!(get_inode(inum)->flags & INODE_COMPRESS) || end <= offset) return;
+ 
+     inode_core_t *core = get_inode_core(inum);
+     int first = offset / BLOCK_SIZE;
+     int last = bytes_to_blocks(end);
+     if (core->pack_end == 0 || first < core->pack_first) core->pack_first = first;
+     if (last > core->pack_end) core->pack_end = last;
+ }
+ 
+ /**
+  * Compresses the clusters of a file written since it was last compressed.
+  * 
+  * @param inum The inode number; the caller holds its write lock
+  */
+ static void storage_pack(int inum) {
+     inode_core_t *core = get_inode_core(inum);
+     if (core->pack_end == 0) return;
+ 
+     off_t offset = (off_t)core->pack_first * BLOCK_SIZE;
+     off_t len = (off_t)core->pack_end * BLOCK_SIZE - offset;
+     core->pack_end = 0;
+     int rv = inode_compress(get_inode(inum), offset, len);
+     if (rv < 0) {
+         log_warn("compressing inode %d: %s", inum, strerror(-rv));
+     }
+ }
+ 
+ /**
+  * Stamps the times of pending writes and reads on an inode.
+  * 
+  * Writes and reads only note their time in the in-core state, so a run
+  * of them costs one update of the inode, made here when the file is
+  * flushed, released or forgotten or its times are set.
+  * 
+  * @param inum The inode number; the caller holds its write lock
+  */
+ static void storage_apply_pending(int inum) {
+     inode_core_t *core = get_inode_core(inum);
+     if (core->pending_mtime) {
+         get_inode(inum)->mtime = core->pending_mtime;
+         core->pending_mtime = 0;
+     }
+     time_t atime = __atomic_exchange_n(&core->pending_atime, 0, __ATOMIC_RELAXED);
+     if (atime) get_inode(inum)->atime = atime;
+ }
+ 
+ /**
+  * Notes that a file was read, for its access time.
+  * 
+  * Only the in-core state is changed, so reads never write to the inode
+  * table. Under relatime a time is only noted when the last access is
+  * no later than the last change or a day old, so a file read over and
+  * over notes nothing.
+  * 
+  * @param inum The inode number; the caller holds its lock, shared or
+  *             exclusive
+  */
+ static void storage_note_access(int inum) {
+     if (atime_mode == STORAGE_ATIME_NEVER) return;
+ 
+     inode_t *node = get_inode(inum);
+     inode_core_t *core = get_inode_core(inum);
+     time_t now = time(NULL);
+     time_t atime = __atomic_load_n(&core->pending_atime, __ATOMIC_RELAXED);
+     if (!atime) atime = node->atime;
+     if (atime == now) return;
+ 
+     if (atime_mode == STORAGE_ATIME_RELATIVE) {
+         time_t mtime = core->pending_mtime ? core->pending_mtime : node->mtime;
+         if (atime > mtime && atime > node->ctime &&
+             now - atime < STORAGE_RELATIME_MAX_AGE) {
+             return;
+         }
+     }
+     __atomic_store_n(&core->pending_atime, now, __ATOMIC_RELAXED);
+ }
+ 
+ /**
+  * Chooses when reads update access times.
+  * 
+  * @param mode STORAGE_ATIME_RELATIVE, STORAGE_ATIME_STRICT or
+  *             STORAGE_ATIME_NEVER
+  */
+ void storage_set_atime_mode(int mode) {
+     atime_mode = mode;
+ }
+ 
+ /**
+  * Fills in the geometry used for newly formatted images.
+  * 
+  * @param geo Geometry to fill in
+  */
+ void storage_default_geometry(blocks_geometry_t *geo) {
+     geo->block_size = 4096;
+     geo->size = 1 << 20;
+     geo->max_size = 1 << 30;
+     geo->inode_count = 256;
+     geo->inode_size = sizeof(inode_t);
+     geo->journal_size = 0; // Sized from the image
+     geo->dedup = 0;
+ }
+ 
  /**
   * Initializes the storage system.
   * 
@@ -25,32 +231,37 @@
   * the root directory if it doesn't exist or is invalid.
   * 
   * @param path The path to the storage file/device
+  * @param geo Geometry for a new image, or NULL for the defaults
   */
- void storage_init(const char *path) {
-     blocks_init(path);
+ void storage_init(const char *path, const blocks_geometry_t *geo) {
+     blocks_geometry_t defaults;
+     if (!geo) {
+         storage_default_geometry(&defaults);
+         geo = &defaults;
+     }
+     blocks_init(path, geo);
+     inodes_init();
+     dcache_init();
+     dedup_init();
+     compress_init();
  
      int root_inum = blocks_get_root_block();
 
      inode_t *root = get_inode(root_inum);
  
-     if (root_inum <= 0 || !root || !S_ISDIR(root->mode)) {
+     if (root_inum < 0 || !root || !S_ISDIR(root->mode)) {
  
+         journal_begin();
          root_inum = alloc_inode();
 
          inode_t *new_root = get_inode(root_inum);
          new_root->mode = S_IFDIR | 0755;
          print_inode(new_root); 
-         new_root->block = alloc_block();
-         new_root->size = 5 * sizeof(dir_entry_t);
- 
-         dir_entry_t *entries = blocks_get_block(new_root->block);
-         memset(entries, 0, BLOCK_SIZE);
-         strcpy(entries[0].name, ".");
-         entries[0].inum = root_inum;
-         strcpy(entries[1].name, "..");
-         entries[1].inum = root_inum;
+         init_directory(new_root, root_inum);
  
+         journal_log(new_root, sizeof(inode_t));
          blocks_set_root_block(root_inum);
+         journal_end();
          blocks_flush();
  
          root = new_root;  // Update root pointer
@@ -63,6 +274,131 @@
      }
  }
  
+ /**
+  * Splits a path into its parent directory and final component.
+  * 
+  * @param path Absolute path to split
+  * @param name Buffer of DIR_NAME_LENGTH bytes that receives the final
+  *             component
+  * @return Inode number of the parent directory, or negative error code
+  */
+ static int storage_split_path(const char *path, char *name) {
+     const char *slash = strrchr(path, '/');
+     if (!slash || slash[1] == '\0') return -EINVAL;
+ 
+     size_t len = strlen(slash + 1);
+     if (len >= DIR_NAME_LENGTH) return -ENAMETOOLONG;
+     memcpy(name, slash + 1, len + 1);
+ 
+     if (slash == path) return 0; // Parent is the root
+ 
+     char *parent_path = strndup(path, slash - path);
+     if (!parent_path) return -ENOMEM;
+     int parent_inum = storage_lookup_path(parent_path);
+     free(parent_path);
+     return parent_inum;
+ }
+ 
+ /**
+  * Frees an inode once nothing refers to it any more.
+  * 
+  * An inode stays allocated while a directory entry links to it or while
+  * the kernel still holds lookup references, so a file that is unlinked
+  * while open keeps its data until the last reference is forgotten.
+  * 
+  * The caller holds the inode's write lock, so of an unlink and a forget
+  * racing on the same inode exactly one sees both counts reach zero.
+  * 
+  * @param inum The inode number to release
+  */
+ static void storage_put_inode(int inum) {
+     inode_t *node = get_inode(inum);
+     inode_core_t *core = get_inode_core(inum);
+     if (node->refs <= 0 &&
+         __atomic_load_n(&core->nlookup, __ATOMIC_ACQUIRE) == 0) {
+         free_inode(inum);
+     }
+ }
+ 
+ /**
+  * Shrinks a directory that deletes have left sparse.
+  * 
+  * Readdir cookies do not depend on where entries are stored, so this can
+  * run while the directory is being listed. After a directory fails to
+  * merge, it is not tried again until half of its entries are gone. The
+  * caller holds the directory's write lock.
+  * 
+  * @param inum The directory's inode number
+  */
+ static void storage_compact_dir(int inum) {
+     inode_t *dir = get_inode(inum);
+     inode_core_t *core = get_inode_core(inum);
+     if (!directory_sparse(dir)) return;
+ 
+     int live = dir->nentries - 2;
+     if (core->compact_floor > 0 && live >= core->compact_floor) return;
+     core->compact_floor = directory_compact(dir) == -EAGAIN ? live / 2 : 0;
+ }
+ 
+ /**
+  * Looks up a name in a directory whose lock the caller already holds.
+  * 
+  * @param parent_inum The inode number of the directory
+  * @param name The entry name
+  * @return Inode number on success, negative error code on failure
+  */
+ static int storage_lookup_locked(int parent_inum, const char *name) {
+     if (strlen(name) >= DIR_NAME_LENGTH) return -ENAMETOOLONG;
+ 
+     int inum = dcache_lookup(parent_inum, name);
+     if (inum < 0) {
+         inum = directory_lookup(get_inode(parent_inum), name);
+         if (inum < 0) return -ENOENT;
+         dcache_insert(parent_inum, name, inum);
+     }
+     return inum;
+ }
+ 
+ /**
+  * Gets metadata about an inode.
+  * 
+  * @param inum The inode number
+  * @param st Pointer to a stat structure to fill with metadata
+  * @return 0 on success, negative error code on failure
+  */
+ int storage_stat_inum(int inum, struct stat *st) {
+     inode_t *node = get_inode(inum);
+     if (!node || !bitmap_get(get_inode_bitmap(), inum)) return -ENOENT;
+ 
+     inode_rdlock(inum);
+     memset(st, 0, sizeof(struct stat));
+     st->st_uid = getuid();
+     st->st_mode = node->mode;
+     st->st_size = node->size;
+     st->st_nlink = node->refs;
+     st->st_ino = inum;
+     st->st_blksize = BLOCK_SIZE;
+     st->st_blocks = (blkcnt_t)inode_data_blocks(node) * (BLOCK_SIZE / 512);
+     st->st_atime = node->atime;
+     st->st_mtime = node->mtime;
+     st->st_ctime = node->ctime;
+     
+     // Report writes and reads whose time has not been stamped yet
+     inode_core_t *core = get_inode_core(inum);
+     if (core->pending_mtime) st->st_mtime = core->pending_mtime;
+     time_t atime = __atomic_load_n(&core->pending_atime, __ATOMIC_RELAXED);
+     if (atime) st->st_atime = atime;
+ 
+     // A directory is linked from its parent, its own "." and the ".." of
+     // each subdirectory
+     if (S_ISDIR(node->mode) && node->refs > 0) {
+         st->st_nlink = 2 + node->nsubdirs;
+     }
+ 
+     inode_unlock(inum);
+     return 0;
+ }
+ 
  /**
   * Gets metadata about a file or directory.
   * 
@@ -71,14 +407,173 @@
   * @return 0 on success, negative error code on failure
   */
  int storage_stat(const char *path, struct stat *st) {
-     // TODO: Implement proper path lookup
-     if (strcmp(path, "/") == 0) {
-         st->st_mode = 040755;
-         st->st_size = 0;
-         st->st_uid = getuid();
+     int inum = storage_lookup_path(path);
+     if (inum < 0) return inum;
+     return storage_stat_inum(inum, st);
+ }
+ 
+ /**
+  * Reports the space and inodes of the mounted image.
+  * 
+  * @param st Pointer to a statvfs structure to fill
+  */
+ void storage_statfs(struct statvfs *st) {
+     superblock_t *sb = blocks_get_superblock();
+     blocks_stats_t bst;
+     blocks_get_stats(&bst);
+     int count = __atomic_load_n(&BLOCK_COUNT, __ATOMIC_ACQUIRE);
+     
+     memset(st, 0, sizeof(*st));
+     st->f_bsize = BLOCK_SIZE;
+     st->f_frsize = BLOCK_SIZE;
+     st->f_blocks = sb->max_block_count - sb->data_start;
+     st->f_bfree = bst.free_count + (sb->max_block_count - count);
+     st->f_bavail = st->f_bfree;
+     st->f_files = INODE_COUNT;
+     st->f_ffree = bst.free_inodes;
+     st->f_favail = st->f_ffree;
+     st->f_namemax = DIR_NAME_LENGTH - 1;
+ }
+ 
+ /**
+  * Reads data from a file given its inode number.
+  * 
+  * @param inum The file's inode number
+  * @param buf Buffer to store the read data
+  * @param size Number of bytes to read
+  * @param offset Starting position for reading
+  * @return Number of bytes read on success, negative error code on failure
+  */
+ int storage_read_inum(int inum, char *buf, size_t size, off_t offset) {
+     inode_t *node = get_inode(inum);
+     if (!node) return -ENOENT;
+     if (!S_ISREG(node->mode)) return -EISDIR;
+     
+     inode_rdlock(inum);
+     
+     // Check bounds
+     if (offset >= node->size) {
+         inode_unlock(inum);
          return 0;
      }
-     return -ENOENT;
+     if (offset + size > node->size) size = node->size - offset;
+     
+     int rv = storage_copy(node, buf, size, offset, 0);
+     storage_note_access(inum);
+     
+     inode_unlock(inum);
+     return rv < 0 ? rv : (int)size;
+ }
+ 
+ /**
+  * Asks the kernel to bring in the data a sequential reader will want next.
+  * 
+  * A read that starts where the last one ended continues a stream, and the
+  * STORAGE_READAHEAD bytes past it are advised with MADV_WILLNEED, again
+  * only once the reader is halfway through what was advised. Any other
+  * read breaks the stream. Holes and compressed extents are skipped.
+  * 
+  * @param inum The file's inode number; the caller holds its lock, shared
+  *             or exclusive
+  * @param offset Where the read starts
+  * @param end Where the read ends, no further than the end of the file
+  */
+ static void storage_readahead(int inum, off_t offset, off_t end) {
+     inode_t *node = get_inode(inum);
+     inode_core_t *core = get_inode_core(inum);
+     if (node->flags & INODE_INLINE) return;
+     
+     off_t last = __atomic_exchange_n(&core->read_next, end, __ATOMIC_RELAXED);
+     off_t ra_end = __atomic_load_n(&core->ra_end, __ATOMIC_RELAXED);
+     if (last != offset) {
+         __atomic_store_n(&core->ra_end, end, __ATOMIC_RELAXED);
+         return;
+     }
+     if (ra_end - end >= STORAGE_READAHEAD / 2) return;
+     
+     off_t from = ra_end > end ? ra_end : end;
+     off_t to = end + STORAGE_READAHEAD;
+     if (to > node->size) to = node->size;
+     __atomic_store_n(&core->ra_end, to, __ATOMIC_RELAXED);
+     
+     while (from < to) {
+         size_t span = 0;
+         int64_t pos = inode_locate(node, from, &span);
+         if (span == 0) break;
+         if (span > (size_t)(to - from)) span = to - from;
+         if (pos >= 0) blocks_advise(pos, span, MADV_WILLNEED);
+         from += span;
+     }
+ }
+ 
+ /**
+  * Maps a read of a file to the spans of the disk image holding the data.
+  * 
+  * A hole is returned as a span with pos -1, to be read as zeros.
+  * 
+  * @param inum The file's inode number
+  * @param size Number of bytes to read
+  * @param offset Starting position for reading
+  * @param spans Filled with the spans in file order
+  * @param max_spans Capacity of spans
+  * @return Number of spans, or negative error code
+  */
+ int storage_read_spans(int inum, size_t size, off_t offset,
+                        storage_span_t *spans, int max_spans) {
+     inode_t *node = get_inode(inum);
+     if (!node) return -ENOENT;
+     if (!S_ISREG(node->mode)) return -EISDIR;
+     
+     inode_rdlock(inum);
+     
+     // Check bounds
+     if (offset >= node->size) return 0;
+     if (offset + size > node->size) size = node->size - offset;
+     
+     storage_readahead(inum, offset, offset + size);
+     
+     int count = 0;
+     while (size > 0) {
+         size_t span = 0;
+         int64_t pos = inode_locate(node, offset, &span);
+         if (count == max_spans) {
+             inode_unlock(inum);
+             return -EINVAL;
+         }
+         if (span > size) span = size;
+         
+         spans[count].pos = pos == INODE_LOCATE_PACKED ? STORAGE_SPAN_PACKED : pos;
+         spans[count].len = span;
+         count++;
+         
+         size -= span;
+         offset += span;
+     }
+     
+     storage_note_access(inum);
+     return count;
+ }
+ 
+ /**
+  * Releases the inode locked by a successful storage_read_spans.
+  * 
+  * @param inum The file's inode number
+  */
+ void storage_read_spans_done(int inum) {
+     inode_unlock(inum);
+ }
+ 
+ /**
+  * Reads the data of a span marked STORAGE_SPAN_PACKED.
+  * 
+  * @param inum The file's inode number, locked by storage_read_spans
+  * @param offset File offset of the span
+  * @param buf Filled with the data
+  * @param len Length of the span
+  * @return 0 on success, -EIO if the data cannot be decompressed
+  */
+ int storage_read_packed(int inum, off_t offset, char *buf, size_t len) {
+     return storage_copy(get_inode(inum), buf, len, offset, 0);
  }
  
  /**
@@ -91,245 +586,1208 @@
   * @return Number of bytes read on success, negative error code on failure
   */
  int storage_read(const char *path, char *buf, size_t size, off_t offset) {
-     // TODO: Implement proper file reading
-     if (strcmp(path, "/hello.txt") == 0) {
-         strcpy(buf, "hello\n");
-         return 6;
+     int inum = storage_lookup_path(path);
+     if (inum < 0) return inum;
+     return storage_read_inum(inum, buf, size, offset);
+ }
+ 
+ /**
+  * Prints the current state of the file system.
+  * 
+  * Displays the root inode information and lists all entries in the root directory.
+  */
+ void print_storage_status() {
+     printf("Storage status:\n");
+     printf("  Root inode: %d\n", storage_lookup_path("/"));
+     printf("  Files in root:\n");
+     
+     inode_t *root = get_inode(0);
+     dir_entry_t *entry;
+     
+     for (int64_t slot = 0; (entry = directory_next(root, &slot)); slot++) {
+         if (entry->name[0] != '\0') {
+             printf("    %s -> inode %d\n", entry->name, entry->inum);
+         }
+     }
+ }
+ 
+ /**
+  * Writes data to a file whose write lock the caller holds.
+  * 
+  * @param inum The file's inode number
+  * @param buf The data to write
+  * @param size Number of bytes to write
+  * @param offset Starting position for writing
+  * @return 0 on success, negative error code on failure
+  */
+ static int storage_write_locked(int inum, const char *buf, size_t size,
+                                 off_t offset) {
+     inode_t *node = get_inode(inum);
+     if (offset + (off_t)size > (off_t)INT32_MAX * BLOCK_SIZE) return -EFBIG;
+ 
+     // Map blocks for the holes being written, then move the end of file
+     int rv = reserve_inode(node, offset, size);
+     if (rv == 0) rv = grow_inode(node, offset + size);
+     if (rv == 0) rv = inode_unshare(node, offset, size);
+     if (rv < 0) return rv;
+     
+     storage_copy(node, (char *)buf, size, offset, 1);
+     inode_dedup(node, offset, size);
+     storage_note_pack(inum, offset, offset + size);
+     get_inode_core(inum)->pending_mtime = time(NULL);
+     return 0;
+ }
+ 
+ /**
+  * Writes data to a file given its inode number.
+  * 
+  * @param inum The file's inode number
+  * @param buf The data to write
+  * @param size Number of bytes to write
+  * @param offset Starting position for writing
+  * @return Number of bytes written on success, negative error code on failure
+  */
+ int storage_write_inum(int inum, const char *buf, size_t size, off_t offset) {
+     inode_t *node = get_inode(inum);
+     if (!node) return -ENOENT;
+     if (!S_ISREG(node->mode)) return -EISDIR;
+     
+     inode_wrlock(inum);
+     inode_note_clean(inum);
+     int rv = storage_write_locked(inum, buf, size, offset);
+     inode_unlock(inum);
+     return rv < 0 ? rv : (int)size;
+ }
+ 
+ /**
+  * Maps a write to a file to the spans of the disk image it will land in.
+  * 
+  * @param inum The file's inode number
+  * @param size Number of bytes to write
+  * @param offset Starting position for writing
+  * @param spans Filled with the spans in file order
+  * @param max_spans Capacity of spans
+  * @return Number of spans, or negative error code
+  */
+ int storage_write_spans(int inum, size_t size, off_t offset,
+                         storage_span_t *spans, int max_spans) {
+     inode_t *node = get_inode(inum);
+     if (!node) return -ENOENT;
+     if (!S_ISREG(node->mode)) return -EISDIR;
+     if (offset < 0) return -EINVAL;
+     if (offset + (off_t)size > (off_t)INT32_MAX * BLOCK_SIZE) return -EFBIG;
+     
+     inode_wrlock(inum);
+     inode_note_clean(inum);
+     
+     // Map blocks for the whole range; the size moves once the data is in
+     int rv = reserve_inode(node, offset, size);
+     if (rv == 0) rv = inode_unshare(node, offset, size);
+     if (rv < 0) {
+         inode_unlock(inum);
+         return rv;
+     }
+     
+     int count = 0;
+     while (size > 0) {
+         size_t span = 0;
+         int64_t pos = inode_locate(node, offset, &span);
+         assert(pos >= 0);
+         if (count == max_spans) {
+             inode_unlock(inum);
+             return -EINVAL;
+         }
+         if (span > size) span = size;
+         
+         spans[count].pos = pos;
+         spans[count].len = span;
+         count++;
+         
+         size -= span;
+         offset += span;
+     }
+     
+     return count;
+ }
+ 
+ /**
+  * Finishes a write started with storage_write_spans.
+  * 
+  * @param inum The file's inode number
+  * @param offset Starting position of the write
+  * @param end File offset just past the last byte written, or -1 if
+  *            nothing was written
+  */
+ void storage_write_spans_done(int inum, off_t offset, off_t end) {
+     inode_t *node = get_inode(inum);
+     if (end >= 0) {
+         // The size is logged with the blocks mapped for it; an overwrite
+         // leaves the inode as it was, so only then is nothing logged
+         if (end > node->size) node->size = end;
+         get_inode_core(inum)->pending_mtime = time(NULL);
+         inode_dedup(node, offset, end - offset);
+         storage_note_pack(inum, offset, end);
+     }
+     inode_unlock(inum);
+ }
+ 
+ /**
+  * Size of the buffer data is copied through when it cannot be shared
+  */
+ #define COPY_CHUNK (1 << 20)
+ 
+ /**
+  * Checks the files of a copy and write-locks them, in inode number order.
+  * 
+  * @return 0 with both locked, or negative error code with neither
+  */
+ static int storage_lock_copy(int src, off_t src_off, int dst, off_t dst_off,
+                              off_t len) {
+     inode_t *from = get_inode(src);
+     inode_t *to = get_inode(dst);
+     if (!from || !to) return -ENOENT;
+     if (S_ISDIR(from->mode) || S_ISDIR(to->mode)) return -EISDIR;
+     if (!S_ISREG(from->mode) || !S_ISREG(to->mode)) return -EINVAL;
+     if (src_off < 0 || dst_off < 0 || len < 0) return -EINVAL;
+     if (dst_off + len > (off_t)INT32_MAX * BLOCK_SIZE) return -EFBIG;
+     if (src == dst && src_off < dst_off + len && dst_off < src_off + len) {
+         return -EINVAL; // Overlapping ranges of one file
      }
-     return -ENOENT;
+ 
+     inode_wrlock(src < dst ? src : dst);
+     if (src != dst) inode_wrlock(src < dst ? dst : src);
+     return 0;
+ }
+ 
+ /**
+  * Releases the locks taken by storage_lock_copy.
+  */
+ static void storage_unlock_copy(int src, int dst) {
+     if (src != dst) inode_unlock(src < dst ? dst : src);
+     inode_unlock(src < dst ? src : dst);
+ }
+ 
+ /**
+  * Copies bytes from one file to another through a buffer.
+  * 
+  * @return 0 on success, negative error code on failure
+  */
+ static int storage_copy_bytes(int src, off_t src_off, int dst, off_t dst_off,
+                               off_t len) {
+     if (len == 0) return 0;
+     char *buf = malloc(len < COPY_CHUNK ? len : COPY_CHUNK);
+     if (!buf) return -ENOMEM;
+ 
+     int rv = 0;
+     while (len > 0 && rv == 0) {
+         size_t chunk = len < COPY_CHUNK ? len : COPY_CHUNK;
+         rv = storage_copy(get_inode(src), buf, chunk, src_off, 0);
+         if (rv == 0) rv = storage_write_locked(dst, buf, chunk, dst_off);
+         src_off += chunk;
+         dst_off += chunk;
+         len -= chunk;
+     }
+     free(buf);
+     return rv;
+ }
+ 
+ /**
+  * Shares whole blocks of one file with another.
+  * 
+  * Both offsets are block-aligned. The range is whole blocks, or ends at
+  * the end of the source with the target running to or past its own end,
+  * since the rest of the last block goes along with it.
+  * 
+  * @return 0 on success, negative error code on failure
+  */
+ static int storage_clone_blocks(int src, off_t src_off, int dst, off_t dst_off,
+                                 off_t len) {
+     inode_t *from = get_inode(src);
+     inode_t *to = get_inode(dst);
+     off_t end = dst_off + len;
+     if (len == 0) return 0;
+ 
+     // Inline data has no blocks to share
+     if ((from->flags & INODE_INLINE) ||
+         ((to->flags & INODE_INLINE) && end <= INODE_INLINE_SIZE)) {
+         return storage_copy_bytes(src, src_off, dst, dst_off, len);
+     }
+ 
+     int count = bytes_to_blocks(len);
+     int rv = grow_inode(to, end > to->size ? end : to->size);
+     if (rv == 0) rv = punch_inode(to, dst_off, (off_t)count * BLOCK_SIZE);
+     if (rv == 0) {
+         rv = inode_clone(to, dst_off / BLOCK_SIZE, from, src_off / BLOCK_SIZE,
+                          count);
+     }
+     if (rv == 0) to->mtime = to->ctime = time(NULL);
+     return rv;
+ }
+ 
+ /**
+  * Copies a range of one file into another given their inode numbers.
+  * 
+  * @param src The source file's inode number
+  * @param src_off Offset of the range in the source
+  * @param dst The target file's inode number
+  * @param dst_off Offset to copy the range to
+  * @param len Number of bytes to copy
+  * @return Number of bytes copied, or negative error code
+  */
+ ssize_t storage_copy_range_inum(int src, off_t src_off, int dst, off_t dst_off,
+                                 size_t len) {
+     int rv = storage_lock_copy(src, src_off, dst, dst_off, len);
+     if (rv < 0) return rv;
+ 
+     // Nothing is copied from past the end of the source
+     off_t src_size = get_inode(src)->size;
+     off_t total = src_off >= src_size ? 0 : src_size - src_off;
+     if ((off_t)len < total) total = len;
+ 
+     off_t head = total;
+     off_t body = 0;
+     if (blocks_dedup_enabled() &&
+         src_off % BLOCK_SIZE == dst_off % BLOCK_SIZE) {
+         // Copy up to a block boundary, then share whole blocks
+         head = (BLOCK_SIZE - src_off % BLOCK_SIZE) % BLOCK_SIZE;
+         if (head > total) head = total;
+         body = (total - head) / BLOCK_SIZE * BLOCK_SIZE;
+         off_t rest = total - head - body;
+         if (rest > 0 && src_off + total == src_size &&
+             dst_off + total >= get_inode(dst)->size) {
+             body += rest;  // The partial last block can go along too
+         }
+     }
+     off_t tail = total - head - body;
+ 
+     rv = storage_copy_bytes(src, src_off, dst, dst_off, head);
+     if (rv == 0) {
+         rv = storage_clone_blocks(src, src_off + head, dst, dst_off + head, body);
+     }
+     if (rv == 0) {
+         rv = storage_copy_bytes(src, src_off + head + body, dst,
+                                 dst_off + head + body, tail);
+     }
+     storage_unlock_copy(src, dst);
+     return rv < 0 ? rv : total;
+ }
+ 
+ /**
+  * Makes a range of one file share the blocks of a range of another.
+  * 
+  * @param src The source file's inode number
+  * @param src_off Offset of the range in the source, block-aligned
+  * @param dst The target file's inode number
+  * @param dst_off Offset to clone the range to, block-aligned
+  * @param len Number of bytes, or 0 for everything up to the source's end
+  * @return 0 on success, negative error code on failure
+  */
+ int storage_clone_range_inum(int src, off_t src_off, int dst, off_t dst_off,
+                              off_t len) {
+     if (!blocks_dedup_enabled()) return -EOPNOTSUPP;
+     if (src_off % BLOCK_SIZE != 0 || dst_off % BLOCK_SIZE != 0) return -EINVAL;
+     if (len == 0) {
+         inode_t *from = get_inode(src);
+         if (!from) return -ENOENT;
+         len = src_off < from->size ? from->size - src_off : 0;
+     }
+ 
+     int rv = storage_lock_copy(src, src_off, dst, dst_off, len);
+     if (rv < 0) return rv;
+ 
+     // A partial last block is only whole at the end of both files
+     if (len % BLOCK_SIZE != 0 &&
+         (src_off + len != get_inode(src)->size ||
+          dst_off + len < get_inode(dst)->size)) {
+         rv = -EINVAL;
+     } else if (src_off + len > get_inode(src)->size) {
+         rv = -EINVAL;
+     } else {
+         rv = storage_clone_blocks(src, src_off, dst, dst_off, len);
+     }
+     storage_unlock_copy(src, dst);
+     return rv;
+ }
+ 
+ /**
+  * Writes data to a file.
+  * 
+  * @param path The path to the file
+  * @param buf The data to write
+  * @param size Number of bytes to write
+  * @param offset Starting position for writing
+  * @return Number of bytes written on success, negative error code on failure
+  */
+ int storage_write(const char *path, const char *buf, size_t size, off_t offset) {
+     int inum = storage_lookup_path(path);
+     if (inum < 0) return inum;
+     return storage_write_inum(inum, buf, size, offset);
+ }
+ 
+ /**
+  * Changes the size of a file given its inode number.
+  * 
+  * Shrinking releases the blocks past the new end; growing leaves a hole
+  * up to it.
+  * 
+  * @param inum The file's inode number
+  * @param size The new size for the file
+  * @return 0 on success, negative error code on failure
+  */
+ int storage_truncate_inum(int inum, off_t size) {
+     inode_t *node = get_inode(inum);
+     if (!node) return -ENOENT;
+     if (S_ISDIR(node->mode)) return -EISDIR;
+     if (size > (off_t)INT32_MAX * BLOCK_SIZE) return -EFBIG;
+     
+     inode_wrlock(inum);
+     int rv = (size < node->size) ? shrink_inode(node, size)
+                                  : grow_inode(node, size);
+     if (rv == 0) {
+         get_inode_core(inum)->pending_mtime = 0;
+         node->mtime = node->ctime = time(NULL);
+     }
+     inode_unlock(inum);
+     return rv;
+ }
+ 
+ /**
+  * Preallocates space for a file given its inode number.
+  * 
+  * @param inum The file's inode number
+  * @param mode 0 to extend the file to cover the range, or
+  *             FALLOC_FL_KEEP_SIZE to only reserve blocks for it
+  * @param offset Start of the range
+  * @param length Length of the range
+  * @return 0 on success, negative error code on failure
+  */
+ int storage_fallocate_inum(int inum, int mode, off_t offset, off_t length) {
+     inode_t *node = get_inode(inum);
+     if (!node) return -ENOENT;
+     if (S_ISDIR(node->mode)) return -EISDIR;
+     if (mode & ~(FALLOC_FL_KEEP_SIZE | FALLOC_FL_PUNCH_HOLE)) return -EOPNOTSUPP;
+     if (mode == FALLOC_FL_PUNCH_HOLE) return -EOPNOTSUPP; // needs KEEP_SIZE
+     if (offset < 0 || length <= 0) return -EINVAL;
+     if (offset + length > (off_t)INT32_MAX * BLOCK_SIZE) return -EFBIG;
+     
+     inode_wrlock(inum);
+     if (mode & FALLOC_FL_PUNCH_HOLE) {
+         int rv = punch_inode(node, offset, length);
+         if (rv == 0 && offset < node->size) {
+             node->mtime = node->ctime = time(NULL);
+         }
+         inode_unlock(inum);
+         return rv;
+     }
+ 
+     off_t old_size = node->size;
+     int rv = reserve_inode(node, offset, length);
+     if (rv == 0 && !(mode & FALLOC_FL_KEEP_SIZE)) {
+         rv = grow_inode(node, offset + length);
+         if (rv == 0 && node->size != old_size) {
+             node->mtime = node->ctime = time(NULL);
+         }
+     }
+     inode_unlock(inum);
+     return rv;
+ }
+ 
+ /**
+  * Finds the next data or hole in a file given its inode number.
+  * 
+  * Blocks that are mapped count as data even if they hold zeros, and the
+  * end of the file counts as a hole.
+  * 
+  * @param inum The file's inode number
+  * @param offset Where to start looking
+  * @param whence SEEK_DATA or SEEK_HOLE
+  * @return The offset found, or -ENXIO if offset is at or past the end of
+  *         file or no data follows it
+  */
+ off_t storage_seek_inum(int inum, off_t offset, int whence) {
+     inode_t *node = get_inode(inum);
+     if (!node) return -ENOENT;
+     if (whence != SEEK_DATA && whence != SEEK_HOLE) return -EINVAL;
+     if (offset < 0) return -ENXIO;
+ 
+     inode_rdlock(inum);
+     off_t size = node->size;
+     off_t found = -ENXIO;
+     while (offset < size) {
+         size_t avail;
+         int is_data = inode_locate(node, offset, &avail) != -1;
+         if (is_data == (whence == SEEK_DATA)) {
+             found = offset;
+             break;
+         }
+         if (avail >= (size_t)(size - offset)) {
+             // Nothing else before the end of file
+             found = whence == SEEK_HOLE ? size : -ENXIO;
+             break;
+         }
+         offset += avail;
+     }
+     inode_unlock(inum);
+     return found;
+ }
+ 
+ /**
+  * Opens a file given its inode number.
+  * 
+  * Files opened for writing keep a preallocation window past their end
+  * until the last such handle is released.
+  * 
+  * @param inum The file's inode number
+  * @param flags The open flags
+  * @return 0 on success, negative error code on failure
+  */
+ int storage_open_inum(int inum, int flags) {
+     inode_t *node = get_inode(inum);
+     if (!node) return -ENOENT;
+     if ((flags & O_ACCMODE) == O_RDONLY) return 0;
+ 
+     // Check access modes
+     if ((node->mode & 0222) == 0) return -EACCES;
+ 
+     inode_wrlock(inum);
+     get_inode_core(inum)->nwriters++;
+     inode_unlock(inum);
+     return 0;
+ }
+ 
+ /**
+  * Releases a file handle opened with storage_open_inum.
+  * 
+  * @param inum The file's inode number
+  * @param flags The flags the file was opened with
+  */
+ void storage_release_inum(int inum, int flags) {
+     inode_core_t *core = get_inode_core(inum);
+     if (!core || (flags & O_ACCMODE) == O_RDONLY) return;
+ 
+     inode_wrlock(inum);
+     storage_apply_pending(inum);
+     if (core->nwriters > 0 && --core->nwriters == 0) {
+         inode_release_prealloc(get_inode(inum));
+         storage_pack(inum);
+     }
+     inode_unlock(inum);
+ }
+ 
+ /**
+  * Applies the metadata updates held back by writes to a file.
+  * 
+  * @param inum The file's inode number
+  * @return 0 on success, negative error code on failure
+  */
+ int storage_flush_inum(int inum) {
+     inode_core_t *core = get_inode_core(inum);
+     if (!get_inode(inum)) return -ENOENT;
+     
+     // Closing a file that was only read changes nothing
+     if (!core->pending_mtime &&
+         !__atomic_load_n(&core->pending_atime, __ATOMIC_RELAXED)) {
+         return 0;
+     }
+     
+     inode_wrlock(inum);
+     storage_apply_pending(inum);
+     inode_unlock(inum);
+     return 0;
+ }
+ 
+ /**
+  * Changes the size of a file.
+  * 
+  * @param path The path to the file
+  * @param size The new size for the file
+  * @return 0 on success, negative error code on failure
+  */
+ int storage_truncate(const char *path, off_t size) {
+     int inum = storage_lookup_path(path);
+     if (inum < 0) return inum;
+     return storage_truncate_inum(inum, size);
+ }
+ 
+ /**
+  * Creates a new file.
+  * 
+  * @param path The path to the new file
+  * @param mode File permissions and type
+  * @return 0 on success, negative error code on failure
+  */
+ int storage_mknod(const char *path, mode_t mode) {
+     char name[DIR_NAME_LENGTH];
+     int parent_inum = storage_split_path(path, name);
+     if (parent_inum < 0) return parent_inum;
+ 
+     int rv = storage_mknod_at(parent_inum, name, mode);
+     return rv < 0 ? rv : 0;
+ }
+ 
+ /**
+  * Creates a new file in a directory whose lock the caller already holds.
+  * 
+  * @param parent_inum The inode number of the parent directory
+  * @param name The name of the new file
+  * @param mode File permissions and type
+  * @return Inode number of the new file on success, negative error code on
+  *         failure
+  */
+ static int storage_mknod_locked(int parent_inum, const char *name, mode_t mode) {
+     inode_t *parent = get_inode(parent_inum);
+ 
+     // Check if file exists
+     if (directory_lookup(parent, name) >= 0) return -EEXIST;
+ 
+     // Allocate new file; nobody else can reach it until it is linked
+     int inum = alloc_inode();
+     if (inum < 0) return -ENOSPC;
+ 
+     inode_t *node = get_inode(inum);
+     node->mode = mode;
+     node->size = 0;
+     if (S_ISREG(mode)) node->flags = INODE_INLINE;  // Small files need no block
+     node->flags |= parent->flags & INODE_COMPRESS;
+ 
+     // Add to directory
+     int rv = directory_put(parent, name, inum);
+     if (rv == 0) {
+         journal_log(node, sizeof(inode_t));
+     } else {
+         free_inode(inum);
+     }
+     return rv < 0 ? rv : inum;
+ }
+ 
+ /**
+  * Creates a new file in a specified directory.
+  * 
+  * @param parent_inum The inode number of the parent directory
+  * @param name The name of the new file
+  * @param mode File permissions and type
+  * @return Inode number of the new file on success, negative error code on
+  *         failure
+  */
+ int storage_mknod_at(int parent_inum, const char *name, mode_t mode) {
+     inode_t *parent = get_inode(parent_inum);
+     if (!parent || !S_ISDIR(parent->mode)) return -ENOTDIR;
+ 
+     inode_wrlock(parent_inum);
+     int rv = storage_mknod_locked(parent_inum, name, mode);
+     inode_unlock(parent_inum);
+     return rv;
+ }
+ 
+ /**
+  * Removes a file from a directory whose lock the caller already holds.
+  * 
+  * @param parent_inum The inode number of the parent directory
+  * @param name The name of the file to remove
+  * @return 0 on success, negative error code on failure
+  */
+ static int storage_unlink_locked(int parent_inum, const char *name) {
+     inode_t *parent = get_inode(parent_inum);
+     int file_inum = storage_lookup_locked(parent_inum, name);
+     inode_t *node = get_inode(file_inum);
+     int rv = node ? 0 : file_inum;
+     
+     // Can't unlink directories (use rmdir instead)
+     if (rv == 0 && S_ISDIR(node->mode)) rv = -EISDIR;
+     
+     // Remove directory entry FIRST
+     if (rv == 0) rv = directory_delete(parent, name);
+     
+     // THEN drop the link, freeing the inode if it was the last reference
+     if (rv == 0) {
+         inode_wrlock(file_inum);
+         node->refs--;
+         node->ctime = time(NULL);
+         storage_put_inode(file_inum);
+         inode_unlock(file_inum);
+         
+         // Update parent directory timestamps
+         parent->mtime = parent->ctime = time(NULL);
+         storage_compact_dir(parent_inum);
+     }
+     return rv;
+ }
+ 
+ /**
+  * Removes a file from a specified directory.
+  * 
+  * The inode itself is freed once the kernel has forgotten it as well.
+  * 
+  * @param parent_inum The inode number of the parent directory
+  * @param name The name of the file to remove
+  * @return 0 on success, negative error code on failure
+  */
+ int storage_unlink_at(int parent_inum, const char *name) {
+     inode_t *parent = get_inode(parent_inum);
+     if (!parent || !S_ISDIR(parent->mode)) return -ENOTDIR;
+     
+     inode_wrlock(parent_inum);
+     int rv = storage_unlink_locked(parent_inum, name);
+     inode_unlock(parent_inum);
+     return rv;
+ }
+ 
+ /**
+  * Applies one entry of a batch to a directory whose lock the caller holds.
+  * 
+  * "." and ".." are refused: stating either would lock an inode the
+  * caller already holds, or one above it.
+  * 
+  * @param parent_inum The inode number of the directory
+  * @param e The entry, filled in with the attributes of the file it names
+  * @return 0 on success, negative error code on failure
+  */
+ static int storage_batch_one(int parent_inum, struct nufs_batch_entry *e) {
+     if (!memchr(e->name, '\0', DIR_NAME_LENGTH)) return -ENAMETOOLONG;
+     if (e->name[0] == '\0' || strchr(e->name, '/') ||
+         strcmp(e->name, ".") == 0 || strcmp(e->name, "..") == 0) {
+         return -EINVAL;
+     }
+ 
+     int inum;
+     switch (e->op) {
+     case NUFS_BATCH_CREATE:
+         inum = storage_mknod_locked(parent_inum, e->name, S_IFREG | (e->mode & 07777));
+         break;
+     case NUFS_BATCH_STAT:
+         inum = storage_lookup_locked(parent_inum, e->name);
+         break;
+     case NUFS_BATCH_UNLINK:
+         return storage_unlink_locked(parent_inum, e->name);
+     default:
+         return -EINVAL;
+     }
+     if (inum < 0) return inum;
+ 
+     struct stat st;
+     int rv = storage_stat_inum(inum, &st);
+     if (rv < 0) return rv;
+     e->mode = st.st_mode;
+     e->nlink = st.st_nlink;
+     e->ino = st.st_ino;
+     e->size = st.st_size;
+     e->blocks = st.st_blocks;
+     e->mtime = st.st_mtime;
+     return 0;
+ }
+ 
+ /**
+  * Applies a batch of creates, stats and unlinks to one directory.
+  * 
+  * @param parent_inum The inode number of the directory
+  * @param entries The operations
+  * @param count Number of entries, at most NUFS_BATCH_MAX
+  * @return Number of entries that succeeded, or negative error code if the
+  *         batch could not be applied at all
+  */
+ int storage_batch_at(int parent_inum, struct nufs_batch_entry *entries, int count) {
+     inode_t *parent = get_inode(parent_inum);
+     if (!parent || !S_ISDIR(parent->mode)) return -ENOTDIR;
+     if (count < 0 || count > NUFS_BATCH_MAX) return -EINVAL;
+ 
+     // One transaction for the lot, however many inodes it touches, unless
+     // that would outgrow the journal
+     journal_begin();
+     inode_wrlock(parent_inum);
+     int done = 0;
+     for (int i = 0; i < count; i++) {
+         if (i > 0 && journal_batch_full()) {
+             // Commit the entries so far and go on in another transaction
+             inode_unlock(parent_inum);
+             journal_end();
+             journal_begin();
+             inode_wrlock(parent_inum);
+         }
+         if (!S_ISDIR(parent->mode)) {
+             entries[i].result = -ENOENT; // Removed while it was unlocked
+             continue;
+         }
+         entries[i].result = storage_batch_one(parent_inum, &entries[i]);
+         if (entries[i].result == 0) done++;
+     }
+     inode_unlock(parent_inum);
+     journal_end();
+     return done;
+ }
+ 
+ /**
+  * Removes a file.
+  * 
+  * @param path The path to the file to remove
+  * @return 0 on success, negative error code on failure
+  */
+ int storage_unlink(const char *path) {
+     char name[DIR_NAME_LENGTH];
+     int parent_inum = storage_split_path(path, name);
+     if (parent_inum < 0) return parent_inum;
+     return storage_unlink_at(parent_inum, name);
+ }
+ 
+ /**
+  * Adds another name for an existing file.
+  * 
+  * Takes rename_lock, then the directory, then the file, as rename does,
+  * inside one journal operation.
+  * 
+  * @param inum The inode number of the file
+  * @param parent_inum The inode number of the directory for the new name
+  * @param name The new name
+  * @return 0 on success, negative error code on failure
+  */
+ int storage_link_at(int inum, int parent_inum, const char *name) {
+     inode_t *parent = get_inode(parent_inum);
+     if (!parent || !S_ISDIR(parent->mode)) return -ENOTDIR;
+     inode_t *node = get_inode(inum);
+     if (!node || !bitmap_get(get_inode_bitmap(), inum)) return -ENOENT;
+     if (S_ISDIR(node->mode)) return -EPERM;
+     
+     journal_begin();
+     pthread_mutex_lock(&rename_lock);
+     inode_wrlock(parent_inum);
+     inode_wrlock(inum);
+     
+     // A file whose last name is gone stays unlinked
+     int rv = node->refs > 0 ? 0 : -ENOENT;
+     if (rv == 0) rv = directory_put(parent, name, inum);
+     if (rv == 0) {
+         node->refs++;
+         node->ctime = time(NULL);
+         parent->mtime = parent->ctime = node->ctime;
+     }
+     
+     inode_unlock(inum);
+     inode_unlock(parent_inum);
+     pthread_mutex_unlock(&rename_lock);
+     journal_end();
+     return rv;
+ }
+ 
+ /**
+  * Creates a hard link between files.
+  * 
+  * @param from Path to the existing file
+  * @param to Path for the new link
+  * @return 0 on success, negative error code on failure
+  */
+ int storage_link(const char *from, const char *to) {
+     int inum = storage_lookup_path(from);
+     if (inum < 0) return inum;
+     char name[DIR_NAME_LENGTH];
+     int parent_inum = storage_split_path(to, name);
+     if (parent_inum < 0) return parent_inum;
+     return storage_link_at(inum, parent_inum, name);
+ }
+ 
+ /**
+  * Removes an empty directory from a specified parent directory.
+  * 
+  * @param parent_inum The inode number of the parent directory
+  * @param name The name of the directory to remove
+  * @return 0 on success, negative error code on failure
+  */
+ int storage_rmdir_at(int parent_inum, const char *name) {
+     if (strcmp(name, ".") == 0) return -EINVAL;
+     if (strcmp(name, "..") == 0) return -ENOTEMPTY;
+ 
+     inode_t *parent = get_inode(parent_inum);
+     if (!parent || !S_ISDIR(parent->mode)) return -ENOTDIR;
+ 
+     inode_wrlock(parent_inum);
+     int dir_inum = storage_lookup_locked(parent_inum, name);
+     inode_t *dir = get_inode(dir_inum);
+     int rv = dir ? 0 : dir_inum;
+     if (rv == 0 && !S_ISDIR(dir->mode)) rv = -ENOTDIR;
+ 
+     if (rv == 0) {
+         inode_wrlock(dir_inum);
+ 
+         // Ensure the directory is empty (only . and .. left)
+         if (dir->nentries > 2) rv = -ENOTEMPTY;
+         if (rv == 0) rv = directory_delete(parent, name);
+         if (rv == 0) {
+             dir->refs = 0;
+             storage_put_inode(dir_inum);
+             parent->nsubdirs--;
+             parent->mtime = parent->ctime = time(NULL);
+             storage_compact_dir(parent_inum);
+         }
+ 
+         inode_unlock(dir_inum);
+     }
+     inode_unlock(parent_inum);
+     return rv;
+ }
+ 
+ /**
+  * Removes an empty directory.
+  * 
+  * @param path The path to the directory to remove
+  * @return 0 on success, negative error code on failure
+  */
+ int storage_rmdir(const char *path) {
+     char name[DIR_NAME_LENGTH];
+     int parent_inum = storage_split_path(path, name);
+     if (parent_inum < 0) return parent_inum;
+     return storage_rmdir_at(parent_inum, name);
  }
  
  /**
-  * Prints the current state of the file system.
+  * Tells whether a directory is, or is somewhere below, another inode.
   * 
-  * Displays the root inode information and lists all entries in the root directory.
+  * Only renames change a directory's parent, so the walk up is stable
+  * while rename_lock is held.
+  * 
+  * @param dir_inum The directory to start from
+  * @param inum The inode to look for
+  * @return 1 if inum is dir_inum or one of its ancestors, 0 otherwise
   */
- void print_storage_status() {
-     printf("Storage status:\n");
-     printf("  Root inode: %d\n", storage_lookup_path("/"));
-     printf("  Files in root:\n");
-     
-     inode_t *root = get_inode(0);
-     dir_entry_t *entries = blocks_get_block(root->block);
-     int count = root->size / sizeof(dir_entry_t);
-     
-     for (int i = 0; i < count; i++) {
-         printf("    %s -> inode %d\n", entries[i].name, entries[i].inum);
+ static int storage_is_below(int dir_inum, int inum) {
+     for (int d = dir_inum; ; d = get_inode(d)->parent) {
+         if (d == inum) return 1;
+         if (d == 0) return 0;
      }
  }
  
  /**
-  * Writes data to a file.
+  * Rewrites the entries of a rename once both names have been looked up.
   * 
-  * @param path The path to the file
-  * @param buf The data to write
-  * @param size Number of bytes to write
-  * @param offset Starting position for writing
-  * @return Number of bytes written on success, negative error code on failure
+  * The caller holds rename_lock and both directories; the inodes named are
+  * locked here, in increasing inode number.
+  * 
+  * @param from_parent Inode number of the source directory
+  * @param from_name Current name of the entry
+  * @param inum The inode it names
+  * @param to_parent Inode number of the destination directory
+  * @param to_name New name of the entry
+  * @param victim The inode to_name names now, or negative if it is free
+  * @param flags 0, RENAME_NOREPLACE or RENAME_EXCHANGE
+  * @return 0 on success, negative error code on failure
   */
- int storage_write(const char *path, const char *buf, size_t size, off_t offset) {
-     int inum = storage_lookup_path(path);
-     if (inum < 0) return -ENOENT;
-     
+ static int storage_rename_entries(int from_parent, const char *from_name,
+                                   int inum, int to_parent,
+                                   const char *to_name, int victim,
+                                   unsigned int flags) {
+     inode_t *from_dir = get_inode(from_parent);
+     inode_t *to_dir = get_inode(to_parent);
      inode_t *node = get_inode(inum);
-     if (!node || !S_ISREG(node->mode)) return -EISDIR;
-     
-     // Calculate required blocks
-     size_t required_blocks = (offset + size + BLOCK_SIZE - 1) / BLOCK_SIZE;
-     size_t current_blocks = (node->size + BLOCK_SIZE - 1) / BLOCK_SIZE;
-     
-     // Allocate additional blocks if needed
-     if (required_blocks > current_blocks) {
-         for (size_t i = current_blocks; i < required_blocks; i++) {
-             int new_block = alloc_block();
-             if (new_block < 0) return -ENOSPC;
-             // For multi-block support, you'll need to implement block pointers
-             // This is a simplified version assuming single block
-             if (i == 0) node->block = new_block;
+     inode_t *old = victim >= 0 ? get_inode(victim) : NULL;
+     int is_dir = S_ISDIR(node->mode);
+     int old_is_dir = old && S_ISDIR(old->mode);
+     int exchange = flags & RENAME_EXCHANGE;
+     int moves = from_parent != to_parent;
+ 
+     // No directory may end up below itself
+     if (is_dir && storage_is_below(to_parent, inum)) return -EINVAL;
+     if (old_is_dir && storage_is_below(from_parent, victim)) {
+         return exchange ? -EINVAL : -ENOTEMPTY;
+     }
+     if (old && !exchange) {
+         if (is_dir && !old_is_dir) return -ENOTDIR;
+         if (!is_dir && old_is_dir) return -EISDIR;
+     }
+ 
+     int first = old && victim < inum ? victim : inum;
+     int second = old && victim > inum ? victim : inum;
+     inode_wrlock(first);
+     if (second != first) inode_wrlock(second);
+ 
+     int rv = 0;
+     time_t now = time(NULL);
+     if (exchange) {
+         // Each name keeps its slot and takes the other's inode
+         directory_replace(from_dir, from_name, victim);
+         directory_replace(to_dir, to_name, inum);
+         if (old_is_dir && moves) {
+             old->parent = from_parent;
+             to_dir->nsubdirs--;
+             from_dir->nsubdirs++;
+         }
+         old->ctime = now;
+     } else if (old) {
+         if (old_is_dir && old->nentries > 2) rv = -ENOTEMPTY;
+ 
+         // The destination slot now names the file; its old inode loses a link
+         if (rv == 0) {
+             directory_replace(to_dir, to_name, inum);
+             directory_delete(from_dir, from_name);
+             if (old_is_dir) {
+                 old->refs = 0;
+                 to_dir->nsubdirs--;
+             } else {
+                 old->refs--;
+             }
+             old->ctime = now;
+             storage_put_inode(victim);
+         }
+     } else {
+         // First add to new location, then remove from old
+         rv = directory_put(to_dir, to_name, inum);
+         if (rv == 0) {
+             rv = directory_delete(from_dir, from_name);
+             if (rv < 0) {
+                 // Rollback if delete fails
+                 directory_delete(to_dir, to_name);
+             }
          }
      }
-     
-     // Write data (simplified single-block version)
-     void *block = blocks_get_block(node->block);
-     memcpy(block + offset, buf, size);
-     
-     // Update size
-     if (offset + size > node->size) {
-         node->size = offset + size;
+ 
+     // A directory's ".." link moves with it
+     if (rv == 0) {
+         if (is_dir && moves) {
+             node->parent = to_parent;
+             from_dir->nsubdirs--;
+             to_dir->nsubdirs++;
+         }
+         node->ctime = now;
+         from_dir->ctime = to_dir->ctime = now;
      }
-     
-     return size;
+ 
+     if (second != first) inode_unlock(second);
+     inode_unlock(first);
+     return rv;
  }
  
  /**
-  * Creates a new file.
+  * Moves a directory entry, possibly into another directory.
   * 
-  * @param path The path to the new file
-  * @param mode File permissions and type
+  * A name already at the destination is replaced, or with RENAME_EXCHANGE
+  * swapped with the source. Either way existing entries are rewritten in
+  * their slots, so only a move to a free name needs a new slot. Everything
+  * the rename changes is logged in one journal transaction, so after a
+  * crash it has happened completely or not at all.
+  * 
+  * Both directories are locked for the whole move, after rename_lock, and
+  * the inodes being moved or replaced after them.
+  * 
+  * @param from_parent Inode number of the source directory
+  * @param from_name Current name of the entry
+  * @param to_parent Inode number of the destination directory
+  * @param to_name New name of the entry
+  * @param flags 0, RENAME_NOREPLACE or RENAME_EXCHANGE
   * @return 0 on success, negative error code on failure
   */
- int storage_mknod(const char *path, mode_t mode) {
-     // Split into directory and filename
-     char *path_copy = strdup(path);
-     char *filename = strrchr(path_copy, '/');
-     if (!filename) {
-         free(path_copy);
+ int storage_rename_at(int from_parent, const char *from_name,
+                       int to_parent, const char *to_name,
+                       unsigned int flags) {
+     inode_t *from_dir = get_inode(from_parent);
+     inode_t *to_dir = get_inode(to_parent);
+     if (!from_dir || !S_ISDIR(from_dir->mode)) return -ENOTDIR;
+     if (!to_dir || !S_ISDIR(to_dir->mode)) return -ENOTDIR;
+     if ((flags & ~(RENAME_NOREPLACE | RENAME_EXCHANGE)) ||
+         flags == (RENAME_NOREPLACE | RENAME_EXCHANGE)) {
          return -EINVAL;
      }
-     *filename++ = '\0';
- 
-     // Get parent directory
-     const char *parent_path = (path_copy[0] == '\0') ? "/" : path_copy;
-     int parent_inum = storage_lookup_path(parent_path);
-     if (parent_inum < 0) {
-         free(path_copy);
-         return parent_inum;
-     }
- 
-     inode_t *parent = get_inode(parent_inum);
-     if (!parent || !S_ISDIR(parent->mode)) {
-         free(path_copy);
-         return -ENOTDIR;
-     }
- 
-     // Check if file exists
-     if (directory_lookup(parent, filename) >= 0) {
-         free(path_copy);
-         return -EEXIST;
+     if (strcmp(from_name, ".") == 0 || strcmp(from_name, "..") == 0 ||
+         strcmp(to_name, ".") == 0 || strcmp(to_name, "..") == 0) {
+         return -EINVAL;
      }
  
-     // Create new file
-     int inum = alloc_inode();
-     if (inum < 0) {
-         free(path_copy);
-         return -ENOSPC;
-     }
+     // Lock order: rename_lock, then both parents by inode number
+     int first = from_parent < to_parent ? from_parent : to_parent;
+     int second = from_parent < to_parent ? to_parent : from_parent;
+     journal_begin();
+     pthread_mutex_lock(&rename_lock);
+     inode_wrlock(first);
+     if (second != first) inode_wrlock(second);
  
-     inode_t *node = get_inode(inum);
-     node->mode = mode;
-     node->size = 0;
-     node->block = alloc_block();
-     if (node->block < 0) {
-         free_inode(inum);
-         free(path_copy);
-         return -ENOSPC;
+     int inum = storage_lookup_locked(from_parent, from_name);
+     int victim = storage_lookup_locked(to_parent, to_name);
+     int rv = inum < 0 ? inum : 0;
+     if (rv == 0 && victim < 0 && (victim != -ENOENT || (flags & RENAME_EXCHANGE))) {
+         rv = victim;
      }
+     if (rv == 0 && victim >= 0 && (flags & RENAME_NOREPLACE)) rv = -EEXIST;
  
-     // Add to directory
-     int rv = directory_put(parent, filename, inum);
-     if (rv < 0) {
-         free_block(node->block);
-         free_inode(inum);
-         free(path_copy);
-         return rv;
+     // Two names for the same inode: nothing to do
+     if (rv == 0 && victim != inum) {
+         rv = storage_rename_entries(from_parent, from_name, inum,
+                                     to_parent, to_name, victim, flags);
      }
+     if (rv == 0 && !(flags & RENAME_EXCHANGE)) storage_compact_dir(from_parent);
  
-     free(path_copy);
-     return 0;
+     if (second != first) inode_unlock(second);
+     inode_unlock(first);
+     pthread_mutex_unlock(&rename_lock);
+     journal_end();
+     return rv;
  }
  
  /**
-  * Creates a new file in a specified directory.
+  * Renames a file or directory.
   * 
-  * @param parent_inum The inode number of the parent directory
-  * @param name The name of the new file
-  * @param mode File permissions and type
+  * @param from Current path of the file/directory
+  * @param to New path for the file/directory
   * @return 0 on success, negative error code on failure
   */
- int storage_mknod_at(int parent_inum, const char *name, mode_t mode) {
-     inode_t *parent = get_inode(parent_inum);
-     if (!parent || !S_ISDIR(parent->mode)) return -ENOTDIR;
- 
-     // Check if file exists
-     if (directory_lookup(parent, name) >= 0) return -EEXIST;
- 
-     // Allocate new file
-     int inum = alloc_inode();
-     if (inum < 0) return -ENOSPC;
- 
-     inode_t *node = get_inode(inum);
-     node->mode = mode;
-     node->size = 0;
-     node->block = alloc_block();
-     if (node->block < 0) {
-         free_inode(inum);
-         return -ENOSPC;
-     }
- 
-     // Add to directory
-     return directory_put(parent, name, inum);
+ int storage_rename(const char *from, const char *to) {
+     char from_name[DIR_NAME_LENGTH];
+     char to_name[DIR_NAME_LENGTH];
+     int from_parent = storage_split_path(from, from_name);
+     if (from_parent < 0) return from_parent;
+     int to_parent = storage_split_path(to, to_name);
+     if (to_parent < 0) return to_parent;
+     return storage_rename_at(from_parent, from_name, to_parent, to_name, 0);
  }
  
  /**
-  * Removes a file.
+  * Makes a file or directory durable.
   * 
-  * @param path The path to the file to remove
+  * Writes back the file's data blocks and commits the journal. Metadata of
+  * other files logged along the way becomes durable too, after the data
+  * blocks newly mapped into them (see blocks_order_data()); nothing else in
+  * the image is synced.
+  * 
+  * @param inum The inode number
   * @return 0 on success, negative error code on failure
   */
- int storage_unlink(const char *path) {
-     printf("unlink(%s)\n", path);
-     
-     // Split path into parent and filename
-     char *path_copy = strdup(path);
-     if (!path_copy) return -ENOMEM;
-     
-     char *filename = strrchr(path_copy, '/');
-     if (!filename) {
-         free(path_copy);
-         return -EINVAL;
-     }
-     *filename++ = '\0'; // Split into dirpath and filename
+ int storage_fsync_inum(int inum) {
+     inode_t *node = get_inode(inum);
+     if (!node) return -ENOENT;
      
-     // Get parent directory
-     const char *parent_path = path_copy[0] ? path_copy : "/";
-     int parent_inum = storage_lookup_path(parent_path);
-     if (parent_inum < 0) {
-         free(path_copy);
-         return parent_inum;
-     }
+     int rv = storage_flush_inum(inum);
+     if (rv < 0) return rv;
      
-     inode_t *parent = get_inode(parent_inum);
-     if (!parent || !S_ISDIR(parent->mode)) {
-         free(path_copy);
-         return -ENOTDIR;
+     if (S_ISREG(node->mode)) {
+         long page = sysconf(_SC_PAGESIZE);
+         char *base = blocks_get_block(0);
+         
+         inode_rdlock(inum);
+         for (off_t offset = 0; offset < node->size && rv == 0;) {
+             size_t span = 0;
+             int64_t pos = inode_locate(node, offset, &span);
+             if (span > (size_t)(node->size - offset)) {
+                 span = node->size - offset;
+             }
+             
+             // Holes have nothing to write back, and compressed extents
+             // were written back when they were made; msync wants
+             // page-aligned addresses
+             if (pos >= 0) {
+                 int64_t start = pos - pos % page;
+                 if (msync(base + start, pos + span - start, MS_SYNC) != 0) {
+                     rv = -errno;
+                 }
+             }
+             offset += span;
+         }
+         inode_unlock(inum);
+         if (rv < 0) return rv;
      }
      
-     // Find the file
-     int file_inum = directory_lookup(parent, filename);
-     if (file_inum < 0) {
-         free(path_copy);
-         return file_inum;
-     }
+     journal_commit();
+     return 0;
+ }
+ 
+ /**
+  * Tells whether a file or directory is marked for compression.
+  * 
+  * @param inum The inode number
+  * @return 1 if it is, 0 if not, or negative error code
+  */
+ int storage_get_compress_inum(int inum) {
+     inode_t *node = get_inode(inum);
+     if (!node) return -ENOENT;
+     return (node->flags & INODE_COMPRESS) != 0;
+ }
+ 
+ /**
+  * Marks a file or directory for compression, or clears the mark.
+  * 
+  * A regular file's existing data is compressed straight away. Clearing
+  * the mark leaves compressed data as it is until it is next written.
+  * 
+  * @param inum The inode number
+  * @param on Nonzero to compress, zero not to
+  * @return 0 on success, negative error code on failure
+  */
+ int storage_set_compress_inum(int inum, int on) {
+     inode_t *node = get_inode(inum);
+     if (!node) return -ENOENT;
+     if (!S_ISREG(node->mode) && !S_ISDIR(node->mode)) return -EINVAL;
      
-     inode_t *node = get_inode(file_inum);
-     if (!node) {
-         free(path_copy);
-         return -ENOENT;
+     inode_wrlock(inum);
+     int rv = 0;
+     if (on) {
+         node->flags |= INODE_COMPRESS;
+         rv = inode_compress(node, 0, node->size);
+     } else {
+         node->flags &= ~INODE_COMPRESS;
+         get_inode_core(inum)->pack_end = 0;
      }
+     node->ctime = time(NULL);
+     inode_unlock(inum);
+     return rv;
+ }
+ 
+ /**
+  * Sets access and modification times for an inode.
+  * 
+  * Each time is set to the value given, to now for UTIME_NOW, or left
+  * alone for UTIME_OMIT. The change time becomes now.
+  * 
+  * @param inum The inode number
+  * @param ts Array of timespec structures (access time at index 0,
+  *           modification time at index 1), or NULL to set both to now
+  * @return 0 on success, negative error code on failure
+  */
+ int storage_set_time_inum(int inum, const struct timespec ts[2]) {
+     inode_t *node = get_inode(inum);
+     if (!node) return -ENOENT;
      
-     // Can't unlink directories (use rmdir instead)
-     if (S_ISDIR(node->mode)) {
-         free(path_copy);
-         return -EISDIR;
-     }
+     // No times at all means now for both, as for utimensat
+     static const struct timespec both_now[2] = {
+         { 0, UTIME_NOW }, { 0, UTIME_NOW }
+     };
+     if (!ts) ts = both_now;
      
-     // Remove directory entry FIRST
-     int rv = directory_delete(parent, filename);
-     if (rv != 0) {
-         free(path_copy);
-         return rv;
+     inode_wrlock(inum);
+     storage_apply_pending(inum);
+     time_t now = time(NULL);
+     if (ts[0].tv_nsec != UTIME_OMIT) {
+         node->atime = ts[0].tv_nsec == UTIME_NOW ? now : ts[0].tv_sec;
      }
-     
-     // THEN free resources
-     if (node->block >= 0) {
-         free_block(node->block);
+     if (ts[1].tv_nsec != UTIME_OMIT) {
+         node->mtime = ts[1].tv_nsec == UTIME_NOW ? now : ts[1].tv_sec;
      }
-     free_inode(file_inum);
+     node->ctime = now;
+     inode_unlock(inum);
      
-     // Update parent directory timestamps
-     parent->mtime = parent->ctime = time(NULL);
-     
-     free(path_copy);
+     return 0;
+ }
+ 
+ /**
+  * Sets access and modification times for a file.
+  * 
+  * @param path The path to the file
+  * @param ts Array of timespec structures (access time at index 0, modification time at index 1)
+  * @return 0 on success, negative error code on failure
+  */
+ int storage_set_time(const char *path, const struct timespec ts[2]) {
+     int inum = storage_lookup_path(path);
+     if (inum < 0) return inum;
+     return storage_set_time_inum(inum, ts);
+ }
+ 
+ /**
+  * Changes the permission bits of an inode, keeping its file type.
+  * 
+  * @param inum The inode number
+  * @param mode New permission bits
+  * @return 0 on success, negative error code on failure
+  */
+ int storage_chmod_inum(int inum, mode_t mode) {
+     inode_t *node = get_inode(inum);
+     if (!node) return -ENOENT;
+ 
+     inode_wrlock(inum);
+     node->mode = (node->mode & S_IFMT) | (mode & 07777);
+     node->ctime = time(NULL);
+     inode_unlock(inum);
      return 0;
  }
  
@@ -343,120 +1801,67 @@
  int storage_mkdir(const char *path, mode_t mode) {
      // Verify path starts with /
      if (path[0] != '/') return -EINVAL;
+     if (strcmp(path, "/") == 0) return -EEXIST;
      
-     // Split into parent path and new dir name
-     char *path_copy = strdup(path);
-     char *dirname = strrchr(path_copy, '/');
-     if (!dirname) {
-         free(path_copy);
-         return -EINVAL;
-     }
-     *dirname = '\0';
-     dirname++;
-     
-     // Get parent directory
-     const char *parent_path = path_copy[0] ? path_copy : "/";
-     int parent_inum = storage_lookup_path(parent_path);
-     free(path_copy);
-     
+     char name[DIR_NAME_LENGTH];
+     int parent_inum = storage_split_path(path, name);
      if (parent_inum < 0) return parent_inum;
      
-     inode_t *parent = get_inode(parent_inum);
-     if (!parent || !S_ISDIR(parent->mode)) {
-         return -ENOTDIR;
-     }
- 
-     // Check if directory already exists
-     if (directory_lookup(parent, dirname) >= 0) {
-         return -EEXIST;
-     }
- 
-     // Create new directory
-     int inum = alloc_inode();
-     if (inum < 0) return -ENOSPC;
-     
-     inode_t *dir = get_inode(inum);
-     dir->mode = S_IFDIR | (mode & 0777);
-     dir->block = alloc_block();
-     if (dir->block < 0) {
-         free_inode(inum);
-         return -ENOSPC;
-     }
+     int rv = storage_mkdir_at(parent_inum, name, mode);
+     return rv < 0 ? rv : 0;
+ }
  
-     // Initialize directory contents
-     dir_entry_t *entries = blocks_get_block(dir->block);
-     memset(entries, 0, BLOCK_SIZE);
-     
-     // Create . and .. entries
-     strncpy(entries[0].name, ".", DIR_NAME_LENGTH);
-     entries[0].inum = inum;
-     strncpy(entries[1].name, "..", DIR_NAME_LENGTH);
-     entries[1].inum = parent_inum;
-     dir->size = 2 * sizeof(dir_entry_t);
+ /**
+  * Looks up a name in a directory.
+  * 
+  * @param parent_inum The inode number of the directory
+  * @param name The entry name
+  * @return Inode number on success, negative error code on failure
+  */
+ int storage_lookup_at(int parent_inum, const char *name) {
+     inode_t *parent = get_inode(parent_inum);
+     if (!parent || !S_ISDIR(parent->mode)) return -ENOTDIR;
  
-     // Add to parent directory
-     dir_entry_t *parent_entries = blocks_get_block(parent->block);
-     int parent_count = parent->size / sizeof(dir_entry_t);
-     
-     // Find empty slot or extend directory
-     int slot = -1;
-     for (int i = 0; i < parent_count; i++) {
-         if (parent_entries[i].name[0] == '\0') {
-             slot = i;
-             break;
-         }
-     }
-     
-     if (slot == -1) { // Need to extend directory
-         if (parent->size + sizeof(dir_entry_t) > BLOCK_SIZE) {
-             free_block(dir->block);
-             free_inode(inum);
-             return -ENOSPC;
-         }
-         slot = parent_count;
-         parent->size += sizeof(dir_entry_t);
-     }
-     
-     // Add the new entry
-     strncpy(parent_entries[slot].name, dirname, DIR_NAME_LENGTH);
-     parent_entries[slot].inum = inum;
-     parent->mtime = time(NULL);
-     
-     return 0;
+     inode_rdlock(parent_inum);
+     int inum = storage_lookup_locked(parent_inum, name);
+     inode_unlock(parent_inum);
+     return inum;
  }
  
  /**
   * Looks up an inode number by path.
   * 
+  * Whole paths and single components are answered from the dentry cache
+  * when possible; only misses scan directories.
+  * 
   * @param path The path to look up
   * @return Inode number on success, negative error code on failure
   */
  int storage_lookup_path(const char *path) {
      if (strcmp(path, "/") == 0) return 0;
  
-     char *path_copy = strdup(path);
-     char *saveptr;
-     char *component = strtok_r(path_copy, "/", &saveptr);
-     int current_inum = 0; // Start at root
+     int cached = dcache_path_lookup(path);
+     if (cached >= 0) return cached;
+     uint64_t generation = dcache_path_generation();
  
-     while (component) {
-         inode_t *current = get_inode(current_inum);
-         if (!current || !S_ISDIR(current->mode)) {
-             free(path_copy);
-             return -ENOTDIR;
-         }
+     char component[DIR_NAME_LENGTH];
+     const char *cursor = path;
+     const char *part;
+     int len;
+     int current_inum = 0; // Start at root
  
-         int next_inum = directory_lookup(current, component);
-         if (next_inum < 0) {
-             free(path_copy);
-             return -ENOENT;
-         }
+     // Copy out each component without touching the path
+     while ((part = s_next_part(&cursor, '/', &len))) {
+         if (len == 0) continue;  // Leading or repeated slash
+         if (len >= DIR_NAME_LENGTH) return -ENAMETOOLONG;
+         memcpy(component, part, len);
+         component[len] = '\0';
  
-         current_inum = next_inum;
-         component = strtok_r(NULL, "/", &saveptr);
+         current_inum = storage_lookup_at(current_inum, component);
+         if (current_inum < 0) return current_inum;
      }
  
-     free(path_copy);
+     dcache_path_insert(path, current_inum, generation);
      return current_inum;
  }
  
@@ -466,43 +1871,100 @@
   * @param parent_inum The inode number of the parent directory
   * @param name The name of the new directory
   * @param mode Directory permissions
-  * @return 0 on success, negative error code on failure
+  * @return Inode number of the new directory on success, negative error
+  *         code on failure
   */
  int storage_mkdir_at(int parent_inum, const char *name, mode_t mode) {
-     printf("[mkdir_at] name='%s'\n", name);
-     printf("Adding directory entry: '%s' (length %ld)\n", name, strlen(name));
+     log_debug("mkdir_at(%d, %s)", parent_inum, name);
      inode_t *parent = get_inode(parent_inum);
      if (!parent || !S_ISDIR(parent->mode)) return -ENOTDIR;
      
+     inode_wrlock(parent_inum);
+     
      // Check if directory already exists
-     if (directory_lookup(parent, name) >= 0) return -EEXIST;
+     int rv = directory_lookup(parent, name) >= 0 ? -EEXIST : 0;
      
-     // Allocate new directory
-     int inum = alloc_inode();
-     if (inum < 0) return -ENOSPC;
+     // Allocate new directory; nobody else can reach it until it is linked
+     int inum = rv == 0 ? alloc_inode() : -1;
+     if (rv == 0 && inum < 0) rv = -ENOSPC;
      
-     inode_t *dir = get_inode(inum);
-     dir->mode = S_IFDIR | (mode & 0777);
-     dir->size = 0;
-     dir->block = alloc_block();
-     if (dir->block < 0) {
-         free_inode(inum);
-         return -ENOSPC;
+     if (rv == 0) {
+         inode_t *dir = get_inode(inum);
+         dir->mode = S_IFDIR | (mode & 0777);
+         dir->size = 0;
+         dir->flags = parent->flags & INODE_COMPRESS;
+         init_directory(dir, parent_inum);
      }
      
-     // Initialize directory contents
-     dir_entry_t *entries = blocks_get_block(dir->block);
-     memset(entries, 0, BLOCK_SIZE);
-     
-     // Create . and .. entries
-     strncpy(entries[0].name, ".", DIR_NAME_LENGTH);
-     entries[0].inum = inum;
-     strncpy(entries[1].name, "..", DIR_NAME_LENGTH);
-     entries[1].inum = parent_inum;
-     dir->size = 2 * sizeof(dir_entry_t);
-     
      // Add to parent directory
-     return directory_put(parent, name, inum);
+     if (rv == 0) rv = directory_put(parent, name, inum);
+     if (rv == 0) {
+         parent->nsubdirs++;
+         journal_log(get_inode(inum), sizeof(inode_t));
+     } else if (inum >= 0) {
+         free_inode(inum);
+     }
+     inode_unlock(parent_inum);
+     
+     return rv < 0 ? rv : inum;
+ }
+ 
+ /**
+  * Takes kernel lookup references on an inode.
+  * 
+  * @param inum The inode number
+  * @param nlookup Number of references to add
+  */
+ void storage_remember(int inum, uint64_t nlookup) {
+     inode_core_t *core = get_inode_core(inum);
+     if (core) __atomic_fetch_add(&core->nlookup, nlookup, __ATOMIC_ACQ_REL);
+ }
+ 
+ /**
+  * Drops kernel lookup references on an inode.
+  * 
+  * An inode that was unlinked while still referenced is freed here once
+  * the last reference goes away.
+  * 
+  * @param inum The inode number
+  * @param nlookup Number of references to drop
+  */
+ void storage_forget(int inum, uint64_t nlookup) {
+     inode_core_t *core = get_inode_core(inum);
+     if (!core) return;
+ 
+     inode_wrlock(inum);
+     uint64_t held = __atomic_load_n(&core->nlookup, __ATOMIC_ACQUIRE);
+     if (nlookup > held) nlookup = held;
+     held = __atomic_sub_fetch(&core->nlookup, nlookup, __ATOMIC_ACQ_REL);
+     if (held == 0 && bitmap_get(get_inode_bitmap(), inum)) {
+         storage_apply_pending(inum);
+         storage_put_inode(inum);
+     }
+     inode_unlock(inum);
+ }
+ 
+ /**
+  * Drops every kernel lookup reference and open file, as happens when the
+  * file system is unmounted.
+  * 
+  * Frees the inodes that were unlinked while still in use, stamps pending
+  * writes, and returns preallocated blocks to the allocator.
+  */
+ void storage_forget_all() {
+     for (int inum = 0; inum < INODE_COUNT; inum++) {
+         inode_core_t *core = get_inode_core(inum);
+         if (!core) continue;
+         if (core->prealloc_len > 0 || core->pending_mtime ||
+             core->pending_atime) {
+             inode_wrlock(inum);
+             storage_apply_pending(inum);
+             core->nwriters = 0;
+             inode_release_prealloc(get_inode(inum));
+             inode_unlock(inum);
+         }
+         if (core->nlookup > 0) storage_forget(inum, core->nlookup);
+     }
  }
  
  /**
@@ -534,28 +1996,15 @@
  
              inode_t *new_dir = get_inode(next_inum);
              new_dir->mode = S_IFDIR | (mode & 0777);
-             new_dir->block = alloc_block();
-             if (new_dir->block < 0) {
-                 free_inode(next_inum);
-                 free(path_copy);
-                 return -ENOSPC;
-             }
- 
-             // Initialize directory
-             dir_entry_t *entries = blocks_get_block(new_dir->block);
-             strcpy(entries[0].name, ".");
-             entries[0].inum = next_inum;
-             strcpy(entries[1].name, "..");
-             entries[1].inum = current_inum;
-             new_dir->size = 2 * sizeof(dir_entry_t);
+             init_directory(new_dir, current_inum);
  
              // Add to parent
              if (directory_put(current, component, next_inum) < 0) {
-                 free_block(new_dir->block);
                  free_inode(next_inum);
                  free(path_copy);
                  return -EIO;
              }
+             current->nsubdirs++;
          }
  
          current_inum = next_inum;
@@ -567,30 +2016,6 @@
      return 0;
  }
  
- /**
-  * Initializes a directory with "." and ".." entries.
-  * 
-  * @param dir Pointer to the directory inode
-  * @param parent_inum Inode number of the parent directory
-  */
- void init_directory(inode_t *dir, int parent_inum) {
-     // Clear the entire block
-     void *block = blocks_get_block(dir->block);
-     memset(block, 0, BLOCK_SIZE);
-     
-     dir_entry_t *entries = block;
-     
-     // Add . entry
-     strncpy(entries[0].name, ".", sizeof(entries[0].name));
-     entries[0].inum = dir->inum;
-     
-     // Add .. entry
-     strncpy(entries[1].name, "..", sizeof(entries[1].name));
-     entries[1].inum = parent_inum;
-     
-     dir->size = 2 * sizeof(dir_entry_t);
- }
- 
  /**
   * Prints debug information about a directory.
   * 
@@ -603,20 +2028,21 @@
          return;
      }
      
-     printf("\nDirectory inode %d (mode %o, size %d):\n", 
-            inum, dir->mode, dir->size);
+     printf("\nDirectory inode %d (mode %o, size %ld):\n", 
+            inum, dir->mode, (long)dir->size);
      
-     dir_entry_t *entries = blocks_get_block(dir->block);
-     int count = dir->size / sizeof(dir_entry_t);
+     dir_entry_t *entry;
      
-     for (int i = 0; i < count; i++) {
-         printf("  [%d] '%.*s' -> inode %d\n", 
-               i, DIR_NAME_LENGTH, entries[i].name, entries[i].inum);
+     for (int64_t slot = 0; (entry = directory_next(dir, &slot)); slot++) {
+         if (entry->name[0] == '\0') continue;
+         
+         printf("  [%lld] '%.*s' -> inode %d\n", 
+               (long long)slot, DIR_NAME_LENGTH, entry->name, entry->inum);
          
          // Print raw bytes for debugging
          printf("    Raw bytes: ");
          for (int j = 0; j < sizeof(dir_entry_t); j++) {
-             printf("%02x ", ((unsigned char*)&entries[i])[j]);
+             printf("%02x ", ((unsigned char*)entry)[j]);
              if (j % 16 == 15) printf("\n             ");
          }
          printf("\n");
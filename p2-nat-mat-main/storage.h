@@ -11,19 +11,114 @@
  #ifndef NUFS_STORAGE_H
  #define NUFS_STORAGE_H
  
+ #include <stdint.h>
+ #include <sys/ioctl.h>
  #include <sys/stat.h>
+ #include <sys/statvfs.h>
  #include <sys/types.h>
  #include <time.h>
  #include <unistd.h>
  
+ #include "helpers/blocks.h"
  #include "helpers/slist.h"
+ #include "directory.h"
+ 
+ /**
+  * Argument of NUFS_IOC_CLONE_RANGE, issued on the file being cloned into
+  */
+ struct nufs_clone_range {
+     uint64_t src_ino;     // st_ino of the file to clone from
+     uint64_t src_offset;  // block-aligned
+     uint64_t length;      // 0 for everything up to the source's end
+     uint64_t dest_offset; // block-aligned
+ };
+ 
+ /**
+  * Shares a range of one file's blocks with another (see
+  * storage_clone_range_inum); fails with EOPNOTSUPP on images without dedup
+  */
+ #define NUFS_IOC_CLONE_RANGE _IOW('N', 2, struct nufs_clone_range)
+
+ /**
+  * Operations of a NUFS_IOC_BATCH entry
+  */
+ #define NUFS_BATCH_CREATE 1  // Create a regular file
+ #define NUFS_BATCH_STAT 2    // Look a name up and fill in its attributes
+ #define NUFS_BATCH_UNLINK 3  // Remove a name that is not a directory
+
+ /**
+  * Most entries in one NUFS_IOC_BATCH; FUSE limits an ioctl's argument to
+  * under 16K
+  */
+ #define NUFS_BATCH_MAX 128
+
+ /**
+  * One operation of a NUFS_IOC_BATCH, on a name in the directory the ioctl
+  * is issued on
+  */
+ struct nufs_batch_entry {
+     char name[DIR_NAME_LENGTH];  // NUL-terminated, no '/'
+     uint32_t op;        // NUFS_BATCH_*
+     uint32_t mode;      // CREATE: permission bits; filled with st_mode
+     int32_t result;     // 0, or a negative errno
+     uint32_t nlink;     // CREATE and STAT fill these in
+     uint64_t ino;
+     uint64_t size;
+     uint64_t blocks;
+     int64_t mtime;
+ };
+
+ /**
+  * Argument of NUFS_IOC_BATCH
+  */
+ struct nufs_batch {
+     uint32_t count;     // Entries used
+     uint32_t done;      // Filled with the number that succeeded
+     struct nufs_batch_entry entries[NUFS_BATCH_MAX];
+ };
+
+ /**
+  * Applies a batch of creates, stats and unlinks to one directory, in a
+  * single transaction as far as the journal allows (see storage_batch_at)
+  */
+ #define NUFS_IOC_BATCH _IOWR('N', 3, struct nufs_batch)
+ 
+ /**
+  * When reads update a file's access time
+  */
+ #define STORAGE_ATIME_RELATIVE 0  // When older than the last change or a day (relatime, the default)
+ #define STORAGE_ATIME_STRICT 1    // On every read (strictatime)
+ #define STORAGE_ATIME_NEVER 2     // Never (noatime)
+ 
+ /**
+  * Fills in the geometry used for newly formatted images.
+  * 
+  * The defaults are a 1 MB image of 4K blocks that can grow to 1 GB,
+  * with 256 inodes.
+  * 
+  * @param geo Geometry to fill in
+  */
+ void storage_default_geometry(blocks_geometry_t *geo);
  
  /**
   * Initializes the storage system.
   * 
   * @param path The path to the storage file/device
+  * @param geo Geometry to format the image with if it has no superblock,
+  *            or NULL for the defaults
   */
- void storage_init(const char *path);
+ void storage_init(const char *path, const blocks_geometry_t *geo);
+ 
+ /**
+  * Chooses when reads update access times.
+  * 
+  * Either way the time is only noted in memory by the read, and written
+  * to the inode when the file is flushed, released or forgotten.
+  * 
+  * @param mode STORAGE_ATIME_RELATIVE, STORAGE_ATIME_STRICT or
+  *             STORAGE_ATIME_NEVER
+  */
+ void storage_set_atime_mode(int mode);
  
  /**
   * Gets metadata about a file or directory.
@@ -132,10 +227,418 @@
   * @param parent_inum The inode number of the parent directory
   * @param name The name of the new directory
   * @param mode Directory permissions
-  * @return 0 on success, negative error code on failure
+  * @return Inode number of the new directory on success, negative error
+  *         code on failure
   */
  int storage_mkdir_at(int parent_inum, const char *name, mode_t mode);
  
+ /**
+  * Removes an empty directory.
+  * 
+  * @param path The path to the directory to remove
+  * @return 0 on success, negative error code on failure
+  */
+ int storage_rmdir(const char *path);
+ 
+ /* The calls below address files by inode number rather than by path. */
+ 
+ /**
+  * Looks up a name in a directory.
+  * 
+  * @param parent_inum The inode number of the directory
+  * @param name The entry name
+  * @return Inode number on success, negative error code on failure
+  */
+ int storage_lookup_at(int parent_inum, const char *name);
+ 
+ /**
+  * Gets metadata about an inode.
+  * 
+  * @param inum The inode number
+  * @param st Pointer to a stat structure to fill with metadata
+  * @return 0 on success, negative error code on failure
+  */
+ int storage_stat_inum(int inum, struct stat *st);
+ 
+ /**
+  * Reports the space and inodes of the mounted image.
+  * 
+  * Reads the free counts kept by the allocators, so it takes the same time
+  * however large the image is. Space the image can still grow into counts
+  * as free.
+  * 
+  * @param st Pointer to a statvfs structure to fill
+  */
+ void storage_statfs(struct statvfs *st);
+ 
+ /**
+  * Reads data from a file given its inode number.
+  * 
+  * @param inum The file's inode number
+  * @param buf Buffer to store the read data
+  * @param size Number of bytes to read
+  * @param offset Starting position for reading
+  * @return Number of bytes read on success, negative error code on failure
+  */
+ int storage_read_inum(int inum, char *buf, size_t size, off_t offset);
+ 
+ /**
+  * A byte range of the disk image backing part of a file.
+  */
+ typedef struct storage_span {
+     int64_t pos;  // Byte offset in the image (and the mapping), -1 for a hole,
+                   // or STORAGE_SPAN_PACKED
+     size_t len;   // Length in bytes
+ } storage_span_t;
+ 
+ /** Span position for compressed data, read with storage_read_packed */
+ #define STORAGE_SPAN_PACKED (-2)
+ 
+ /**
+  * Maps a read of a file to the spans of the disk image holding the data.
+  * 
+  * Lets the caller send file data straight from the image instead of
+  * copying it into a buffer first; only compressed data has to be read
+  * into one, with storage_read_packed. On success the inode is left
+  * read-locked, so its blocks cannot be freed and reused while the data is
+  * sent; the caller then releases it with storage_read_spans_done.
+  * 
+  * @param inum The file's inode number
+  * @param size Number of bytes to read
+  * @param offset Starting position for reading
+  * @param spans Filled with the spans in file order; size / BLOCK_SIZE + 2
+  *              entries are always enough
+  * @param max_spans Capacity of spans
+  * @return Number of spans (0 at end of file), or negative error code with
+  *         the inode unlocked
+  */
+ int storage_read_spans(int inum, size_t size, off_t offset,
+                        storage_span_t *spans, int max_spans);
+ 
+ /**
+  * Releases the inode locked by a successful storage_read_spans.
+  * 
+  * @param inum The file's inode number
+  */
+ void storage_read_spans_done(int inum);
+ 
+ /**
+  * Reads the data of a span marked STORAGE_SPAN_PACKED.
+  * 
+  * Decompresses straight into the caller's buffer, between a successful
+  * storage_read_spans and storage_read_spans_done.
+  * 
+  * @param inum The file's inode number
+  * @param offset File offset of the span
+  * @param buf Filled with the data
+  * @param len Length of the span
+  * @return 0 on success, -EIO if the data cannot be decompressed
+  */
+ int storage_read_packed(int inum, off_t offset, char *buf, size_t len);
+ 
+ /**
+  * Maps a write to a file to the spans of the disk image it will land in.
+  * 
+  * Blocks are mapped for the whole range first, so the caller can move the
+  * data straight into the image (for instance by splicing it from the
+  * kernel) and then report how much arrived with storage_write_spans_done.
+  * The inode stays write-locked in between. On error it is unlocked.
+  * 
+  * @param inum The file's inode number
+  * @param size Number of bytes to write
+  * @param offset Starting position for writing
+  * @param spans Filled with the spans in file order; size / BLOCK_SIZE + 2
+  *              entries are always enough
+  * @param max_spans Capacity of spans
+  * @return Number of spans, or negative error code
+  */
+ int storage_write_spans(int inum, size_t size, off_t offset,
+                         storage_span_t *spans, int max_spans);
+ 
+ /**
+  * Finishes a write started with storage_write_spans.
+  * 
+  * Extends the file to cover what was written, shares its blocks with
+  * identical ones on images with dedup, and unlocks the inode.
+  * 
+  * @param inum The file's inode number
+  * @param offset Starting position of the write
+  * @param end File offset just past the last byte written, or -1 if
+  *            nothing was written
+  */
+ void storage_write_spans_done(int inum, off_t offset, off_t end);
+ 
+ /**
+  * Copies a range of one file into another given their inode numbers.
+  * 
+  * On images with dedup, whole blocks are shared rather than copied when
+  * the two offsets are equally aligned, so the copy costs a few extent
+  * updates; the bytes up to the first block boundary, and any partial
+  * block at the end, are copied. Otherwise every byte is copied, but
+  * within the filesystem. Nothing is copied from past the end of the
+  * source.
+  * 
+  * @param src The source file's inode number
+  * @param src_off Offset of the range in the source
+  * @param dst The target file's inode number
+  * @param dst_off Offset to copy the range to
+  * @param len Number of bytes to copy
+  * @return Number of bytes copied, or negative error code (-EINVAL if the
+  *         ranges overlap within one file)
+  */
+ ssize_t storage_copy_range_inum(int src, off_t src_off, int dst, off_t dst_off,
+                                 size_t len);
+ 
+ /**
+  * Makes a range of one file share the blocks of a range of another.
+  * 
+  * Whatever the target range held is replaced. Both offsets must be
+  * block-aligned and so must the length, unless the range ends at the end
+  * of the source and runs to or past the end of the target.
+  * 
+  * @param src The source file's inode number
+  * @param src_off Offset of the range in the source
+  * @param dst The target file's inode number
+  * @param dst_off Offset to clone the range to
+  * @param len Number of bytes, or 0 for everything up to the source's end
+  * @return 0 on success, -EOPNOTSUPP on images without dedup, -EINVAL for
+  *         a misaligned or overlapping range, or another negative error code
+  */
+ int storage_clone_range_inum(int src, off_t src_off, int dst, off_t dst_off,
+                              off_t len);
+ 
+ /**
+  * Writes data to a file given its inode number.
+  * 
+  * @param inum The file's inode number
+  * @param buf The data to write
+  * @param size Number of bytes to write
+  * @param offset Starting position for writing
+  * @return Number of bytes written on success, negative error code on failure
+  */
+ int storage_write_inum(int inum, const char *buf, size_t size, off_t offset);
+ 
+ /**
+  * Changes the size of a file given its inode number.
+  * 
+  * @param inum The file's inode number
+  * @param size The new size for the file
+  * @return 0 on success, negative error code on failure
+  */
+ int storage_truncate_inum(int inum, off_t size);
+ 
+ /**
+  * Preallocates space for a file given its inode number.
+  * 
+  * @param inum The file's inode number
+  * @param mode 0 to extend the file to cover the range,
+  *             FALLOC_FL_KEEP_SIZE to only reserve blocks for it, or
+  *             FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE to release them
+  * @param offset Start of the range
+  * @param length Length of the range
+  * @return 0 on success, negative error code on failure
+  */
+ int storage_fallocate_inum(int inum, int mode, off_t offset, off_t length);
+ 
+ /**
+  * Finds the next data or hole in a file given its inode number.
+  * 
+  * @param inum The file's inode number
+  * @param offset Where to start looking
+  * @param whence SEEK_DATA or SEEK_HOLE
+  * @return The offset found, or -ENXIO if offset is at or past the end of
+  *         file or no data follows it
+  */
+ off_t storage_seek_inum(int inum, off_t offset, int whence);
+ 
+ /**
+  * Opens a file given its inode number.
+  * 
+  * Checks write permission, and keeps a preallocation window past the end
+  * of a file for as long as it is open for writing.
+  * 
+  * @param inum The file's inode number
+  * @param flags The open flags
+  * @return 0 on success, negative error code on failure
+  */
+ int storage_open_inum(int inum, int flags);
+ 
+ /**
+  * Releases a file handle opened with storage_open_inum.
+  * 
+  * @param inum The file's inode number
+  * @param flags The flags the file was opened with
+  */
+ void storage_release_inum(int inum, int flags);
+ 
+ /**
+  * Applies the metadata updates held back by writes to a file.
+  * 
+  * Writes record their modification time in memory only; it is stamped on
+  * the inode here, when the file is released, or when its times are set.
+  * 
+  * @param inum The file's inode number
+  * @return 0 on success, negative error code on failure
+  */
+ int storage_flush_inum(int inum);
+ 
+ /**
+  * Makes a file or directory durable.
+  * 
+  * Only the file's own data and the journal are written; the rest of the
+  * image is left to be checkpointed.
+  * 
+  * @param inum The inode number
+  * @return 0 on success, negative error code on failure
+  */
+ int storage_fsync_inum(int inum);
+ 
+ /**
+  * Tells whether a file or directory is marked for compression.
+  * 
+  * @param inum The inode number
+  * @return 1 if it is, 0 if not, or negative error code
+  */
+ int storage_get_compress_inum(int inum);
+ 
+ /**
+  * Marks a file or directory for compression, or clears the mark.
+  * 
+  * Files mark their data to be compressed whenever the last handle that
+  * wrote to them is released (see compress.h); a regular file's existing
+  * data is compressed straight away. Files and directories created in a
+  * marked directory are marked too. Clearing the mark leaves compressed
+  * data as it is until it is next written.
+  * 
+  * @param inum The inode number of a regular file or directory
+  * @param on Nonzero to compress, zero not to
+  * @return 0 on success, negative error code on failure
+  */
+ int storage_set_compress_inum(int inum, int on);
+ 
+ /**
+  * Sets access and modification times for an inode.
+  * 
+  * Each time is set to the value given, to now for UTIME_NOW, or left
+  * alone for UTIME_OMIT, as utimensat does. The change time becomes now.
+  * 
+  * @param inum The inode number
+  * @param ts Array of timespec structures (access time at index 0,
+  *           modification time at index 1), or NULL to set both to now
+  * @return 0 on success, negative error code on failure
+  */
+ int storage_set_time_inum(int inum, const struct timespec ts[2]);
+ 
+ /**
+  * Changes the permission bits of an inode, keeping its file type.
+  * 
+  * @param inum The inode number
+  * @param mode New permission bits
+  * @return 0 on success, negative error code on failure
+  */
+ int storage_chmod_inum(int inum, mode_t mode);
+ 
+ /**
+  * Creates a new file in a specified directory.
+  * 
+  * @param parent_inum The inode number of the parent directory
+  * @param name The name of the new file
+  * @param mode File permissions and type
+  * @return Inode number of the new file on success, negative error code on
+  *         failure
+  */
+ int storage_mknod_at(int parent_inum, const char *name, mode_t mode);
+ 
+ /**
+  * Removes a file from a specified directory.
+  * 
+  * The inode itself is freed once the kernel has forgotten it as well.
+  * 
+  * @param parent_inum The inode number of the parent directory
+  * @param name The name of the file to remove
+  * @return 0 on success, negative error code on failure
+  */
+ int storage_unlink_at(int parent_inum, const char *name);
+
+ /**
+  * Applies a batch of creates, stats and unlinks to one directory.
+  * 
+  * The directory is locked once for the whole batch and every change goes
+  * into a single journal transaction, unless that would outgrow the
+  * journal: the batch is then committed in several, split between entries.
+  * Entries are applied in order, each succeeding or failing on its own with
+  * its result stored in the entry.
+  * 
+  * @param parent_inum The inode number of the directory
+  * @param entries The operations
+  * @param count Number of entries, at most NUFS_BATCH_MAX
+  * @return Number of entries that succeeded, or negative error code if the
+  *         batch could not be applied at all
+  */
+ int storage_batch_at(int parent_inum, struct nufs_batch_entry *entries, int count);
+ 
+ /**
+  * Adds another name for an existing file.
+  * 
+  * @param inum The inode number of the file
+  * @param parent_inum The inode number of the directory for the new name
+  * @param name The new name
+  * @return 0 on success, negative error code on failure
+  */
+ int storage_link_at(int inum, int parent_inum, const char *name);
+ 
+ /**
+  * Removes an empty directory from a specified parent directory.
+  * 
+  * @param parent_inum The inode number of the parent directory
+  * @param name The name of the directory to remove
+  * @return 0 on success, negative error code on failure
+  */
+ int storage_rmdir_at(int parent_inum, const char *name);
+ 
+ /**
+  * Moves a directory entry, possibly into another directory.
+  * 
+  * An existing destination is replaced, as rename(2) does, in one journal
+  * transaction.
+  * 
+  * @param from_parent Inode number of the source directory
+  * @param from_name Current name of the entry
+  * @param to_parent Inode number of the destination directory
+  * @param to_name New name of the entry
+  * @param flags 0, RENAME_NOREPLACE to fail with -EEXIST rather than
+  *              replace, or RENAME_EXCHANGE to swap the two entries
+  * @return 0 on success, negative error code on failure
+  */
+ int storage_rename_at(int from_parent, const char *from_name,
+                       int to_parent, const char *to_name,
+                       unsigned int flags);
+ 
+ /**
+  * Takes kernel lookup references on an inode.
+  * 
+  * Every inode handed to the kernel in a lookup-style reply must be
+  * remembered here, and is kept allocated until it is forgotten again.
+  * 
+  * @param inum The inode number
+  * @param nlookup Number of references to add
+  */
+ void storage_remember(int inum, uint64_t nlookup);
+ 
+ /**
+  * Drops kernel lookup references on an inode, freeing it if it has been
+  * unlinked and this was the last reference.
+  * 
+  * @param inum The inode number
+  * @param nlookup Number of references to drop
+  */
+ void storage_forget(int inum, uint64_t nlookup);
+ 
+ /**
+  * Drops every kernel lookup reference, as happens at unmount.
+  */
+ void storage_forget_all();
+ 
  /**
   * Lists the contents of a directory.
   * 
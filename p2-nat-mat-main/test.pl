@@ -2,11 +2,24 @@
 use 5.16.0;
 use warnings FATAL => 'all';
 
-use Test::Simple tests => 31;
+use Test::Simple tests => 63;
 use IO::Handle;
+use Fcntl qw(O_RDONLY O_DIRECTORY);
+use POSIX ();
+
+# _IOW('N', 2, struct nufs_clone_range) from storage.h
+use constant NUFS_IOC_CLONE_RANGE => 0x40204e02;
+
+# _IOWR('N', 3, struct nufs_batch) from storage.h, and its operations
+use constant NUFS_IOC_BATCH => 0xf0084e03;
+use constant { NUFS_BATCH_CREATE => 1, NUFS_BATCH_STAT => 2, NUFS_BATCH_UNLINK => 3 };
+use constant NUFS_BATCH_MAX => 128;
+use constant NUFS_BATCH_ENTRY => "Z48 L L l L Q Q Q q"; # struct nufs_batch_entry
 
 sub mount {
-    system("(make mount 2>&1) >> test.log &");
+    my ($opts) = @_;
+    $opts = $opts ? "NUFS_OPTS='$opts'" : "";
+    system("(make mount $opts 2>&1) >> test.log &");
     sleep 1;
 }
 
@@ -14,6 +27,20 @@ sub unmount {
     system("(make unmount 2>&1) >> test.log");
 }
 
+# Start over on a new image, mounted with the given options
+sub fresh_mount {
+    my ($opts) = @_;
+    system("rm -f data.nufs test.log");
+    mount($opts);
+}
+
+# Unmount, then check the image without repairing it
+sub check_image {
+    my ($name) = @_;
+    unmount();
+    ok(system("./nufsck -n data.nufs > /dev/null") == 0, $name);
+}
+
 sub write_text {
     my ($name, $data) = @_;
     open my $fh, ">", "mnt/$name" or return;
@@ -103,6 +130,13 @@ system("rm -f mnt/one.txt");
 $files = `ls mnt`;
 ok($files !~ /one\.txt/, "deleted one.txt");
 
+say "# Testing hard links...";
+
+ok(link("mnt/two.txt", "mnt/three.txt"), "link two.txt to three.txt");
+ok((stat("mnt/two.txt"))[3] == 2, "two.txt has two links");
+system("rm -f mnt/two.txt");
+ok(read_text("three.txt") eq $msg2, "three.txt keeps the data after two.txt is removed");
+
 unmount();
 
 system("rm -f data.nufs test.log");
@@ -121,6 +155,8 @@ ok(($files =~ /foo/ and $files =~ /tmp/), "Directories listed");
 
 ok((mkdir("mnt/foo/bar") and -d "mnt/foo/bar"), "Create a nested directory");
 ok((mkdir("mnt/foo/bar/baz") and -d "mnt/foo/bar/baz"), "Create a nested-nested directory");
+my $links = (stat("mnt/foo"))[3];
+ok($links == 3, "Directory link count includes its subdirectories");
 
 my $msg4 = "This is a file";
 write_text("tmp/file.txt", $msg4);
@@ -132,6 +168,14 @@ ok(-e "mnt/foo/file.txt", "Move a file to another directory");
 my $msg6 = read_text("foo/file.txt");
 ok($msg4 eq $msg6, "Read data back correctly");
 
+write_text("foo/new.txt", "Replacement");
+ok((rename("mnt/foo/new.txt", "mnt/foo/file.txt") and !-e "mnt/foo/new.txt"
+    and read_text("foo/file.txt") eq "Replacement"), "Rename over an existing file");
+
+utime(1000000000, 1200000000, "mnt/foo/file.txt");
+my @times = (stat("mnt/foo/file.txt"))[8, 9];
+ok(($times[0] == 1000000000 and $times[1] == 1200000000), "Set access and modification times");
+
 unmount();
 
 system("rm -f data.nufs test.log");
@@ -171,5 +215,221 @@ ok(($listed and $exists and $has_size), "Larger file exists and has the correct
 $back = read_text("larger.txt");
 ok($content eq $back, "Read back data from larger file correctly");
 
-unmount()
+say "# Free space";
+my $free = `stat -f -c %f mnt`;
+write_text("space.txt", "x" x (1024 * 1024));
+my $used = `stat -f -c %f mnt`;
+ok(($free > 0 and $used < $free), "Writing a file lowers the free space df reports");
+unlink("mnt/space.txt");
+
+say "# Sparse files";
+system("touch mnt/sparse.bin");
+truncate("mnt/sparse.bin", 64 * 1024 * 1024);
+ok((stat("mnt/sparse.bin"))[12] == 0, "A file truncated up holds no blocks");
+system("fallocate -p -o 0 -l 4096 mnt/larger.txt");
+$back = read_text("larger.txt");
+ok($back eq ("\0" x 4096) . substr($content, 4096), "A punched hole reads back as zeros");
 
+say "# Compression";
+system("mkdir mnt/packed");
+system("setfattr -n user.nufs.compress -v lz4 mnt/packed");
+$content = "1_2_3_4_5_6_7_8_" x 16384; # 256K of data
+write_text("packed/data.txt", $content);
+unmount();
+
+# The file is compressed once it has been released
+mount();
+ok((stat("mnt/packed/data.txt"))[12] < 256 * 2, "A file in a compressed directory takes fewer blocks");
+$back = read_text("packed/data.txt");
+ok($content eq $back, "Read back data from compressed file correctly");
+
+unmount();
+
+say "# Consistency check";
+ok(system("./nufsck data.nufs > /dev/null") == 0, "nufsck finds the image consistent");
+
+say "# Cloning";
+fresh_mount("-o dedup");
+
+$content = join("", map { sprintf("%-4095s\n", "block $_") } 0 .. 63);
+write_text("source.bin", $content);
+my $source_ino = (stat("mnt/source.bin"))[1];
+
+sub clone_range {
+    my ($name, $src_offset, $length, $dest_offset) = @_;
+    open my $fh, "+>", "mnt/$name" or return 0;
+    my $range = pack("Q4", $source_ino, $src_offset, $length, $dest_offset);
+    my $rv = ioctl($fh, NUFS_IOC_CLONE_RANGE, $range);
+    close $fh;
+    return $rv;
+}
+
+ok((clone_range("whole.bin", 0, 0, 0)
+    and read_text("whole.bin") eq read_text("source.bin")
+    and (stat("mnt/whole.bin"))[12] == (stat("mnt/source.bin"))[12]),
+   "A cloned file reads back the same and holds as many blocks");
+ok((clone_range("part.bin", 16 * 4096, 32 * 4096, 0)
+    and read_text_slice("part.bin", 32 * 4096, 0) eq substr($content, 16 * 4096, 32 * 4096)
+    and (stat("mnt/part.bin"))[12] == 32 * 8),
+   "A cloned range reads back the same and holds its own blocks");
+
+check_image("nufsck counts the shared blocks right");
+
+say "# Parallel writers";
+fresh_mount("-o inodes=1024");
+
+# Each writer creates files in one shared directory and renames them there
+mkdir("mnt/busy");
+my @writers;
+for my $w (0 .. 7) {
+    my $pid = fork();
+    if ($pid == 0) {
+        my $ok = 1;
+        for my $i (0 .. 49) {
+            write_text("busy/w$w-$i", "writer $w file $i\n" x 200);
+            $ok &&= rename("mnt/busy/w$w-$i", "mnt/busy/r$w-$i");
+        }
+        POSIX::_exit($ok ? 0 : 1);
+    }
+    push @writers, $pid;
+}
+my $failed = 0;
+for my $pid (@writers) {
+    waitpid($pid, 0);
+    $failed++ if $? != 0;
+}
+my @names = glob("mnt/busy/*");
+my $landed = !$failed && @names == 8 * 50 && !grep { !m{/r\d+-\d+$} } @names;
+for my $w (0 .. 7) {
+    $landed &&= read_text("busy/r$w-49") eq ("writer $w file 49\n" x 200) =~ s/\s*$//r;
+}
+ok($landed, "Parallel writers and renames in one directory all land");
+
+check_image("nufsck finds the image consistent after parallel renames");
+
+say "# Large directories";
+fresh_mount("-o inodes=8192");
+
+# Enough names to split the directory's buckets many times over
+my $count = 5000;
+mkdir("mnt/many");
+for my $i (0 .. $count - 1) {
+    open my $fh, ">", "mnt/many/entry-$i" or last;
+    close $fh;
+}
+opendir my $dh, "mnt/many";
+my @listed = grep { !/^\.\.?$/ } readdir $dh;
+closedir $dh;
+ok((@listed == $count and (stat("mnt/many"))[7] > 64 * 4096),
+   "A directory of $count entries lists them all after growing");
+my $found = grep { -e "mnt/many/entry-$_" } 0 .. $count - 1;
+ok($found == $count, "Every entry of a large directory can be looked up");
+my $removed = unlink(map { "mnt/many/entry-$_" } 0 .. $count - 1);
+ok(($removed == $count and rmdir("mnt/many")), "Every entry of a large directory can be unlinked");
+
+# A listing carries on where it was while the buckets split under it
+mkdir("mnt/growing");
+for my $i (0 .. 499) {
+    open my $fh, ">", "mnt/growing/old-$i" or last;
+    close $fh;
+}
+opendir $dh, "mnt/growing";
+my %seen;
+my $twice = 0;
+for (1 .. 100) {
+    my $name = readdir $dh;
+    $twice++ if defined $name && $seen{$name}++;
+}
+for my $i (0 .. 1999) {
+    open my $fh, ">", "mnt/growing/new-$i" or last;
+    close $fh;
+}
+while (defined(my $name = readdir $dh)) {
+    $twice++ if $seen{$name}++;
+}
+closedir $dh;
+my $missed = grep { !$seen{"old-$_"} } 0 .. 499;
+say "# listed while growing: $twice twice, $missed missed";
+ok(($twice == 0 and $missed == 0), "A directory listed while it grows shows each old entry once");
+
+check_image("nufsck finds a large directory consistent");
+
+say "# Deduplication";
+fresh_mount("-o dedup");
+
+sub shared_blocks {
+    my $stats = read_text(".nufs/stats");
+    return $stats =~ /(\d+) shared/ ? $1 : -1;
+}
+
+$content = join("", map { sprintf("%-4095s\n", "dedup block $_") } 0 .. 63);
+write_text("first.bin", $content);
+my $shared0 = shared_blocks();
+my $free0 = `stat -f -c %f mnt`;
+write_text("second.bin", $content);
+write_text("third.bin", $content);
+my $shared1 = shared_blocks();
+my $free1 = `stat -f -c %f mnt`;
+chomp($free0, $free1);
+say "# shared $shared0 -> $shared1, free $free0 -> $free1";
+ok(($shared0 >= 0 and $shared1 - $shared0 >= 2 * 64), "Identical files share their blocks");
+ok(($free0 - $free1 < 16 and read_text("third.bin") eq read_text("first.bin")),
+   "Copies of a file take almost no space and read back the same");
+
+check_image("nufsck finds the shared blocks consistent");
+
+say "# Shrinking directories";
+fresh_mount("-o inodes=4096");
+
+mkdir("mnt/sparse");
+for my $i (0 .. 1999) {
+    open my $fh, ">", "mnt/sparse/entry-$i" or last;
+    close $fh;
+}
+my $grown = (stat("mnt/sparse"))[7];
+unlink(map { "mnt/sparse/entry-$_" } grep { $_ % 50 != 0 } 0 .. 1999);
+my $shrunk = (stat("mnt/sparse"))[7];
+say "# directory size $grown -> $shrunk";
+ok(($grown > 4096 and $shrunk < $grown / 4), "A directory shrinks once most of its entries are gone");
+my @kept = grep { -e "mnt/sparse/entry-$_" } 0 .. 1999;
+ok((@kept == 40 and !grep { $_ % 50 != 0 } @kept), "The remaining entries survive the shrink");
+
+check_image("nufsck finds a shrunk directory consistent");
+
+say "# Batches";
+fresh_mount();
+
+# Applied in order, in one transaction on the directory
+mkdir("mnt/batch");
+my @ops = (["a", NUFS_BATCH_CREATE], ["b", NUFS_BATCH_CREATE],
+           ["c", NUFS_BATCH_CREATE], ["a", NUFS_BATCH_STAT],
+           ["b", NUFS_BATCH_UNLINK], ["missing", NUFS_BATCH_STAT]);
+my $batch = pack("L L", scalar @ops, 0);
+$batch .= pack(NUFS_BATCH_ENTRY, $_->[0], $_->[1], 0644, 0, 0, 0, 0, 0, 0) for @ops;
+my $entry_size = length(pack(NUFS_BATCH_ENTRY));
+$batch .= "\0" x (8 + NUFS_BATCH_MAX * $entry_size - length($batch));
+sysopen(my $dir, "mnt/batch", O_RDONLY | O_DIRECTORY);
+my $applied = ioctl($dir, NUFS_IOC_BATCH, $batch);
+close $dir;
+
+my $done = (unpack("L L", $batch))[1];
+my @results = map { [unpack(NUFS_BATCH_ENTRY, substr($batch, 8 + $_ * $entry_size, $entry_size))] } 0 .. $#ops;
+say "# batch done $done, results @{[map { $_->[3] } @results]}";
+ok(($applied and $done == 5 and !grep { $_->[3] != 0 } @results[0 .. 4]
+    and $results[5][3] == -POSIX::ENOENT()), "A batch of creates, stats and unlinks reports each result");
+ok((-f "mnt/batch/a" and !-e "mnt/batch/b" and -f "mnt/batch/c"
+    and $results[3][5] == (stat("mnt/batch/a"))[1]), "A batch's changes show up through the mount");
+
+# A full batch may not fit one journal transaction, and is split up
+$batch = pack("L L", NUFS_BATCH_MAX, 0);
+$batch .= pack(NUFS_BATCH_ENTRY, "full-$_", NUFS_BATCH_CREATE, 0644, 0, 0, 0, 0, 0, 0)
+    for 1 .. NUFS_BATCH_MAX;
+sysopen($dir, "mnt/batch", O_RDONLY | O_DIRECTORY);
+$applied = ioctl($dir, NUFS_IOC_BATCH, $batch);
+close $dir;
+$done = (unpack("L L", $batch))[1];
+my $made = grep { -f "mnt/batch/full-$_" } 1 .. NUFS_BATCH_MAX;
+ok(($applied and $done == NUFS_BATCH_MAX and $made == NUFS_BATCH_MAX),
+   "A full batch of creates lands in full");
+
+check_image("nufsck finds the image consistent after batches");